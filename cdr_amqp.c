@@ -49,7 +49,10 @@
 				<configOption name="connection">
 					<synopsis>Name of the connection from amqp.conf to use</synopsis>
 					<description>
-						<para>Specifies the name of the connection from amqp.conf to use</para>
+						<para>Specifies the name of the connection from amqp.conf to use.</para>
+						<para>A comma separated list names fallback connections, in order of
+						preference. When a publish fails the next connection in the list is
+						tried; see <literal>failback</literal>.</para>
 					</description>
 				</configOption>
 				<configOption name="queue">
@@ -64,270 +67,4887 @@
 						<para>Defaults to empty string</para>
 					</description>
 				</configOption>
+				<configOption name="maxfieldlen">
+					<synopsis>Maximum length of each string field, in bytes</synopsis>
+					<description>
+						<para>Longer values are cut on a character boundary and the field
+						is listed in the <literal>truncated</literal> array of the
+						message. Default is 0, which means no limit.</para>
+					</description>
+				</configOption>
+				<configOption name="fieldlimits">
+					<synopsis>Per-field maximum lengths, overriding maxfieldlen</synopsis>
+					<description>
+						<para>A comma separated list of <replaceable>field</replaceable>:<replaceable>length</replaceable>
+						pairs, for example <literal>lastdata:256,clid:80</literal>.
+						A length of 0 removes the limit for that field.</para>
+					</description>
+				</configOption>
+				<configOption name="maxmessagesize">
+					<synopsis>Largest message body to publish, in bytes</synopsis>
+					<description>
+						<para>CDRs that still exceed this after field limits are applied
+						are dropped and counted as <literal>oversize</literal>, with a warning
+						that names their uniqueid. They are not written to the dead-letter
+						file, since the broker would refuse them again on a re-drive, so
+						they are lost. Set this below the broker's
+						<literal>max_message_size</literal>. Default is 0, which means no limit.</para>
+					</description>
+				</configOption>
+				<configOption name="appid">
+					<synopsis>Value of the app_id message property</synopsis>
+					<description>
+						<para>Defaults to asterisk. Set to an empty string to omit it.</para>
+					</description>
+				</configOption>
+				<configOption name="nodeid">
+					<synopsis>Identifier of this node, sent in the x-node-id header</synopsis>
+					<description>
+						<para>Defaults to the systemname from asterisk.conf, or the
+						entity ID if no systemname is set. Every message also carries
+						an x-schema-version header with the version of the message
+						layout. The nodeid of [global] also names the node in metrics
+						summaries, whether or not [global] is a destination itself.</para>
+					</description>
+				</configOption>
+				<configOption name="mandatory">
+					<synopsis>Publish with the mandatory flag</synopsis>
+					<description>
+						<para>Asks the broker to return messages it cannot route instead
+						of silently dropping them. Default is no.</para>
+						<note><para>res_amqp does not read the returned messages back, so they
+						are discarded: they are neither dead-lettered nor counted, and an
+						unroutable CDR is still lost. To keep such CDRs, give the exchange an
+						alternate exchange on the broker instead.</para></note>
+					</description>
+				</configOption>
+				<configOption name="deadletter">
+					<synopsis>File that unpublishable CDRs are written to</synopsis>
+					<description>
+						<para>CDRs that fail to publish are appended to this file, one
+						per line, and can be published again with
+						<literal>cdr amqp redrive</literal>. Defaults to
+						<filename>cdr_amqp/deadletter</filename> in the Asterisk spool
+						directory.</para>
+					</description>
+				</configOption>
+				<configOption name="persistent">
+					<synopsis>Publish with persistent delivery mode</synopsis>
+					<description>
+						<para>Persistent messages are written to disk by the broker.
+						Streams that can tolerate loss on a broker restart, such as
+						analytics feeds, can set this to no to avoid that write.
+						Default is yes.</para>
+					</description>
+				</configOption>
+				<configOption name="expiration">
+					<synopsis>Per-message TTL, in milliseconds</synopsis>
+					<description>
+						<para>Sets the expiration property so the broker discards CDRs
+						that have not been consumed in time, which is useful for
+						real-time dashboards. Default is 0, which means no expiration.</para>
+					</description>
+				</configOption>
+				<configOption name="dispositions">
+					<synopsis>Only publish CDRs with these dispositions</synopsis>
+					<description>
+						<para>A comma separated list of dispositions as they appear in
+						the CDR, for example <literal>ANSWERED,BUSY</literal>. Default
+						is empty, which publishes every CDR.</para>
+					</description>
+				</configOption>
+				<configOption name="failback" default="30">
+					<synopsis>Seconds the primary connection must stay up before returning to it</synopsis>
+					<description>
+						<para>When <literal>connection</literal> lists more than one connection
+						and publishing has failed over to a later one, the first connection is
+						probed every second, off the publisher thread. Publishing switches back
+						to it once it has passed every probe for this many seconds, so a
+						flapping primary is not returned to. Set to 0 to stay on the fallback
+						until it fails in turn.</para>
+					</description>
+				</configOption>
+				<configOption name="latencyheaders" default="no">
+					<synopsis>Stamp messages with latency headers</synopsis>
+					<description>
+						<para>Adds the headers <literal>x-cdr-end</literal>, <literal>x-received</literal>,
+						<literal>x-enqueued</literal> and <literal>x-published</literal> to each message.
+						They hold, in microseconds since the epoch, the end of the call, when the CDR
+						reached this module, when it was queued for publishing and when it was
+						published, so consumers can tell where a CDR was delayed. Re-driven messages
+						carry no stamps.</para>
+					</description>
+				</configOption>
+				<configOption name="metricsinterval" default="0">
+					<synopsis>Seconds between metrics summaries</synopsis>
+					<description>
+						<para>Publishes a JSON summary of the module's counters and latency
+						histograms every this many seconds, through the connection and exchange of
+						the first destination. Set to 0 to disable. Counters are totals since the
+						module was loaded. Each histogram has 24 buckets: bucket 0 counts hops of
+						under a microsecond, bucket n those under 2^n microseconds, and the last
+						everything slower. Only valid in [global].</para>
+					</description>
+				</configOption>
+				<configOption name="metricsqueue" default="asterisk_cdr_metrics">
+					<synopsis>Routing key of the metrics summary</synopsis>
+					<description>
+						<para>Queue name, or routing key, the <literal>metricsinterval</literal>
+						summary is published to. Only valid in [global].</para>
+					</description>
+				</configOption>
+				<configOption name="queuewatermark" default="1000">
+					<synopsis>Queue depth that raises an AMI event</synopsis>
+					<description>
+						<para>When this many CDRs are waiting to be published, a
+						<literal>CdrAmqpQueueHigh</literal> manager event is raised. Once the queue
+						has drained to half of it, <literal>CdrAmqpQueueNormal</literal> follows.
+						Set to 0 to disable.</para>
+					</description>
+				</configOption>
+				<configOption name="maxpublishrate" default="0">
+					<synopsis>Most messages to publish per second</synopsis>
+					<description>
+						<para>Limits how fast CDRs are published, so a re-drive after an outage
+						does not overload the broker. CDRs wait in the publisher queue
+						meanwhile. While live CDRs are waiting, a re-drive lets them go first.
+						Set to 0 for no limit.</para>
+					</description>
+				</configOption>
+				<configOption name="maxpublishbytes" default="0">
+					<synopsis>Most message bytes to publish per second</synopsis>
+					<description>
+						<para>Like <literal>maxpublishrate</literal>, but counts message body
+						bytes. Set to 0 for no limit.</para>
+					</description>
+				</configOption>
+				<configOption name="publishburst" default="1">
+					<synopsis>Seconds of publishing allowed at once</synopsis>
+					<description>
+						<para>How many seconds' worth of <literal>maxpublishrate</literal> and
+						<literal>maxpublishbytes</literal> may be published back to back after
+						a quiet period. Between 1 and 3600.</para>
+					</description>
+				</configOption>
+				<configOption name="heartbeatinterval" default="0">
+					<synopsis>Seconds between heartbeats</synopsis>
+					<description>
+						<para>Publishes a small JSON heartbeat for each destination this often,
+						through that destination's own publisher and connection. Each heartbeat
+						holds the node id, the destination, the sequence number of the last
+						CDR, the queue depth, the dead-letter file size, the publish rate since
+						the previous heartbeat and the 99th percentile publish latency in
+						microseconds. A heartbeat waits behind the destination's queued CDRs,
+						so heartbeats stop if publishing is stuck but keep coming when there
+						are simply no calls. Set to 0 to disable. Only valid in [global].</para>
+					</description>
+				</configOption>
+				<configOption name="heartbeatqueue" default="asterisk_cdr_heartbeat">
+					<synopsis>Routing key of heartbeats</synopsis>
+					<description>
+						<para>Queue name, or routing key, heartbeats are published to. Only valid
+						in [global].</para>
+					</description>
+				</configOption>
+				<configOption name="format" default="json">
+					<synopsis>Message format</synopsis>
+					<description>
+						<enumlist>
+							<enum name="json"><para>Each CDR is published as a JSON object of its own.</para></enum>
+							<enum name="compact"><para>CDRs are published in batches. A batch is a JSON
+							object with the list of fields, then one array per CDR. The start, answer
+							and end times are milliseconds relative to the batch's <literal>base</literal>,
+							and frequently repeated strings can be replaced by ids from a dictionary in
+							the batch. The last column of each CDR is the <literal>message_id</literal>
+							it would have been published with on its own; the batch's own
+							<literal>message_id</literal> is a hash of these.
+							<literal>contrib/compact/decode.py</literal> is a reference
+							decoder.</para></enum>
+						</enumlist>
+					</description>
+				</configOption>
+				<configOption name="batchsize" default="100">
+					<synopsis>Most CDRs in a compact batch</synopsis>
+					<description>
+						<para>With <literal>format=compact</literal>, a batch is published once it
+						holds this many CDRs. A batch is also cut short rather than exceed
+						<literal>maxmessagesize</literal>.</para>
+					</description>
+				</configOption>
+				<configOption name="batchlinger" default="100">
+					<synopsis>Milliseconds a compact batch waits for more CDRs</synopsis>
+					<description>
+						<para>With <literal>format=compact</literal>, a batch that is not full is
+						published once its first CDR has waited this long. Set to 0 to publish
+						whatever has been batched whenever the queue runs empty.</para>
+					</description>
+				</configOption>
+				<configOption name="batchdictionary" default="yes">
+					<synopsis>Use a string dictionary in compact batches</synopsis>
+					<description>
+						<para>With <literal>format=compact</literal>, the dcontext, lastapp,
+						disposition, accountcode, amaflags and peeraccount columns hold an id
+						into the batch's <literal>dict</literal> object instead of the string,
+						as listed in the batch's <literal>dictfields</literal>.</para>
+					</description>
+				</configOption>
+				<configOption name="compression" default="none">
+					<synopsis>Compress message bodies</synopsis>
+					<description>
+						<enumlist>
+							<enum name="none"/>
+							<enum name="gzip"/>
+							<enum name="deflate"/>
+						</enumlist>
+						<para>Messages are compressed on a separate pool of threads while the
+						previous message is published, and sent with the matching
+						<literal>content_encoding</literal> property. A message that would not
+						get smaller is sent as is. Dead-lettered messages are always written
+						uncompressed.</para>
+					</description>
+				</configOption>
+				<configOption name="compressionlevel" default="6">
+					<synopsis>zlib compression level, from 1 to 9</synopsis>
+				</configOption>
+				<configOption name="adaptivecompression" default="yes">
+					<synopsis>Lower the compression level while the queue backs up</synopsis>
+					<description>
+						<para>Drops a level at a time, down to 1, while the destination's
+						queue keeps growing, and climbs back to
+						<literal>compressionlevel</literal> once it is drained.</para>
+					</description>
+				</configOption>
+				<configOption name="compressionthreads" default="2">
+					<synopsis>Threads compressing messages for every destination</synopsis>
+					<description>
+						<para>Between 1 and 64. Only valid in [global]; can be changed
+						without a reload with <literal>cdr amqp set compressionthreads</literal>.</para>
+					</description>
+				</configOption>
+			</configObject>
+			<configObject name="destination">
+				<synopsis>A destination CDRs are published to</synopsis>
+				<description>
+					<para>Each section other than <literal>global</literal> is a
+					destination with its own connection, routing, filter and
+					dead-letter file. Every CDR is serialized once per distinct
+					output format and queued to each destination. When any
+					destination is configured, the <literal>global</literal>
+					section only publishes CDRs itself if it sets
+					<literal>connection</literal>.</para>
+				</description>
+				<configOption name="loguniqueid">
+					<xi:include xpointer="xpointer(/docs/configInfo[@name='cdr_amqp']/configFile[@name='cdr_amqp.conf']/configObject[@name='global']/configOption[@name='loguniqueid']/synopsis)"/>
+					<xi:include xpointer="xpointer(/docs/configInfo[@name='cdr_amqp']/configFile[@name='cdr_amqp.conf']/configObject[@name='global']/configOption[@name='loguniqueid']/description)"/>
+				</configOption>
+				<configOption name="loguserfield">
+					<xi:include xpointer="xpointer(/docs/configInfo[@name='cdr_amqp']/configFile[@name='cdr_amqp.conf']/configObject[@name='global']/configOption[@name='loguserfield']/synopsis)"/>
+					<xi:include xpointer="xpointer(/docs/configInfo[@name='cdr_amqp']/configFile[@name='cdr_amqp.conf']/configObject[@name='global']/configOption[@name='loguserfield']/description)"/>
+				</configOption>
+				<configOption name="connection">
+					<xi:include xpointer="xpointer(/docs/configInfo[@name='cdr_amqp']/configFile[@name='cdr_amqp.conf']/configObject[@name='global']/configOption[@name='connection']/synopsis)"/>
+					<xi:include xpointer="xpointer(/docs/configInfo[@name='cdr_amqp']/configFile[@name='cdr_amqp.conf']/configObject[@name='global']/configOption[@name='connection']/description)"/>
+				</configOption>
+				<configOption name="queue">
+					<xi:include xpointer="xpointer(/docs/configInfo[@name='cdr_amqp']/configFile[@name='cdr_amqp.conf']/configObject[@name='global']/configOption[@name='queue']/synopsis)"/>
+					<xi:include xpointer="xpointer(/docs/configInfo[@name='cdr_amqp']/configFile[@name='cdr_amqp.conf']/configObject[@name='global']/configOption[@name='queue']/description)"/>
+				</configOption>
+				<configOption name="exchange">
+					<xi:include xpointer="xpointer(/docs/configInfo[@name='cdr_amqp']/configFile[@name='cdr_amqp.conf']/configObject[@name='global']/configOption[@name='exchange']/synopsis)"/>
+					<xi:include xpointer="xpointer(/docs/configInfo[@name='cdr_amqp']/configFile[@name='cdr_amqp.conf']/configObject[@name='global']/configOption[@name='exchange']/description)"/>
+				</configOption>
+				<configOption name="maxfieldlen">
+					<xi:include xpointer="xpointer(/docs/configInfo[@name='cdr_amqp']/configFile[@name='cdr_amqp.conf']/configObject[@name='global']/configOption[@name='maxfieldlen']/synopsis)"/>
+					<xi:include xpointer="xpointer(/docs/configInfo[@name='cdr_amqp']/configFile[@name='cdr_amqp.conf']/configObject[@name='global']/configOption[@name='maxfieldlen']/description)"/>
+				</configOption>
+				<configOption name="fieldlimits">
+					<xi:include xpointer="xpointer(/docs/configInfo[@name='cdr_amqp']/configFile[@name='cdr_amqp.conf']/configObject[@name='global']/configOption[@name='fieldlimits']/synopsis)"/>
+					<xi:include xpointer="xpointer(/docs/configInfo[@name='cdr_amqp']/configFile[@name='cdr_amqp.conf']/configObject[@name='global']/configOption[@name='fieldlimits']/description)"/>
+				</configOption>
+				<configOption name="maxmessagesize">
+					<xi:include xpointer="xpointer(/docs/configInfo[@name='cdr_amqp']/configFile[@name='cdr_amqp.conf']/configObject[@name='global']/configOption[@name='maxmessagesize']/synopsis)"/>
+					<xi:include xpointer="xpointer(/docs/configInfo[@name='cdr_amqp']/configFile[@name='cdr_amqp.conf']/configObject[@name='global']/configOption[@name='maxmessagesize']/description)"/>
+				</configOption>
+				<configOption name="appid">
+					<xi:include xpointer="xpointer(/docs/configInfo[@name='cdr_amqp']/configFile[@name='cdr_amqp.conf']/configObject[@name='global']/configOption[@name='appid']/synopsis)"/>
+					<xi:include xpointer="xpointer(/docs/configInfo[@name='cdr_amqp']/configFile[@name='cdr_amqp.conf']/configObject[@name='global']/configOption[@name='appid']/description)"/>
+				</configOption>
+				<configOption name="nodeid">
+					<xi:include xpointer="xpointer(/docs/configInfo[@name='cdr_amqp']/configFile[@name='cdr_amqp.conf']/configObject[@name='global']/configOption[@name='nodeid']/synopsis)"/>
+					<xi:include xpointer="xpointer(/docs/configInfo[@name='cdr_amqp']/configFile[@name='cdr_amqp.conf']/configObject[@name='global']/configOption[@name='nodeid']/description)"/>
+				</configOption>
+				<configOption name="mandatory">
+					<xi:include xpointer="xpointer(/docs/configInfo[@name='cdr_amqp']/configFile[@name='cdr_amqp.conf']/configObject[@name='global']/configOption[@name='mandatory']/synopsis)"/>
+					<xi:include xpointer="xpointer(/docs/configInfo[@name='cdr_amqp']/configFile[@name='cdr_amqp.conf']/configObject[@name='global']/configOption[@name='mandatory']/description)"/>
+				</configOption>
+				<configOption name="deadletter">
+					<xi:include xpointer="xpointer(/docs/configInfo[@name='cdr_amqp']/configFile[@name='cdr_amqp.conf']/configObject[@name='global']/configOption[@name='deadletter']/synopsis)"/>
+					<xi:include xpointer="xpointer(/docs/configInfo[@name='cdr_amqp']/configFile[@name='cdr_amqp.conf']/configObject[@name='global']/configOption[@name='deadletter']/description)"/>
+				</configOption>
+				<configOption name="persistent">
+					<xi:include xpointer="xpointer(/docs/configInfo[@name='cdr_amqp']/configFile[@name='cdr_amqp.conf']/configObject[@name='global']/configOption[@name='persistent']/synopsis)"/>
+					<xi:include xpointer="xpointer(/docs/configInfo[@name='cdr_amqp']/configFile[@name='cdr_amqp.conf']/configObject[@name='global']/configOption[@name='persistent']/description)"/>
+				</configOption>
+				<configOption name="expiration">
+					<xi:include xpointer="xpointer(/docs/configInfo[@name='cdr_amqp']/configFile[@name='cdr_amqp.conf']/configObject[@name='global']/configOption[@name='expiration']/synopsis)"/>
+					<xi:include xpointer="xpointer(/docs/configInfo[@name='cdr_amqp']/configFile[@name='cdr_amqp.conf']/configObject[@name='global']/configOption[@name='expiration']/description)"/>
+				</configOption>
+				<configOption name="dispositions">
+					<xi:include xpointer="xpointer(/docs/configInfo[@name='cdr_amqp']/configFile[@name='cdr_amqp.conf']/configObject[@name='global']/configOption[@name='dispositions']/synopsis)"/>
+					<xi:include xpointer="xpointer(/docs/configInfo[@name='cdr_amqp']/configFile[@name='cdr_amqp.conf']/configObject[@name='global']/configOption[@name='dispositions']/description)"/>
+				</configOption>
+				<configOption name="failback">
+					<xi:include xpointer="xpointer(/docs/configInfo[@name='cdr_amqp']/configFile[@name='cdr_amqp.conf']/configObject[@name='global']/configOption[@name='failback']/synopsis)"/>
+					<xi:include xpointer="xpointer(/docs/configInfo[@name='cdr_amqp']/configFile[@name='cdr_amqp.conf']/configObject[@name='global']/configOption[@name='failback']/description)"/>
+				</configOption>
+				<configOption name="latencyheaders">
+					<xi:include xpointer="xpointer(/docs/configInfo[@name='cdr_amqp']/configFile[@name='cdr_amqp.conf']/configObject[@name='global']/configOption[@name='latencyheaders']/synopsis)"/>
+					<xi:include xpointer="xpointer(/docs/configInfo[@name='cdr_amqp']/configFile[@name='cdr_amqp.conf']/configObject[@name='global']/configOption[@name='latencyheaders']/description)"/>
+				</configOption>
+				<configOption name="queuewatermark">
+					<xi:include xpointer="xpointer(/docs/configInfo[@name='cdr_amqp']/configFile[@name='cdr_amqp.conf']/configObject[@name='global']/configOption[@name='queuewatermark']/synopsis)"/>
+					<xi:include xpointer="xpointer(/docs/configInfo[@name='cdr_amqp']/configFile[@name='cdr_amqp.conf']/configObject[@name='global']/configOption[@name='queuewatermark']/description)"/>
+				</configOption>
+				<configOption name="maxpublishrate">
+					<xi:include xpointer="xpointer(/docs/configInfo[@name='cdr_amqp']/configFile[@name='cdr_amqp.conf']/configObject[@name='global']/configOption[@name='maxpublishrate']/synopsis)"/>
+					<xi:include xpointer="xpointer(/docs/configInfo[@name='cdr_amqp']/configFile[@name='cdr_amqp.conf']/configObject[@name='global']/configOption[@name='maxpublishrate']/description)"/>
+				</configOption>
+				<configOption name="maxpublishbytes">
+					<xi:include xpointer="xpointer(/docs/configInfo[@name='cdr_amqp']/configFile[@name='cdr_amqp.conf']/configObject[@name='global']/configOption[@name='maxpublishbytes']/synopsis)"/>
+					<xi:include xpointer="xpointer(/docs/configInfo[@name='cdr_amqp']/configFile[@name='cdr_amqp.conf']/configObject[@name='global']/configOption[@name='maxpublishbytes']/description)"/>
+				</configOption>
+				<configOption name="publishburst">
+					<xi:include xpointer="xpointer(/docs/configInfo[@name='cdr_amqp']/configFile[@name='cdr_amqp.conf']/configObject[@name='global']/configOption[@name='publishburst']/synopsis)"/>
+					<xi:include xpointer="xpointer(/docs/configInfo[@name='cdr_amqp']/configFile[@name='cdr_amqp.conf']/configObject[@name='global']/configOption[@name='publishburst']/description)"/>
+				</configOption>
+				<configOption name="format">
+					<xi:include xpointer="xpointer(/docs/configInfo[@name='cdr_amqp']/configFile[@name='cdr_amqp.conf']/configObject[@name='global']/configOption[@name='format']/synopsis)"/>
+					<xi:include xpointer="xpointer(/docs/configInfo[@name='cdr_amqp']/configFile[@name='cdr_amqp.conf']/configObject[@name='global']/configOption[@name='format']/description)"/>
+				</configOption>
+				<configOption name="batchsize">
+					<xi:include xpointer="xpointer(/docs/configInfo[@name='cdr_amqp']/configFile[@name='cdr_amqp.conf']/configObject[@name='global']/configOption[@name='batchsize']/synopsis)"/>
+					<xi:include xpointer="xpointer(/docs/configInfo[@name='cdr_amqp']/configFile[@name='cdr_amqp.conf']/configObject[@name='global']/configOption[@name='batchsize']/description)"/>
+				</configOption>
+				<configOption name="batchlinger">
+					<xi:include xpointer="xpointer(/docs/configInfo[@name='cdr_amqp']/configFile[@name='cdr_amqp.conf']/configObject[@name='global']/configOption[@name='batchlinger']/synopsis)"/>
+					<xi:include xpointer="xpointer(/docs/configInfo[@name='cdr_amqp']/configFile[@name='cdr_amqp.conf']/configObject[@name='global']/configOption[@name='batchlinger']/description)"/>
+				</configOption>
+				<configOption name="batchdictionary">
+					<xi:include xpointer="xpointer(/docs/configInfo[@name='cdr_amqp']/configFile[@name='cdr_amqp.conf']/configObject[@name='global']/configOption[@name='batchdictionary']/synopsis)"/>
+					<xi:include xpointer="xpointer(/docs/configInfo[@name='cdr_amqp']/configFile[@name='cdr_amqp.conf']/configObject[@name='global']/configOption[@name='batchdictionary']/description)"/>
+				</configOption>
+				<configOption name="compression">
+					<xi:include xpointer="xpointer(/docs/configInfo[@name='cdr_amqp']/configFile[@name='cdr_amqp.conf']/configObject[@name='global']/configOption[@name='compression']/synopsis)"/>
+					<xi:include xpointer="xpointer(/docs/configInfo[@name='cdr_amqp']/configFile[@name='cdr_amqp.conf']/configObject[@name='global']/configOption[@name='compression']/description)"/>
+				</configOption>
+				<configOption name="compressionlevel">
+					<xi:include xpointer="xpointer(/docs/configInfo[@name='cdr_amqp']/configFile[@name='cdr_amqp.conf']/configObject[@name='global']/configOption[@name='compressionlevel']/synopsis)"/>
+					<xi:include xpointer="xpointer(/docs/configInfo[@name='cdr_amqp']/configFile[@name='cdr_amqp.conf']/configObject[@name='global']/configOption[@name='compressionlevel']/description)"/>
+				</configOption>
+				<configOption name="adaptivecompression">
+					<xi:include xpointer="xpointer(/docs/configInfo[@name='cdr_amqp']/configFile[@name='cdr_amqp.conf']/configObject[@name='global']/configOption[@name='adaptivecompression']/synopsis)"/>
+					<xi:include xpointer="xpointer(/docs/configInfo[@name='cdr_amqp']/configFile[@name='cdr_amqp.conf']/configObject[@name='global']/configOption[@name='adaptivecompression']/description)"/>
+				</configOption>
 			</configObject>
 		</configFile>
 	</configInfo>
+	<manager name="CdrAmqpPause" language="en_US">
+		<synopsis>
+			Pause publishing CDRs to AMQP.
+		</synopsis>
+		<syntax>
+			<xi:include xpointer="xpointer(/docs/manager[@name='Login']/syntax/parameter[@name='ActionID'])" />
+			<parameter name="Destination">
+				<para>The destination to pause. Every destination if omitted.</para>
+			</parameter>
+		</syntax>
+		<description>
+			<para>While paused, CDRs are written to the dead-letter file of the
+			destination instead of being published, for example during broker
+			maintenance. The pause lasts across configuration reloads.</para>
+		</description>
+		<see-also>
+			<ref type="manager">CdrAmqpResume</ref>
+		</see-also>
+	</manager>
+	<manager name="CdrAmqpResume" language="en_US">
+		<synopsis>
+			Resume publishing CDRs to AMQP.
+		</synopsis>
+		<syntax>
+			<xi:include xpointer="xpointer(/docs/manager[@name='Login']/syntax/parameter[@name='ActionID'])" />
+			<parameter name="Destination">
+				<para>The destination to resume. Every destination if omitted.</para>
+			</parameter>
+		</syntax>
+		<description>
+			<para>Resumes publishing and re-drives the CDRs dead-lettered while the
+			destination was paused.</para>
+		</description>
+		<see-also>
+			<ref type="manager">CdrAmqpPause</ref>
+		</see-also>
+	</manager>
+	<manager name="CdrAmqpFlush" language="en_US">
+		<synopsis>
+			Re-drive dead-lettered CDRs.
+		</synopsis>
+		<syntax>
+			<xi:include xpointer="xpointer(/docs/manager[@name='Login']/syntax/parameter[@name='ActionID'])" />
+			<parameter name="Destination">
+				<para>The destination to re-drive. Every destination if omitted.</para>
+			</parameter>
+		</syntax>
+		<description>
+			<para>Publishes the CDRs in the dead-letter file again, like the
+			<literal>cdr amqp redrive</literal> CLI command. Fails for a paused
+			destination.</para>
+		</description>
+	</manager>
+	<manager name="CdrAmqpSet" language="en_US">
+		<synopsis>
+			Change an AMQP CDR destination setting without a reload.
+		</synopsis>
+		<syntax>
+			<xi:include xpointer="xpointer(/docs/manager[@name='Login']/syntax/parameter[@name='ActionID'])" />
+			<parameter name="Parameter" required="true">
+				<para>One of <literal>maxpublishrate</literal>, <literal>maxpublishbytes</literal>,
+				<literal>publishburst</literal>, <literal>queuewatermark</literal>,
+				<literal>failback</literal>, <literal>batchsize</literal>,
+				<literal>batchlinger</literal> or <literal>compressionlevel</literal>;
+				or <literal>compressionthreads</literal>, which is shared by every
+				destination and so takes no <literal>Destination</literal>.</para>
+			</parameter>
+			<parameter name="Value" required="true">
+				<para>The new value, as in cdr_amqp.conf.</para>
+			</parameter>
+			<parameter name="Destination">
+				<para>The destination to change. Every destination if omitted.</para>
+			</parameter>
+		</syntax>
+		<description>
+			<para>The change takes effect with the next CDR published, without
+			reconnecting or disturbing queued CDRs, and lasts until the next
+			reload. The <literal>cdr amqp set</literal> CLI command does the same.</para>
+		</description>
+	</manager>
+	<manager name="CdrAmqpStatus" language="en_US">
+		<synopsis>
+			Show the state of each AMQP CDR destination.
+		</synopsis>
+		<syntax>
+			<xi:include xpointer="xpointer(/docs/manager[@name='Login']/syntax/parameter[@name='ActionID'])" />
+		</syntax>
+		<description>
+			<para>Sends a <literal>CdrAmqpStatus</literal> event for each destination, with
+			its connection in use, whether it is paused, the number of CDRs queued
+			for publishing and the size of its dead-letter file, followed by
+			<literal>CdrAmqpStatusComplete</literal>.</para>
+		</description>
+	</manager>
  ***/
 
-#include "asterisk.h"
+#include "asterisk.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "asterisk/cdr.h"
+#include "asterisk/cli.h"
+#include "asterisk/config_options.h"
+#include "asterisk/http.h"
+#include "asterisk/json.h"
+#include "asterisk/lock.h"
+#include "asterisk/manager.h"
+#include "asterisk/module.h"
+#include "asterisk/options.h"
+#include "asterisk/paths.h"
+#include "asterisk/amqp.h"
+#include "asterisk/sched.h"
+#include "asterisk/stringfields.h"
+#include "asterisk/taskprocessor.h"
+#include "asterisk/threadpool.h"
+#include "asterisk/threadstorage.h"
+#include "asterisk/vector.h"
+
+#include <zlib.h>
+
+#ifdef HAVE_SYS_SDT_H
+#include <sys/sdt.h>
+#endif
+
+#define CDR_NAME "AMQP"
+#define CONF_FILENAME "cdr_amqp.conf"
+
+/*! \brief Version of the message layout, sent in the x-schema-version header */
+#define CDR_AMQP_SCHEMA_VERSION 1
+
+/*! \brief Message headers; the static ones are the same on every message */
+enum cdr_amqp_header {
+	CDR_HEADER_NODE_ID,
+	CDR_HEADER_SCHEMA_VERSION,
+	CDR_HEADER_STATIC_MAX,
+	/* Latency stamps, in microseconds since the epoch, with latencyheaders */
+	CDR_HEADER_CDR_END = CDR_HEADER_STATIC_MAX,
+	CDR_HEADER_RECEIVED,
+	CDR_HEADER_ENQUEUED,
+	CDR_HEADER_PUBLISHED,
+	CDR_HEADER_MAX,
+};
+
+/*! \brief Compression codecs, by their content_encoding names */
+enum cdr_amqp_codec {
+	CDR_CODEC_NONE,
+	CDR_CODEC_GZIP,
+	CDR_CODEC_DEFLATE,
+	CDR_CODEC_MAX,
+};
+
+static const char * const cdr_codec_names[] = {
+	[CDR_CODEC_NONE] = "none",
+	[CDR_CODEC_GZIP] = "gzip",
+	[CDR_CODEC_DEFLATE] = "deflate",
+};
+
+/*! \brief Hops of a CDR's trip to the broker, for latency tracking */
+enum cdr_amqp_hop {
+	/*! \brief end of the call until the CDR reaches the module */
+	CDR_HOP_ASTERISK,
+	/*! \brief serializing and queueing for a destination */
+	CDR_HOP_MODULE,
+	/*! \brief waiting in the publisher queue and publishing */
+	CDR_HOP_PUBLISHER,
+	CDR_HOP_MAX,
+};
+
+static const char * const cdr_hop_names[] = {
+	[CDR_HOP_ASTERISK] = "asterisk",
+	[CDR_HOP_MODULE] = "module",
+	[CDR_HOP_PUBLISHER] = "publisher",
+};
+
+/*!
+ * \brief Buckets per latency histogram.
+ *
+ * Bucket 0 counts hops under a microsecond, bucket n those under 2^n
+ * microseconds, and the last bucket everything from about 4 seconds up.
+ */
+#define LATENCY_BUCKETS 24
+
+/*! \brief String fields of a CDR that can be length limited */
+enum cdr_amqp_field {
+	CDR_FIELD_CLID,
+	CDR_FIELD_SRC,
+	CDR_FIELD_DST,
+	CDR_FIELD_DCONTEXT,
+	CDR_FIELD_CHANNEL,
+	CDR_FIELD_DSTCHANNEL,
+	CDR_FIELD_LASTAPP,
+	CDR_FIELD_LASTDATA,
+	CDR_FIELD_ACCOUNTCODE,
+	CDR_FIELD_PEERACCOUNT,
+	CDR_FIELD_LINKEDID,
+	CDR_FIELD_UNIQUEID,
+	CDR_FIELD_USERFIELD,
+	CDR_FIELD_MAX,
+};
+
+static const char * const cdr_field_names[CDR_FIELD_MAX] = {
+	[CDR_FIELD_CLID] = "clid",
+	[CDR_FIELD_SRC] = "src",
+	[CDR_FIELD_DST] = "dst",
+	[CDR_FIELD_DCONTEXT] = "dcontext",
+	[CDR_FIELD_CHANNEL] = "channel",
+	[CDR_FIELD_DSTCHANNEL] = "dstchannel",
+	[CDR_FIELD_LASTAPP] = "lastapp",
+	[CDR_FIELD_LASTDATA] = "lastdata",
+	[CDR_FIELD_ACCOUNTCODE] = "accountcode",
+	[CDR_FIELD_PEERACCOUNT] = "peeraccount",
+	[CDR_FIELD_LINKEDID] = "linkedid",
+	[CDR_FIELD_UNIQUEID] = "uniqueid",
+	[CDR_FIELD_USERFIELD] = "userfield",
+};
+
+/*!
+ * \brief Module counters, updated atomically.
+ *
+ * 64 bits, so a busy system cannot wrap them; they are reported as
+ * Prometheus counters, which must never go backwards.
+ */
+static struct cdr_amqp_stats {
+	/*! \brief CDRs published to the broker */
+	uint64_t published;
+	/*! \brief CDRs that could not be serialized or published */
+	uint64_t failed;
+	/*! \brief CDRs dropped for exceeding maxmessagesize */
+	uint64_t oversize;
+	/*! \brief CDRs with at least one truncated field */
+	uint64_t truncated_cdrs;
+	/*! \brief Individual fields truncated */
+	uint64_t truncated_fields;
+	/*! \brief Invalid UTF-8 sequences replaced */
+	uint64_t utf8_repairs;
+	/*! \brief CDRs written to the dead-letter file */
+	uint64_t deadlettered;
+	/*! \brief CDRs read back from the dead-letter file */
+	uint64_t redriven;
+	/*! \brief CDRs that could be neither published nor dead-lettered */
+	uint64_t lost;
+	/*! \brief Switches between connections of a destination */
+	uint64_t failovers;
+	/*! \brief Messages published compressed */
+	uint64_t compressed;
+	/*! \brief Strings left out of the full intern table */
+	uint64_t intern_misses;
+} stats;
+
+#define STATS_INC(field, n) ast_atomic_fetch_add(&stats.field, (n), __ATOMIC_RELAXED)
+
+/*!
+ * \brief Sequence number of the last CDR handed to the module.
+ *
+ * CDRs are posted from several threads at once, so this is only ever
+ * accessed atomically; "last" is whichever store landed last.
+ */
+static int last_sequence;
+
+/*! \brief Counters by name, in the order they are reported */
+static const struct {
+	const char *name;
+	const char *help;
+	const uint64_t *value;
+} stats_counters[] = {
+	{ "published", "CDRs published", &stats.published },
+	{ "failed", "CDRs that failed to serialize, queue or publish", &stats.failed },
+	{ "deadlettered", "CDRs written to the dead-letter file", &stats.deadlettered },
+	{ "redriven", "CDRs read back from the dead-letter file", &stats.redriven },
+	{ "lost", "CDRs that could be neither published nor dead-lettered", &stats.lost },
+	{ "failovers", "Switches between connections of a destination", &stats.failovers },
+	{ "oversize", "CDRs dropped for exceeding maxmessagesize", &stats.oversize },
+	{ "truncated_cdrs", "CDRs with at least one truncated field", &stats.truncated_cdrs },
+	{ "truncated_fields", "Fields truncated to their length limit", &stats.truncated_fields },
+	{ "utf8_repairs", "Invalid UTF-8 sequences replaced", &stats.utf8_repairs },
+	{ "compressed", "Messages published compressed", &stats.compressed },
+	{ "intern_misses", "Strings not interned because the intern table was full",
+		&stats.intern_misses },
+};
+
+/*! \brief Latency histograms, indexed by cdr_amqp_hop */
+static uint64_t latency[CDR_HOP_MAX][LATENCY_BUCKETS];
+/*! \brief Total microseconds counted in each histogram */
+static int64_t latency_sum[CDR_HOP_MAX];
+
+/*! \brief Wall clock minus monotonic clock at load, in microseconds */
+static int64_t clock_offset;
+
+/*!
+ * \brief Wall clock time in microseconds, derived from the monotonic clock.
+ *
+ * Stamps taken this way cannot go backwards when the wall clock is
+ * stepped, so the differences between them are real latencies.
+ */
+static int64_t cdr_amqp_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000 + clock_offset;
+}
+
+static void clock_init(void)
+{
+	struct timeval now = ast_tvnow();
+
+	clock_offset = 0;
+	clock_offset = now.tv_sec * 1000000LL + now.tv_usec - cdr_amqp_now();
+}
+
+/*! \brief Count a \a hop that took \a usec microseconds */
+static void latency_record(enum cdr_amqp_hop hop, int64_t usec)
+{
+	int bucket = usec > 0 ? 64 - __builtin_clzll(usec) : 0;
+
+	ast_atomic_fetch_add(&latency[hop][MIN(bucket, LATENCY_BUCKETS - 1)], 1, __ATOMIC_RELAXED);
+	ast_atomic_fetch_add(&latency_sum[hop], usec, __ATOMIC_RELAXED);
+}
+
+/*!
+ * \brief USDT probe on a pipeline stage, as cdr_amqp:\a name.
+ *
+ * Every probe passes a message_id first, so tracers can follow a CDR
+ * through the stages and compute latencies themselves; a disabled probe
+ * is a nop. A compact row goes by its own id until batch_flushed, and by
+ * the id of its batch from there on. See contrib/bpftrace for examples.
+ */
+#ifdef HAVE_SYS_SDT_H
+#define CDR_PROBE(name, ...) STAP_PROBEV(cdr_amqp, name, __VA_ARGS__)
+#else
+#define CDR_PROBE(name, ...) do { } while (0)
+#endif
+
+struct cdr_amqp_buf;
+struct cdr_amqp_serialize_info;
+struct cdr_amqp_destination;
+struct cdr_amqp_batch;
+struct cdr_amqp_pipeline;
+struct compress_job;
+
+/*! \brief Token bucket of a publish rate limit */
+struct token_bucket {
+	/*! \brief tokens available; negative after an oversized message, down to -size */
+	double tokens;
+	/*! \brief when \a tokens was last refilled, from cdr_amqp_now() */
+	int64_t updated;
+	/*! \brief the limit \a tokens was counted for; 0 until it is first enforced */
+	unsigned int rate;
+	/*! \brief the publishburst \a tokens was counted for */
+	unsigned int burst;
+};
+
+/*! \brief One of the broker connections a destination can publish through */
+struct cdr_amqp_connection {
+	/*! \brief connection name in amqp.conf */
+	char *name;
+	/*! \brief the connection; NULL until it could be established */
+	struct ast_amqp_connection *amqp;
+};
+
+/*! \brief Signature of the serializer variants */
+typedef int (*cdr_serializer_fn)(struct cdr_amqp_buf *buf,
+	const struct cdr_amqp_destination *dest, const struct ast_cdr *cdr,
+	struct cdr_amqp_serialize_info *info);
+
+/*! \brief Name of the destination configured by the [global] section */
+#define GLOBAL_DESTINATION "global"
+
+/*!
+ * \brief A place CDRs are published to.
+ *
+ * Every section other than [global] in cdr_amqp.conf is a destination.
+ * The [global] section is one too when it names a connection, so
+ * single-destination configurations keep working unchanged.
+ */
+struct cdr_amqp_destination {
+	AST_DECLARE_STRING_FIELDS(
+		/*! \brief section name */
+		AST_STRING_FIELD(name);
+		/*! \brief connection names from amqp.conf, in failover order */
+		AST_STRING_FIELD(connection);
+		/*! \brief queue name */
+		AST_STRING_FIELD(queue);
+		/*! \brief exchange name */
+		AST_STRING_FIELD(exchange);
+		/*! \brief app_id message property */
+		AST_STRING_FIELD(appid);
+		/*! \brief node identifier sent in the x-node-id header */
+		AST_STRING_FIELD(nodeid);
+		/*! \brief file unpublishable CDRs are written to */
+		AST_STRING_FIELD(deadletter);
+		/*! \brief routing key of the metrics summary; global only */
+		AST_STRING_FIELD(metricsqueue);
+		/*! \brief routing key of heartbeats; global only */
+		AST_STRING_FIELD(heartbeatqueue);
+		/*! \brief compact batch envelope up to the base time, built in setup_amqp() */
+		AST_STRING_FIELD(batchheader);
+	);
+	/*! \brief whether to log the unique id */
+	int loguniqueid;
+	/*! \brief whether to log the user field */
+	int loguserfield;
+	/*! \brief whether to publish with the mandatory flag */
+	int mandatory;
+	/*! \brief whether messages use persistent delivery mode */
+	int persistent;
+	/*! \brief per-message TTL in milliseconds; 0 for none */
+	unsigned int expiration;
+	/*! \brief default length limit for string fields; 0 for none */
+	unsigned int maxfieldlen;
+	/*! \brief per-field length limits from fieldlimits; -1 if unset */
+	int fieldlimits[CDR_FIELD_MAX];
+	/*! \brief effective per-field limits, resolved in setup_amqp() */
+	size_t fieldcaps[CDR_FIELD_MAX];
+	/*! \brief largest message body to publish; 0 for no limit */
+	unsigned int maxmessagesize;
+	/*! \brief disposition_bit() mask of CDRs to publish; 0 for all */
+	unsigned int dispositions;
+	/*! \brief serializer specialized for this configuration */
+	cdr_serializer_fn serialize;
+	/*! \brief index of the first active destination with the same output */
+	size_t format;
+	/*! \brief whether CDRs are published as compact batches */
+	int compact;
+	/*! \brief most CDRs in a compact batch */
+	unsigned int batchsize;
+	/*! \brief milliseconds a compact batch waits for more CDRs */
+	unsigned int batchlinger;
+	/*! \brief whether compact batches carry a string dictionary */
+	int batchdictionary;
+	/*! \brief codec messages are compressed with */
+	enum cdr_amqp_codec compression;
+	/*! \brief compression level, or the highest one with adaptivecompression */
+	unsigned int compressionlevel;
+	/*! \brief whether to lower the level while the publisher falls behind */
+	int adaptivecompression;
+	/*! \brief threads compressing messages; global only */
+	unsigned int compressionthreads;
+
+	/*! \brief exchange as an AMQP string, so publishing needs no strlen() */
+	amqp_bytes_t exchange_bytes;
+	/*! \brief routing key (the queue name) as an AMQP string */
+	amqp_bytes_t routing_key;
+	/*! \brief whether to stamp messages with latency headers */
+	int latencyheaders;
+	/*! \brief seconds between metrics summaries; 0 for none; global only */
+	unsigned int metricsinterval;
+	/*! \brief seconds between heartbeats; 0 for none; global only */
+	unsigned int heartbeatinterval;
+	/*! \brief message headers; only the static ones are filled in */
+	amqp_table_entry_t headers[CDR_HEADER_MAX];
+	/*! \brief expiration property as the decimal string AMQP wants */
+	char expiration_str[12];
+	/*! \brief message properties, built once in setup_amqp() */
+	amqp_basic_properties_t props;
+
+	/*! \brief queue depth that raises a CdrAmqpQueueHigh event; 0 for none */
+	unsigned int queuewatermark;
+	/*! \brief publisher thread and its state; a reference */
+	struct cdr_amqp_pipeline *pipeline;
+	/*! \brief seconds on a fallback connection before retrying the primary */
+	unsigned int failback;
+	/*! \brief messages published per second; 0 for no limit */
+	unsigned int maxpublishrate;
+	/*! \brief message bytes published per second; 0 for no limit */
+	unsigned int maxpublishbytes;
+	/*! \brief seconds' worth of either limit that may be published at once */
+	unsigned int publishburst;
+	/*! \brief limiter state for maxpublishrate; publisher thread only */
+	struct token_bucket rate_bucket;
+	/*! \brief limiter state for maxpublishbytes; publisher thread only */
+	struct token_bucket bytes_bucket;
+	/*! \brief connections to amqp, in failover order */
+	AST_VECTOR(, struct cdr_amqp_connection) connections;
+	/*! \brief index of the connection in use; only written by the publisher thread */
+	size_t current;
+	/*! \brief the first connection, once it has passed failback seconds of probes */
+	struct ast_amqp_connection *probed;
+	/*! \brief since when probes of the first connection have passed; 0 if failing */
+	int64_t probe_since;
+};
+
+/*! \brief cdr_amqp configuration */
+struct cdr_amqp_conf {
+	/*! \brief the [global] section */
+	struct cdr_amqp_destination *global;
+	/*! \brief the other sections */
+	struct ao2_container *destinations;
+	/*! \brief destinations CDRs are published to, built in setup_amqp() */
+	AST_VECTOR(, struct cdr_amqp_destination *) active;
+};
+
+/*! \brief Locking container for safe configuration access. */
+static AO2_GLOBAL_OBJ_STATIC(confs);
+
+/*!
+ * \brief Publisher thread of a destination.
+ *
+ * These outlive configuration reloads, so CDRs still queued for a
+ * destination stay in order. Each destination holds a reference, as
+ * does the pipelines container while a destination by that name is
+ * configured; a pipeline dropped by a reload goes away once the CDRs
+ * queued on it have been published.
+ */
+struct cdr_amqp_pipeline {
+	/*! \brief publisher thread */
+	struct ast_taskprocessor *publisher;
+	/*! \brief whether publishing is paused; CDRs go to the dead-letter file */
+	int paused;
+	/*! \brief whether the queue is above its watermark */
+	int congested;
+	/*! \brief whether a re-drive is in progress; publisher thread only */
+	int redriving;
+	/*! \brief CDRs published; publisher thread only */
+	int published;
+	/*! \brief when the last heartbeat was sent, from cdr_amqp_now() */
+	int64_t heartbeat_time;
+	/*! \brief \a published as of the last heartbeat */
+	int heartbeat_published;
+	/*! \brief compact rows not yet published; publisher thread only */
+	struct cdr_amqp_batch *batch;
+	/*! \brief message being compressed, published before the next one; publisher thread only */
+	struct compress_job *inflight;
+	/*! \brief compression level in use; 0 until the first compressed message */
+	int level;
+	/*! \brief queue depth when the level was last picked */
+	long depth;
+	/*! \brief destination name */
+	char name[0];
+};
+
+/*! \brief Container of cdr_amqp_pipeline, keyed by destination name */
+static struct ao2_container *pipelines;
+
+/*! \brief Scheduler for the metrics summary, heartbeats and pipeline teardown */
+static struct ast_sched_context *sched;
+
+/*! \brief Pipelines not yet destroyed, so unload can wait for them to drain */
+static int pipeline_count;
+AST_MUTEX_DEFINE_STATIC(pipeline_lock);
+static ast_cond_t pipeline_cond;
+
+static int destination_cmp(void *obj, void *arg, int flags)
+{
+	const struct cdr_amqp_destination *dest = obj;
+	const char *name = arg;
+
+	if ((flags & OBJ_SEARCH_MASK) == OBJ_SEARCH_OBJECT) {
+		name = ((const struct cdr_amqp_destination *) arg)->name;
+	}
+
+	return strcmp(dest->name, name) ? 0 : CMP_MATCH | CMP_STOP;
+}
+
+static int pipeline_cmp(void *obj, void *arg, int flags)
+{
+	const struct cdr_amqp_pipeline *pipeline = obj;
+	const char *name = arg;
+
+	if ((flags & OBJ_SEARCH_MASK) == OBJ_SEARCH_OBJECT) {
+		name = ((const struct cdr_amqp_pipeline *) arg)->name;
+	}
+
+	return strcmp(pipeline->name, name) ? 0 : CMP_MATCH | CMP_STOP;
+}
+
+static void batch_destroy(struct cdr_amqp_pipeline *pipeline);
+static void compress_drain(struct cdr_amqp_pipeline *pipeline);
+
+static void pipeline_dtor(void *obj)
+{
+	struct cdr_amqp_pipeline *pipeline = obj;
+
+	/* Publishes whatever is still queued before the thread exits */
+	if (pipeline->publisher) {
+		ast_taskprocessor_unreference(pipeline->publisher);
+	}
+	batch_destroy(pipeline);
+	compress_drain(pipeline);
+
+	ast_mutex_lock(&pipeline_lock);
+	--pipeline_count;
+	ast_cond_signal(&pipeline_cond);
+	ast_mutex_unlock(&pipeline_lock);
+}
+
+/*!
+ * \brief Find or start the pipeline of destination \a name.
+ *
+ * \return A reference, which the caller must release with pipeline_release().
+ * \return NULL on error.
+ */
+static struct cdr_amqp_pipeline *pipeline_get(const char *name)
+{
+	RAII_VAR(struct cdr_amqp_pipeline *, pipeline, NULL, ao2_cleanup);
+	char tps_name[AST_TASKPROCESSOR_MAX_NAME + 1];
+
+	pipeline = ao2_find(pipelines, name, OBJ_SEARCH_KEY);
+	if (pipeline) {
+		return ao2_bump(pipeline);
+	}
+
+	pipeline = ao2_alloc(sizeof(*pipeline) + strlen(name) + 1, pipeline_dtor);
+	if (!pipeline) {
+		return NULL;
+	}
+	strcpy(pipeline->name, name); /* Safe */
+
+	ast_mutex_lock(&pipeline_lock);
+	++pipeline_count;
+	ast_mutex_unlock(&pipeline_lock);
+
+	snprintf(tps_name, sizeof(tps_name), "cdr_amqp/%s", name);
+	pipeline->publisher = ast_taskprocessor_get(tps_name, TPS_REF_DEFAULT);
+	if (!pipeline->publisher || !ao2_link(pipelines, pipeline)) {
+		return NULL;
+	}
+
+	return ao2_bump(pipeline);
+}
+
+/*! \brief Scheduler callback dropping a pipeline reference; see pipeline_release() */
+static int pipeline_release_cb(const void *data)
+{
+	ao2_ref((void *) data, -1);
+	return 0;
+}
+
+/*!
+ * \brief Release a reference to \a pipeline.
+ *
+ * The last reference to a pipeline dropped by a reload is usually
+ * released by its own publisher, when the last CDR queued on it has
+ * been published. The destructor joins that thread, so it has to run
+ * somewhere else; the scheduler thread does it.
+ */
+static void pipeline_release(struct cdr_amqp_pipeline *pipeline)
+{
+	if (pipeline->publisher && ast_taskprocessor_is_task(pipeline->publisher)
+		&& ast_sched_add(sched, 0, pipeline_release_cb, pipeline) >= 0) {
+		return;
+	}
+
+	ao2_ref(pipeline, -1);
+}
+
+static int pipeline_unused_cb(void *obj, void *arg, int flags)
+{
+	const struct cdr_amqp_pipeline *pipeline = obj;
+	const struct cdr_amqp_conf *conf = arg;
+	size_t i;
+
+	for (i = 0; conf && i < AST_VECTOR_SIZE(&conf->active); ++i) {
+		if (AST_VECTOR_GET(&conf->active, i)->pipeline == pipeline) {
+			return 0;
+		}
+	}
+
+	ast_log(LOG_NOTICE, "Destination %s removed; its publisher stops once its queue drains\n",
+		pipeline->name);
+	return CMP_MATCH;
+}
+
+/*!
+ * \brief Drop the pipelines no destination of \a conf uses.
+ *
+ * Those of destinations a reload removed or renamed, and those started
+ * by a configuration that then failed to apply.
+ */
+static void pipelines_prune(const struct cdr_amqp_conf *conf)
+{
+	ao2_callback(pipelines, OBJ_UNLINK | OBJ_NODATA | OBJ_MULTIPLE,
+		pipeline_unused_cb, (void *) conf);
+}
+
+/*! \brief Wait until every pipeline has published its queue and gone */
+static void pipelines_wait(void)
+{
+	ast_mutex_lock(&pipeline_lock);
+	while (pipeline_count) {
+		ast_cond_wait(&pipeline_cond, &pipeline_lock);
+	}
+	ast_mutex_unlock(&pipeline_lock);
+}
+
+static struct aco_type global_option = {
+	.type = ACO_GLOBAL,
+	.name = "global",
+	.item_offset = offsetof(struct cdr_amqp_conf, global),
+	.category = "^global$",
+	.category_match = ACO_WHITELIST,
+};
+
+static void *destination_alloc(const char *name);
+static void *destination_find(struct ao2_container *container, const char *name);
+
+static struct aco_type destination_option = {
+	.type = ACO_ITEM,
+	.name = "destination",
+	.item_alloc = destination_alloc,
+	.item_find = destination_find,
+	.item_offset = offsetof(struct cdr_amqp_conf, destinations),
+	.category = "^global$",
+	.category_match = ACO_BLACKLIST,
+};
+
+/*! \brief Options that apply to [global] and to each destination */
+static struct aco_type *destination_options[] = ACO_TYPES(&global_option, &destination_option);
+
+/*! \brief Options that only apply to [global] */
+static struct aco_type *global_options[] = ACO_TYPES(&global_option);
+
+static void connection_cleanup(struct cdr_amqp_connection cxn)
+{
+	ao2_cleanup(cxn.amqp);
+	ast_free(cxn.name);
+}
+
+static void destination_dtor(void *obj)
+{
+	struct cdr_amqp_destination *dest = obj;
+
+	AST_VECTOR_CALLBACK_VOID(&dest->connections, connection_cleanup);
+	AST_VECTOR_FREE(&dest->connections);
+	ao2_cleanup(dest->probed);
+	if (dest->pipeline) {
+		pipeline_release(dest->pipeline);
+	}
+	ast_string_field_free_memory(dest);
+}
+
+static struct cdr_amqp_destination *destination_create(struct aco_type *type,
+	const char *name)
+{
+	RAII_VAR(struct cdr_amqp_destination *, dest, NULL, ao2_cleanup);
+	int i;
+
+	dest = ao2_alloc(sizeof(*dest), destination_dtor);
+	if (!dest) {
+		return NULL;
+	}
+
+	if (ast_string_field_init(dest, 64) != 0
+		|| AST_VECTOR_INIT(&dest->connections, 1) != 0) {
+		return NULL;
+	}
+	ast_string_field_set(dest, name, name);
+
+	for (i = 0; i < CDR_FIELD_MAX; ++i) {
+		dest->fieldlimits[i] = -1;
+	}
+
+	aco_set_defaults(type, name, dest);
+
+	return ao2_bump(dest);
+}
+
+static void *destination_alloc(const char *name)
+{
+	return destination_create(&destination_option, name);
+}
+
+static void *destination_find(struct ao2_container *container, const char *name)
+{
+	return ao2_find(container, name, OBJ_SEARCH_KEY);
+}
+
+/*! \brief Handler for the fieldlimits option; a list of field:length pairs */
+static int fieldlimits_handler(const struct aco_option *opt,
+	struct ast_variable *var, void *obj)
+{
+	struct cdr_amqp_destination *dest = obj;
+	char *parse = ast_strdupa(var->value);
+	char *item;
+	int i;
+
+	for (i = 0; i < CDR_FIELD_MAX; ++i) {
+		dest->fieldlimits[i] = -1;
+	}
+
+	while ((item = strsep(&parse, ","))) {
+		char *name = ast_strip(strsep(&item, ":"));
+		int32_t len;
+
+		if (ast_strlen_zero(name)) {
+			continue;
+		}
+
+		for (i = 0; i < CDR_FIELD_MAX; ++i) {
+			if (!strcasecmp(name, cdr_field_names[i])) {
+				break;
+			}
+		}
+
+		/* fieldlimits[] uses -1 for unset, so a negative length must not get through */
+		if (i == CDR_FIELD_MAX || !item
+			|| ast_parse_arg(ast_strip(item), PARSE_INT32 | PARSE_IN_RANGE, &len,
+				0, INT_MAX) != 0) {
+			ast_log(LOG_ERROR, "Invalid fieldlimits entry '%s'\n", name);
+			return -1;
+		}
+
+		dest->fieldlimits[i] = len;
+	}
+
+	return 0;
+}
+
+/*!
+ * \brief Bit representing \a disposition in a dispositions mask.
+ *
+ * AST_CDR_NOANSWER is 0 and the others are single bits, so shift them
+ * all up by one.
+ */
+static inline unsigned int disposition_bit(long disposition)
+{
+	return 1U << (disposition ? __builtin_ctzl(disposition) + 1 : 0);
+}
+
+/*! \brief Handler for the dispositions option; a list of CDR dispositions */
+static int dispositions_handler(const struct aco_option *opt,
+	struct ast_variable *var, void *obj)
+{
+	static const int all[] = {
+		AST_CDR_NOANSWER, AST_CDR_NULL, AST_CDR_FAILED,
+		AST_CDR_BUSY, AST_CDR_ANSWERED, AST_CDR_CONGESTION,
+	};
+	struct cdr_amqp_destination *dest = obj;
+	char *parse = ast_strdupa(var->value);
+	char *item;
+	size_t i;
+
+	dest->dispositions = 0;
+
+	while ((item = strsep(&parse, ","))) {
+		item = ast_strip(item);
+		if (ast_strlen_zero(item)) {
+			continue;
+		}
+
+		for (i = 0; i < ARRAY_LEN(all); ++i) {
+			if (!strcasecmp(item, ast_cdr_disp2str(all[i]))) {
+				break;
+			}
+		}
+
+		if (i == ARRAY_LEN(all)) {
+			ast_log(LOG_ERROR, "Invalid disposition '%s'\n", item);
+			return -1;
+		}
+
+		dest->dispositions |= disposition_bit(all[i]);
+	}
+
+	return 0;
+}
+
+/*! \brief Handler for the format option */
+static int format_handler(const struct aco_option *opt,
+	struct ast_variable *var, void *obj)
+{
+	struct cdr_amqp_destination *dest = obj;
+
+	if (!strcasecmp(var->value, "json")) {
+		dest->compact = 0;
+	} else if (!strcasecmp(var->value, "compact")) {
+		dest->compact = 1;
+	} else {
+		ast_log(LOG_ERROR, "Invalid format '%s'\n", var->value);
+		return -1;
+	}
+
+	return 0;
+}
+
+/*! \brief Handler for the compression option */
+static int compression_handler(const struct aco_option *opt,
+	struct ast_variable *var, void *obj)
+{
+	struct cdr_amqp_destination *dest = obj;
+	int i;
+
+	for (i = 0; i < CDR_CODEC_MAX; ++i) {
+		if (!strcasecmp(var->value, cdr_codec_names[i])) {
+			dest->compression = i;
+			return 0;
+		}
+	}
+
+	ast_log(LOG_ERROR, "Invalid compression '%s'\n", var->value);
+	return -1;
+}
+
+/*! \brief The conf file that's processed for the module. */
+static struct aco_file conf_file = {
+	/*! The config file name. */
+	.filename = CONF_FILENAME,
+	/*! The mapping object types to be processed. */
+	.types = ACO_TYPES(&global_option, &destination_option),
+};
+
+static void conf_dtor(void *obj)
+{
+	struct cdr_amqp_conf *conf = obj;
+
+	AST_VECTOR_CALLBACK_VOID(&conf->active, ao2_cleanup);
+	AST_VECTOR_FREE(&conf->active);
+	ao2_cleanup(conf->destinations);
+	ao2_cleanup(conf->global);
+}
+
+static void *conf_alloc(void)
+{
+	RAII_VAR(struct cdr_amqp_conf *, conf, NULL, ao2_cleanup);
+
+	conf = ao2_alloc_options(sizeof(*conf), conf_dtor,
+		AO2_ALLOC_OPT_LOCK_NOLOCK);
+	if (!conf) {
+		return NULL;
+	}
+
+	if (AST_VECTOR_INIT(&conf->active, 0) != 0) {
+		return NULL;
+	}
+
+	conf->global = destination_create(&global_option, GLOBAL_DESTINATION);
+	if (!conf->global) {
+		return NULL;
+	}
+
+	conf->destinations = ao2_container_alloc_list(AO2_ALLOC_OPT_LOCK_NOLOCK, 0,
+		NULL, destination_cmp);
+	if (!conf->destinations) {
+		return NULL;
+	}
+
+	return ao2_bump(conf);
+}
+
+static int setup_amqp(void);
+static cdr_serializer_fn cdr_serializer_select(const struct cdr_amqp_destination *dest);
+
+CONFIG_INFO_STANDARD(cfg_info, confs, conf_alloc,
+	.files = ACO_FILES(&conf_file),
+	.pre_apply_config = setup_amqp,
+);
+
+/*!
+ * \brief Build the message properties shared by every CDR.
+ *
+ * Everything here points into \a dest's string fields, which live as
+ * long as the configuration does. Only per-message properties are
+ * filled in when publishing.
+ */
+static void setup_properties(struct cdr_amqp_destination *dest)
+{
+	amqp_table_entry_t *header;
+
+	dest->exchange_bytes = amqp_cstring_bytes(dest->exchange);
+	dest->routing_key = amqp_cstring_bytes(dest->queue);
+
+	header = &dest->headers[CDR_HEADER_NODE_ID];
+	header->key = amqp_cstring_bytes("x-node-id");
+	header->value.kind = AMQP_FIELD_KIND_UTF8;
+	header->value.value.bytes = amqp_cstring_bytes(dest->nodeid);
+
+	header = &dest->headers[CDR_HEADER_SCHEMA_VERSION];
+	header->key = amqp_cstring_bytes("x-schema-version");
+	header->value.kind = AMQP_FIELD_KIND_I32;
+	header->value.value.i32 = CDR_AMQP_SCHEMA_VERSION;
+
+	/* Values are filled in per message by connection_publish() */
+	dest->headers[CDR_HEADER_CDR_END].key = amqp_cstring_bytes("x-cdr-end");
+	dest->headers[CDR_HEADER_RECEIVED].key = amqp_cstring_bytes("x-received");
+	dest->headers[CDR_HEADER_ENQUEUED].key = amqp_cstring_bytes("x-enqueued");
+	dest->headers[CDR_HEADER_PUBLISHED].key = amqp_cstring_bytes("x-published");
+	for (header = &dest->headers[CDR_HEADER_STATIC_MAX];
+		header < &dest->headers[CDR_HEADER_MAX]; ++header) {
+		header->value.kind = AMQP_FIELD_KIND_I64;
+	}
+
+	dest->props._flags = AMQP_BASIC_DELIVERY_MODE_FLAG
+		| AMQP_BASIC_CONTENT_TYPE_FLAG
+		| AMQP_BASIC_HEADERS_FLAG
+		| AMQP_BASIC_MESSAGE_ID_FLAG
+		| AMQP_BASIC_TIMESTAMP_FLAG;
+	/* 2 is persistent delivery mode, 1 is transient */
+	dest->props.delivery_mode = dest->persistent ? 2 : 1;
+	dest->props.content_type = amqp_cstring_bytes("application/json");
+	dest->props.headers.num_entries = CDR_HEADER_STATIC_MAX;
+	dest->props.headers.entries = dest->headers;
+
+	if (!ast_strlen_zero(dest->appid)) {
+		dest->props._flags |= AMQP_BASIC_APP_ID_FLAG;
+		dest->props.app_id = amqp_cstring_bytes(dest->appid);
+	}
+
+	if (dest->expiration) {
+		snprintf(dest->expiration_str, sizeof(dest->expiration_str), "%u",
+			dest->expiration);
+		dest->props._flags |= AMQP_BASIC_EXPIRATION_FLAG;
+		dest->props.expiration = amqp_cstring_bytes(dest->expiration_str);
+	}
+}
+
+/*! \brief Create the directory holding the dead-letter file \a path */
+static int deadletter_mkdir(const char *path)
+{
+	char *dir = ast_strdupa(path);
+	char *slash = strrchr(dir, '/');
+
+	if (!slash || slash == dir) {
+		return 0;
+	}
+	*slash = '\0';
+
+	if (ast_mkdir(dir, 0755) != 0) {
+		ast_log(LOG_ERROR, "Unable to create dead-letter directory %s: %s\n",
+			dir, strerror(errno));
+		return -1;
+	}
+
+	return 0;
+}
+
+/*!
+ * \brief Connect \a dest to the connections in its failover list.
+ *
+ * A broker that is down at load time does not fail the configuration
+ * as long as one connection in the list is up; the others are retried
+ * when the publisher fails over to them.
+ */
+static int setup_connections(struct cdr_amqp_destination *dest)
+{
+	char *parse = ast_strdupa(dest->connection);
+	char *name;
+	int connected = 0;
+	size_t i;
+
+	while ((name = strsep(&parse, ","))) {
+		struct cdr_amqp_connection cxn;
+
+		name = ast_strip(name);
+		if (ast_strlen_zero(name)) {
+			continue;
+		}
+
+		cxn.name = ast_strdup(name);
+		cxn.amqp = NULL;
+		if (!cxn.name || AST_VECTOR_APPEND(&dest->connections, cxn) != 0) {
+			ast_free(cxn.name);
+			return -1;
+		}
+	}
+
+	for (i = 0; i < AST_VECTOR_SIZE(&dest->connections); ++i) {
+		struct cdr_amqp_connection *cxn = AST_VECTOR_GET_ADDR(&dest->connections, i);
+
+		cxn->amqp = ast_amqp_get_connection(cxn->name);
+		if (!cxn->amqp) {
+			ast_log(LOG_WARNING, "Could not get AMQP connection %s for destination %s\n",
+				cxn->name, dest->name);
+			continue;
+		}
+
+		if (!connected) {
+			dest->current = i;
+		}
+		connected = 1;
+	}
+
+	if (!connected) {
+		ast_log(LOG_ERROR, "No usable AMQP connection for destination %s\n",
+			dest->name);
+		return -1;
+	}
+
+	return 0;
+}
+
+/*! \brief Whether any field of \a dest has a length limit */
+static int destination_capped(const struct cdr_amqp_destination *dest)
+{
+	int i;
+
+	for (i = 0; i < CDR_FIELD_MAX; ++i) {
+		if (dest->fieldcaps[i] != SIZE_MAX) {
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+/*!
+ * \brief Build the start of the compact batch envelope of \a dest.
+ *
+ * Everything up to the value of "base" is the same for every batch;
+ * see cdr_serialize_compact() for the rows.
+ */
+static int setup_batch_header(struct cdr_amqp_destination *dest)
+{
+	RAII_VAR(struct ast_str *, header, ast_str_create(512), ast_free);
+
+	if (!header) {
+		return -1;
+	}
+
+	ast_str_set(&header, 0, "{\"format\":\"compact\",\"fields\":["
+		"\"start\",\"answer\",\"end\",\"clid\",\"src\",\"dst\",\"dcontext\","
+		"\"channel\",\"dstchannel\",\"lastapp\",\"lastdata\",\"durationsec\","
+		"\"billsec\",\"disposition\",\"accountcode\",\"amaflags\","
+		"\"peeraccount\",\"linkedid\"%s%s%s,\"message_id\"]",
+		dest->loguniqueid ? ",\"uniqueid\"" : "",
+		dest->loguserfield ? ",\"userfield\"" : "",
+		destination_capped(dest) ? ",\"truncated\"" : "");
+	if (dest->batchdictionary) {
+		ast_str_append(&header, 0, ",\"dictfields\":[\"dcontext\",\"lastapp\","
+			"\"disposition\",\"accountcode\",\"amaflags\",\"peeraccount\"]");
+	}
+	ast_str_append(&header, 0, ",\"base\":");
+
+	ast_string_field_set(dest, batchheader, ast_str_buffer(header));
+
+	return 0;
+}
+
+/*! \brief Default the nodeid of \a dest to the system name, or else the EID */
+static void setup_nodeid(struct cdr_amqp_destination *dest)
+{
+	char eid[32];
+
+	if (!ast_strlen_zero(dest->nodeid)) {
+		return;
+	}
+
+	if (!ast_strlen_zero(ast_config_AST_SYSTEM_NAME)) {
+		ast_string_field_set(dest, nodeid, ast_config_AST_SYSTEM_NAME);
+	} else {
+		ast_eid_to_str(eid, sizeof(eid), &ast_eid_default);
+		ast_string_field_set(dest, nodeid, eid);
+	}
+}
+
+/*! \brief Resolve the derived settings of \a dest and connect it */
+static int setup_destination(struct cdr_amqp_destination *dest)
+{
+	int i;
+
+	/* Resolve the field length limits once rather than per CDR */
+	for (i = 0; i < CDR_FIELD_MAX; ++i) {
+		unsigned int cap = dest->fieldlimits[i] >= 0
+			? (unsigned int) dest->fieldlimits[i] : dest->maxfieldlen;
+
+		dest->fieldcaps[i] = cap ? cap : SIZE_MAX;
+	}
+	dest->serialize = cdr_serializer_select(dest);
+	if (dest->compact && setup_batch_header(dest) != 0) {
+		return -1;
+	}
+
+	setup_nodeid(dest);
+	setup_properties(dest);
+
+	if (dest->mandatory) {
+		ast_log(LOG_WARNING, "Destination %s: messages the broker returns as unroutable "
+			"are discarded, not dead-lettered\n", dest->name);
+	}
+
+	if (ast_strlen_zero(dest->deadletter)) {
+		char *path;
+		int res;
+
+		if (!strcmp(dest->name, GLOBAL_DESTINATION)) {
+			res = ast_asprintf(&path, "%s/cdr_amqp/deadletter",
+				ast_config_AST_SPOOL_DIR);
+		} else {
+			res = ast_asprintf(&path, "%s/cdr_amqp/deadletter-%s",
+				ast_config_AST_SPOOL_DIR, dest->name);
+		}
+		if (res < 0) {
+			return -1;
+		}
+		ast_string_field_set(dest, deadletter, path);
+		ast_free(path);
+	}
+	if (deadletter_mkdir(dest->deadletter) != 0) {
+		return -1;
+	}
+
+	dest->pipeline = pipeline_get(dest->name);
+	if (!dest->pipeline) {
+		ast_log(LOG_ERROR, "Could not start publisher for destination %s\n",
+			dest->name);
+		return -1;
+	}
+
+	return setup_connections(dest);
+}
+
+/*!
+ * \brief Whether \a a and \a b serialize CDRs to identical bytes.
+ *
+ * Destinations that do can share one serialized message.
+ */
+static int destination_same_format(const struct cdr_amqp_destination *a,
+	const struct cdr_amqp_destination *b)
+{
+	return a->serialize == b->serialize
+		&& !memcmp(a->fieldcaps, b->fieldcaps, sizeof(a->fieldcaps))
+		/* The compact serializer is not specialized, so compare its flags */
+		&& (!a->compact || (a->loguniqueid == b->loguniqueid
+			&& a->loguserfield == b->loguserfield
+			&& a->batchdictionary == b->batchdictionary));
+}
+
+static int activate_destination(struct cdr_amqp_conf *conf,
+	struct cdr_amqp_destination *dest)
+{
+	size_t i;
+
+	if (setup_destination(dest) != 0) {
+		return -1;
+	}
+
+	dest->format = AST_VECTOR_SIZE(&conf->active);
+	for (i = 0; i < AST_VECTOR_SIZE(&conf->active); ++i) {
+		if (destination_same_format(AST_VECTOR_GET(&conf->active, i), dest)) {
+			dest->format = i;
+			break;
+		}
+	}
+
+	if (AST_VECTOR_APPEND(&conf->active, dest) != 0) {
+		return -1;
+	}
+	ao2_ref(dest, +1);
+
+	return 0;
+}
+
+static int setup_amqp(void)
+{
+	struct cdr_amqp_conf *conf = aco_pending_config(&cfg_info);
+	struct cdr_amqp_destination *dest;
+	struct ao2_iterator iter;
+	int res = 0;
+
+	if (!conf) {
+		return 0;
+	}
+
+	if (!conf->global) {
+		ast_log(LOG_ERROR, "Invalid cdr_amqp.conf\n");
+		return -1;
+	}
+
+	/* The metrics summary names the node by [global], active or not */
+	setup_nodeid(conf->global);
+
+	/* [global] is only a destination of its own when it has a connection */
+	if (!ast_strlen_zero(conf->global->connection)
+		|| !ao2_container_count(conf->destinations)) {
+		if (activate_destination(conf, conf->global) != 0) {
+			return -1;
+		}
+	}
+
+	iter = ao2_iterator_init(conf->destinations, 0);
+	while (!res && (dest = ao2_iterator_next(&iter))) {
+		res = activate_destination(conf, dest);
+		ao2_ref(dest, -1);
+	}
+	ao2_iterator_destroy(&iter);
+
+	return res;
+}
+
+/*!
+ * \brief Growable output buffer for the CDR serializer.
+ *
+ * One of these lives in each thread that posts CDRs, so serialization
+ * does not allocate once the buffer has grown to its working size.
+ */
+struct cdr_amqp_buf {
+	/*! \brief serialized bytes; not NUL terminated */
+	char *data;
+	/*! \brief number of bytes used */
+	size_t used;
+	/*! \brief number of bytes allocated */
+	size_t size;
+};
+
+static void serialize_buf_cleanup(void *data)
+{
+	struct cdr_amqp_buf *buf = data;
+
+	ast_free(buf->data);
+	ast_free(buf);
+}
+
+AST_THREADSTORAGE_CUSTOM(serialize_buf, NULL, serialize_buf_cleanup);
+
+/*!
+ * \brief Make room for \a len more bytes in \a buf.
+ *
+ * \return 0 on success.
+ * \return -1 on allocation failure.
+ */
+static int buf_reserve(struct cdr_amqp_buf *buf, size_t len)
+{
+	size_t size;
+	char *data;
+
+	if (buf->size - buf->used >= len) {
+		return 0;
+	}
+
+	size = buf->size ? buf->size : 1024;
+	while (size - buf->used < len) {
+		size *= 2;
+	}
+
+	data = ast_realloc(buf->data, size);
+	if (!data) {
+		return -1;
+	}
+
+	buf->data = data;
+	buf->size = size;
+	return 0;
+}
+
+/*! \brief Append bytes to \a buf; space must already be reserved. */
+static inline void buf_append(struct cdr_amqp_buf *buf, const char *src, size_t len)
+{
+	memcpy(buf->data + buf->used, src, len);
+	buf->used += len;
+}
+
+/*! \brief Append a string literal to \a buf without a strlen(). */
+#define buf_append_literal(buf, lit) buf_append(buf, lit, sizeof(lit) - 1)
+
+/*!
+ * \brief Bytes that can be copied into a JSON string verbatim.
+ *
+ * Everything else is either a quote, a backslash, a control character
+ * that must be escaped, or the start of a multi-byte UTF-8 sequence
+ * that must be validated.
+ */
+static const unsigned char json_plain[256] = {
+	[0x20] = 1, [0x21] = 1, /* 0x22 '"' */ [0x23 ... 0x5b] = 1,
+	/* 0x5c '\\' */ [0x5d ... 0x7f] = 1,
+};
+
+static size_t json_plain_span_scalar(const unsigned char *s, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len && json_plain[s[i]]; ++i) {
+	}
+
+	return i;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+
+/*!
+ * \brief SSE2 version of json_plain_span_scalar().
+ *
+ * Flags quotes, backslashes and bytes below 0x20 with compares, and
+ * bytes with the high bit set through the movemask sign bits.
+ */
+__attribute__((target("sse2")))
+static size_t json_plain_span_sse2(const unsigned char *s, size_t len)
+{
+	const __m128i quote = _mm_set1_epi8('"');
+	const __m128i bslash = _mm_set1_epi8('\\');
+	const __m128i ctrl = _mm_set1_epi8(0x1f);
+	size_t i;
+
+	for (i = 0; i + 16 <= len; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(s + i));
+		__m128i special = _mm_or_si128(
+			_mm_or_si128(_mm_cmpeq_epi8(v, quote), _mm_cmpeq_epi8(v, bslash)),
+			_mm_cmpeq_epi8(_mm_min_epu8(v, ctrl), v));
+		unsigned int mask = _mm_movemask_epi8(special) | _mm_movemask_epi8(v);
+
+		if (mask) {
+			return i + __builtin_ctz(mask);
+		}
+	}
+
+	return i + json_plain_span_scalar(s + i, len - i);
+}
+
+/*! \brief AVX2 version of json_plain_span_scalar(). */
+__attribute__((target("avx2")))
+static size_t json_plain_span_avx2(const unsigned char *s, size_t len)
+{
+	const __m256i quote = _mm256_set1_epi8('"');
+	const __m256i bslash = _mm256_set1_epi8('\\');
+	const __m256i ctrl = _mm256_set1_epi8(0x1f);
+	size_t i;
+
+	for (i = 0; i + 32 <= len; i += 32) {
+		__m256i v = _mm256_loadu_si256((const __m256i *)(s + i));
+		__m256i special = _mm256_or_si256(
+			_mm256_or_si256(_mm256_cmpeq_epi8(v, quote), _mm256_cmpeq_epi8(v, bslash)),
+			_mm256_cmpeq_epi8(_mm256_min_epu8(v, ctrl), v));
+		unsigned int mask = (unsigned int) _mm256_movemask_epi8(special)
+			| (unsigned int) _mm256_movemask_epi8(v);
+
+		if (mask) {
+			return i + __builtin_ctz(mask);
+		}
+	}
+
+	return i + json_plain_span_sse2(s + i, len - i);
+}
+#endif
+
+/*! \brief Scanner picked by json_scanner_init() for this CPU. */
+static size_t (*json_plain_span)(const unsigned char *s, size_t len) = json_plain_span_scalar;
+
+static void json_scanner_init(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		json_plain_span = json_plain_span_avx2;
+	} else if (__builtin_cpu_supports("sse2")) {
+		json_plain_span = json_plain_span_sse2;
+	}
+#endif
+}
+
+/*!
+ * \brief Length of the well formed UTF-8 sequence at \a s.
+ *
+ * \return Sequence length (2-4) if valid.
+ * \return 0 for a stray, overlong, surrogate or truncated sequence.
+ */
+static size_t utf8_sequence_len(const unsigned char *s, size_t len)
+{
+	if (s[0] >= 0xc2 && s[0] <= 0xdf) {
+		if (len >= 2 && (s[1] & 0xc0) == 0x80) {
+			return 2;
+		}
+	} else if (s[0] >= 0xe0 && s[0] <= 0xef) {
+		if (len >= 3 && (s[1] & 0xc0) == 0x80 && (s[2] & 0xc0) == 0x80
+			&& (s[0] != 0xe0 || s[1] >= 0xa0)
+			&& (s[0] != 0xed || s[1] < 0xa0)) {
+			return 3;
+		}
+	} else if (s[0] >= 0xf0 && s[0] <= 0xf4) {
+		if (len >= 4 && (s[1] & 0xc0) == 0x80 && (s[2] & 0xc0) == 0x80
+			&& (s[3] & 0xc0) == 0x80
+			&& (s[0] != 0xf0 || s[1] >= 0x90)
+			&& (s[0] != 0xf4 || s[1] < 0x90)) {
+			return 4;
+		}
+	}
+
+	return 0;
+}
+
+/*! \brief Fields a compact row can carry as dictionary ids */
+#define CDR_DICT_FIELDS 6
+
+/*! \brief Per-CDR bookkeeping filled in by the serializer */
+struct cdr_amqp_serialize_info {
+	/*! \brief bitmask of truncated cdr_amqp_field values */
+	unsigned int truncated;
+	/*! \brief number of invalid UTF-8 sequences replaced */
+	unsigned int repaired;
+	/*! \brief dictionary ids in a compact row */
+	unsigned short dict[CDR_DICT_FIELDS];
+	unsigned int dict_count;
+};
+
+/*!
+ * \brief Append the first \a len bytes of \a str as a quoted JSON string.
+ *
+ * Escaping and UTF-8 validation happen in a single pass. Runs of plain
+ * ASCII are found by the vectorized scanner and copied in bulk; invalid
+ * UTF-8 is replaced with U+FFFD rather than failing the whole CDR, which
+ * is what jansson would do.
+ *
+ * \return 0 on success.
+ * \return -1 on allocation failure.
+ */
+static int json_append_escaped(struct cdr_amqp_buf *buf, const char *str,
+	size_t len, struct cdr_amqp_serialize_info *info)
+{
+	static const char hex[] = "0123456789ABCDEF";
+	const unsigned char *s = (const unsigned char *) str;
+	size_t i = 0;
+
+	/* Worst case every byte becomes a six byte \u00XX escape */
+	if (buf_reserve(buf, len * 6 + 2) != 0) {
+		return -1;
+	}
+
+	buf_append_literal(buf, "\"");
+	while (i < len) {
+		size_t span = json_plain_span(s + i, len - i);
+		size_t seq;
+
+		buf_append(buf, str + i, span);
+		i += span;
+		if (i == len) {
+			break;
+		}
+
+		switch (s[i]) {
+		case '"':
+			buf_append_literal(buf, "\\\"");
+			break;
+		case '\\':
+			buf_append_literal(buf, "\\\\");
+			break;
+		case '\b':
+			buf_append_literal(buf, "\\b");
+			break;
+		case '\f':
+			buf_append_literal(buf, "\\f");
+			break;
+		case '\n':
+			buf_append_literal(buf, "\\n");
+			break;
+		case '\r':
+			buf_append_literal(buf, "\\r");
+			break;
+		case '\t':
+			buf_append_literal(buf, "\\t");
+			break;
+		default:
+			if (s[i] < 0x20) {
+				char esc[6] = { '\\', 'u', '0', '0', hex[s[i] >> 4], hex[s[i] & 0xf] };
+
+				buf_append(buf, esc, sizeof(esc));
+				break;
+			}
+
+			seq = utf8_sequence_len(s + i, len - i);
+			if (seq) {
+				buf_append(buf, str + i, seq);
+				i += seq;
+				continue;
+			}
+
+			/* U+FFFD REPLACEMENT CHARACTER */
+			buf_append_literal(buf, "\xef\xbf\xbd");
+			++info->repaired;
+			break;
+		}
+		++i;
+	}
+	buf_append_literal(buf, "\"");
+
+	return 0;
+}
+
+/*! \brief Append a string that is never length limited. */
+static inline int json_append_string(struct cdr_amqp_buf *buf, const char *str,
+	struct cdr_amqp_serialize_info *info)
+{
+	return json_append_escaped(buf, str, strlen(str), info);
+}
+
+/*!
+ * \brief Append CDR string field \a field, applying its configured limit.
+ *
+ * Strings longer than the limit are cut in place on a character boundary,
+ * so no truncated copy of the field is ever made.
+ *
+ * \a capped is a compile time constant in every caller, so serializers
+ * for configurations without limits skip the lookup and strnlen()
+ * entirely.
+ */
+static inline __attribute__((always_inline)) int json_append_field(
+	struct cdr_amqp_buf *buf, const char *str, enum cdr_amqp_field field,
+	const struct cdr_amqp_destination *dest,
+	struct cdr_amqp_serialize_info *info, const int capped)
+{
+	size_t cap;
+	size_t len;
+
+	if (!capped) {
+		return json_append_string(buf, str, info);
+	}
+
+	cap = dest->fieldcaps[field];
+	len = cap == SIZE_MAX ? strlen(str) : strnlen(str, cap + 1);
+	if (len > cap) {
+		len = cap;
+		while (len && ((const unsigned char *) str)[len] >> 6 == 2) {
+			--len;
+		}
+		info->truncated |= 1U << field;
+	}
+
+	return json_append_escaped(buf, str, len, info);
+}
+
+/*! \brief Most strings the intern table holds */
+#define INTERN_MAX 1024
+/*! \brief Slots in the intern hash table; a power of two, so at most half full */
+#define INTERN_SLOTS 2048
+/*! \brief Longest string worth interning */
+#define INTERN_MAX_LEN 64
+
+/*! \brief A string from a low-cardinality CDR field, with its JSON form */
+struct intern_entry {
+	/*! \brief small id, stable until unload */
+	unsigned int id;
+	uint32_t hash;
+	/*! \brief length of \a str */
+	size_t len;
+	/*! \brief the string escaped and quoted for JSON; points into \a str */
+	const char *json;
+	size_t json_len;
+	/*! \brief the string, then its JSON form */
+	char str[0];
+};
+
+/*!
+ * \brief Intern table, as an open addressing hash table.
+ *
+ * Entries are only ever added, and are published with a release store
+ * into an empty slot, so lookups need no lock. Adding takes \a intern_lock.
+ * Once INTERN_MAX strings are in, new strings are simply not interned;
+ * they are serialized in full and counted in intern_misses.
+ */
+static struct intern_entry *intern_slots[INTERN_SLOTS];
+/*! \brief Intern table entries, indexed by id */
+static struct intern_entry *intern_ids[INTERN_MAX];
+static unsigned int intern_count;
+AST_MUTEX_DEFINE_STATIC(intern_lock);
+
+/*! \brief FNV-1a; the strings are short, so this beats anything fancier */
+static uint32_t intern_hash(const char *str, size_t len)
+{
+	uint32_t hash = 2166136261U;
+
+	while (len--) {
+		hash = (hash ^ (unsigned char) *str++) * 16777619U;
+	}
+
+	return hash;
+}
+
+static struct intern_entry *intern_find(const char *str, size_t len, uint32_t hash)
+{
+	size_t slot;
+
+	for (slot = hash & (INTERN_SLOTS - 1);; slot = (slot + 1) & (INTERN_SLOTS - 1)) {
+		struct intern_entry *entry = __atomic_load_n(&intern_slots[slot], __ATOMIC_ACQUIRE);
+
+		if (!entry) {
+			return NULL;
+		}
+		if (entry->hash == hash && entry->len == len && !memcmp(entry->str, str, len)) {
+			return entry;
+		}
+	}
+}
+
+/*! \brief Add \a str to the intern table; called with \a intern_lock held */
+static struct intern_entry *intern_add(const char *str, size_t len, uint32_t hash)
+{
+	struct cdr_amqp_buf json = { NULL, 0, 0 };
+	struct cdr_amqp_serialize_info info = { 0, };
+	struct intern_entry *entry;
+	size_t slot;
+
+	/* Strings that need repair are left to the serializer, which counts them */
+	if (json_append_escaped(&json, str, len, &info) != 0 || info.repaired) {
+		ast_free(json.data);
+		return NULL;
+	}
+
+	entry = ast_malloc(sizeof(*entry) + len + 1 + json.used);
+	if (!entry) {
+		ast_free(json.data);
+		return NULL;
+	}
+	entry->id = intern_count;
+	entry->hash = hash;
+	entry->len = len;
+	memcpy(entry->str, str, len);
+	entry->str[len] = '\0';
+	memcpy(entry->str + len + 1, json.data, json.used);
+	entry->json = entry->str + len + 1;
+	entry->json_len = json.used;
+	ast_free(json.data);
+
+	for (slot = hash & (INTERN_SLOTS - 1); intern_slots[slot];
+		slot = (slot + 1) & (INTERN_SLOTS - 1)) {
+	}
+	intern_ids[entry->id] = entry;
+	__atomic_store_n(&intern_slots[slot], entry, __ATOMIC_RELEASE);
+	/* Read without the lock by intern(), so only counted once published */
+	__atomic_store_n(&intern_count, entry->id + 1, __ATOMIC_RELEASE);
+
+	if (entry->id + 1 == INTERN_MAX) {
+		ast_log(LOG_WARNING, "Intern table is full at %d strings; further values "
+			"of contexts, applications and account codes are serialized in full\n",
+			INTERN_MAX);
+	}
+
+	return entry;
+}
+
+/*!
+ * \brief Look up, or add, \a str in the intern table.
+ *
+ * \param cap Length limit of the field; longer strings are not interned.
+ * \return NULL if \a str is not interned.
+ */
+static const struct intern_entry *intern(const char *str, size_t cap)
+{
+	struct intern_entry *entry;
+	size_t len;
+	uint32_t hash;
+
+	len = strnlen(str, INTERN_MAX_LEN + 1);
+	if (len > INTERN_MAX_LEN || len > cap) {
+		return NULL;
+	}
+
+	hash = intern_hash(str, len);
+	entry = intern_find(str, len, hash);
+	if (entry) {
+		return entry;
+	}
+	if (__atomic_load_n(&intern_count, __ATOMIC_ACQUIRE) >= INTERN_MAX) {
+		STATS_INC(intern_misses, 1);
+		return NULL;
+	}
+
+	ast_mutex_lock(&intern_lock);
+	entry = intern_find(str, len, hash);
+	if (!entry && intern_count < INTERN_MAX) {
+		entry = intern_add(str, len, hash);
+	} else if (!entry) {
+		STATS_INC(intern_misses, 1);
+	}
+	ast_mutex_unlock(&intern_lock);
+
+	return entry;
+}
+
+/*! \brief Free the intern table; only once nothing can serialize anymore */
+static void intern_cleanup(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < intern_count; ++i) {
+		ast_free(intern_ids[i]);
+	}
+	memset(intern_slots, 0, sizeof(intern_slots));
+	memset(intern_ids, 0, sizeof(intern_ids));
+	intern_count = 0;
+}
+
+/*!
+ * \brief Append a low-cardinality field through the intern table.
+ *
+ * Values such as contexts, applications and account codes repeat
+ * constantly, so their escaped form is copied from the table instead of
+ * being scanned again for every CDR.
+ */
+static inline __attribute__((always_inline)) int json_append_interned(
+	struct cdr_amqp_buf *buf, const char *str, enum cdr_amqp_field field,
+	const struct cdr_amqp_destination *dest,
+	struct cdr_amqp_serialize_info *info, const int capped)
+{
+	const struct intern_entry *entry;
+
+	entry = intern(str, capped ? dest->fieldcaps[field] : SIZE_MAX);
+	if (!entry) {
+		return json_append_field(buf, str, field, dest, info, capped);
+	}
+
+	if (buf_reserve(buf, entry->json_len) != 0) {
+		return -1;
+	}
+	buf_append(buf, entry->json, entry->json_len);
+	return 0;
+}
+
+/*! \brief Append a string from a fixed set, such as a disposition, through the intern table */
+static int json_append_interned_string(struct cdr_amqp_buf *buf, const char *str,
+	struct cdr_amqp_serialize_info *info)
+{
+	const struct intern_entry *entry = intern(str, SIZE_MAX);
+
+	if (!entry) {
+		return json_append_string(buf, str, info);
+	}
+
+	if (buf_reserve(buf, entry->json_len) != 0) {
+		return -1;
+	}
+	buf_append(buf, entry->json, entry->json_len);
+	return 0;
+}
+
+/*! \brief Append the list of truncated fields, if any, as a JSON array. */
+static int json_append_truncated(struct cdr_amqp_buf *buf,
+	const struct cdr_amqp_serialize_info *info, const char *open)
+{
+	const char *sep = open;
+	int i;
+
+	if (!info->truncated) {
+		return 0;
+	}
+
+	for (i = 0; i < CDR_FIELD_MAX; ++i) {
+		size_t len;
+
+		if (!(info->truncated & (1U << i))) {
+			continue;
+		}
+
+		len = strlen(cdr_field_names[i]);
+		if (buf_reserve(buf, strlen(sep) + len + 2) != 0) {
+			return -1;
+		}
+		buf_append(buf, sep, strlen(sep));
+		buf_append_literal(buf, "\"");
+		buf_append(buf, cdr_field_names[i], len);
+		buf_append_literal(buf, "\"");
+		sep = ",";
+	}
+
+	if (buf_reserve(buf, 1) != 0) {
+		return -1;
+	}
+	buf_append_literal(buf, "]");
+
+	return 0;
+}
+
+/*!
+ * \brief Append \a tv as a JSON string.
+ *
+ * Formatted the same way as ast_json_timeval(), so consumers see no
+ * difference from the jansson based serializer.
+ */
+static int json_append_timeval(struct cdr_amqp_buf *buf, struct timeval tv)
+{
+	char tmp[AST_ISO8601_LEN];
+	struct ast_tm tm = {};
+	int len;
+
+	ast_localtime(&tv, &tm, NULL);
+	len = ast_strftime(tmp, sizeof(tmp), AST_ISO8601_FORMAT, &tm);
+	if (len < 0) {
+		return -1;
+	}
+
+	if (buf_reserve(buf, len + 2) != 0) {
+		return -1;
+	}
+
+	buf_append_literal(buf, "\"");
+	buf_append(buf, tmp, len);
+	buf_append_literal(buf, "\"");
+
+	return 0;
+}
+
+static int json_append_long(struct cdr_amqp_buf *buf, long value)
+{
+	char tmp[24];
+	int len = snprintf(tmp, sizeof(tmp), "%ld", value);
+
+	if (buf_reserve(buf, len) != 0) {
+		return -1;
+	}
+
+	buf_append(buf, tmp, len);
+	return 0;
+}
+
+/*! \brief Append an object key (with its leading separator) to \a buf. */
+#define json_append_key(buf, key) \
+	(buf_reserve(buf, sizeof(key) + 2) ? -1 : (buf_append_literal(buf, key ":"), 0))
+
+/*!
+ * \brief Serialize \a cdr as a compact JSON object into \a buf.
+ *
+ * The output is byte-for-byte what ast_json_dump_string() produced for
+ * the equivalent ast_json_pack() object, plus a "truncated" array naming
+ * any fields cut short by the configured length limits.
+ *
+ * The configuration flags are passed as constants by the
+ * CDR_SERIALIZER() variants below, so each variant is compiled without
+ * any per-field configuration branches.
+ *
+ * \return 0 on success.
+ * \return -1 on error.
+ */
+static inline __attribute__((always_inline)) int cdr_serialize_common(
+	struct cdr_amqp_buf *buf, const struct cdr_amqp_destination *dest,
+	const struct ast_cdr *cdr, struct cdr_amqp_serialize_info *info,
+	const int loguniqueid, const int loguserfield, const int capped)
+{
+	buf->used = 0;
+	info->truncated = 0;
+	info->repaired = 0;
+
+	if (json_append_key(buf, "{\"clid\"")
+		|| json_append_field(buf, cdr->clid, CDR_FIELD_CLID, dest, info, capped)
+		|| json_append_key(buf, ",\"src\"")
+		|| json_append_field(buf, cdr->src, CDR_FIELD_SRC, dest, info, capped)
+		|| json_append_key(buf, ",\"dst\"")
+		|| json_append_field(buf, cdr->dst, CDR_FIELD_DST, dest, info, capped)
+		|| json_append_key(buf, ",\"dcontext\"")
+		|| json_append_interned(buf, cdr->dcontext, CDR_FIELD_DCONTEXT, dest, info, capped)
+
+		|| json_append_key(buf, ",\"channel\"")
+		|| json_append_field(buf, cdr->channel, CDR_FIELD_CHANNEL, dest, info, capped)
+		|| json_append_key(buf, ",\"dstchannel\"")
+		|| json_append_field(buf, cdr->dstchannel, CDR_FIELD_DSTCHANNEL, dest, info, capped)
+		|| json_append_key(buf, ",\"lastapp\"")
+		|| json_append_interned(buf, cdr->lastapp, CDR_FIELD_LASTAPP, dest, info, capped)
+		|| json_append_key(buf, ",\"lastdata\"")
+		|| json_append_field(buf, cdr->lastdata, CDR_FIELD_LASTDATA, dest, info, capped)
+
+		|| json_append_key(buf, ",\"start\"")
+		|| json_append_timeval(buf, cdr->start)
+		|| json_append_key(buf, ",\"answer\"")
+		|| json_append_timeval(buf, cdr->answer)
+		|| json_append_key(buf, ",\"end\"")
+		|| json_append_timeval(buf, cdr->end)
+		|| json_append_key(buf, ",\"durationsec\"")
+		|| json_append_long(buf, cdr->duration)
+
+		|| json_append_key(buf, ",\"billsec\"")
+		|| json_append_long(buf, cdr->billsec)
+		|| json_append_key(buf, ",\"disposition\"")
+		|| json_append_interned_string(buf, ast_cdr_disp2str(cdr->disposition), info)
+		|| json_append_key(buf, ",\"accountcode\"")
+		|| json_append_interned(buf, cdr->accountcode, CDR_FIELD_ACCOUNTCODE, dest, info, capped)
+		|| json_append_key(buf, ",\"amaflags\"")
+		|| json_append_interned_string(buf, ast_channel_amaflags2string(cdr->amaflags), info)
+
+		|| json_append_key(buf, ",\"peeraccount\"")
+		|| json_append_interned(buf, cdr->peeraccount, CDR_FIELD_PEERACCOUNT, dest, info, capped)
+		|| json_append_key(buf, ",\"linkedid\"")
+		|| json_append_field(buf, cdr->linkedid, CDR_FIELD_LINKEDID, dest, info, capped)) {
+		return -1;
+	}
+
+	/* Set optional fields */
+	if (loguniqueid) {
+		if (json_append_key(buf, ",\"uniqueid\"")
+			|| json_append_field(buf, cdr->uniqueid, CDR_FIELD_UNIQUEID, dest, info, capped)) {
+			return -1;
+		}
+	}
+
+	if (loguserfield) {
+		if (json_append_key(buf, ",\"userfield\"")
+			|| json_append_field(buf, cdr->userfield, CDR_FIELD_USERFIELD, dest, info, capped)) {
+			return -1;
+		}
+	}
+
+	if ((capped && json_append_truncated(buf, info, ",\"truncated\":[") != 0)
+		|| buf_reserve(buf, 1) != 0) {
+		return -1;
+	}
+	buf_append_literal(buf, "}");
+
+	return 0;
+}
+
+/*! \brief Define a serializer specialized for one flag combination */
+#define CDR_SERIALIZER(name, loguniqueid, loguserfield, capped) \
+	static int name(struct cdr_amqp_buf *buf, \
+		const struct cdr_amqp_destination *dest, const struct ast_cdr *cdr, \
+		struct cdr_amqp_serialize_info *info) \
+	{ \
+		return cdr_serialize_common(buf, dest, cdr, info, \
+			loguniqueid, loguserfield, capped); \
+	}
+
+CDR_SERIALIZER(cdr_serialize_plain, 0, 0, 0)
+CDR_SERIALIZER(cdr_serialize_u, 1, 0, 0)
+CDR_SERIALIZER(cdr_serialize_f, 0, 1, 0)
+CDR_SERIALIZER(cdr_serialize_uf, 1, 1, 0)
+CDR_SERIALIZER(cdr_serialize_capped, 0, 0, 1)
+CDR_SERIALIZER(cdr_serialize_u_capped, 1, 0, 1)
+CDR_SERIALIZER(cdr_serialize_f_capped, 0, 1, 1)
+CDR_SERIALIZER(cdr_serialize_uf_capped, 1, 1, 1)
+
+/*! \brief Serializer variants, indexed by cdr_serializer_index() */
+static const cdr_serializer_fn cdr_serializers[] = {
+	cdr_serialize_plain,
+	cdr_serialize_u,
+	cdr_serialize_f,
+	cdr_serialize_uf,
+	cdr_serialize_capped,
+	cdr_serialize_u_capped,
+	cdr_serialize_f_capped,
+	cdr_serialize_uf_capped,
+};
+
+/*! \brief Append a separator between the columns of a compact row */
+#define json_append_comma(buf) \
+	(buf_reserve(buf, 1) ? -1 : (buf_append_literal(buf, ","), 0))
+
+/*!
+ * \brief Append a string column of a compact row.
+ *
+ * With batchdictionary, strings that can be interned are written as
+ * their intern id, and the batch carries the id's string once.
+ *
+ * \param field Field whose length limit applies; CDR_FIELD_MAX for none.
+ */
+static int json_append_dict(struct cdr_amqp_buf *buf, const char *str,
+	enum cdr_amqp_field field, const struct cdr_amqp_destination *dest,
+	struct cdr_amqp_serialize_info *info)
+{
+	const struct intern_entry *entry = NULL;
+
+	/* No id is shorter than "" */
+	if (dest->batchdictionary && *str) {
+		entry = intern(str, field == CDR_FIELD_MAX ? SIZE_MAX : dest->fieldcaps[field]);
+	}
+	if (!entry) {
+		return field == CDR_FIELD_MAX ? json_append_string(buf, str, info)
+			: json_append_field(buf, str, field, dest, info, 1);
+	}
+
+	info->dict[info->dict_count++] = entry->id;
+	return json_append_long(buf, entry->id);
+}
+
+/*!
+ * \brief Serialize \a cdr as a row of a compact batch.
+ *
+ * The row is the columns after start, answer and end, each preceded by
+ * a comma. The times depend on the batch the row ends up in, so they
+ * are kept in the message and written by batch_append(), as is the
+ * closing message_id column.
+ *
+ * Batching dominates the cost of this format, so unlike
+ * cdr_serialize_common() it is not specialized per configuration.
+ */
+static int cdr_serialize_compact(struct cdr_amqp_buf *buf,
+	const struct cdr_amqp_destination *dest, const struct ast_cdr *cdr,
+	struct cdr_amqp_serialize_info *info)
+{
+	buf->used = 0;
+	info->truncated = 0;
+	info->repaired = 0;
+	info->dict_count = 0;
+
+	if (json_append_comma(buf)
+		|| json_append_field(buf, cdr->clid, CDR_FIELD_CLID, dest, info, 1)
+		|| json_append_comma(buf)
+		|| json_append_field(buf, cdr->src, CDR_FIELD_SRC, dest, info, 1)
+		|| json_append_comma(buf)
+		|| json_append_field(buf, cdr->dst, CDR_FIELD_DST, dest, info, 1)
+		|| json_append_comma(buf)
+		|| json_append_dict(buf, cdr->dcontext, CDR_FIELD_DCONTEXT, dest, info)
+
+		|| json_append_comma(buf)
+		|| json_append_field(buf, cdr->channel, CDR_FIELD_CHANNEL, dest, info, 1)
+		|| json_append_comma(buf)
+		|| json_append_field(buf, cdr->dstchannel, CDR_FIELD_DSTCHANNEL, dest, info, 1)
+		|| json_append_comma(buf)
+		|| json_append_dict(buf, cdr->lastapp, CDR_FIELD_LASTAPP, dest, info)
+		|| json_append_comma(buf)
+		|| json_append_field(buf, cdr->lastdata, CDR_FIELD_LASTDATA, dest, info, 1)
+
+		|| json_append_comma(buf)
+		|| json_append_long(buf, cdr->duration)
+		|| json_append_comma(buf)
+		|| json_append_long(buf, cdr->billsec)
+		|| json_append_comma(buf)
+		|| json_append_dict(buf, ast_cdr_disp2str(cdr->disposition), CDR_FIELD_MAX, dest, info)
+		|| json_append_comma(buf)
+		|| json_append_dict(buf, cdr->accountcode, CDR_FIELD_ACCOUNTCODE, dest, info)
+		|| json_append_comma(buf)
+		|| json_append_dict(buf, ast_channel_amaflags2string(cdr->amaflags), CDR_FIELD_MAX, dest, info)
+
+		|| json_append_comma(buf)
+		|| json_append_dict(buf, cdr->peeraccount, CDR_FIELD_PEERACCOUNT, dest, info)
+		|| json_append_comma(buf)
+		|| json_append_field(buf, cdr->linkedid, CDR_FIELD_LINKEDID, dest, info, 1)) {
+		return -1;
+	}
+
+	if (dest->loguniqueid) {
+		if (json_append_comma(buf)
+			|| json_append_field(buf, cdr->uniqueid, CDR_FIELD_UNIQUEID, dest, info, 1)) {
+			return -1;
+		}
+	}
+
+	if (dest->loguserfield) {
+		if (json_append_comma(buf)
+			|| json_append_field(buf, cdr->userfield, CDR_FIELD_USERFIELD, dest, info, 1)) {
+			return -1;
+		}
+	}
+
+	if (destination_capped(dest)) {
+		if (info->truncated) {
+			return json_append_truncated(buf, info, ",[");
+		}
+		if (buf_reserve(buf, 5) != 0) {
+			return -1;
+		}
+		buf_append_literal(buf, ",null");
+	}
+
+	return 0;
+}
+
+/*! \brief Pick the serializer variant matching \a dest */
+static cdr_serializer_fn cdr_serializer_select(const struct cdr_amqp_destination *dest)
+{
+	if (dest->compact) {
+		return cdr_serialize_compact;
+	}
+
+	return cdr_serializers[(dest->loguniqueid ? 1 : 0)
+		| (dest->loguserfield ? 2 : 0)
+		| (destination_capped(dest) ? 4 : 0)];
+}
+
+static inline uint64_t rotl64(uint64_t x, int r)
+{
+	return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t fmix64(uint64_t k)
+{
+	k ^= k >> 33;
+	k *= 0xff51afd7ed558ccdULL;
+	k ^= k >> 33;
+	k *= 0xc4ceb9fe1a85ec53ULL;
+	k ^= k >> 33;
+	return k;
+}
+
+/*!
+ * \brief MurmurHash3 x64 128-bit hash of \a len bytes at \a key.
+ *
+ * \param out Receives the two 64-bit halves of the hash.
+ */
+static void murmur3_128(const void *key, size_t len, uint64_t out[2])
+{
+	const uint8_t *data = key;
+	const uint64_t c1 = 0x87c37b91114253d5ULL;
+	const uint64_t c2 = 0x4cf5ad432745937fULL;
+	uint64_t h1 = 0;
+	uint64_t h2 = 0;
+	uint64_t k1;
+	uint64_t k2;
+	size_t i;
+
+	for (i = 0; i + 16 <= len; i += 16) {
+		memcpy(&k1, data + i, sizeof(k1));
+		memcpy(&k2, data + i + 8, sizeof(k2));
+
+		k1 *= c1; k1 = rotl64(k1, 31); k1 *= c2; h1 ^= k1;
+		h1 = rotl64(h1, 27); h1 += h2; h1 = h1 * 5 + 0x52dce729;
+		k2 *= c2; k2 = rotl64(k2, 33); k2 *= c1; h2 ^= k2;
+		h2 = rotl64(h2, 31); h2 += h1; h2 = h2 * 5 + 0x38495ab5;
+	}
+
+	k1 = 0;
+	k2 = 0;
+	switch (len & 15) {
+	case 15: k2 ^= (uint64_t) data[i + 14] << 48; /* fall through */
+	case 14: k2 ^= (uint64_t) data[i + 13] << 40; /* fall through */
+	case 13: k2 ^= (uint64_t) data[i + 12] << 32; /* fall through */
+	case 12: k2 ^= (uint64_t) data[i + 11] << 24; /* fall through */
+	case 11: k2 ^= (uint64_t) data[i + 10] << 16; /* fall through */
+	case 10: k2 ^= (uint64_t) data[i + 9] << 8; /* fall through */
+	case 9: k2 ^= (uint64_t) data[i + 8];
+		k2 *= c2; k2 = rotl64(k2, 33); k2 *= c1; h2 ^= k2;
+		/* fall through */
+	case 8: k1 ^= (uint64_t) data[i + 7] << 56; /* fall through */
+	case 7: k1 ^= (uint64_t) data[i + 6] << 48; /* fall through */
+	case 6: k1 ^= (uint64_t) data[i + 5] << 40; /* fall through */
+	case 5: k1 ^= (uint64_t) data[i + 4] << 32; /* fall through */
+	case 4: k1 ^= (uint64_t) data[i + 3] << 24; /* fall through */
+	case 3: k1 ^= (uint64_t) data[i + 2] << 16; /* fall through */
+	case 2: k1 ^= (uint64_t) data[i + 1] << 8; /* fall through */
+	case 1: k1 ^= (uint64_t) data[i];
+		k1 *= c1; k1 = rotl64(k1, 31); k1 *= c2; h1 ^= k1;
+	}
+
+	h1 ^= len;
+	h2 ^= len;
+	h1 += h2;
+	h2 += h1;
+	h1 = fmix64(h1);
+	h2 = fmix64(h2);
+	h1 += h2;
+	h2 += h1;
+
+	out[0] = h1;
+	out[1] = h2;
+}
+
+/*! \brief Length of a message_id: 128 bits as hex */
+#define CDR_MESSAGE_ID_LEN 32
+
+/*! \brief Format a 128 bit \a hash as a message_id */
+static void message_id_format(const uint64_t hash[2], char id[CDR_MESSAGE_ID_LEN + 1])
+{
+	static const char hex[] = "0123456789abcdef";
+	int i;
+
+	for (i = 0; i < CDR_MESSAGE_ID_LEN; ++i) {
+		id[i] = hex[(hash[i / 16] >> (60 - (i % 16) * 4)) & 0xf];
+	}
+	id[CDR_MESSAGE_ID_LEN] = '\0';
+}
+
+/*!
+ * \brief Compute the idempotency key of \a cdr.
+ *
+ * The id is a hash of the fields that identify a CDR, so a CDR that is
+ * published more than once carries the same message_id every time and
+ * consumers can drop duplicates without a database lookup.
+ *
+ * \param id Receives CDR_MESSAGE_ID_LEN hex digits and a terminator.
+ */
+static void cdr_message_id(const struct ast_cdr *cdr, char id[CDR_MESSAGE_ID_LEN + 1])
+{
+	char key[sizeof(cdr->uniqueid) + sizeof(cdr->linkedid) + sizeof(int64_t) * 3];
+	size_t len;
+	size_t n;
+	int64_t num;
+	uint64_t hash[2];
+
+	/* uniqueid and linkedid keep their terminators as separators */
+	len = strnlen(cdr->uniqueid, sizeof(cdr->uniqueid) - 1) + 1;
+	memcpy(key, cdr->uniqueid, len);
+	n = strnlen(cdr->linkedid, sizeof(cdr->linkedid) - 1) + 1;
+	memcpy(key + len, cdr->linkedid, n);
+	len += n;
+
+	num = cdr->sequence;
+	memcpy(key + len, &num, sizeof(num));
+	len += sizeof(num);
+	num = cdr->start.tv_sec;
+	memcpy(key + len, &num, sizeof(num));
+	len += sizeof(num);
+	num = cdr->start.tv_usec;
+	memcpy(key + len, &num, sizeof(num));
+	len += sizeof(num);
+
+	murmur3_128(key, len, hash);
+	message_id_format(hash, id);
+}
+
+/*! \brief A serialized CDR waiting to be published */
+struct cdr_amqp_message {
+	/*! \brief timestamp property; when the CDR was posted */
+	uint64_t timestamp;
+	/*! \brief when the call ended, in microseconds; 0 if unknown */
+	int64_t cdr_end;
+	/*! \brief when the module got the CDR, from cdr_amqp_now(); 0 if unknown */
+	int64_t received;
+	/*! \brief CDRs in the message; more than one for a compact batch */
+	unsigned int rows;
+	/*! \brief start, answer and end of the CDR in milliseconds; compact rows only */
+	int64_t start;
+	int64_t answer;
+	int64_t end;
+	/*! \brief dictionary ids used by the row; compact rows only */
+	unsigned short dict[CDR_DICT_FIELDS];
+	unsigned int dict_count;
+	/*! \brief content_encoding property; NULL if not compressed */
+	const char *encoding;
+	/*! \brief the uncompressed message, which is what gets dead-lettered */
+	struct cdr_amqp_message *plain;
+	/*! \brief message_id property */
+	char message_id[CDR_MESSAGE_ID_LEN + 1];
+	/*! \brief length of body */
+	size_t len;
+	/*! \brief serialized CDR; not NUL terminated */
+	char body[0];
+};
+
+static void message_dtor(void *obj)
+{
+	struct cdr_amqp_message *msg = obj;
+
+	ao2_cleanup(msg->plain);
+}
+
+static struct cdr_amqp_message *message_alloc(const char *body, size_t len)
+{
+	struct cdr_amqp_message *msg;
+
+	msg = ao2_alloc_options(sizeof(*msg) + len, message_dtor, AO2_ALLOC_OPT_LOCK_NOLOCK);
+	if (!msg) {
+		return NULL;
+	}
+
+	msg->len = len;
+	msg->rows = 1;
+	memcpy(msg->body, body, len);
+
+	return msg;
+}
+
+/*!
+ * \brief Publish \a msg on \a amqp using the properties of \a dest.
+ *
+ * \param enqueued When \a msg was queued for \a dest; 0 if unknown.
+ */
+static int connection_publish(const struct cdr_amqp_destination *dest,
+	struct ast_amqp_connection *amqp, amqp_bytes_t routing_key,
+	const struct cdr_amqp_message *msg, int64_t enqueued)
+{
+	amqp_basic_properties_t props;
+	amqp_table_entry_t headers[CDR_HEADER_MAX];
+	amqp_bytes_t body;
+
+	/* Only the per-message properties differ from the prebuilt ones */
+	props = dest->props;
+	props.timestamp = msg->timestamp;
+	props.message_id.len = CDR_MESSAGE_ID_LEN;
+	props.message_id.bytes = (void *) msg->message_id;
+
+	if (dest->latencyheaders && msg->received && enqueued) {
+		memcpy(headers, dest->headers, sizeof(headers));
+		headers[CDR_HEADER_CDR_END].value.value.i64 = msg->cdr_end;
+		headers[CDR_HEADER_RECEIVED].value.value.i64 = msg->received;
+		headers[CDR_HEADER_ENQUEUED].value.value.i64 = enqueued;
+		headers[CDR_HEADER_PUBLISHED].value.value.i64 = cdr_amqp_now();
+		props.headers.num_entries = CDR_HEADER_MAX;
+		props.headers.entries = headers;
+	}
+
+	if (msg->encoding) {
+		props._flags |= AMQP_BASIC_CONTENT_ENCODING_FLAG;
+		props.content_encoding = amqp_cstring_bytes(msg->encoding);
+	}
+
+	body.len = msg->len;
+	body.bytes = (void *) msg->body;
+
+	return ast_amqp_basic_publish(amqp,
+		dest->exchange_bytes,
+		routing_key,
+		dest->mandatory,
+		0, /* immediate; allow messages to be queued */
+		&props,
+		body);
+}
+
+/*!
+ * \brief Publish \a msg to \a dest, failing over between its connections.
+ *
+ * The connection in use is tried first, then the rest of the list in
+ * order, so a dead broker costs one failed publish rather than a backlog.
+ * The publisher only goes back to the first connection once
+ * failback_probe_cb() has found it up for failback seconds, so a dead
+ * or flapping primary never holds up publishing.
+ *
+ * Only called from the destination's publisher thread, which is also
+ * what keeps messages in order across a switch.
+ */
+static int message_publish(struct cdr_amqp_destination *dest,
+	amqp_bytes_t routing_key, const struct cdr_amqp_message *msg, int64_t enqueued)
+{
+	size_t count = AST_VECTOR_SIZE(&dest->connections);
+	size_t start = dest->current;
+	struct ast_amqp_connection *probed;
+	size_t i;
+
+	probed = start ? __atomic_exchange_n(&dest->probed, NULL, __ATOMIC_ACQ_REL) : NULL;
+	if (probed) {
+		struct cdr_amqp_connection *primary = AST_VECTOR_GET_ADDR(&dest->connections, 0);
+
+		ao2_cleanup(primary->amqp);
+		primary->amqp = probed;
+		start = 0;
+	}
+
+	for (i = 0; i < count; ++i) {
+		size_t index = (start + i) % count;
+		struct cdr_amqp_connection *cxn = AST_VECTOR_GET_ADDR(&dest->connections, index);
+
+		if (!cxn->amqp) {
+			cxn->amqp = ast_amqp_get_connection(cxn->name);
+			if (!cxn->amqp) {
+				continue;
+			}
+		}
+
+		if (connection_publish(dest, cxn->amqp, routing_key, msg, enqueued) != 0) {
+			continue;
+		}
+
+		if (index != dest->current) {
+			ast_log(LOG_NOTICE, "Destination %s switched from connection %s to %s\n",
+				dest->name, AST_VECTOR_GET(&dest->connections, dest->current).name,
+				cxn->name);
+			__atomic_store_n(&dest->current, index, __ATOMIC_RELEASE);
+			STATS_INC(failovers, 1);
+		}
+
+		return 0;
+	}
+
+	return -1;
+}
+
+/*! \brief Path a dead-letter file is moved to while it is re-driven */
+#define REDRIVE_SUFFIX ".redrive"
+
+/*!
+ * \brief Append \a msg to the dead-letter file.
+ *
+ * Each line is the message_id, the timestamp and the body, separated
+ * by spaces. Bodies are compact JSON, so they never contain a newline.
+ * Only called from the publisher, so writes never interleave.
+ */
+static void deadletter_append(const struct cdr_amqp_destination *dest,
+	const struct cdr_amqp_message *msg)
+{
+	FILE *out;
+
+	out = fopen(dest->deadletter, "a");
+	if (!out) {
+		ast_log(LOG_ERROR, "Unable to open dead-letter file %s: %s; CDR %s lost\n",
+			dest->deadletter, strerror(errno), msg->message_id);
+		STATS_INC(lost, msg->rows);
+		CDR_PROBE(dropped, msg->message_id, dest->name, "lost");
+		return;
+	}
+
+	if (fprintf(out, "%s %" PRIu64 " ", msg->message_id, msg->timestamp) < 0
+		|| fwrite(msg->body, 1, msg->len, out) != msg->len
+		|| fputc('\n', out) == EOF
+		|| fclose(out) != 0) {
+		ast_log(LOG_ERROR, "Unable to write dead-letter file %s: %s; CDR %s lost\n",
+			dest->deadletter, strerror(errno), msg->message_id);
+		STATS_INC(lost, msg->rows);
+		CDR_PROBE(dropped, msg->message_id, dest->name, "lost");
+		return;
+	}
+
+	STATS_INC(deadlettered, msg->rows);
+	CDR_PROBE(spooled, msg->message_id, dest->name, msg->len, msg->rows);
+}
+
+/*! \brief Size of the dead-letter file of \a dest, in bytes */
+static off_t deadletter_size(const struct cdr_amqp_destination *dest)
+{
+	struct stat st;
+
+	return stat(dest->deadletter, &st) == 0 ? st.st_size : 0;
+}
+
+/*!
+ * \brief Microseconds until \a bucket holds \a need tokens.
+ *
+ * Refills \a bucket at \a rate tokens per second, up to \a burst seconds'
+ * worth, first. A \a need larger than the bucket only waits for a full
+ * bucket, and leaves it negative once taken.
+ *
+ * A bucket whose limit has changed since it was last used, whether by
+ * cdr amqp set or because it was off, starts over with a full burst;
+ * nothing published under the old limit is charged to the new one.
+ */
+static int64_t token_bucket_wait(struct token_bucket *bucket, unsigned int rate,
+	unsigned int burst, double need, int64_t now)
+{
+	double size = (double) rate * burst;
+
+	if (!rate) {
+		return 0;
+	}
+
+	if (bucket->rate != rate || bucket->burst != burst) {
+		bucket->rate = rate;
+		bucket->burst = burst;
+		bucket->tokens = size;
+		bucket->updated = now;
+	}
+
+	bucket->tokens = MIN(size, bucket->tokens + (now - bucket->updated) * (rate / 1e6));
+	bucket->updated = now;
+
+	need = MIN(need, size);
+	if (bucket->tokens >= need) {
+		return 0;
+	}
+	return (int64_t) ((need - bucket->tokens) * 1e6 / rate) + 1;
+}
+
+/*! \brief Take \a count tokens from \a bucket, if it has a limit to enforce */
+static void token_bucket_take(struct token_bucket *bucket, unsigned int rate,
+	unsigned int burst, double count)
+{
+	if (rate) {
+		bucket->tokens = MAX(bucket->tokens - count, -(double) rate * burst);
+	}
+}
+
+/*!
+ * \brief Wait until \a dest may publish a message of \a len bytes.
+ *
+ * Sleeping here holds up the publisher, so a slow broker or a re-drive
+ * backs up in the queue instead of on the broker.
+ */
+static void publish_throttle(struct cdr_amqp_destination *dest, size_t len)
+{
+	/* cdr amqp set can change these meanwhile; one message sees one value */
+	unsigned int rate = dest->maxpublishrate;
+	unsigned int bytes = dest->maxpublishbytes;
+	unsigned int burst = dest->publishburst;
+	int64_t wait;
+
+	if (!rate && !bytes) {
+		return;
+	}
+
+	for (;;) {
+		int64_t now = cdr_amqp_now();
+
+		wait = MAX(token_bucket_wait(&dest->rate_bucket, rate, burst, 1, now),
+			token_bucket_wait(&dest->bytes_bucket, bytes, burst, len, now));
+		if (!wait) {
+			break;
+		}
+		usleep(MIN(wait, 100000));
+	}
+
+	token_bucket_take(&dest->rate_bucket, rate, burst, 1);
+	token_bucket_take(&dest->bytes_bucket, bytes, burst, len);
+}
+
+/*!
+ * \brief Publish a message, dead-lettering it on failure or while paused
+ *
+ * \param enqueued When \a msg was queued for \a dest; 0 if unknown.
+ */
+static void message_deliver(struct cdr_amqp_destination *dest,
+	const struct cdr_amqp_message *msg, int64_t enqueued)
+{
+	if (dest->pipeline->paused) {
+		deadletter_append(dest, msg->plain ? msg->plain : msg);
+		return;
+	}
+
+	publish_throttle(dest, msg->len);
+	if (message_publish(dest, dest->routing_key, msg, enqueued) == 0) {
+		STATS_INC(published, msg->rows);
+		dest->pipeline->published += msg->rows;
+		if (enqueued) {
+			latency_record(CDR_HOP_PUBLISHER, cdr_amqp_now() - enqueued);
+		}
+		CDR_PROBE(published, msg->message_id, dest->name, msg->len, msg->rows);
+		return;
+	}
+
+	ast_log(LOG_ERROR, "Error publishing CDR to AMQP; writing it to %s\n",
+		dest->deadletter);
+	STATS_INC(failed, msg->rows);
+	deadletter_append(dest, msg->plain ? msg->plain : msg);
+}
+
+/*! \brief Queue depth at which adaptive compression starts dropping levels */
+#define COMPRESS_BACKLOG 32
+
+/*! \brief Worker threads compressing messages for every destination */
+static struct ast_threadpool *compressors;
+
+/*! \brief zlib streams of a compressor thread, kept across messages */
+struct compress_streams {
+	z_stream stream[CDR_CODEC_MAX];
+	/*! \brief level each stream is set to; 0 if not initialized */
+	int level[CDR_CODEC_MAX];
+};
+
+static void compress_streams_cleanup(void *data)
+{
+	struct compress_streams *zs = data;
+	int i;
+
+	for (i = 0; i < CDR_CODEC_MAX; ++i) {
+		if (zs->level[i]) {
+			deflateEnd(&zs->stream[i]);
+		}
+	}
+	ast_free(zs);
+}
+
+AST_THREADSTORAGE_CUSTOM(compress_streams, NULL, compress_streams_cleanup);
+
+/*!
+ * \brief Compress \a msg with \a codec at \a level.
+ *
+ * Each thread keeps a deflate stream per codec, so compressing does not
+ * allocate zlib's state for every message.
+ *
+ * \return A new message, which the caller must unref.
+ * \return NULL on error, or if compressing does not make \a msg smaller.
+ */
+static struct cdr_amqp_message *message_compress(struct cdr_amqp_message *msg,
+	enum cdr_amqp_codec codec, int level)
+{
+	struct compress_streams *zs;
+	struct cdr_amqp_message *out;
+	z_stream *strm;
+	uLong bound;
+
+	zs = ast_threadstorage_get(&compress_streams, sizeof(*zs));
+	if (!zs) {
+		return NULL;
+	}
+	strm = &zs->stream[codec];
+
+	if (!zs->level[codec]) {
+		/* Adding 16 to the window bits selects the gzip wrapper */
+		if (deflateInit2(strm, level, Z_DEFLATED,
+				codec == CDR_CODEC_GZIP ? MAX_WBITS + 16 : MAX_WBITS,
+				8, Z_DEFAULT_STRATEGY) != Z_OK) {
+			return NULL;
+		}
+		zs->level[codec] = level;
+	} else if (deflateReset(strm) != Z_OK) {
+		return NULL;
+	}
+	if (zs->level[codec] != level) {
+		if (deflateParams(strm, level, Z_DEFAULT_STRATEGY) != Z_OK) {
+			return NULL;
+		}
+		zs->level[codec] = level;
+	}
+
+	bound = deflateBound(strm, msg->len);
+	out = ao2_alloc_options(sizeof(*out) + bound, message_dtor, AO2_ALLOC_OPT_LOCK_NOLOCK);
+	if (!out) {
+		return NULL;
+	}
+
+	strm->next_in = (Bytef *) msg->body;
+	strm->avail_in = msg->len;
+	strm->next_out = (Bytef *) out->body;
+	strm->avail_out = bound;
+	if (deflate(strm, Z_FINISH) != Z_STREAM_END || strm->total_out >= msg->len) {
+		ao2_ref(out, -1);
+		return NULL;
+	}
+
+	*out = *msg;
+	out->len = strm->total_out;
+	out->encoding = cdr_codec_names[codec];
+	out->plain = ao2_bump(msg);
+
+	return out;
+}
+
+/*!
+ * \brief A message handed from a publisher to the compressors.
+ *
+ * Each publisher has at most one of these in flight: the message it
+ * compresses while it publishes the previous one.
+ */
+struct compress_job {
+	ast_mutex_t lock;
+	ast_cond_t cond;
+	/*! \brief whether \a compressed is final */
+	int done;
+	struct cdr_amqp_destination *dest;
+	struct cdr_amqp_message *msg;
+	/*! \brief \a msg compressed; NULL to publish \a msg as it is */
+	struct cdr_amqp_message *compressed;
+	enum cdr_amqp_codec codec;
+	int level;
+	/*! \brief when \a msg was queued for \a dest; 0 if unknown */
+	int64_t enqueued;
+};
+
+static int compress_task(void *data)
+{
+	struct compress_job *job = data;
+	struct cdr_amqp_message *compressed;
+
+	compressed = message_compress(job->msg, job->codec, job->level);
+
+	ast_mutex_lock(&job->lock);
+	job->compressed = compressed;
+	job->done = 1;
+	ast_cond_signal(&job->cond);
+	ast_mutex_unlock(&job->lock);
+
+	return 0;
+}
+
+static void compress_job_free(struct compress_job *job)
+{
+	ao2_cleanup(job->compressed);
+	ao2_ref(job->msg, -1);
+	ao2_ref(job->dest, -1);
+	ast_cond_destroy(&job->cond);
+	ast_mutex_destroy(&job->lock);
+	ast_free(job);
+}
+
+/*!
+ * \brief Pick the compression level for the next message of \a dest.
+ *
+ * With adaptivecompression, the level drops by one for each message
+ * while the publisher queue is backed up and still growing, and climbs
+ * back by one towards compressionlevel for each message that finds the
+ * queue empty.
+ */
+static int compress_level(struct cdr_amqp_destination *dest)
+{
+	struct cdr_amqp_pipeline *pipeline = dest->pipeline;
+	int level = pipeline->level;
+	long depth;
+
+	if (!dest->adaptivecompression || !level || level > (int) dest->compressionlevel) {
+		return pipeline->level = dest->compressionlevel;
+	}
+
+	depth = ast_taskprocessor_size(pipeline->publisher);
+	if (!depth) {
+		level = MIN(level + 1, (int) dest->compressionlevel);
+	} else if (depth >= COMPRESS_BACKLOG && depth > pipeline->depth) {
+		level = MAX(level - 1, 1);
+	}
+	pipeline->depth = depth;
+
+	return pipeline->level = level;
+}
+
+/*! \brief Hand \a msg to the compressors for \a dest */
+static struct compress_job *compress_submit(struct cdr_amqp_destination *dest,
+	struct cdr_amqp_message *msg, int64_t enqueued)
+{
+	struct compress_job *job;
+
+	job = ast_calloc(1, sizeof(*job));
+	if (!job) {
+		return NULL;
+	}
+
+	ast_mutex_init(&job->lock);
+	ast_cond_init(&job->cond, NULL);
+	job->dest = ao2_bump(dest);
+	job->msg = ao2_bump(msg);
+	job->codec = dest->compression;
+	job->level = compress_level(dest);
+	job->enqueued = enqueued;
+
+	if (ast_threadpool_push(compressors, compress_task, job) != 0) {
+		/* Better compressed late than not at all */
+		compress_task(job);
+	}
+
+	return job;
+}
+
+/*! \brief Wait for the message \a pipeline has in the compressors and publish it */
+static void compress_drain(struct cdr_amqp_pipeline *pipeline)
+{
+	struct compress_job *job = pipeline->inflight;
+
+	if (!job) {
+		return;
+	}
+	pipeline->inflight = NULL;
+
+	ast_mutex_lock(&job->lock);
+	while (!job->done) {
+		ast_cond_wait(&job->cond, &job->lock);
+	}
+	ast_mutex_unlock(&job->lock);
+
+	if (job->compressed) {
+		STATS_INC(compressed, 1);
+	}
+	message_deliver(job->dest, job->compressed ? job->compressed : job->msg, job->enqueued);
+	compress_job_free(job);
+}
+
+/*!
+ * \brief Publish \a msg from the publisher of \a dest, compressing it first if configured.
+ *
+ * A message to compress is handed to the compressors and published with
+ * the next call, or by compress_drain(). Meanwhile the publisher sends
+ * the message compressed before it, so compression and socket I/O
+ * overlap, and messages still go out in order.
+ *
+ * \param enqueued When \a msg was queued for \a dest; 0 if unknown.
+ */
+static void pipeline_deliver(struct cdr_amqp_destination *dest,
+	struct cdr_amqp_message *msg, int64_t enqueued)
+{
+	struct cdr_amqp_pipeline *pipeline = dest->pipeline;
+	struct compress_job *job = NULL;
+
+	/* Paused messages go to the dead-letter file uncompressed anyway */
+	if (dest->compression != CDR_CODEC_NONE && !pipeline->paused) {
+		job = compress_submit(dest, msg, enqueued);
+	}
+
+	compress_drain(pipeline);
+
+	if (job) {
+		pipeline->inflight = job;
+	} else {
+		message_deliver(dest, msg, enqueued);
+	}
+}
+
+/*! \brief Longest a lingering publisher sleeps before checking its queue again */
+#define BATCH_POLL_USEC 5000
+
+/*!
+ * \brief Compact rows waiting to be published as one message.
+ *
+ * Owned by the publisher thread of a pipeline. Rows are only left in it
+ * while more tasks are queued behind them, or while batch_linger() waits,
+ * so it is empty whenever the publisher is idle.
+ */
+struct cdr_amqp_batch {
+	/*! \brief destination the rows were serialized for */
+	struct cdr_amqp_destination *dest;
+	/*! \brief rows in the batch */
+	unsigned int count;
+	/*! \brief start of the first row, in milliseconds; row times are relative to it */
+	int64_t base;
+	/*! \brief when the first row was queued, from cdr_amqp_now() */
+	int64_t enqueued;
+	/*! \brief properties and latency stamps of the first row */
+	uint64_t timestamp;
+	int64_t cdr_end;
+	int64_t received;
+	/*! \brief bitmap of the intern ids in \a dict */
+	uint64_t used[(INTERN_MAX + 63) / 64];
+	/*! \brief "id":"string" pairs of the dictionary */
+	struct cdr_amqp_buf dict;
+	/*! \brief the rows, comma separated */
+	struct cdr_amqp_buf rows;
+	/*! \brief message ids of the rows, which the batch's id is hashed from */
+	struct cdr_amqp_buf ids;
+};
+
+/*!
+ * \brief Format the start, answer and end of \a msg relative to \a base.
+ *
+ * Times that were never set are null.
+ */
+static int batch_row_prefix(const struct cdr_amqp_message *msg, int64_t base,
+	int first, char *out, size_t size)
+{
+	const int64_t times[] = { msg->start, msg->answer, msg->end };
+	int len = first ? 0 : snprintf(out, size, ",");
+	size_t i;
+
+	for (i = 0; i < ARRAY_LEN(times); ++i) {
+		const char *sep = i ? "," : "[";
+
+		len += times[i]
+			? snprintf(out + len, size - len, "%s%" PRId64, sep, times[i] - base)
+			: snprintf(out + len, size - len, "%snull", sep);
+	}
+
+	return len;
+}
+
+/*! \brief Bytes of the message_id column closing a row: comma, quotes and bracket */
+#define BATCH_ROW_ID_LEN (CDR_MESSAGE_ID_LEN + 4)
+
+/*! \brief Upper bound of the size of \a batch as a message */
+static size_t batch_size(const struct cdr_amqp_batch *batch,
+	const struct cdr_amqp_destination *dest)
+{
+	/* The base, the dict and rows keys and the closing brackets */
+	return strlen(dest->batchheader) + 64 + batch->dict.used + batch->rows.used;
+}
+
+/*! \brief Bytes the dictionary of \a batch grows by if \a msg is added */
+static size_t batch_dict_growth(const struct cdr_amqp_batch *batch,
+	const struct cdr_amqp_message *msg)
+{
+	size_t growth = 0;
+	unsigned int i;
+
+	for (i = 0; i < msg->dict_count; ++i) {
+		unsigned int id = msg->dict[i];
+
+		if (!(batch->used[id / 64] & (1ULL << (id % 64)))) {
+			/* Comma, quoted id and colon */
+			growth += intern_ids[id]->json_len + 16;
+		}
+	}
+
+	return growth;
+}
+
+/*!
+ * \brief Add the row \a msg, preceded by \a prefix, to \a batch.
+ *
+ * The row ends with the message_id \a msg would have been published
+ * with on its own, so consumers can tell the CDRs of a batch apart.
+ */
+static int batch_append(struct cdr_amqp_batch *batch, const struct cdr_amqp_message *msg,
+	const char *prefix, size_t len)
+{
+	unsigned int i;
+
+	if (buf_reserve(&batch->rows, len + msg->len + BATCH_ROW_ID_LEN) != 0
+		|| buf_reserve(&batch->ids, CDR_MESSAGE_ID_LEN) != 0) {
+		return -1;
+	}
+
+	for (i = 0; i < msg->dict_count; ++i) {
+		unsigned int id = msg->dict[i];
+		const struct intern_entry *entry = intern_ids[id];
+		char key[16];
+		int keylen;
+
+		if (batch->used[id / 64] & (1ULL << (id % 64))) {
+			continue;
+		}
+
+		keylen = snprintf(key, sizeof(key), "%s\"%u\":", batch->dict.used ? "," : "", id);
+		if (buf_reserve(&batch->dict, keylen + entry->json_len) != 0) {
+			return -1;
+		}
+		buf_append(&batch->dict, key, keylen);
+		buf_append(&batch->dict, entry->json, entry->json_len);
+		batch->used[id / 64] |= 1ULL << (id % 64);
+	}
+
+	buf_append(&batch->rows, prefix, len);
+	buf_append(&batch->rows, msg->body, msg->len);
+	buf_append_literal(&batch->rows, ",\"");
+	buf_append(&batch->rows, msg->message_id, CDR_MESSAGE_ID_LEN);
+	buf_append_literal(&batch->rows, "\"]");
+	buf_append(&batch->ids, msg->message_id, CDR_MESSAGE_ID_LEN);
+	++batch->count;
+
+	return 0;
+}
+
+/*!
+ * \brief Publish the rows batched on \a pipeline as one message.
+ *
+ * The batch goes through message_deliver() like any other message, so
+ * a batch that cannot be published is dead-lettered whole, as a line
+ * consumers can decode on its own.
+ */
+static void batch_flush(struct cdr_amqp_pipeline *pipeline)
+{
+	struct cdr_amqp_batch *batch = pipeline->batch;
+	RAII_VAR(struct cdr_amqp_message *, msg, NULL, ao2_cleanup);
+	struct cdr_amqp_destination *dest;
+	struct cdr_amqp_buf *buf;
+	uint64_t hash[2];
+	size_t header_len;
+	char base[24];
+	int base_len;
+
+	if (!batch || !batch->count) {
+		return;
+	}
+	dest = batch->dest;
+
+	header_len = strlen(dest->batchheader);
+	base_len = snprintf(base, sizeof(base), "%" PRId64, batch->base);
+	buf = ast_threadstorage_get(&serialize_buf, sizeof(*buf));
+	if (buf) {
+		buf->used = 0;
+	}
+	if (buf && buf_reserve(buf, batch_size(batch, dest)) == 0) {
+		buf_append(buf, dest->batchheader, header_len);
+		buf_append(buf, base, base_len);
+		if (batch->dict.used) {
+			buf_append_literal(buf, ",\"dict\":{");
+			buf_append(buf, batch->dict.data, batch->dict.used);
+			buf_append_literal(buf, "}");
+		}
+		buf_append_literal(buf, ",\"rows\":[");
+		buf_append(buf, batch->rows.data, batch->rows.used);
+		buf_append_literal(buf, "]}");
+
+		msg = message_alloc(buf->data, buf->used);
+	}
+
+	if (msg) {
+		msg->rows = batch->count;
+		msg->timestamp = batch->timestamp;
+		msg->cdr_end = batch->cdr_end;
+		msg->received = batch->received;
+		murmur3_128(batch->ids.data, batch->ids.used, hash);
+		message_id_format(hash, msg->message_id);
+		CDR_PROBE(batch_flushed, msg->message_id, dest->name, msg->rows, msg->len);
+		pipeline_deliver(dest, msg, batch->enqueued);
+	} else {
+		ast_log(LOG_ERROR, "Unable to build batch for destination %s; %u CDRs lost\n",
+			dest->name, batch->count);
+		STATS_INC(lost, batch->count);
+	}
+
+	batch->count = 0;
+	batch->dict.used = 0;
+	batch->rows.used = 0;
+	batch->ids.used = 0;
+	memset(batch->used, 0, sizeof(batch->used));
+	batch->dest = NULL;
+	ao2_ref(dest, -1);
+}
+
+/*!
+ * \brief Add the compact row \a msg to the batch of \a dest.
+ *
+ * The batch is published once it holds batchsize rows. If the row
+ * would take it over maxmessagesize, the batch is published first and
+ * the row starts the next one.
+ */
+static void batch_add(struct cdr_amqp_destination *dest,
+	const struct cdr_amqp_message *msg, int64_t enqueued)
+{
+	struct cdr_amqp_pipeline *pipeline = dest->pipeline;
+	struct cdr_amqp_batch *batch;
+	char prefix[80];
+	int len;
+
+	if (!pipeline->batch) {
+		pipeline->batch = ast_calloc(1, sizeof(*pipeline->batch));
+		if (!pipeline->batch) {
+			STATS_INC(lost, 1);
+			CDR_PROBE(dropped, msg->message_id, dest->name, "lost");
+			return;
+		}
+	}
+	batch = pipeline->batch;
+
+	/* Rows serialized before a reload go out on their own */
+	if (batch->count && batch->dest != dest) {
+		batch_flush(pipeline);
+	}
+
+	for (;;) {
+		len = batch_row_prefix(msg, batch->count ? batch->base : msg->start,
+			!batch->count, prefix, sizeof(prefix));
+		if (!batch->count || !dest->maxmessagesize
+			|| batch_size(batch, dest) + len + msg->len + BATCH_ROW_ID_LEN
+				+ batch_dict_growth(batch, msg) <= dest->maxmessagesize) {
+			break;
+		}
+		batch_flush(pipeline);
+	}
+
+	if (batch_append(batch, msg, prefix, len) != 0) {
+		ast_log(LOG_ERROR, "Unable to batch CDR %s for destination %s; CDR lost\n",
+			msg->message_id, dest->name);
+		STATS_INC(lost, 1);
+		CDR_PROBE(dropped, msg->message_id, dest->name, "lost");
+		return;
+	}
+
+	if (batch->count == 1) {
+		batch->dest = ao2_bump(dest);
+		batch->base = msg->start;
+		batch->enqueued = enqueued;
+		batch->timestamp = msg->timestamp;
+		batch->cdr_end = msg->cdr_end;
+		batch->received = msg->received;
+	}
+
+	if (batch->count >= dest->batchsize) {
+		batch_flush(pipeline);
+	}
+}
+
+/*!
+ * \brief Wait up to batchlinger for more rows to join a partial batch.
+ *
+ * Only waits while nothing else is queued; any queued task is handled
+ * first and the batch stays open for it.
+ */
+static void batch_linger(struct cdr_amqp_pipeline *pipeline)
+{
+	struct cdr_amqp_batch *batch = pipeline->batch;
+
+	while (batch && batch->count) {
+		int64_t remaining;
+
+		if (ast_taskprocessor_size(pipeline->publisher) > 0) {
+			return;
+		}
+
+		remaining = batch->enqueued + batch->dest->batchlinger * 1000LL - cdr_amqp_now();
+		if (remaining <= 0) {
+			batch_flush(pipeline);
+			return;
+		}
+		usleep(MIN(remaining, BATCH_POLL_USEC));
+	}
+}
+
+/*! \brief Publish everything \a pipeline is holding back, batched or compressing */
+static void pipeline_flush(struct cdr_amqp_pipeline *pipeline)
+{
+	batch_flush(pipeline);
+	compress_drain(pipeline);
+}
+
+/*! \brief Publish what is left of the batch of \a pipeline and free it */
+static void batch_destroy(struct cdr_amqp_pipeline *pipeline)
+{
+	struct cdr_amqp_batch *batch = pipeline->batch;
+
+	if (!batch) {
+		return;
+	}
+
+	batch_flush(pipeline);
+	ast_free(batch->dict.data);
+	ast_free(batch->rows.data);
+	ast_free(batch->ids.data);
+	ast_free(batch);
+	pipeline->batch = NULL;
+}
+
+/*!
+ * \brief A message queued for one destination.
+ *
+ * The message itself is shared by every destination with the same
+ * output format.
+ */
+struct publish_task_data {
+	struct cdr_amqp_destination *dest;
+	struct cdr_amqp_message *msg;
+	/*! \brief from cdr_amqp_now() */
+	int64_t enqueued;
+};
+
+/*!
+ * \brief Raise or clear the queue watermark events of \a dest.
+ *
+ * CdrAmqpQueueHigh is sent when the publisher queue reaches
+ * queuewatermark, and CdrAmqpQueueNormal once it has drained to half
+ * that. The gap keeps a queue hovering around the mark from flooding
+ * AMI with events.
+ */
+static void queue_watermark_check(struct cdr_amqp_destination *dest)
+{
+	struct cdr_amqp_pipeline *pipeline = dest->pipeline;
+	long depth;
+
+	if (!dest->queuewatermark) {
+		return;
+	}
+
+	depth = ast_taskprocessor_size(pipeline->publisher);
+	if (depth >= dest->queuewatermark) {
+		if (__sync_bool_compare_and_swap(&pipeline->congested, 0, 1)) {
+			/*** DOCUMENTATION
+				<managerEvent language="en_US" name="CdrAmqpQueueHigh">
+					<managerEventInstance class="EVENT_FLAG_REPORTING">
+						<synopsis>Raised when CDRs back up in front of the broker.</synopsis>
+						<syntax>
+							<parameter name="Destination">
+								<para>The destination whose queue reached <literal>queuewatermark</literal>.</para>
+							</parameter>
+							<parameter name="QueueDepth">
+								<para>CDRs waiting to be published.</para>
+							</parameter>
+						</syntax>
+						<see-also>
+							<ref type="managerEvent">CdrAmqpQueueNormal</ref>
+						</see-also>
+					</managerEventInstance>
+				</managerEvent>
+			***/
+			manager_event(EVENT_FLAG_REPORTING, "CdrAmqpQueueHigh",
+				"Destination: %s\r\nQueueDepth: %ld\r\n", dest->name, depth);
+		}
+	} else if (depth <= dest->queuewatermark / 2) {
+		if (__sync_bool_compare_and_swap(&pipeline->congested, 1, 0)) {
+			/*** DOCUMENTATION
+				<managerEvent language="en_US" name="CdrAmqpQueueNormal">
+					<managerEventInstance class="EVENT_FLAG_REPORTING">
+						<synopsis>Raised when a backed up CDR queue has drained.</synopsis>
+						<syntax>
+							<xi:include xpointer="xpointer(/docs/managerEvent[@name='CdrAmqpQueueHigh']/managerEventInstance/syntax/parameter)" />
+						</syntax>
+					</managerEventInstance>
+				</managerEvent>
+			***/
+			manager_event(EVENT_FLAG_REPORTING, "CdrAmqpQueueNormal",
+				"Destination: %s\r\nQueueDepth: %ld\r\n", dest->name, depth);
+		}
+	}
+}
+
+static int publish_task(void *data)
+{
+	struct publish_task_data *task = data;
+
+	CDR_PROBE(dequeued, task->msg->message_id, task->dest->name, task->dest->compact);
+	if (task->dest->compact) {
+		batch_add(task->dest, task->msg, task->enqueued);
+		batch_linger(task->dest->pipeline);
+	} else {
+		/* Rows batched before a reload changed the format go first */
+		batch_flush(task->dest->pipeline);
+		pipeline_deliver(task->dest, task->msg, task->enqueued);
+	}
+	/* Nothing is left compressing once the publisher goes idle */
+	if (!ast_taskprocessor_size(task->dest->pipeline->publisher)) {
+		compress_drain(task->dest->pipeline);
+	}
+	queue_watermark_check(task->dest);
+
+	ao2_ref(task->msg, -1);
+	ao2_ref(task->dest, -1);
+	ast_free(task);
+	return 0;
+}
+
+/*! \brief Queue \a msg on the publisher of \a dest */
+static int message_queue(struct cdr_amqp_destination *dest, struct cdr_amqp_message *msg)
+{
+	struct publish_task_data *task;
+	int64_t enqueued = cdr_amqp_now();
+
+	task = ast_malloc(sizeof(*task));
+	if (!task) {
+		return -1;
+	}
+
+	task->dest = ao2_bump(dest);
+	task->msg = ao2_bump(msg);
+	task->enqueued = enqueued;
+
+	if (ast_taskprocessor_push(dest->pipeline->publisher, publish_task, task) != 0) {
+		ao2_ref(task->msg, -1);
+		ao2_ref(task->dest, -1);
+		ast_free(task);
+		return -1;
+	}
+	CDR_PROBE(enqueued, msg->message_id, dest->name);
+	latency_record(CDR_HOP_MODULE, enqueued - msg->received);
+	queue_watermark_check(dest);
+
+	return 0;
+}
+
+/*! \brief A re-drive in progress */
+struct redrive_state {
+	struct cdr_amqp_destination *dest;
+	/*! \brief the dead-letter file, moved aside */
+	FILE *in;
+	/*! \brief CDRs re-driven so far */
+	int count;
+	/*! \brief path of \a in */
+	char path[0];
+};
+
+static void redrive_state_free(struct redrive_state *state)
+{
+	if (state->in) {
+		fclose(state->in);
+	}
+	if (state->dest) {
+		state->dest->pipeline->redriving = 0;
+		ao2_ref(state->dest, -1);
+	}
+	ast_free(state);
+}
+
+/*!
+ * \brief Publish the rest of a dead-letter file being re-driven.
+ *
+ * Whenever live CDRs are waiting behind it, the re-drive queues its own
+ * continuation and returns, so live traffic gets the publisher first
+ * and a large re-drive only uses what is left of the publish rate.
+ */
+static int redrive_continue_task(void *data)
+{
+	struct redrive_state *state = data;
+	struct cdr_amqp_destination *dest = state->dest;
+	RAII_VAR(char *, line, NULL, ast_std_free);
+	size_t size = 0;
+	ssize_t len;
+
+	/* CDRs queued ahead of the re-drive go first */
+	pipeline_flush(dest->pipeline);
+
+	while ((len = getline(&line, &size, state->in)) > 0) {
+		RAII_VAR(struct cdr_amqp_message *, msg, NULL, ao2_cleanup);
+		uint64_t timestamp;
+		int body;
+
+		if (line[len - 1] == '\n') {
+			line[--len] = '\0';
+		}
+
+		if (sscanf(line, "%*" __stringify(CDR_MESSAGE_ID_LEN) "[0-9a-f] %" SCNu64 " %n",
+				&timestamp, &body) != 1 || body <= CDR_MESSAGE_ID_LEN) {
+			ast_log(LOG_WARNING, "Skipping malformed line in %s\n", state->path);
+			continue;
+		}
+
+		msg = message_alloc(line + body, len - body);
+		if (!msg) {
+			break;
+		}
+		memcpy(msg->message_id, line, CDR_MESSAGE_ID_LEN);
+		msg->message_id[CDR_MESSAGE_ID_LEN] = '\0';
+		msg->timestamp = timestamp;
+
+		pipeline_deliver(dest, msg, 0);
+		STATS_INC(redriven, 1);
+		++state->count;
+
+		if (ast_taskprocessor_size(dest->pipeline->publisher) > 0
+			&& ast_taskprocessor_push(dest->pipeline->publisher,
+				redrive_continue_task, state) == 0) {
+			return 0;
+		}
+	}
+
+	compress_drain(dest->pipeline);
+
+	if (ferror(state->in) || !feof(state->in)) {
+		ast_log(LOG_ERROR, "Re-drive of %s stopped early; run it again to resume\n",
+			state->path);
+		redrive_state_free(state);
+		return -1;
+	}
+
+	unlink(state->path);
+	ast_log(LOG_NOTICE, "Re-drove %d CDRs from %s to destination %s\n",
+		state->count, dest->deadletter, dest->name);
+	redrive_state_free(state);
+
+	return 0;
+}
+
+/*!
+ * \brief Publish everything in the dead-letter file again.
+ *
+ * The file is first moved aside, so messages that fail again are
+ * appended to a fresh dead-letter file instead of being read back in a
+ * loop. A leftover file from an interrupted re-drive is resumed.
+ */
+static int redrive_task(void *data)
+{
+	RAII_VAR(struct cdr_amqp_destination *, dest, data, ao2_cleanup);
+	struct redrive_state *state;
+	const char *path;
+
+	pipeline_flush(dest->pipeline);
+
+	if (dest->pipeline->paused) {
+		ast_log(LOG_NOTICE, "Destination %s is paused; not re-driving\n", dest->name);
+		return 0;
+	}
+	if (dest->pipeline->redriving) {
+		return 0;
+	}
+
+	path = dest->deadletter;
+	state = ast_calloc(1, sizeof(*state) + strlen(path) + sizeof(REDRIVE_SUFFIX));
+	if (!state) {
+		return -1;
+	}
+	sprintf(state->path, "%s" REDRIVE_SUFFIX, path); /* Safe */
+
+	if (access(state->path, F_OK) != 0 && rename(path, state->path) != 0) {
+		if (errno != ENOENT) {
+			ast_log(LOG_ERROR, "Unable to move dead-letter file %s aside: %s\n",
+				path, strerror(errno));
+		}
+		redrive_state_free(state);
+		return 0;
+	}
+
+	state->in = fopen(state->path, "r");
+	if (!state->in) {
+		ast_log(LOG_ERROR, "Unable to open %s: %s\n", state->path, strerror(errno));
+		redrive_state_free(state);
+		return -1;
+	}
+	state->dest = ao2_bump(dest);
+	dest->pipeline->redriving = 1;
+
+	return redrive_continue_task(state);
+}
+
+/*! \brief Queue a re-drive of the dead-letter file of \a dest */
+static int destination_redrive(struct cdr_amqp_destination *dest)
+{
+	ao2_ref(dest, +1);
+	if (ast_taskprocessor_push(dest->pipeline->publisher, redrive_task, dest) != 0) {
+		ao2_ref(dest, -1);
+		return -1;
+	}
+
+	return 0;
+}
+
+/*!
+ * \brief Serialize \a cdr for \a dest.
+ *
+ * \param id The message_id of \a cdr, from cdr_message_id().
+ * \return A new message, which the caller must unref.
+ * \return NULL on error.
+ */
+static struct cdr_amqp_message *message_create(const struct cdr_amqp_destination *dest,
+	const struct ast_cdr *cdr, const char id[CDR_MESSAGE_ID_LEN + 1], int64_t received)
+{
+	struct cdr_amqp_buf *buf;
+	struct cdr_amqp_serialize_info info;
+	struct cdr_amqp_message *msg;
+
+	buf = ast_threadstorage_get(&serialize_buf, sizeof(*buf));
+	if (!buf) {
+		return NULL;
+	}
+
+	if (dest->serialize(buf, dest, cdr, &info) != 0) {
+		ast_log(LOG_ERROR, "Failed to serialize CDR to JSON\n");
+		return NULL;
+	}
+
+	if (info.repaired) {
+		STATS_INC(utf8_repairs, info.repaired);
+	}
+	if (info.truncated) {
+		STATS_INC(truncated_cdrs, 1);
+		STATS_INC(truncated_fields, __builtin_popcount(info.truncated));
+	}
+
+	msg = message_alloc(buf->data, buf->used);
+	if (!msg) {
+		return NULL;
+	}
+	msg->timestamp = time(NULL);
+	msg->received = received;
+	if (!ast_tvzero(cdr->end)) {
+		msg->cdr_end = cdr->end.tv_sec * 1000000LL + cdr->end.tv_usec;
+	}
+	if (dest->compact) {
+		msg->start = cdr->start.tv_sec * 1000LL + cdr->start.tv_usec / 1000;
+		msg->answer = cdr->answer.tv_sec * 1000LL + cdr->answer.tv_usec / 1000;
+		msg->end = cdr->end.tv_sec * 1000LL + cdr->end.tv_usec / 1000;
+		memcpy(msg->dict, info.dict, sizeof(msg->dict));
+		msg->dict_count = info.dict_count;
+	}
+	memcpy(msg->message_id, id, sizeof(msg->message_id));
+	CDR_PROBE(serialized, msg->message_id, msg->len);
+
+	return msg;
+}
+
+/*!
+ * \brief CDR handler for AMQP.
+ *
+ * Serializes the CDR once per distinct output format and hands it to
+ * the publisher of each destination; the broker round trips happen off
+ * the CDR posting thread.
+ *
+ * \param cdr CDR to log.
+ * \return 0 on success.
+ * \return -1 on error.
+ */
+static int amqp_cdr_log(struct ast_cdr *cdr)
+{
+	RAII_VAR(struct cdr_amqp_conf *, conf, NULL, ao2_cleanup);
+	struct cdr_amqp_message **msgs;
+	size_t count;
+	size_t i;
+	int res = 0;
+	int64_t received = cdr_amqp_now();
+	char id[CDR_MESSAGE_ID_LEN + 1];
+
+	/* The same for every format, so hashed once */
+	cdr_message_id(cdr, id);
+	CDR_PROBE(received, id, cdr->uniqueid);
+	__atomic_store_n(&last_sequence, cdr->sequence, __ATOMIC_RELAXED);
+
+	if (!ast_tvzero(cdr->end)) {
+		latency_record(CDR_HOP_ASTERISK,
+			received - (cdr->end.tv_sec * 1000000LL + cdr->end.tv_usec));
+	}
+
+	conf = ao2_global_obj_ref(confs);
+
+	ast_assert(conf && AST_VECTOR_SIZE(&conf->active));
+
+	count = AST_VECTOR_SIZE(&conf->active);
+	msgs = ast_alloca(count * sizeof(*msgs));
+	memset(msgs, 0, count * sizeof(*msgs));
+
+	for (i = 0; i < count; ++i) {
+		struct cdr_amqp_destination *dest = AST_VECTOR_GET(&conf->active, i);
+		struct cdr_amqp_message *msg;
+
+		if (dest->dispositions
+			&& !(dest->dispositions & disposition_bit(cdr->disposition))) {
+			continue;
+		}
+
+		msg = msgs[dest->format];
+		if (!msg) {
+			msg = msgs[dest->format] = message_create(dest, cdr, id, received);
+			if (!msg) {
+				STATS_INC(failed, 1);
+				CDR_PROBE(dropped, id, dest->name, "serialize");
+				res = -1;
+				continue;
+			}
+		}
+
+		if (dest->maxmessagesize && msg->len > dest->maxmessagesize) {
+			ast_log(LOG_WARNING, "Dropping CDR %s for destination %s: %zu bytes exceeds maxmessagesize %u\n",
+				cdr->uniqueid, dest->name, msg->len, dest->maxmessagesize);
+			STATS_INC(oversize, 1);
+			CDR_PROBE(dropped, id, dest->name, "oversize");
+			res = -1;
+			continue;
+		}
+
+		if (message_queue(dest, msg) != 0) {
+			ast_log(LOG_ERROR, "Unable to queue CDR for destination %s\n", dest->name);
+			STATS_INC(failed, 1);
+			CDR_PROBE(dropped, id, dest->name, "queue");
+			res = -1;
+		}
+	}
+
+	for (i = 0; i < count; ++i) {
+		ao2_cleanup(msgs[i]);
+	}
+
+	return res;
+}
+
+static int metrics_sched_id = -1;
+static int heartbeat_sched_id = -1;
+static int failback_sched_id = -1;
+
+/*! \brief Build the metrics summary: every counter and latency histogram */
+static struct ast_json *metrics_summary(const struct cdr_amqp_conf *conf)
+{
+	RAII_VAR(struct ast_json *, json, NULL, ast_json_unref);
+	struct ast_json *counters;
+	struct ast_json *hops;
+	size_t i;
+	int res = 0;
+
+	json = ast_json_pack("{s: s, s: I, s: {}, s: {}}",
+		"node_id", conf->global->nodeid,
+		"timestamp", (ast_json_int_t) time(NULL),
+		"counters",
+		"latency");
+	if (!json) {
+		return NULL;
+	}
+
+	counters = ast_json_object_get(json, "counters");
+	for (i = 0; i < ARRAY_LEN(stats_counters); ++i) {
+		res |= ast_json_object_set(counters, stats_counters[i].name,
+			ast_json_integer_create((ast_json_int_t) *stats_counters[i].value));
+	}
+
+	hops = ast_json_object_get(json, "latency");
+	for (i = 0; i < CDR_HOP_MAX; ++i) {
+		struct ast_json *buckets = ast_json_array_create();
+		int bucket;
+
+		for (bucket = 0; buckets && bucket < LATENCY_BUCKETS; ++bucket) {
+			res |= ast_json_array_append(buckets,
+				ast_json_integer_create((ast_json_int_t) latency[i][bucket]));
+		}
+		res |= ast_json_object_set(hops, cdr_hop_names[i], buckets);
+	}
+
+	return res ? NULL : ast_json_ref(json);
+}
+
+/*!
+ * \brief Publish \a json to \a routing_key through \a dest, bypassing
+ * the rate limits and the dead-letter file.
+ *
+ * Only called from the destination's publisher thread.
+ */
+static int json_publish(struct cdr_amqp_destination *dest, const char *routing_key,
+	struct ast_json *json)
+{
+	RAII_VAR(struct cdr_amqp_message *, msg, NULL, ao2_cleanup);
+	uint64_t hash[2];
+	char *str;
+
+	str = json ? ast_json_dump_string(json) : NULL;
+	if (!str) {
+		return -1;
+	}
+
+	msg = message_alloc(str, strlen(str));
+	ast_json_free(str);
+	if (!msg) {
+		return -1;
+	}
+	msg->timestamp = time(NULL);
+	murmur3_128(msg->body, msg->len, hash);
+	message_id_format(hash, msg->message_id);
+
+	return message_publish(dest, amqp_cstring_bytes(routing_key), msg, 0);
+}
+
+/*!
+ * \brief Publish the metrics summary through the first destination.
+ *
+ * Runs on that destination's publisher, like every other publish to it.
+ * A summary that cannot be published is dropped; the next one carries
+ * the same counters.
+ */
+static int metrics_task(void *data)
+{
+	RAII_VAR(struct cdr_amqp_conf *, conf, data, ao2_cleanup);
+	RAII_VAR(struct ast_json *, json, NULL, ast_json_unref);
+	struct cdr_amqp_destination *dest = AST_VECTOR_GET(&conf->active, 0);
+
+	/* The summary is never batched; publish the CDRs ahead of it */
+	pipeline_flush(dest->pipeline);
+
+	if (dest->pipeline->paused) {
+		return 0;
+	}
+
+	json = metrics_summary(conf);
+	if (json_publish(dest, conf->global->metricsqueue, json) != 0) {
+		ast_log(LOG_WARNING, "Unable to publish CDR metrics to destination %s\n",
+			dest->name);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int metrics_sched_cb(const void *data)
+{
+	struct cdr_amqp_conf *conf = ao2_global_obj_ref(confs);
+
+	if (conf && ast_taskprocessor_push(AST_VECTOR_GET(&conf->active, 0)->pipeline->publisher,
+			metrics_task, conf) != 0) {
+		ao2_ref(conf, -1);
+	}
+
+	/* Keep the same interval */
+	return 1;
+}
+
+/*! \brief A heartbeat queued for one destination */
+struct heartbeat_task_data {
+	struct cdr_amqp_conf *conf;
+	struct cdr_amqp_destination *dest;
+};
+
+/*!
+ * \brief Upper bound, in microseconds, of quantile \a q of a latency histogram.
+ *
+ * \return 0 if nothing has been counted yet.
+ */
+static int64_t latency_quantile(enum cdr_amqp_hop hop, double q)
+{
+	uint64_t total = 0;
+	uint64_t seen = 0;
+	int bucket;
+
+	for (bucket = 0; bucket < LATENCY_BUCKETS; ++bucket) {
+		total += latency[hop][bucket];
+	}
+
+	for (bucket = 0; total && bucket < LATENCY_BUCKETS - 1; ++bucket) {
+		seen += latency[hop][bucket];
+		if (seen >= total * q) {
+			return 1LL << bucket;
+		}
+	}
+
+	return total ? 1LL << (LATENCY_BUCKETS - 2) : 0;
+}
+
+/*!
+ * \brief Publish a heartbeat for one destination.
+ *
+ * It is queued behind the destination's CDRs, so a publisher that is
+ * stuck stops sending heartbeats, while a module that just sees no
+ * calls keeps sending them.
+ */
+static int heartbeat_task(void *data)
+{
+	struct heartbeat_task_data *task = data;
+	struct cdr_amqp_destination *dest = task->dest;
+	struct cdr_amqp_pipeline *pipeline = dest->pipeline;
+	RAII_VAR(struct ast_json *, json, NULL, ast_json_unref);
+	int64_t now = cdr_amqp_now();
+	double rate = 0;
+
+	/* Heartbeats are never batched; publish the CDRs ahead of this one */
+	pipeline_flush(pipeline);
+
+	if (!pipeline->paused) {
+		if (pipeline->heartbeat_time) {
+			rate = (pipeline->published - pipeline->heartbeat_published) * 1e6
+				/ MAX(now - pipeline->heartbeat_time, 1);
+		}
+		pipeline->heartbeat_time = now;
+		pipeline->heartbeat_published = pipeline->published;
+
+		json = ast_json_pack("{s: s, s: s, s: I, s: i, s: I, s: I, s: f, s: I}",
+			"node_id", dest->nodeid,
+			"destination", dest->name,
+			"timestamp", (ast_json_int_t) time(NULL),
+			"sequence", __atomic_load_n(&last_sequence, __ATOMIC_RELAXED),
+			"queue_depth", (ast_json_int_t) ast_taskprocessor_size(pipeline->publisher),
+			"deadletter_bytes", (ast_json_int_t) deadletter_size(dest),
+			"publish_rate", rate,
+			"latency_p99_us", (ast_json_int_t) latency_quantile(CDR_HOP_PUBLISHER, 0.99));
+		if (json_publish(dest, task->conf->global->heartbeatqueue, json) != 0) {
+			ast_log(LOG_WARNING, "Unable to publish heartbeat to destination %s\n",
+				dest->name);
+		}
+	}
+
+	ao2_ref(task->dest, -1);
+	ao2_ref(task->conf, -1);
+	ast_free(task);
+	return 0;
+}
+
+static int heartbeat_sched_cb(const void *data)
+{
+	RAII_VAR(struct cdr_amqp_conf *, conf, ao2_global_obj_ref(confs), ao2_cleanup);
+	size_t i;
+
+	for (i = 0; conf && i < AST_VECTOR_SIZE(&conf->active); ++i) {
+		struct heartbeat_task_data *task = ast_malloc(sizeof(*task));
+
+		if (!task) {
+			break;
+		}
+		task->conf = ao2_bump(conf);
+		task->dest = ao2_bump(AST_VECTOR_GET(&conf->active, i));
+		if (ast_taskprocessor_push(task->dest->pipeline->publisher,
+				heartbeat_task, task) != 0) {
+			ao2_ref(task->dest, -1);
+			ao2_ref(task->conf, -1);
+			ast_free(task);
+		}
+	}
+
+	/* Keep the same interval */
+	return 1;
+}
+
+/*! \brief Milliseconds between probes of a destination's first connection */
+#define FAILBACK_PROBE_INTERVAL 1000
+
+/*!
+ * \brief Probe the first connection of each destination that failed over.
+ *
+ * Runs on the scheduler, so a primary that is still down only costs
+ * this thread a connection attempt, never the publisher. Once the
+ * primary has passed every probe for failback seconds, the handle is
+ * left in the destination for message_publish() to switch back to.
+ */
+static int failback_probe_cb(const void *data)
+{
+	RAII_VAR(struct cdr_amqp_conf *, conf, ao2_global_obj_ref(confs), ao2_cleanup);
+	int64_t now = cdr_amqp_now();
+	size_t i;
+
+	for (i = 0; conf && i < AST_VECTOR_SIZE(&conf->active); ++i) {
+		struct cdr_amqp_destination *dest = AST_VECTOR_GET(&conf->active, i);
+		struct ast_amqp_connection *amqp;
+
+		if (!dest->failback || !__atomic_load_n(&dest->current, __ATOMIC_ACQUIRE)
+			|| __atomic_load_n(&dest->probed, __ATOMIC_ACQUIRE)) {
+			dest->probe_since = 0;
+			continue;
+		}
+
+		amqp = ast_amqp_get_connection(AST_VECTOR_GET(&dest->connections, 0).name);
+		if (!amqp) {
+			dest->probe_since = 0;
+			continue;
+		}
+
+		if (!dest->probe_since) {
+			dest->probe_since = now;
+		}
+		if (now - dest->probe_since < dest->failback * 1000000LL) {
+			ao2_ref(amqp, -1);
+			continue;
+		}
+
+		dest->probe_since = 0;
+		__atomic_store_n(&dest->probed, amqp, __ATOMIC_RELEASE);
+	}
+
+	/* Keep the same interval */
+	return 1;
+}
+
+/*! \brief (Re)start the metrics summary, heartbeat and failback timers for \a conf */
+static void metrics_schedule(const struct cdr_amqp_conf *conf)
+{
+	AST_SCHED_DEL(sched, metrics_sched_id);
+	AST_SCHED_DEL(sched, heartbeat_sched_id);
+	AST_SCHED_DEL(sched, failback_sched_id);
+
+	failback_sched_id = ast_sched_add(sched, FAILBACK_PROBE_INTERVAL,
+		failback_probe_cb, NULL);
+
+	if (conf->global->metricsinterval) {
+		metrics_sched_id = ast_sched_add(sched, conf->global->metricsinterval * 1000,
+			metrics_sched_cb, NULL);
+	}
+	if (conf->global->heartbeatinterval) {
+		heartbeat_sched_id = ast_sched_add(sched, conf->global->heartbeatinterval * 1000,
+			heartbeat_sched_cb, NULL);
+	}
+}
+
+/*!
+ * \brief Serve the counters, gauges and latency histograms to Prometheus.
+ *
+ * Everything is read with plain loads of counters that are only ever
+ * updated atomically, so scraping never blocks the pipeline.
+ */
+static int metrics_http_callback(struct ast_tcptls_session_instance *ser,
+	const struct ast_http_uri *urih, const char *uri, enum ast_http_method method,
+	struct ast_variable *get_params, struct ast_variable *headers)
+{
+	RAII_VAR(struct cdr_amqp_conf *, conf, NULL, ao2_cleanup);
+	struct ast_str *http_header;
+	struct ast_str *out;
+	size_t i;
+	int bucket;
+
+	if (method != AST_HTTP_GET && method != AST_HTTP_HEAD) {
+		ast_http_error(ser, 501, "Not Implemented", "Attempt to use unimplemented / unsupported method");
+		return 0;
+	}
+
+	http_header = ast_str_create(64);
+	out = ast_str_create(4096);
+	if (!http_header || !out) {
+		ast_free(http_header);
+		ast_free(out);
+		ast_http_error(ser, 500, "Server Error", "Out of memory");
+		return 0;
+	}
+	ast_str_set(&http_header, 0, "Content-Type: text/plain; version=0.0.4\r\n");
+
+	for (i = 0; i < ARRAY_LEN(stats_counters); ++i) {
+		ast_str_append(&out, 0,
+			"# HELP cdr_amqp_%s_total %s.\n"
+			"# TYPE cdr_amqp_%s_total counter\n"
+			"cdr_amqp_%s_total %" PRIu64 "\n",
+			stats_counters[i].name, stats_counters[i].help,
+			stats_counters[i].name,
+			stats_counters[i].name, *stats_counters[i].value);
+	}
 
-#include "asterisk/cdr.h"
-#include "asterisk/config_options.h"
-#include "asterisk/json.h"
-#include "asterisk/module.h"
-#include "asterisk/amqp.h"
-#include "asterisk/stringfields.h"
+	conf = ao2_global_obj_ref(confs);
+	if (conf) {
+		ast_str_append(&out, 0,
+			"# HELP cdr_amqp_queue_depth CDRs waiting for the publisher.\n"
+			"# TYPE cdr_amqp_queue_depth gauge\n");
+		for (i = 0; i < AST_VECTOR_SIZE(&conf->active); ++i) {
+			struct cdr_amqp_destination *dest = AST_VECTOR_GET(&conf->active, i);
 
-#define CDR_NAME "AMQP"
-#define CONF_FILENAME "cdr_amqp.conf"
+			ast_str_append(&out, 0, "cdr_amqp_queue_depth{destination=\"%s\"} %ld\n",
+				dest->name, ast_taskprocessor_size(dest->pipeline->publisher));
+		}
 
-/*! \brief global config structure */
-struct cdr_amqp_global_conf {
-	AST_DECLARE_STRING_FIELDS(
-		/*! \brief connection name */
-		AST_STRING_FIELD(connection);
-		/*! \brief queue name */
-		AST_STRING_FIELD(queue);
-		/*! \brief exchange name */
-		AST_STRING_FIELD(exchange);
-	);
-	/*! \brief whether to log the unique id */
-	int loguniqueid;
-	/*! \brief whether to log the user field */
-	int loguserfield;
+		ast_str_append(&out, 0,
+			"# HELP cdr_amqp_deadletter_bytes Size of the dead-letter file.\n"
+			"# TYPE cdr_amqp_deadletter_bytes gauge\n");
+		for (i = 0; i < AST_VECTOR_SIZE(&conf->active); ++i) {
+			struct cdr_amqp_destination *dest = AST_VECTOR_GET(&conf->active, i);
 
-	/*! \brief current connection to amqp */
-	struct ast_amqp_connection *amqp;
-};
+			ast_str_append(&out, 0, "cdr_amqp_deadletter_bytes{destination=\"%s\"} %jd\n",
+				dest->name, (intmax_t) deadletter_size(dest));
+		}
 
-/*! \brief cdr_amqp configuration */
-struct cdr_amqp_conf {
-	struct cdr_amqp_global_conf *global;
-};
+		ast_str_append(&out, 0,
+			"# HELP cdr_amqp_connection Position of the connection in use; 0 is the primary.\n"
+			"# TYPE cdr_amqp_connection gauge\n");
+		for (i = 0; i < AST_VECTOR_SIZE(&conf->active); ++i) {
+			struct cdr_amqp_destination *dest = AST_VECTOR_GET(&conf->active, i);
+			size_t current = dest->current;
 
-/*! \brief Locking container for safe configuration access. */
-static AO2_GLOBAL_OBJ_STATIC(confs);
+			ast_str_append(&out, 0,
+				"cdr_amqp_connection{destination=\"%s\",connection=\"%s\"} %zu\n",
+				dest->name, AST_VECTOR_GET(&dest->connections, current).name, current);
+		}
+	}
 
-static struct aco_type global_option = {
-	.type = ACO_GLOBAL,
-	.name = "global",
-	.item_offset = offsetof(struct cdr_amqp_conf, global),
-	.category = "^global$",
-	.category_match = ACO_WHITELIST,
-};
+	ast_str_append(&out, 0,
+		"# HELP cdr_amqp_latency_seconds Time taken by each hop of a CDR to the broker.\n"
+		"# TYPE cdr_amqp_latency_seconds histogram\n");
+	for (i = 0; i < CDR_HOP_MAX; ++i) {
+		uint64_t count = 0;
 
-static struct aco_type *global_options[] = ACO_TYPES(&global_option);
+		for (bucket = 0; bucket < LATENCY_BUCKETS - 1; ++bucket) {
+			count += latency[i][bucket];
+			ast_str_append(&out, 0,
+				"cdr_amqp_latency_seconds_bucket{hop=\"%s\",le=\"%.6f\"} %" PRIu64 "\n",
+				cdr_hop_names[i], (1LL << bucket) / 1000000.0, count);
+		}
+		count += latency[i][LATENCY_BUCKETS - 1];
+		ast_str_append(&out, 0,
+			"cdr_amqp_latency_seconds_bucket{hop=\"%s\",le=\"+Inf\"} %" PRIu64 "\n"
+			"cdr_amqp_latency_seconds_sum{hop=\"%s\"} %.6f\n"
+			"cdr_amqp_latency_seconds_count{hop=\"%s\"} %" PRIu64 "\n",
+			cdr_hop_names[i], count,
+			cdr_hop_names[i], latency_sum[i] / 1000000.0,
+			cdr_hop_names[i], count);
+	}
 
-static void conf_global_dtor(void *obj)
-{
-	struct cdr_amqp_global_conf *global = obj;
-	ao2_cleanup(global->amqp);
-	ast_string_field_free_memory(global);
+	ast_http_send(ser, method, 200, NULL, http_header, out, 0, 0);
+	return 0;
 }
 
-static struct cdr_amqp_global_conf *conf_global_create(void)
+static struct ast_http_uri metrics_uri = {
+	.description = "AMQP CDR backend metrics",
+	.uri = "cdr_amqp/metrics",
+	.callback = metrics_http_callback,
+	.has_subtree = 0,
+	.data = NULL,
+	.key = __FILE__,
+};
+
+static char *handle_cli_show_status(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a)
 {
-	RAII_VAR(struct cdr_amqp_global_conf *, global, NULL, ao2_cleanup);
+	RAII_VAR(struct cdr_amqp_conf *, conf, NULL, ao2_cleanup);
+	size_t i;
 
-	global = ao2_alloc(sizeof(*global), conf_global_dtor);
-	if (!global) {
+	switch (cmd) {
+	case CLI_INIT:
+		e->command = "cdr amqp show status";
+		e->usage =
+			"Usage: cdr amqp show status\n"
+			"       Shows the AMQP CDR backend counters.\n";
+		return NULL;
+	case CLI_GENERATE:
 		return NULL;
 	}
 
-	if (ast_string_field_init(global, 64) != 0) {
-		return NULL;
+	if (a->argc != 4) {
+		return CLI_SHOWUSAGE;
+	}
+
+	conf = ao2_global_obj_ref(confs);
+	if (!conf) {
+		ast_cli(a->fd, "cdr_amqp is not configured\n");
+		return CLI_FAILURE;
 	}
 
-	aco_set_defaults(&global_option, "global", global);
+	for (i = 0; i < AST_VECTOR_SIZE(&conf->active); ++i) {
+		struct cdr_amqp_destination *dest = AST_VECTOR_GET(&conf->active, i);
 
-	return ao2_bump(global);
-}
+		ast_cli(a->fd, "Destination %s: connection %s, %ld queued%s", dest->name,
+			AST_VECTOR_GET(&dest->connections, dest->current).name,
+			ast_taskprocessor_size(dest->pipeline->publisher),
+			dest->pipeline->paused ? ", paused" : "");
+		if (dest->compression != CDR_CODEC_NONE) {
+			ast_cli(a->fd, ", %s level %d", cdr_codec_names[dest->compression],
+				dest->pipeline->level ? dest->pipeline->level : (int) dest->compressionlevel);
+		}
+		ast_cli(a->fd, "\n");
+	}
+	ast_cli(a->fd, "Published:         %" PRIu64 "\n", stats.published);
+	ast_cli(a->fd, "Failed:            %" PRIu64 "\n", stats.failed);
+	ast_cli(a->fd, "Dead-lettered:     %" PRIu64 "\n", stats.deadlettered);
+	ast_cli(a->fd, "Re-driven:         %" PRIu64 "\n", stats.redriven);
+	ast_cli(a->fd, "Lost:              %" PRIu64 "\n", stats.lost);
+	ast_cli(a->fd, "Failovers:         %" PRIu64 "\n", stats.failovers);
+	ast_cli(a->fd, "Oversize dropped:  %" PRIu64 "\n", stats.oversize);
+	ast_cli(a->fd, "Truncated CDRs:    %" PRIu64 "\n", stats.truncated_cdrs);
+	ast_cli(a->fd, "Truncated fields:  %" PRIu64 "\n", stats.truncated_fields);
+	ast_cli(a->fd, "UTF-8 repairs:     %" PRIu64 "\n", stats.utf8_repairs);
+	ast_cli(a->fd, "Compressed:        %" PRIu64 "\n", stats.compressed);
+	ast_cli(a->fd, "Interned strings:  %u of %d\n",
+		__atomic_load_n(&intern_count, __ATOMIC_RELAXED), INTERN_MAX);
+	ast_cli(a->fd, "Intern misses:     %" PRIu64 "\n", stats.intern_misses);
 
-/*! \brief The conf file that's processed for the module. */
-static struct aco_file conf_file = {
-	/*! The config file name. */
-	.filename = CONF_FILENAME,
-	/*! The mapping object types to be processed. */
-	.types = ACO_TYPES(&global_option),
-};
+	return CLI_SUCCESS;
+}
 
-static void conf_dtor(void *obj)
+static char *handle_cli_show_latency(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a)
 {
-	struct cdr_amqp_conf *conf = obj;
+	size_t i;
+	int bucket;
 
-	ao2_cleanup(conf->global);
+	switch (cmd) {
+	case CLI_INIT:
+		e->command = "cdr amqp show latency";
+		e->usage =
+			"Usage: cdr amqp show latency\n"
+			"       Shows how long CDRs took to reach the module (asterisk),\n"
+			"       to be queued for a destination (module) and to be\n"
+			"       published (publisher), as histograms.\n";
+		return NULL;
+	case CLI_GENERATE:
+		return NULL;
+	}
+
+	if (a->argc != 4) {
+		return CLI_SHOWUSAGE;
+	}
+
+	for (i = 0; i < CDR_HOP_MAX; ++i) {
+		ast_cli(a->fd, "%s:\n", cdr_hop_names[i]);
+		for (bucket = 0; bucket < LATENCY_BUCKETS; ++bucket) {
+			if (!latency[i][bucket]) {
+				continue;
+			}
+			if (bucket == LATENCY_BUCKETS - 1) {
+				ast_cli(a->fd, "  >= %10lld us: %" PRIu64 "\n",
+					1LL << (LATENCY_BUCKETS - 2), latency[i][bucket]);
+			} else {
+				ast_cli(a->fd, "   < %10lld us: %" PRIu64 "\n", 1LL << bucket,
+					latency[i][bucket]);
+			}
+		}
+	}
+
+	return CLI_SUCCESS;
 }
 
-static void *conf_alloc(void)
+static char *complete_destination(const char *word, int state)
 {
-	RAII_VAR(struct cdr_amqp_conf *, conf, NULL, ao2_cleanup);
+	RAII_VAR(struct cdr_amqp_conf *, conf, ao2_global_obj_ref(confs), ao2_cleanup);
+	size_t len = strlen(word);
+	int which = 0;
+	size_t i;
 
-	conf = ao2_alloc_options(sizeof(*conf), conf_dtor,
-		AO2_ALLOC_OPT_LOCK_NOLOCK);
 	if (!conf) {
 		return NULL;
 	}
 
-	conf->global = conf_global_create();
-	if (!conf->global) {
-		return NULL;
+	for (i = 0; i < AST_VECTOR_SIZE(&conf->active); ++i) {
+		const char *name = AST_VECTOR_GET(&conf->active, i)->name;
+
+		if (!strncasecmp(word, name, len) && ++which > state) {
+			return ast_strdup(name);
+		}
 	}
 
-	return ao2_bump(conf);
+	return NULL;
 }
 
-static int setup_amqp(void);
+static char *handle_cli_redrive(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a)
+{
+	RAII_VAR(struct cdr_amqp_conf *, conf, NULL, ao2_cleanup);
+	const char *name;
+	size_t i;
 
-CONFIG_INFO_STANDARD(cfg_info, confs, conf_alloc,
-	.files = ACO_FILES(&conf_file),
-	.pre_apply_config = setup_amqp,
-);
+	switch (cmd) {
+	case CLI_INIT:
+		e->command = "cdr amqp redrive";
+		e->usage =
+			"Usage: cdr amqp redrive [<destination>]\n"
+			"       Publishes the CDRs in the dead-letter file of a destination,\n"
+			"       or of every destination, again. For example once a missing\n"
+			"       binding has been fixed.\n";
+		return NULL;
+	case CLI_GENERATE:
+		return a->pos == 3 ? complete_destination(a->word, a->n) : NULL;
+	}
 
-static int setup_amqp(void)
-{
-	struct cdr_amqp_conf *conf = aco_pending_config(&cfg_info);
+	if (a->argc != 3 && a->argc != 4) {
+		return CLI_SHOWUSAGE;
+	}
+	name = a->argc == 4 ? a->argv[3] : NULL;
 
+	conf = ao2_global_obj_ref(confs);
 	if (!conf) {
-		return 0;
+		ast_cli(a->fd, "cdr_amqp is not configured\n");
+		return CLI_FAILURE;
 	}
 
-	if (!conf->global) {
-		ast_log(LOG_ERROR, "Invalid cdr_amqp.conf\n");
-		return -1;
+	for (i = 0; i < AST_VECTOR_SIZE(&conf->active); ++i) {
+		struct cdr_amqp_destination *dest = AST_VECTOR_GET(&conf->active, i);
+
+		if (name && strcmp(name, dest->name)) {
+			continue;
+		}
+
+		if (destination_redrive(dest) != 0) {
+			ast_cli(a->fd, "Unable to queue re-drive of destination %s\n", dest->name);
+			return CLI_FAILURE;
+		}
+		ast_cli(a->fd, "Re-drive of destination %s queued\n", dest->name);
+
+		if (name) {
+			return CLI_SUCCESS;
+		}
+	}
+
+	if (name) {
+		ast_cli(a->fd, "No destination named %s\n", name);
+		return CLI_FAILURE;
+	}
+
+	return CLI_SUCCESS;
+}
+
+/*!
+ * \brief Settings that can be changed on a running destination.
+ *
+ * Each is an unsigned int in cdr_amqp_destination that the publisher
+ * reads afresh for every message, so a change takes effect with the
+ * next CDR without reconnecting or touching anything queued. Changes
+ * last until the next reload.
+ */
+static const struct {
+	const char *name;
+	size_t offset;
+	unsigned int min;
+	unsigned int max;
+} tunables[] = {
+	{ "maxpublishrate", offsetof(struct cdr_amqp_destination, maxpublishrate), 0, UINT_MAX },
+	{ "maxpublishbytes", offsetof(struct cdr_amqp_destination, maxpublishbytes), 0, UINT_MAX },
+	{ "publishburst", offsetof(struct cdr_amqp_destination, publishburst), 1, 3600 },
+	{ "queuewatermark", offsetof(struct cdr_amqp_destination, queuewatermark), 0, UINT_MAX },
+	{ "failback", offsetof(struct cdr_amqp_destination, failback), 0, UINT_MAX },
+	{ "batchsize", offsetof(struct cdr_amqp_destination, batchsize), 1, 10000 },
+	{ "batchlinger", offsetof(struct cdr_amqp_destination, batchlinger), 0, 60000 },
+	{ "compressionlevel", offsetof(struct cdr_amqp_destination, compressionlevel), 1, 9 },
+};
+
+/*! \brief A parsed tunable assignment */
+struct tunable_value {
+	size_t index;
+	unsigned int value;
+};
+
+/*! \brief Parse \a name = \a value into \a out; -1 if either is invalid */
+static int tunable_parse(const char *name, const char *value, struct tunable_value *out)
+{
+	for (out->index = 0; out->index < ARRAY_LEN(tunables); ++out->index) {
+		if (!strcasecmp(name, tunables[out->index].name)) {
+			return ast_parse_arg(value, PARSE_UINT32 | PARSE_IN_RANGE, &out->value,
+				tunables[out->index].min, tunables[out->index].max);
+		}
 	}
 
-	/* Refresh the AMQP connection */
-	ao2_cleanup(conf->global->amqp);
-	conf->global->amqp = ast_amqp_get_connection(conf->global->connection);
+	return -1;
+}
+
+static int destination_set(struct cdr_amqp_destination *dest, void *arg)
+{
+	const struct tunable_value *set = arg;
+
+	/* A single aligned store; the publisher sees it on its next message */
+	*(volatile unsigned int *) ((char *) dest + tunables[set->index].offset) = set->value;
+	ast_log(LOG_NOTICE, "Destination %s: %s set to %u\n", dest->name,
+		tunables[set->index].name, set->value);
+	return 0;
+}
+
+/*! \brief The one global setting that can be changed on a running system */
+#define GLOBAL_TUNABLE "compressionthreads"
+
+/*!
+ * \brief Resize the compressors to \a value threads.
+ *
+ * compressionthreads is not a tunable: the compressors are shared by
+ * every destination, so it is set on the pool rather than on any one
+ * of them. Threads beyond the new size finish their message and exit.
+ *
+ * \return 0 on success, -1 if \a value is not between 1 and 64.
+ */
+static int compressors_set(const char *value)
+{
+	unsigned int threads;
 
-	if (!conf->global->amqp) {
-		ast_log(LOG_ERROR, "Could not get AMQP connection %s\n",
-			conf->global->connection);
+	if (ast_parse_arg(value, PARSE_UINT32 | PARSE_IN_RANGE, &threads, 1, 64) != 0) {
 		return -1;
 	}
 
+	ast_threadpool_set_size(compressors, threads);
+	ast_log(LOG_NOTICE, "%s set to %u\n", GLOBAL_TUNABLE, threads);
+	return 0;
+}
+
+static int destination_pause(struct cdr_amqp_destination *dest, void *arg)
+{
+	if (!dest->pipeline->paused) {
+		dest->pipeline->paused = 1;
+		ast_log(LOG_NOTICE, "Publishing to destination %s paused\n", dest->name);
+	}
 	return 0;
 }
 
+static int destination_resume(struct cdr_amqp_destination *dest, void *arg)
+{
+	if (dest->pipeline->paused) {
+		dest->pipeline->paused = 0;
+		ast_log(LOG_NOTICE, "Publishing to destination %s resumed\n", dest->name);
+	}
+	return destination_redrive(dest);
+}
+
+static int destination_flush(struct cdr_amqp_destination *dest, void *arg)
+{
+	return dest->pipeline->paused ? -1 : destination_redrive(dest);
+}
+
 /*!
- * \brief CDR handler for AMQP.
+ * \brief Apply \a fn to the destination called \a name, or every destination.
  *
- * \param cdr CDR to log.
- * \return 0 on success.
- * \return -1 on error.
+ * \return 0 if \a fn succeeded for each.
+ * \return -1 on failure, or if there is no such destination.
  */
-static int amqp_cdr_log(struct ast_cdr *cdr)
+static int destinations_apply(const char *name,
+	int (*fn)(struct cdr_amqp_destination *dest, void *arg), void *arg)
 {
 	RAII_VAR(struct cdr_amqp_conf *, conf, NULL, ao2_cleanup);
-	RAII_VAR(struct ast_json *, json, NULL, ast_json_unref);
-	RAII_VAR(char *, str, NULL, ast_json_free);
-	RAII_VAR(struct ast_json *, disposition, NULL, ast_json_unref);
-	int res;
-	amqp_basic_properties_t props = {
-		._flags = AMQP_BASIC_DELIVERY_MODE_FLAG | AMQP_BASIC_CONTENT_TYPE_FLAG,
-		.delivery_mode = 2, /* persistent delivery mode */
-		.content_type = amqp_cstring_bytes("application/json")
-	};
+	int found = 0;
+	int res = 0;
+	size_t i;
 
 	conf = ao2_global_obj_ref(confs);
-
-	ast_assert(conf && conf->global && conf->global->amqp);
-
-	json = ast_json_pack("{"
-		/* clid, src, dst, dcontext */
-		"s: s, s: s, s: s, s: s,"
-		/* channel, dstchannel, lastapp, lastdata */
-		"s: s, s: s, s: s, s: s,"
-		/* start, answer, end, duration */
-		"s: o, s: o, s: o, s: i"
-		/* billsec, disposition, accountcode, amaflags */
-		"s: i, s: s, s: s, s: s"
-		/* peeraccount, linkedid */
-		"s: s, s: s }",
-
-		"clid", cdr->clid,
-		"src", cdr->src,
-		"dst", cdr->dst,
-		"dcontext", cdr->dcontext,
-
-		"channel", cdr->channel,
-		"dstchannel", cdr->dstchannel,
-		"lastapp", cdr->lastapp,
-		"lastdata", cdr->lastdata,
-
-		"start", ast_json_timeval(cdr->start, NULL),
-		"answer", ast_json_timeval(cdr->answer, NULL),
-		"end", ast_json_timeval(cdr->end, NULL),
-		"durationsec", cdr->duration,
-
-		"billsec", cdr->billsec,
-		"disposition", ast_cdr_disp2str(cdr->disposition),
-		"accountcode", cdr->accountcode,
-		"amaflags", ast_channel_amaflags2string(cdr->amaflags),
-
-		"peeraccount", cdr->peeraccount,
-		"linkedid", cdr->linkedid);
-	if (!json) {
+	if (!conf) {
 		return -1;
 	}
 
-	/* Set optional fields */
-	if (conf->global->loguniqueid) {
-		ast_json_object_set(json,
-			"uniqueid", ast_json_string_create(cdr->uniqueid));
+	for (i = 0; i < AST_VECTOR_SIZE(&conf->active); ++i) {
+		struct cdr_amqp_destination *dest = AST_VECTOR_GET(&conf->active, i);
+
+		if (!ast_strlen_zero(name) && strcmp(name, dest->name)) {
+			continue;
+		}
+		found = 1;
+		res |= fn(dest, arg);
 	}
 
-	if (conf->global->loguserfield) {
-		ast_json_object_set(json,
-			"userfield", ast_json_string_create(cdr->userfield));
+	return found ? res : -1;
+}
+
+static char *complete_tunable(const char *word, int state)
+{
+	size_t wordlen = strlen(word);
+	int which = 0;
+	size_t i;
+
+	for (i = 0; i < ARRAY_LEN(tunables); ++i) {
+		if (!strncasecmp(word, tunables[i].name, wordlen) && ++which > state) {
+			return ast_strdup(tunables[i].name);
+		}
+	}
+	if (!strncasecmp(word, GLOBAL_TUNABLE, wordlen) && ++which > state) {
+		return ast_strdup(GLOBAL_TUNABLE);
 	}
 
-	/* Dump the JSON to a string for publication */
-	str = ast_json_dump_string(json);
-	if (!str) {
-		ast_log(LOG_ERROR, "Failed to build string from JSON\n");
-		return -1;
+	return NULL;
+}
+
+static char *handle_cli_set(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a)
+{
+	struct tunable_value set;
+	const char *name;
+
+	switch (cmd) {
+	case CLI_INIT:
+		e->command = "cdr amqp set";
+		e->usage =
+			"Usage: cdr amqp set <parameter> <value> [<destination>]\n"
+			"       Changes a setting of a destination, or of every destination,\n"
+			"       without a reload. The change lasts until the next reload.\n"
+			"       Parameters: maxpublishrate, maxpublishbytes, publishburst,\n"
+			"       queuewatermark, failback, batchsize, batchlinger and\n"
+			"       compressionlevel.\n"
+			"       compressionthreads can be set too, but is shared by every\n"
+			"       destination, so takes none.\n";
+		return NULL;
+	case CLI_GENERATE:
+		if (a->pos == 3) {
+			return complete_tunable(a->word, a->n);
+		}
+		return a->pos == 5 ? complete_destination(a->word, a->n) : NULL;
 	}
 
-	res = ast_amqp_basic_publish(conf->global->amqp,
-		amqp_cstring_bytes(conf->global->exchange),
-		amqp_cstring_bytes(conf->global->queue),
-		0, /* mandatory; don't return unsendable messages */
-		0, /* immediate; allow messages to be queued */
-		&props,
-		amqp_cstring_bytes(str));
+	if (a->argc != 5 && a->argc != 6) {
+		return CLI_SHOWUSAGE;
+	}
+	name = a->argc == 6 ? a->argv[5] : NULL;
 
-	if (res != 0) {
-		ast_log(LOG_ERROR, "Error publishing CDR to AMQP\n");
-		return -1;
+	if (!strcasecmp(a->argv[3], GLOBAL_TUNABLE)) {
+		if (name) {
+			ast_cli(a->fd, "%s is shared by every destination\n", GLOBAL_TUNABLE);
+			return CLI_FAILURE;
+		}
+		if (compressors_set(a->argv[4]) != 0) {
+			ast_cli(a->fd, "Invalid value '%s' for %s\n", a->argv[4], a->argv[3]);
+			return CLI_FAILURE;
+		}
+		return CLI_SUCCESS;
+	}
+
+	if (tunable_parse(a->argv[3], a->argv[4], &set) != 0) {
+		ast_cli(a->fd, "Invalid value '%s' for %s\n", a->argv[4], a->argv[3]);
+		return CLI_FAILURE;
+	}
+
+	if (destinations_apply(name, destination_set, &set) != 0) {
+		ast_cli(a->fd, "No destination named %s\n", name);
+		return CLI_FAILURE;
+	}
+
+	return CLI_SUCCESS;
+}
+
+static struct ast_cli_entry cli_cdr_amqp[] = {
+	AST_CLI_DEFINE(handle_cli_show_status, "Show AMQP CDR backend status"),
+	AST_CLI_DEFINE(handle_cli_show_latency, "Show AMQP CDR latency histograms"),
+	AST_CLI_DEFINE(handle_cli_redrive, "Re-publish dead-lettered CDRs"),
+	AST_CLI_DEFINE(handle_cli_set, "Change an AMQP CDR destination setting"),
+};
+
+static int manager_pause(struct mansession *s, const struct message *m)
+{
+	if (destinations_apply(astman_get_header(m, "Destination"), destination_pause, NULL) != 0) {
+		astman_send_error(s, m, "No such destination");
+		return 0;
+	}
+
+	astman_send_ack(s, m, "Publishing paused");
+	return 0;
+}
+
+static int manager_resume(struct mansession *s, const struct message *m)
+{
+	if (destinations_apply(astman_get_header(m, "Destination"), destination_resume, NULL) != 0) {
+		astman_send_error(s, m, "No such destination, or the re-drive could not be queued");
+		return 0;
+	}
+
+	astman_send_ack(s, m, "Publishing resumed");
+	return 0;
+}
+
+static int manager_flush(struct mansession *s, const struct message *m)
+{
+	if (destinations_apply(astman_get_header(m, "Destination"), destination_flush, NULL) != 0) {
+		astman_send_error(s, m, "No such destination, or it is paused");
+		return 0;
+	}
+
+	astman_send_ack(s, m, "Re-drive queued");
+	return 0;
+}
+
+static int manager_set(struct mansession *s, const struct message *m)
+{
+	struct tunable_value set;
+
+	if (!strcasecmp(astman_get_header(m, "Parameter"), GLOBAL_TUNABLE)) {
+		if (!ast_strlen_zero(astman_get_header(m, "Destination"))) {
+			astman_send_error(s, m, GLOBAL_TUNABLE " is shared by every destination");
+		} else if (compressors_set(astman_get_header(m, "Value")) != 0) {
+			astman_send_error(s, m, "Invalid Parameter or Value");
+		} else {
+			astman_send_ack(s, m, "Parameter set");
+		}
+		return 0;
+	}
+
+	if (tunable_parse(astman_get_header(m, "Parameter"),
+			astman_get_header(m, "Value"), &set) != 0) {
+		astman_send_error(s, m, "Invalid Parameter or Value");
+		return 0;
 	}
 
+	if (destinations_apply(astman_get_header(m, "Destination"), destination_set, &set) != 0) {
+		astman_send_error(s, m, "No such destination");
+		return 0;
+	}
+
+	astman_send_ack(s, m, "Parameter set");
 	return 0;
 }
 
+static int manager_status(struct mansession *s, const struct message *m)
+{
+	RAII_VAR(struct cdr_amqp_conf *, conf, NULL, ao2_cleanup);
+	const char *id = astman_get_header(m, "ActionID");
+	char id_text[256] = "";
+	size_t i;
+
+	if (!ast_strlen_zero(id)) {
+		snprintf(id_text, sizeof(id_text), "ActionID: %s\r\n", id);
+	}
+
+	conf = ao2_global_obj_ref(confs);
+	if (!conf) {
+		astman_send_error(s, m, "cdr_amqp is not configured");
+		return 0;
+	}
+
+	astman_send_listack(s, m, "Destination status will follow", "start");
+
+	for (i = 0; i < AST_VECTOR_SIZE(&conf->active); ++i) {
+		struct cdr_amqp_destination *dest = AST_VECTOR_GET(&conf->active, i);
+
+		astman_append(s,
+			"Event: CdrAmqpStatus\r\n"
+			"%s"
+			"Destination: %s\r\n"
+			"Connection: %s\r\n"
+			"Paused: %s\r\n"
+			"QueueDepth: %ld\r\n"
+			"DeadletterBytes: %jd\r\n"
+			"\r\n",
+			id_text,
+			dest->name,
+			AST_VECTOR_GET(&dest->connections, dest->current).name,
+			AST_YESNO(dest->pipeline->paused),
+			ast_taskprocessor_size(dest->pipeline->publisher),
+			(intmax_t) deadletter_size(dest));
+	}
+
+	astman_send_list_complete_start(s, m, "CdrAmqpStatusComplete", (int) i);
+	astman_send_list_complete_end(s);
+	return 0;
+}
 
 static int load_config(int reload)
 {
 	RAII_VAR(struct cdr_amqp_conf *, conf, NULL, ao2_cleanup);
 	RAII_VAR(struct ast_amqp_connection *, amqp, NULL, ao2_cleanup);
+	enum aco_process_status status;
+
+	status = aco_process_config(&cfg_info, reload);
 
-	switch (aco_process_config(&cfg_info, reload)) {
-	case ACO_PROCESS_ERROR:
+	/* Whether or not it applied, pipelines no destination uses can go */
+	conf = ao2_global_obj_ref(confs);
+	pipelines_prune(conf);
+
+	if (status == ACO_PROCESS_ERROR) {
 		return -1;
-	case ACO_PROCESS_OK:
-	case ACO_PROCESS_UNCHANGED:
-		break;
 	}
 
-	conf = ao2_global_obj_ref(confs);
-	if (!conf || !conf->global) {
+	if (!conf || !AST_VECTOR_SIZE(&conf->active)) {
 		ast_log(LOG_ERROR, "Error obtaining config from cdr_amqp.conf\n");
 		return -1;
 	}
 
+	metrics_schedule(conf);
+	ast_threadpool_set_size(compressors, conf->global->compressionthreads);
+
 	return 0;
 }
 
+static const struct ast_threadpool_options compressor_options = {
+	.version = AST_THREADPOOL_OPTIONS_VERSION,
+	.idle_timeout = 0,
+	.auto_increment = 0,
+	.initial_size = 1,
+	.max_size = 0,
+};
+
 static int load_module(void)
 {
 	if (aco_info_init(&cfg_info) != 0) {
@@ -336,24 +4956,147 @@ static int load_module(void)
 		return -1;
 	}
 
+	json_scanner_init();
+	clock_init();
+	ast_cond_init(&pipeline_cond, NULL);
+
+	pipelines = ao2_container_alloc_list(AO2_ALLOC_OPT_LOCK_MUTEX, 0,
+		NULL, pipeline_cmp);
+	if (!pipelines) {
+		aco_info_destroy(&cfg_info);
+		return AST_MODULE_LOAD_DECLINE;
+	}
+
+	sched = ast_sched_context_create();
+	if (!sched || ast_sched_start_thread(sched) != 0) {
+		ast_log(LOG_ERROR, "Failed to start the metrics scheduler\n");
+		ast_sched_context_destroy(sched);
+		sched = NULL;
+		aco_info_destroy(&cfg_info);
+		ao2_cleanup(pipelines);
+		pipelines = NULL;
+		return AST_MODULE_LOAD_DECLINE;
+	}
+
+	/* Sized from compressionthreads by load_config() */
+	compressors = ast_threadpool_create("cdr_amqp_compress", NULL, &compressor_options);
+	if (!compressors) {
+		ast_log(LOG_ERROR, "Failed to start the compressors\n");
+		ast_sched_context_destroy(sched);
+		sched = NULL;
+		aco_info_destroy(&cfg_info);
+		ao2_cleanup(pipelines);
+		pipelines = NULL;
+		return AST_MODULE_LOAD_DECLINE;
+	}
+
 	aco_option_register(&cfg_info, "loguniqueid", ACO_EXACT,
-		global_options, "no", OPT_BOOL_T, 1,
-		FLDSET(struct cdr_amqp_global_conf, loguniqueid));
+		destination_options, "no", OPT_BOOL_T, 1,
+		FLDSET(struct cdr_amqp_destination, loguniqueid));
 	aco_option_register(&cfg_info, "loguserfield", ACO_EXACT,
-		global_options, "no", OPT_BOOL_T, 1,
-		FLDSET(struct cdr_amqp_global_conf, loguserfield));
+		destination_options, "no", OPT_BOOL_T, 1,
+		FLDSET(struct cdr_amqp_destination, loguserfield));
+	aco_option_register(&cfg_info, "mandatory", ACO_EXACT,
+		destination_options, "no", OPT_BOOL_T, 1,
+		FLDSET(struct cdr_amqp_destination, mandatory));
+	aco_option_register(&cfg_info, "persistent", ACO_EXACT,
+		destination_options, "yes", OPT_BOOL_T, 1,
+		FLDSET(struct cdr_amqp_destination, persistent));
+	aco_option_register(&cfg_info, "expiration", ACO_EXACT,
+		destination_options, "0", OPT_UINT_T, 0,
+		FLDSET(struct cdr_amqp_destination, expiration));
+	aco_option_register(&cfg_info, "deadletter", ACO_EXACT,
+		destination_options, "", OPT_STRINGFIELD_T, 0,
+		STRFLDSET(struct cdr_amqp_destination, deadletter));
 	aco_option_register(&cfg_info, "connection", ACO_EXACT,
-		global_options, "", OPT_STRINGFIELD_T, 0,
-		STRFLDSET(struct cdr_amqp_global_conf, connection));
+		destination_options, "", OPT_STRINGFIELD_T, 0,
+		STRFLDSET(struct cdr_amqp_destination, connection));
+	aco_option_register(&cfg_info, "latencyheaders", ACO_EXACT,
+		destination_options, "no", OPT_BOOL_T, 1,
+		FLDSET(struct cdr_amqp_destination, latencyheaders));
+	aco_option_register(&cfg_info, "metricsinterval", ACO_EXACT,
+		global_options, "0", OPT_UINT_T, 0,
+		FLDSET(struct cdr_amqp_destination, metricsinterval));
+	aco_option_register(&cfg_info, "metricsqueue", ACO_EXACT,
+		global_options, "asterisk_cdr_metrics", OPT_STRINGFIELD_T, 0,
+		STRFLDSET(struct cdr_amqp_destination, metricsqueue));
+	aco_option_register(&cfg_info, "heartbeatinterval", ACO_EXACT,
+		global_options, "0", OPT_UINT_T, 0,
+		FLDSET(struct cdr_amqp_destination, heartbeatinterval));
+	aco_option_register(&cfg_info, "heartbeatqueue", ACO_EXACT,
+		global_options, "asterisk_cdr_heartbeat", OPT_STRINGFIELD_T, 0,
+		STRFLDSET(struct cdr_amqp_destination, heartbeatqueue));
+	aco_option_register(&cfg_info, "queuewatermark", ACO_EXACT,
+		destination_options, "1000", OPT_UINT_T, 0,
+		FLDSET(struct cdr_amqp_destination, queuewatermark));
+	aco_option_register(&cfg_info, "maxpublishrate", ACO_EXACT,
+		destination_options, "0", OPT_UINT_T, 0,
+		FLDSET(struct cdr_amqp_destination, maxpublishrate));
+	aco_option_register(&cfg_info, "maxpublishbytes", ACO_EXACT,
+		destination_options, "0", OPT_UINT_T, 0,
+		FLDSET(struct cdr_amqp_destination, maxpublishbytes));
+	aco_option_register(&cfg_info, "publishburst", ACO_EXACT,
+		destination_options, "1", OPT_UINT_T, PARSE_IN_RANGE,
+		FLDSET(struct cdr_amqp_destination, publishburst), 1, 3600);
+	aco_option_register(&cfg_info, "failback", ACO_EXACT,
+		destination_options, "30", OPT_UINT_T, 0,
+		FLDSET(struct cdr_amqp_destination, failback));
 	aco_option_register(&cfg_info, "queue", ACO_EXACT,
-		global_options, "asterisk_cdr", OPT_STRINGFIELD_T, 0,
-		STRFLDSET(struct cdr_amqp_global_conf, queue));
+		destination_options, "asterisk_cdr", OPT_STRINGFIELD_T, 0,
+		STRFLDSET(struct cdr_amqp_destination, queue));
 	aco_option_register(&cfg_info, "exchange", ACO_EXACT,
-		global_options, "", OPT_STRINGFIELD_T, 0,
-		STRFLDSET(struct cdr_amqp_global_conf, exchange));
+		destination_options, "", OPT_STRINGFIELD_T, 0,
+		STRFLDSET(struct cdr_amqp_destination, exchange));
+	aco_option_register(&cfg_info, "appid", ACO_EXACT,
+		destination_options, "asterisk", OPT_STRINGFIELD_T, 0,
+		STRFLDSET(struct cdr_amqp_destination, appid));
+	aco_option_register(&cfg_info, "nodeid", ACO_EXACT,
+		destination_options, "", OPT_STRINGFIELD_T, 0,
+		STRFLDSET(struct cdr_amqp_destination, nodeid));
+	aco_option_register(&cfg_info, "maxfieldlen", ACO_EXACT,
+		destination_options, "0", OPT_UINT_T, 0,
+		FLDSET(struct cdr_amqp_destination, maxfieldlen));
+	aco_option_register_custom(&cfg_info, "fieldlimits", ACO_EXACT,
+		destination_options, "", fieldlimits_handler, 0);
+	aco_option_register(&cfg_info, "maxmessagesize", ACO_EXACT,
+		destination_options, "0", OPT_UINT_T, 0,
+		FLDSET(struct cdr_amqp_destination, maxmessagesize));
+	aco_option_register_custom(&cfg_info, "dispositions", ACO_EXACT,
+		destination_options, "", dispositions_handler, 0);
+	aco_option_register_custom(&cfg_info, "format", ACO_EXACT,
+		destination_options, "json", format_handler, 0);
+	aco_option_register(&cfg_info, "batchsize", ACO_EXACT,
+		destination_options, "100", OPT_UINT_T, PARSE_IN_RANGE,
+		FLDSET(struct cdr_amqp_destination, batchsize), 1, 10000);
+	aco_option_register(&cfg_info, "batchlinger", ACO_EXACT,
+		destination_options, "100", OPT_UINT_T, PARSE_IN_RANGE,
+		FLDSET(struct cdr_amqp_destination, batchlinger), 0, 60000);
+	aco_option_register(&cfg_info, "batchdictionary", ACO_EXACT,
+		destination_options, "yes", OPT_BOOL_T, 1,
+		FLDSET(struct cdr_amqp_destination, batchdictionary));
+	aco_option_register_custom(&cfg_info, "compression", ACO_EXACT,
+		destination_options, "none", compression_handler, 0);
+	aco_option_register(&cfg_info, "compressionlevel", ACO_EXACT,
+		destination_options, "6", OPT_UINT_T, PARSE_IN_RANGE,
+		FLDSET(struct cdr_amqp_destination, compressionlevel), 1, 9);
+	aco_option_register(&cfg_info, "adaptivecompression", ACO_EXACT,
+		destination_options, "yes", OPT_BOOL_T, 1,
+		FLDSET(struct cdr_amqp_destination, adaptivecompression));
+	aco_option_register(&cfg_info, "compressionthreads", ACO_EXACT,
+		global_options, "2", OPT_UINT_T, PARSE_IN_RANGE,
+		FLDSET(struct cdr_amqp_destination, compressionthreads), 1, 64);
 
 	if (load_config(0) != 0) {
 		ast_log(LOG_WARNING, "Configuration failed to load\n");
+		aco_info_destroy(&cfg_info);
+		ao2_global_obj_release(confs);
+		ast_sched_context_destroy(sched);
+		sched = NULL;
+		ast_threadpool_shutdown(compressors);
+		compressors = NULL;
+		ao2_cleanup(pipelines);
+		pipelines = NULL;
+		ast_cond_destroy(&pipeline_cond);
 		return AST_MODULE_LOAD_DECLINE;
 	}
 
@@ -362,18 +5105,59 @@ static int load_module(void)
 		return AST_MODULE_LOAD_FAILURE;
 	}
 
+	ast_cli_register_multiple(cli_cdr_amqp, ARRAY_LEN(cli_cdr_amqp));
+	ast_http_uri_link(&metrics_uri);
+	ast_manager_register_xml("CdrAmqpPause", EVENT_FLAG_SYSTEM, manager_pause);
+	ast_manager_register_xml("CdrAmqpResume", EVENT_FLAG_SYSTEM, manager_resume);
+	ast_manager_register_xml("CdrAmqpFlush", EVENT_FLAG_SYSTEM, manager_flush);
+	ast_manager_register_xml("CdrAmqpSet", EVENT_FLAG_SYSTEM | EVENT_FLAG_CONFIG, manager_set);
+	ast_manager_register_xml("CdrAmqpStatus", EVENT_FLAG_SYSTEM | EVENT_FLAG_REPORTING,
+		manager_status);
+
 	ast_log(LOG_NOTICE, "CDR AMQP logging enabled\n");
 	return AST_MODULE_LOAD_SUCCESS;
 }
 
 static int unload_module(void)
 {
-	aco_info_destroy(&cfg_info);
-	ao2_global_obj_release(confs);
 	if (ast_cdr_unregister(CDR_NAME) != 0) {
 		return -1;
 	}
 
+	ast_cli_unregister_multiple(cli_cdr_amqp, ARRAY_LEN(cli_cdr_amqp));
+	ast_http_uri_unlink(&metrics_uri);
+	ast_manager_unregister("CdrAmqpPause");
+	ast_manager_unregister("CdrAmqpResume");
+	ast_manager_unregister("CdrAmqpFlush");
+	ast_manager_unregister("CdrAmqpSet");
+	ast_manager_unregister("CdrAmqpStatus");
+
+	AST_SCHED_DEL(sched, metrics_sched_id);
+	AST_SCHED_DEL(sched, heartbeat_sched_id);
+	AST_SCHED_DEL(sched, failback_sched_id);
+
+	aco_info_destroy(&cfg_info);
+	ao2_global_obj_release(confs);
+
+	/*
+	 * Publishes whatever is still queued before the threads exit. A
+	 * pipeline still holding queued CDRs is released by its publisher
+	 * through the scheduler, so that has to keep running until then.
+	 */
+	ao2_cleanup(pipelines);
+	pipelines = NULL;
+	pipelines_wait();
+
+	ast_sched_context_destroy(sched);
+	sched = NULL;
+
+	/* Only now that no publisher can be waiting on them */
+	ast_threadpool_shutdown(compressors);
+	compressors = NULL;
+
+	intern_cleanup();
+	ast_cond_destroy(&pipeline_cond);
+
 	return 0;
 }
 
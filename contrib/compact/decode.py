@@ -0,0 +1,92 @@
+#!/usr/bin/env python3
+#
+# Reference decoder for cdr_amqp compact batches (format = compact).
+#
+# Reads batch messages, one per line, and writes each CDR in the batch as
+# a JSON object with the same keys as format = json, plus message_id,
+# the AMQP message_id the CDR has when published on its own. Lines from a
+# dead-letter file, which start with the message id and timestamp, are
+# accepted as well.
+#
+#     python3 decode.py < batches
+#     python3 decode.py /var/spool/asterisk/cdr_amqp/deadletter
+#
+# A batch looks like
+#
+#     {"format": "compact",
+#      "fields": ["start", "answer", "end", "clid", ..., "message_id"],
+#      "dictfields": ["dcontext", "lastapp", ...],
+#      "base": 1700000000250,
+#      "dict": {"0": "from-internal", "1": "Dial", ...},
+#      "rows": [[0, 1000, 10000, "\"Alice\" <100>", ..., "9f0c..."], ...]}
+#
+# start, answer and end are milliseconds relative to base, which is in
+# milliseconds since the epoch; null means the time was never set. In
+# the columns named by dictfields, a number is a key of dict and a string
+# is the value itself. dictfields and dict are omitted when the
+# destination has batchdictionary = no. The batch's own message_id is a
+# hash of the message_id column of its rows.
+
+import datetime
+import json
+import sys
+
+TIME_FIELDS = ("start", "answer", "end")
+
+
+def decode_time(value, base):
+    if value is None:
+        return None
+    when = datetime.datetime.fromtimestamp((base + value) / 1000.0,
+                                           tz=datetime.timezone.utc)
+    return when.isoformat(timespec="milliseconds")
+
+
+def decode_batch(batch):
+    """Yield the CDRs of a compact batch as dictionaries."""
+    if batch.get("format") != "compact":
+        raise ValueError("not a compact batch")
+
+    fields = batch["fields"]
+    dictfields = set(batch.get("dictfields", ()))
+    strings = batch.get("dict", {})
+    base = batch["base"]
+
+    for row in batch["rows"]:
+        if len(row) != len(fields):
+            raise ValueError("row has %d columns, expected %d"
+                             % (len(row), len(fields)))
+        cdr = {}
+        for name, value in zip(fields, row):
+            if name in TIME_FIELDS:
+                value = decode_time(value, base)
+            elif name in dictfields and isinstance(value, int):
+                value = strings[str(value)]
+            cdr[name] = value
+        if cdr.get("truncated") is None:
+            cdr.pop("truncated", None)
+        yield cdr
+
+
+def decode_line(line):
+    line = line.strip()
+    if not line:
+        return
+    if not line.startswith("{"):
+        # Dead-letter file: message id, timestamp, body
+        line = line.split(" ", 2)[2]
+    for cdr in decode_batch(json.loads(line)):
+        yield cdr
+
+
+def main(argv):
+    inputs = [open(path) for path in argv[1:]] or [sys.stdin]
+    for lines in inputs:
+        for line in lines:
+            for cdr in decode_line(line):
+                print(json.dumps(cdr, separators=(",", ":")))
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main(sys.argv))
@@ -0,0 +1,741 @@
+/*
+ * Asterisk -- An open source telephony toolkit.
+ *
+ * See http://www.asterisk.org for more information about
+ * the Asterisk project.
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2. See the LICENSE file
+ * at the top of the source tree.
+ */
+
+/*! \file
+ *
+ * \brief AMQP 0-9-1 broker on a local socket; see amqp_server.h.
+ *
+ * Each client gets a thread of its own, which reads a frame at a time
+ * and answers it. Only what a publisher sends is understood; any other
+ * method is ignored.
+ */
+
+#include "asterisk.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <amqp.h>
+
+#include "amqp_server.h"
+#include "fake_broker.h"
+
+#define FRAME_METHOD 1
+#define FRAME_HEADER 2
+#define FRAME_BODY 3
+#define FRAME_END 0xce
+/*! \brief Largest frame the server accepts, as sent in connection.tune */
+#define FRAME_MAX 131072
+
+/*! \brief A class and method id as one number, the way amqp_framing.h has them */
+#define METHOD(class, method) (((uint32_t) (class) << 16) | (method))
+#define CONNECTION_START METHOD(10, 10)
+#define CONNECTION_START_OK METHOD(10, 11)
+#define CONNECTION_TUNE METHOD(10, 30)
+#define CONNECTION_OPEN METHOD(10, 40)
+#define CONNECTION_OPEN_OK METHOD(10, 41)
+#define CONNECTION_CLOSE METHOD(10, 50)
+#define CONNECTION_CLOSE_OK METHOD(10, 51)
+#define CHANNEL_OPEN METHOD(20, 10)
+#define CHANNEL_OPEN_OK METHOD(20, 11)
+#define CHANNEL_CLOSE METHOD(20, 40)
+#define CHANNEL_CLOSE_OK METHOD(20, 41)
+#define BASIC_PUBLISH METHOD(60, 40)
+#define BASIC_ACK METHOD(60, 80)
+#define BASIC_NACK METHOD(60, 120)
+#define CONFIRM_SELECT METHOD(85, 10)
+#define CONFIRM_SELECT_OK METHOD(85, 11)
+
+/*! \brief Most tables and arrays the headers of one message may hold */
+#define ARENA_MAX 64
+
+/*! \brief A client and the message it is sending */
+struct server_connection {
+	int fd;
+	/*! \brief virtual host the client opened, which names the connection */
+	char name[32];
+	/*! \brief whether publisher confirms are on */
+	int confirm;
+	/*! \brief delivery tag of the last message confirmed */
+	uint64_t tag;
+	/*! \brief whether a basic.publish is waiting for its content */
+	int publishing;
+	/*! \brief channel and routing key of that basic.publish */
+	uint16_t channel;
+	char routing_key[256];
+	/*! \brief its properties, pointing into \a header and \a arena */
+	amqp_basic_properties_t props;
+	/*! \brief its body; NULL until the content header has arrived */
+	uint8_t *body;
+	size_t body_len;
+	size_t body_size;
+	/*! \brief tables and arrays decoded from \a header */
+	void *arena[ARENA_MAX];
+	size_t arena_count;
+	/*! \brief payload of the content header frame */
+	uint8_t header[FRAME_MAX];
+	/*! \brief payload of the frame just read */
+	uint8_t frame[FRAME_MAX];
+};
+
+/*! \brief Bounds checked cursor over a frame payload */
+struct reader {
+	const uint8_t *data;
+	size_t len;
+	size_t at;
+	/*! \brief set once a read has run past the end */
+	int error;
+};
+
+/*! \brief Payload of a method frame being built */
+struct writer {
+	uint8_t data[256];
+	size_t len;
+};
+
+static pthread_once_t server_once = PTHREAD_ONCE_INIT;
+static int server_fd = -1;
+static int server_port = -1;
+
+static const uint8_t *read_bytes(struct reader *r, size_t n)
+{
+	const uint8_t *p;
+
+	if (r->error || r->len - r->at < n) {
+		r->error = 1;
+		return NULL;
+	}
+	p = r->data + r->at;
+	r->at += n;
+	return p;
+}
+
+/*! \brief Read an \a n byte network order integer */
+static uint64_t read_uint(struct reader *r, size_t n)
+{
+	const uint8_t *p = read_bytes(r, n);
+	uint64_t value = 0;
+	size_t i;
+
+	for (i = 0; p && i < n; ++i) {
+		value = value << 8 | p[i];
+	}
+	return value;
+}
+
+/*! \brief Read a string preceded by its length in \a len_size bytes */
+static amqp_bytes_t read_string(struct reader *r, size_t len_size)
+{
+	amqp_bytes_t bytes;
+
+	bytes.len = read_uint(r, len_size);
+	bytes.bytes = (void *) read_bytes(r, bytes.len);
+	if (!bytes.bytes) {
+		bytes.len = 0;
+	}
+	return bytes;
+}
+
+/*! \brief Keep \a ptr until the message is delivered; NULL if it cannot be kept */
+static void *arena_keep(struct server_connection *conn, void *ptr)
+{
+	if (ptr && conn->arena_count == ARENA_MAX) {
+		free(ptr);
+		return NULL;
+	}
+	if (ptr) {
+		conn->arena[conn->arena_count++] = ptr;
+	}
+	return ptr;
+}
+
+static void arena_free(struct server_connection *conn)
+{
+	while (conn->arena_count) {
+		free(conn->arena[--conn->arena_count]);
+	}
+}
+
+static int read_field(struct server_connection *conn, struct reader *r,
+	amqp_field_value_t *value);
+
+/*! \brief Read the field table \a table; a long string of keys and values */
+static int read_table(struct server_connection *conn, struct reader *r, amqp_table_t *table)
+{
+	amqp_table_entry_t *entries = NULL;
+	amqp_table_entry_t *grown;
+	struct reader fields = { NULL, 0, 0, 0 };
+	int count = 0;
+	int max = 0;
+
+	fields.len = read_uint(r, 4);
+	fields.data = read_bytes(r, fields.len);
+	if (!fields.data) {
+		return -1;
+	}
+	while (fields.at < fields.len) {
+		if (count == max) {
+			max = max ? max * 2 : 8;
+			grown = realloc(entries, max * sizeof(*entries));
+			if (!grown) {
+				free(entries);
+				return -1;
+			}
+			entries = grown;
+		}
+		entries[count].key = read_string(&fields, 1);
+		if (read_field(conn, &fields, &entries[count++].value) != 0) {
+			free(entries);
+			return -1;
+		}
+	}
+
+	table->num_entries = count;
+	table->entries = arena_keep(conn, entries);
+	return count && !table->entries ? -1 : 0;
+}
+
+/*! \brief Read the field array \a array; a long string of values */
+static int read_array(struct server_connection *conn, struct reader *r, amqp_array_t *array)
+{
+	amqp_field_value_t *entries = NULL;
+	amqp_field_value_t *grown;
+	struct reader items = { NULL, 0, 0, 0 };
+	int count = 0;
+	int max = 0;
+
+	items.len = read_uint(r, 4);
+	items.data = read_bytes(r, items.len);
+	if (!items.data) {
+		return -1;
+	}
+	while (items.at < items.len) {
+		if (count == max) {
+			max = max ? max * 2 : 8;
+			grown = realloc(entries, max * sizeof(*entries));
+			if (!grown) {
+				free(entries);
+				return -1;
+			}
+			entries = grown;
+		}
+		if (read_field(conn, &items, &entries[count++]) != 0) {
+			free(entries);
+			return -1;
+		}
+	}
+
+	array->num_entries = count;
+	array->entries = arena_keep(conn, entries);
+	return count && !array->entries ? -1 : 0;
+}
+
+/*! \brief Read a field value, its kind first */
+static int read_field(struct server_connection *conn, struct reader *r,
+	amqp_field_value_t *value)
+{
+	uint64_t bits;
+
+	value->kind = read_uint(r, 1);
+	switch (value->kind) {
+	case AMQP_FIELD_KIND_BOOLEAN:
+		value->value.boolean = read_uint(r, 1);
+		break;
+	case AMQP_FIELD_KIND_I8:
+	case AMQP_FIELD_KIND_U8:
+		value->value.u8 = read_uint(r, 1);
+		break;
+	case AMQP_FIELD_KIND_I16:
+	case AMQP_FIELD_KIND_U16:
+		value->value.u16 = read_uint(r, 2);
+		break;
+	case AMQP_FIELD_KIND_I32:
+	case AMQP_FIELD_KIND_U32:
+		value->value.u32 = read_uint(r, 4);
+		break;
+	case AMQP_FIELD_KIND_I64:
+	case AMQP_FIELD_KIND_U64:
+	case AMQP_FIELD_KIND_TIMESTAMP:
+		value->value.u64 = read_uint(r, 8);
+		break;
+	case AMQP_FIELD_KIND_F32:
+		bits = read_uint(r, 4);
+		memcpy(&value->value.f32, &(uint32_t) { bits }, sizeof(value->value.f32));
+		break;
+	case AMQP_FIELD_KIND_F64:
+		bits = read_uint(r, 8);
+		memcpy(&value->value.f64, &bits, sizeof(value->value.f64));
+		break;
+	case AMQP_FIELD_KIND_DECIMAL:
+		value->value.decimal.decimals = read_uint(r, 1);
+		value->value.decimal.value = read_uint(r, 4);
+		break;
+	case AMQP_FIELD_KIND_UTF8:
+	case AMQP_FIELD_KIND_BYTES:
+		value->value.bytes = read_string(r, 4);
+		break;
+	case AMQP_FIELD_KIND_ARRAY:
+		return read_array(conn, r, &value->value.array);
+	case AMQP_FIELD_KIND_TABLE:
+		return read_table(conn, r, &value->value.table);
+	case AMQP_FIELD_KIND_VOID:
+		break;
+	default:
+		return -1;
+	}
+
+	return r->error ? -1 : 0;
+}
+
+/*! \brief Read the properties of a basic content header, in the order of their flags */
+static int read_properties(struct server_connection *conn, struct reader *r,
+	amqp_basic_properties_t *props)
+{
+	uint64_t flags = read_uint(r, 2);
+	uint64_t more = flags;
+
+	memset(props, 0, sizeof(*props));
+	/* Bit 0 says more flags follow; basic has no property that needs them */
+	while (!r->error && (more & 1)) {
+		more = read_uint(r, 2);
+	}
+	props->_flags = flags & ~1;
+
+	if (flags & AMQP_BASIC_CONTENT_TYPE_FLAG) {
+		props->content_type = read_string(r, 1);
+	}
+	if (flags & AMQP_BASIC_CONTENT_ENCODING_FLAG) {
+		props->content_encoding = read_string(r, 1);
+	}
+	if ((flags & AMQP_BASIC_HEADERS_FLAG) && read_table(conn, r, &props->headers) != 0) {
+		return -1;
+	}
+	if (flags & AMQP_BASIC_DELIVERY_MODE_FLAG) {
+		props->delivery_mode = read_uint(r, 1);
+	}
+	if (flags & AMQP_BASIC_PRIORITY_FLAG) {
+		props->priority = read_uint(r, 1);
+	}
+	if (flags & AMQP_BASIC_CORRELATION_ID_FLAG) {
+		props->correlation_id = read_string(r, 1);
+	}
+	if (flags & AMQP_BASIC_REPLY_TO_FLAG) {
+		props->reply_to = read_string(r, 1);
+	}
+	if (flags & AMQP_BASIC_EXPIRATION_FLAG) {
+		props->expiration = read_string(r, 1);
+	}
+	if (flags & AMQP_BASIC_MESSAGE_ID_FLAG) {
+		props->message_id = read_string(r, 1);
+	}
+	if (flags & AMQP_BASIC_TIMESTAMP_FLAG) {
+		props->timestamp = read_uint(r, 8);
+	}
+	if (flags & AMQP_BASIC_TYPE_FLAG) {
+		props->type = read_string(r, 1);
+	}
+	if (flags & AMQP_BASIC_USER_ID_FLAG) {
+		props->user_id = read_string(r, 1);
+	}
+	if (flags & AMQP_BASIC_APP_ID_FLAG) {
+		props->app_id = read_string(r, 1);
+	}
+	if (flags & AMQP_BASIC_CLUSTER_ID_FLAG) {
+		props->cluster_id = read_string(r, 1);
+	}
+
+	return r->error ? -1 : 0;
+}
+
+/*! \brief Write \a value as an \a n byte network order integer */
+static void write_uint(struct writer *w, uint64_t value, size_t n)
+{
+	size_t i;
+
+	for (i = 0; i < n; ++i) {
+		w->data[w->len + i] = value >> (8 * (n - 1 - i));
+	}
+	w->len += n;
+}
+
+/*! \brief Write \a str preceded by its length in \a len_size bytes */
+static void write_string(struct writer *w, const char *str, size_t len_size)
+{
+	size_t len = strlen(str);
+
+	write_uint(w, len, len_size);
+	memcpy(w->data + w->len, str, len);
+	w->len += len;
+}
+
+/*! \brief Start the payload of \a method in \a w */
+static void method_begin(struct writer *w, uint32_t method)
+{
+	w->len = 0;
+	write_uint(w, method, 4);
+}
+
+static int read_all(int fd, void *buf, size_t len)
+{
+	ssize_t res;
+
+	while (len) {
+		res = recv(fd, buf, len, 0);
+		if (res < 0 && errno == EINTR) {
+			continue;
+		}
+		if (res <= 0) {
+			return -1;
+		}
+		buf = (uint8_t *) buf + res;
+		len -= res;
+	}
+	return 0;
+}
+
+static int write_all(int fd, const void *buf, size_t len)
+{
+	ssize_t res;
+
+	while (len) {
+		/* A client gone away is an error, not a SIGPIPE */
+		res = send(fd, buf, len, MSG_NOSIGNAL);
+		if (res < 0 && errno == EINTR) {
+			continue;
+		}
+		if (res <= 0) {
+			return -1;
+		}
+		buf = (const uint8_t *) buf + res;
+		len -= res;
+	}
+	return 0;
+}
+
+/*! \brief Send the method in \a w on \a channel */
+static int method_send(struct server_connection *conn, uint16_t channel,
+	const struct writer *w)
+{
+	uint8_t frame[7 + sizeof(w->data) + 1];
+
+	frame[0] = FRAME_METHOD;
+	frame[1] = channel >> 8;
+	frame[2] = channel;
+	frame[3] = w->len >> 24;
+	frame[4] = w->len >> 16;
+	frame[5] = w->len >> 8;
+	frame[6] = w->len;
+	memcpy(frame + 7, w->data, w->len);
+	frame[7 + w->len] = FRAME_END;
+
+	return write_all(conn->fd, frame, 7 + w->len + 1);
+}
+
+/*!
+ * \brief Read the next frame into conn->frame.
+ *
+ * \return 0 on success; -1 if the client has gone or sent garbage.
+ */
+static int frame_read(struct server_connection *conn, uint8_t *type, uint16_t *channel,
+	size_t *size)
+{
+	uint8_t header[7];
+	uint8_t end;
+
+	if (read_all(conn->fd, header, sizeof(header)) != 0) {
+		return -1;
+	}
+	*type = header[0];
+	*channel = header[1] << 8 | header[2];
+	*size = (uint32_t) header[3] << 24 | header[4] << 16 | header[5] << 8 | header[6];
+
+	if (*size > sizeof(conn->frame)
+		|| read_all(conn->fd, conn->frame, *size) != 0
+		|| read_all(conn->fd, &end, 1) != 0
+		|| end != FRAME_END) {
+		return -1;
+	}
+	return 0;
+}
+
+/*! \brief Check the protocol header of the client and send connection.start */
+static int connection_start(struct server_connection *conn)
+{
+	static const uint8_t protocol[] = { 'A', 'M', 'Q', 'P', 0, 0, 9, 1 };
+	uint8_t header[sizeof(protocol)];
+	struct writer w;
+
+	if (read_all(conn->fd, header, sizeof(header)) != 0) {
+		return -1;
+	}
+	if (memcmp(header, protocol, sizeof(protocol))) {
+		/* What the server speaks instead, as the specification has it */
+		write_all(conn->fd, protocol, sizeof(protocol));
+		return -1;
+	}
+
+	method_begin(&w, CONNECTION_START);
+	write_uint(&w, 0, 1);
+	write_uint(&w, 9, 1);
+	/* No server properties */
+	write_uint(&w, 0, 4);
+	write_string(&w, "PLAIN", 4);
+	write_string(&w, "en_US", 4);
+
+	return method_send(conn, 0, &w);
+}
+
+/*! \brief Hand the message received to the broker, and confirm it */
+static int message_deliver(struct server_connection *conn)
+{
+	amqp_bytes_t routing_key = { strlen(conn->routing_key), conn->routing_key };
+	amqp_bytes_t body = { conn->body_len, conn->body };
+	struct writer w;
+	int res;
+
+	res = fake_broker_publish(conn->name, routing_key, &conn->props, body);
+
+	free(conn->body);
+	conn->body = NULL;
+	conn->publishing = 0;
+	arena_free(conn);
+
+	if (!conn->confirm) {
+		return 0;
+	}
+	method_begin(&w, res ? BASIC_NACK : BASIC_ACK);
+	write_uint(&w, ++conn->tag, 8);
+	/* Neither multiple nor, for a nack, requeue */
+	write_uint(&w, 0, 1);
+
+	return method_send(conn, conn->channel, &w);
+}
+
+/*!
+ * \brief Answer the method in conn->frame.
+ *
+ * \return 0 to go on; 1 once the connection is closed; -1 on error.
+ */
+static int method_handle(struct server_connection *conn, uint16_t channel, struct reader *r)
+{
+	uint32_t method = read_uint(r, 4);
+	amqp_bytes_t bytes;
+	struct writer w;
+
+	switch (method) {
+	case CONNECTION_START_OK:
+		/* Any credentials will do */
+		method_begin(&w, CONNECTION_TUNE);
+		write_uint(&w, 2047, 2);
+		write_uint(&w, FRAME_MAX, 4);
+		/* No heartbeats */
+		write_uint(&w, 0, 2);
+		break;
+	case CONNECTION_OPEN:
+		bytes = read_string(r, 1);
+		snprintf(conn->name, sizeof(conn->name), "%.*s", (int) bytes.len, (char *) bytes.bytes);
+		if (fake_broker_is_up(conn->name)) {
+			method_begin(&w, CONNECTION_OPEN_OK);
+			write_string(&w, "", 1);
+		} else {
+			method_begin(&w, CONNECTION_CLOSE);
+			write_uint(&w, 530, 2);
+			write_string(&w, "NOT_ALLOWED - connection is down", 1);
+			write_uint(&w, CONNECTION_OPEN, 4);
+		}
+		break;
+	case CHANNEL_OPEN:
+		method_begin(&w, CHANNEL_OPEN_OK);
+		write_string(&w, "", 4);
+		break;
+	case CONFIRM_SELECT:
+		conn->confirm = 1;
+		conn->tag = 0;
+		if (read_uint(r, 1) & 1) {
+			/* nowait */
+			return r->error ? -1 : 0;
+		}
+		method_begin(&w, CONFIRM_SELECT_OK);
+		break;
+	case BASIC_PUBLISH:
+		/* Reserved, then the exchange, which is not routed on */
+		read_uint(r, 2);
+		read_string(r, 1);
+		bytes = read_string(r, 1);
+		snprintf(conn->routing_key, sizeof(conn->routing_key), "%.*s",
+			(int) bytes.len, (char *) bytes.bytes);
+		conn->channel = channel;
+		conn->publishing = 1;
+		return r->error ? -1 : 0;
+	case CHANNEL_CLOSE:
+		method_begin(&w, CHANNEL_CLOSE_OK);
+		break;
+	case CONNECTION_CLOSE:
+		method_begin(&w, CONNECTION_CLOSE_OK);
+		return method_send(conn, channel, &w) ? -1 : 1;
+	case CONNECTION_CLOSE_OK:
+		return 1;
+	default:
+		/* connection.tune-ok, and whatever else a publisher needs no answer to */
+		return 0;
+	}
+
+	if (r->error) {
+		return -1;
+	}
+	return method_send(conn, channel, &w);
+}
+
+/*!
+ * \brief Handle the frame in conn->frame.
+ *
+ * \return 0 to go on; 1 once the connection is closed; -1 on error.
+ */
+static int frame_handle(struct server_connection *conn, uint8_t type, uint16_t channel,
+	size_t size)
+{
+	struct reader r = { conn->frame, size, 0, 0 };
+
+	switch (type) {
+	case FRAME_METHOD:
+		return method_handle(conn, channel, &r);
+	case FRAME_HEADER:
+		if (!conn->publishing || conn->body) {
+			return -1;
+		}
+		/* The properties point into the header, so it has to outlive the frame */
+		memcpy(conn->header, conn->frame, size);
+		r.data = conn->header;
+		/* Class and weight */
+		read_uint(&r, 4);
+		conn->body_size = read_uint(&r, 8);
+		conn->body_len = 0;
+		if (read_properties(conn, &r, &conn->props) != 0
+			|| conn->body_size > SIZE_MAX - 1) {
+			return -1;
+		}
+		conn->body = malloc(conn->body_size + 1);
+		if (!conn->body) {
+			return -1;
+		}
+		return conn->body_size ? 0 : message_deliver(conn);
+	case FRAME_BODY:
+		if (!conn->body || size > conn->body_size - conn->body_len) {
+			return -1;
+		}
+		memcpy(conn->body + conn->body_len, conn->frame, size);
+		conn->body_len += size;
+		return conn->body_len < conn->body_size ? 0 : message_deliver(conn);
+	default:
+		/* Heartbeats */
+		return 0;
+	}
+}
+
+static void *connection_thread(void *data)
+{
+	struct server_connection *conn = data;
+	uint16_t channel;
+	uint8_t type;
+	size_t size;
+	int res;
+
+	res = connection_start(conn);
+	while (!res) {
+		res = frame_read(conn, &type, &channel, &size) ? -1
+			: frame_handle(conn, type, channel, size);
+	}
+
+	arena_free(conn);
+	free(conn->body);
+	close(conn->fd);
+	free(conn);
+
+	return NULL;
+}
+
+static void *server_thread(void *data)
+{
+	struct server_connection *conn;
+	pthread_t thread;
+	int on = 1;
+	int fd;
+
+	for (;;) {
+		fd = accept(server_fd, NULL, NULL);
+		if (fd < 0) {
+			if (errno == EINTR || errno == ECONNABORTED) {
+				continue;
+			}
+			break;
+		}
+		/* Confirms go out as soon as they are written, as from a broker */
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+		conn = calloc(1, sizeof(*conn));
+		if (!conn) {
+			close(fd);
+			continue;
+		}
+		conn->fd = fd;
+		if (pthread_create(&thread, NULL, connection_thread, conn) != 0) {
+			close(fd);
+			free(conn);
+			continue;
+		}
+		pthread_detach(thread);
+	}
+
+	return NULL;
+}
+
+static void server_init(void)
+{
+	struct sockaddr_in addr = {
+		.sin_family = AF_INET,
+		.sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+	};
+	socklen_t len = sizeof(addr);
+	pthread_t thread;
+	int fd;
+
+	fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (fd < 0) {
+		return;
+	}
+	/* Port 0, so the kernel picks one that is free */
+	if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) != 0
+		|| listen(fd, 64) != 0
+		|| getsockname(fd, (struct sockaddr *) &addr, &len) != 0) {
+		close(fd);
+		return;
+	}
+
+	server_fd = fd;
+	if (pthread_create(&thread, NULL, server_thread, NULL) != 0) {
+		close(fd);
+		server_fd = -1;
+		return;
+	}
+	pthread_detach(thread);
+	server_port = ntohs(addr.sin_port);
+}
+
+int amqp_server_start(void)
+{
+	pthread_once(&server_once, server_init);
+
+	return server_port;
+}
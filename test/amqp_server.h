@@ -0,0 +1,34 @@
+/*
+ * Asterisk -- An open source telephony toolkit.
+ *
+ * See http://www.asterisk.org for more information about
+ * the Asterisk project.
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2. See the LICENSE file
+ * at the top of the source tree.
+ */
+
+/*! \file
+ *
+ * \brief AMQP 0-9-1 broker on a local socket, for tests over the real librabbitmq.
+ *
+ * It speaks as much of the protocol as a publisher needs: the connection
+ * handshake, channels, publisher confirms and basic.publish. The virtual
+ * host a client opens names the connection, and every message goes
+ * through fake_broker_publish(), so the controls of fake_broker.h work
+ * unchanged: a connection that is down refuses connection.open, and a
+ * failed publish is answered with basic.nack.
+ */
+
+#ifndef CDR_AMQP_AMQP_SERVER_H
+#define CDR_AMQP_AMQP_SERVER_H
+
+/*!
+ * \brief Start the server on the loopback interface, the first time only.
+ *
+ * \return The port it listens on; -1 if it could not be started.
+ */
+int amqp_server_start(void);
+
+#endif /* CDR_AMQP_AMQP_SERVER_H */
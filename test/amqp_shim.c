@@ -0,0 +1,116 @@
+/*
+ * Asterisk -- An open source telephony toolkit.
+ *
+ * See http://www.asterisk.org for more information about
+ * the Asterisk project.
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2. See the LICENSE file
+ * at the top of the source tree.
+ */
+
+/*! \file
+ *
+ * \brief res_amqp stand-in over the real librabbitmq, for test_publish_wire.
+ *
+ * Every connection is a librabbitmq connection to amqp_server, whose
+ * virtual host is the connection's name, with a channel in confirm mode.
+ * A publish waits for the confirm of its message, as res_amqp does, and
+ * succeeds only if the server acked it.
+ */
+
+#include "asterisk.h"
+
+#include <amqp.h>
+#include <amqp_tcp_socket.h>
+
+#include "asterisk/amqp.h"
+#include "asterisk/astobj2.h"
+
+#include "amqp_server.h"
+
+#define SHIM_CHANNEL 1
+
+struct ast_amqp_connection {
+	amqp_connection_state_t state;
+};
+
+static void amqp_connection_dtor(void *obj)
+{
+	struct ast_amqp_connection *amqp = obj;
+
+	amqp_connection_close(amqp->state, AMQP_REPLY_SUCCESS);
+	amqp_destroy_connection(amqp->state);
+}
+
+/*! \brief Whether the last RPC on \a state succeeded */
+static int rpc_ok(amqp_connection_state_t state)
+{
+	return amqp_get_rpc_reply(state).reply_type == AMQP_RESPONSE_NORMAL;
+}
+
+struct ast_amqp_connection *ast_amqp_get_connection(const char *name)
+{
+	amqp_connection_state_t state;
+	amqp_socket_t *socket;
+	struct ast_amqp_connection *amqp;
+	int port = amqp_server_start();
+
+	if (port < 0) {
+		return NULL;
+	}
+
+	state = amqp_new_connection();
+	if (!state) {
+		return NULL;
+	}
+	socket = amqp_tcp_socket_new(state);
+	if (!socket || amqp_socket_open(socket, "127.0.0.1", port) != AMQP_STATUS_OK) {
+		amqp_destroy_connection(state);
+		return NULL;
+	}
+	/* The server refuses to open the virtual host of a connection that is down */
+	if (amqp_login(state, name, 0, 131072, 0, AMQP_SASL_METHOD_PLAIN,
+			"guest", "guest").reply_type != AMQP_RESPONSE_NORMAL
+		|| (amqp_channel_open(state, SHIM_CHANNEL), !rpc_ok(state))
+		|| (amqp_confirm_select(state, SHIM_CHANNEL), !rpc_ok(state))) {
+		amqp_destroy_connection(state);
+		return NULL;
+	}
+
+	amqp = ao2_alloc(sizeof(*amqp), amqp_connection_dtor);
+	if (!amqp) {
+		amqp_connection_close(state, AMQP_REPLY_SUCCESS);
+		amqp_destroy_connection(state);
+		return NULL;
+	}
+	amqp->state = state;
+
+	return amqp;
+}
+
+int ast_amqp_basic_publish(struct ast_amqp_connection *amqp,
+	amqp_bytes_t exchange,
+	amqp_bytes_t routing_key,
+	amqp_boolean_t mandatory,
+	amqp_boolean_t immediate,
+	const amqp_basic_properties_t *properties,
+	amqp_bytes_t body)
+{
+	amqp_frame_t frame;
+	int res = -1;
+
+	/* Several publishers may share a connection; one message in flight on it */
+	ao2_lock(amqp);
+	if (amqp_basic_publish(amqp->state, SHIM_CHANNEL, exchange, routing_key,
+			mandatory, immediate, properties, body) == AMQP_STATUS_OK
+		&& amqp_simple_wait_frame(amqp->state, &frame) == AMQP_STATUS_OK
+		&& frame.frame_type == AMQP_FRAME_METHOD
+		&& frame.payload.method.id == AMQP_BASIC_ACK_METHOD) {
+		res = 0;
+	}
+	amqp_maybe_release_buffers(amqp->state);
+	ao2_unlock(amqp);
+
+	return res;
+}
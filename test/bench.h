@@ -0,0 +1,97 @@
+/*
+ * Asterisk -- An open source telephony toolkit.
+ *
+ * See http://www.asterisk.org for more information about
+ * the Asterisk project.
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2. See the LICENSE file
+ * at the top of the source tree.
+ */
+
+/*! \file
+ *
+ * \brief Result reporting shared by the benchmarks.
+ *
+ * Results are printed, and with -j written as JSON for bench_check.py:
+ *
+ * {"results": [{"name": ..., "metric": ..., "value": ..., "unit": ...,
+ *   "better": "lower" or "higher"}, ...]}
+ */
+
+#ifndef CDR_AMQP_BENCH_H
+#define CDR_AMQP_BENCH_H
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+/*! \brief JSON results; NULL unless -j was given */
+static FILE *bench_json;
+static int bench_json_count;
+
+/*! \brief Write results to \a path as well as stdout */
+static void bench_json_open(const char *path)
+{
+	bench_json = fopen(path, "w");
+	if (!bench_json) {
+		perror(path);
+		exit(1);
+	}
+	fprintf(bench_json, "{\"results\": [");
+}
+
+static void bench_json_close(void)
+{
+	if (bench_json) {
+		fprintf(bench_json, "\n]}\n");
+		fclose(bench_json);
+		bench_json = NULL;
+	}
+}
+
+/*!
+ * \brief Report \a value of \a metric for benchmark \a name.
+ *
+ * \param higher Whether a higher value is better, as for throughput.
+ */
+static void bench_result(const char *name, const char *metric, double value,
+	const char *unit, int higher)
+{
+	printf("  %-40s %-16s %14.2f %s\n", name, metric, value, unit);
+	if (bench_json) {
+		fprintf(bench_json, "%s\n  {\"name\": \"%s\", \"metric\": \"%s\", \"value\": %.6g, "
+			"\"unit\": \"%s\", \"better\": \"%s\"}", bench_json_count++ ? "," : "",
+			name, metric, value, unit, higher ? "higher" : "lower");
+	}
+}
+
+/*! \brief Monotonic time, in nanoseconds */
+static int64_t bench_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static int bench_cmp_int64(const void *a, const void *b)
+{
+	int64_t x = *(const int64_t *) a;
+	int64_t y = *(const int64_t *) b;
+
+	return x < y ? -1 : x > y;
+}
+
+/*! \brief The \a q quantile of \a count samples, which this sorts */
+static int64_t bench_quantile(int64_t *samples, size_t count, double q)
+{
+	if (!count) {
+		return 0;
+	}
+	qsort(samples, count, sizeof(*samples), bench_cmp_int64);
+	return samples[MIN((size_t) (q * count), count - 1)];
+}
+
+#endif /* CDR_AMQP_BENCH_H */
@@ -0,0 +1,158 @@
+#!/usr/bin/env python3
+#
+# Benchmark regression check for cdr_amqp; run by make bench-check.
+#
+# Runs bench_pipeline and its builds with other optimizations a number of
+# times, takes the median of each result, and compares the medians with a
+# baseline file:
+#
+#     python3 bench_check.py [--runs N] [--tolerance PCT] [--update] baseline.json
+#
+# A result fails when it is worse than its baseline by more than the
+# tolerance, in the direction its "better" field gives. An entry in the
+# baseline may carry its own "tolerance", for results noisier than the
+# rest. Results without a baseline are reported but do not fail, and
+# --update writes the current medians as the new baseline.
+#
+# The other builds are not compared result by result. Each one's gain is
+# reported as a "speedup": the geometric mean, over the results of both
+# builds, of how much better it did than the build it is measured
+# against. "O3", "lto" and "pgo" are measured against bench_pipeline,
+# built -O2 as the module is; "O2" is -O2 against -O0.
+#
+# Results files are the JSON written by the benchmarks' -j option; see
+# bench.h.
+
+import argparse
+import json
+import math
+import os
+import statistics
+import subprocess
+import sys
+import tempfile
+
+BENCHMARK = "./bench_pipeline"
+
+# Name of each gain, the build measured and the build it is measured against
+GAINS = (
+    ("O2", BENCHMARK, "./bench_pipeline_O0"),
+    ("O3", "./bench_pipeline_O3", BENCHMARK),
+    ("lto", "./bench_pipeline_lto", BENCHMARK),
+    ("pgo", "./bench_pipeline_pgo", BENCHMARK),
+)
+
+
+def run(command):
+    """Run a benchmark once and return its results."""
+    with tempfile.NamedTemporaryFile(suffix=".json") as out:
+        subprocess.run([command, "-j", out.name], check=True,
+                       stdout=subprocess.DEVNULL)
+        with open(out.name) as results:
+            return json.load(results)["results"]
+
+
+def medians(command, runs):
+    """Median of each result of a benchmark over a number of runs."""
+    samples = {}
+    for i in range(runs):
+        print("%s, run %d of %d" % (command, i + 1, runs), file=sys.stderr)
+        for result in run(command):
+            key = (result["name"], result["metric"])
+            samples.setdefault(key, dict(result, values=[]))
+            samples[key]["values"].append(result["value"])
+
+    results = {}
+    for key, result in samples.items():
+        result["value"] = statistics.median(result.pop("values"))
+        results[key] = result
+    return results
+
+
+def improvement(result, other):
+    """How many times better other is than result."""
+    if result["better"] == "higher":
+        return other["value"] / result["value"]
+    return result["value"] / other["value"]
+
+
+def gain_result(name, base, build):
+    gains = [improvement(result, build[key]) for key, result in base.items()
+             if key in build and result["value"] > 0 and build[key]["value"] > 0]
+    gain = math.exp(sum(map(math.log, gains)) / len(gains)) if gains else 1
+    return {"name": name, "metric": "speedup", "value": gain, "unit": "x",
+            "better": "higher"}
+
+
+def regressed(result, baseline, tolerance):
+    """Whether result is worse than baseline beyond tolerance percent."""
+    tolerance = baseline.get("tolerance", tolerance) / 100.0
+    if result["better"] == "higher":
+        return result["value"] < baseline["value"] * (1 - tolerance)
+    return result["value"] > baseline["value"] * (1 + tolerance)
+
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument("baseline")
+    parser.add_argument("--runs", type=int, default=5)
+    parser.add_argument("--tolerance", type=float, default=25,
+                        help="percent a result may be worse than its baseline")
+    parser.add_argument("--update", action="store_true",
+                        help="write the results as the new baseline")
+    args = parser.parse_args()
+
+    builds = {}
+    for _, build, base in GAINS:
+        for command in (base, build):
+            if command not in builds:
+                builds[command] = medians(command, args.runs)
+    results = list(builds[BENCHMARK].values())
+    results += [gain_result(name, builds[base], builds[build])
+                for name, build, base in GAINS]
+
+    if args.update:
+        old = {}
+        if os.path.exists(args.baseline):
+            with open(args.baseline) as f:
+                old = {(b["name"], b["metric"]): b for b in json.load(f)["results"]}
+        for result in results:
+            # Keep the tolerances given by hand
+            key = (result["name"], result["metric"])
+            if "tolerance" in old.get(key, {}):
+                result["tolerance"] = old[key]["tolerance"]
+        with open(args.baseline, "w") as f:
+            # A result per line, so changes to the baseline diff well
+            f.write('{"runs": %d, "results": [\n  ' % args.runs)
+            f.write(",\n  ".join(json.dumps(result) for result in results))
+            f.write("\n]}\n")
+        print("Wrote %s" % args.baseline)
+        return 0
+
+    with open(args.baseline) as f:
+        baseline = {(b["name"], b["metric"]): b for b in json.load(f)["results"]}
+
+    failures = 0
+    print("%-46s %-10s %12s %12s %8s" % ("name", "metric", "baseline", "median", "change"))
+    for result in results:
+        key = (result["name"], result["metric"])
+        base = baseline.get(key)
+        if not base:
+            print("%-46s %-10s %12s %12.2f %8s  new" % (key + ("-", result["value"], "")))
+            continue
+        change = (result["value"] / base["value"] - 1) * 100 if base["value"] else 0
+        status = ""
+        if regressed(result, base, args.tolerance):
+            status = "  REGRESSION"
+            failures += 1
+        print("%-46s %-10s %12.2f %12.2f %+7.1f%%%s"
+              % (key + (base["value"], result["value"], change, status)))
+
+    if failures:
+        print("%d results regressed beyond the tolerance" % failures)
+        return 1
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
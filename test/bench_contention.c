@@ -0,0 +1,278 @@
+/*
+ * Asterisk -- An open source telephony toolkit.
+ *
+ * See http://www.asterisk.org for more information about
+ * the Asterisk project.
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2. See the LICENSE file
+ * at the top of the source tree.
+ */
+
+/*! \file
+ *
+ * \brief Contention benchmark of the CDR entry point.
+ *
+ * Asterisk posts CDRs from several threads at once, and every call to
+ * amqp_cdr_log() touches state shared between them: the configuration
+ * read lock, the latency histograms, the last sequence number and the
+ * publisher queue. N producer threads call it at a combined rate, and
+ * for each thread count this reports throughput, the scaling against
+ * one thread, per-call latency, the worst thread's p99 and, where
+ * perf_event_open() is permitted, cache misses per CDR.
+ *
+ * Usage: bench_contention [-t threads,...] [-r rate] [-d ms] [-j file] [-v]
+ *
+ * -t  thread counts to run (1,2,4,8,16,32,64)
+ * -r  combined CDRs per second; 0 for as fast as possible (0)
+ * -d  milliseconds per thread count (500)
+ * -j  also write the results as JSON, see bench.h
+ * -v  report every thread, not just the summary
+ */
+
+#include "../cdr_amqp.c"
+
+#include <getopt.h>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+
+#include "harness.h"
+#include "bench.h"
+
+static const char bench_conf[] =
+	"[global]\n"
+	"connection = amqp1\n";
+
+/*! \brief A producer thread and what it measured */
+struct producer {
+	pthread_t thread;
+	int index;
+	/*! \brief CDRs per second; 0 for as fast as possible */
+	double rate;
+	int64_t duration;
+	/*! \brief nanoseconds per amqp_cdr_log() call */
+	int64_t *latencies;
+	size_t count;
+	size_t size;
+	/*! \brief cache misses while posting; -1 if they could not be counted */
+	int64_t misses;
+};
+
+static pthread_barrier_t start_barrier;
+
+/*! \brief Count cache misses of the calling thread; -1 if not permitted */
+static int perf_open(void)
+{
+	struct perf_event_attr attr;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.type = PERF_TYPE_HARDWARE;
+	attr.size = sizeof(attr);
+	attr.config = PERF_COUNT_HW_CACHE_MISSES;
+	attr.disabled = 1;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+
+	return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static void *producer_thread(void *data)
+{
+	struct producer *p = data;
+	int fd = perf_open();
+	int64_t start;
+	int64_t end;
+	struct ast_cdr cdr;
+
+	p->misses = -1;
+	pthread_barrier_wait(&start_barrier);
+	if (fd >= 0) {
+		ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+		ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+	}
+
+	start = bench_now_ns();
+	end = start + p->duration;
+	for (;;) {
+		int64_t now = bench_now_ns();
+		int64_t begin;
+
+		if (now >= end) {
+			break;
+		}
+		if (p->rate > 0) {
+			int64_t due = start + (int64_t) (p->count * 1e9 / p->rate);
+
+			if (due >= end) {
+				break;
+			}
+			if (due > now) {
+				struct timespec ts = { 0, due - now };
+
+				nanosleep(&ts, NULL);
+			}
+		}
+
+		if (p->count == p->size) {
+			p->size = p->size ? p->size * 2 : 4096;
+			p->latencies = realloc(p->latencies, p->size * sizeof(*p->latencies));
+			if (!p->latencies) {
+				abort();
+			}
+		}
+
+		/* A distinct call for every CDR, as in a real call mix */
+		harness_cdr(&cdr, p->index * 10000000 + (int) p->count);
+		begin = bench_now_ns();
+		amqp_cdr_log(&cdr);
+		p->latencies[p->count++] = bench_now_ns() - begin;
+	}
+
+	if (fd >= 0) {
+		int64_t misses;
+
+		ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+		if (read(fd, &misses, sizeof(misses)) == sizeof(misses)) {
+			p->misses = misses;
+		}
+		close(fd);
+	}
+
+	return NULL;
+}
+
+/*! \brief Run \a threads producers; \return CDRs per second */
+static double bench_threads(int threads, double rate, int duration_ms, double base, int verbose)
+{
+	struct producer *producers = calloc(threads, sizeof(*producers));
+	int64_t *all;
+	size_t total = 0;
+	int64_t worst_p99 = 0;
+	int64_t misses = 0;
+	int counted = 1;
+	int64_t elapsed;
+	double throughput;
+	char name[64];
+	int i;
+
+	if (harness_load(bench_conf) != AST_MODULE_LOAD_SUCCESS) {
+		fprintf(stderr, "Unable to load the module\n");
+		exit(1);
+	}
+	/* Only the counts matter; keeping millions of bodies would skew memory */
+	fake_broker_keep(0);
+
+	pthread_barrier_init(&start_barrier, NULL, threads + 1);
+	for (i = 0; i < threads; ++i) {
+		producers[i].index = i;
+		producers[i].rate = rate / threads;
+		producers[i].duration = duration_ms * 1000000LL;
+		pthread_create(&producers[i].thread, NULL, producer_thread, &producers[i]);
+	}
+	elapsed = bench_now_ns();
+	pthread_barrier_wait(&start_barrier);
+	for (i = 0; i < threads; ++i) {
+		pthread_join(producers[i].thread, NULL);
+		total += producers[i].count;
+	}
+	elapsed = bench_now_ns() - elapsed;
+	pthread_barrier_destroy(&start_barrier);
+
+	/* What was queued is published on unload, outside the measurement */
+	harness_unload();
+
+	all = malloc(MAX(total, (size_t) 1) * sizeof(*all));
+	total = 0;
+	for (i = 0; i < threads; ++i) {
+		struct producer *p = &producers[i];
+		int64_t p99;
+
+		memcpy(all + total, p->latencies, p->count * sizeof(*all));
+		total += p->count;
+		p99 = bench_quantile(p->latencies, p->count, 0.99);
+		worst_p99 = MAX(worst_p99, p99);
+		if (p->misses < 0) {
+			counted = 0;
+		} else {
+			misses += p->misses;
+		}
+		if (verbose) {
+			printf("    thread %2d: %8zu CDRs, p50 %7.2f us, p99 %7.2f us, max %8.2f us",
+				i, p->count, bench_quantile(p->latencies, p->count, 0.5) / 1e3,
+				p99 / 1e3, bench_quantile(p->latencies, p->count, 1) / 1e3);
+			if (p->misses >= 0) {
+				printf(", %.1f misses/CDR", p->count ? (double) p->misses / p->count : 0);
+			}
+			printf("\n");
+		}
+		free(p->latencies);
+	}
+
+	throughput = total * 1e9 / elapsed;
+	snprintf(name, sizeof(name), "contention/threads=%d", threads);
+	bench_result(name, "throughput", throughput, "cdr/s", 1);
+	bench_result(name, "scaling", base > 0 ? throughput / base : 1, "x", 1);
+	bench_result(name, "p50", bench_quantile(all, total, 0.5) / 1e3, "us", 0);
+	bench_result(name, "p99", bench_quantile(all, total, 0.99) / 1e3, "us", 0);
+	bench_result(name, "worst_thread_p99", worst_p99 / 1e3, "us", 0);
+	if (counted && total) {
+		bench_result(name, "cache_misses", (double) misses / total, "misses/cdr", 0);
+	}
+
+	free(all);
+	free(producers);
+
+	return throughput;
+}
+
+int main(int argc, char *argv[])
+{
+	char *threads = ast_strdupa("1,2,4,8,16,32,64");
+	double rate = 0;
+	int duration_ms = 500;
+	int verbose = 0;
+	double base = 0;
+	char *count;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "t:r:d:j:v")) != -1) {
+		switch (opt) {
+		case 't':
+			threads = optarg;
+			break;
+		case 'r':
+			rate = atof(optarg);
+			break;
+		case 'd':
+			duration_ms = atoi(optarg);
+			break;
+		case 'j':
+			bench_json_open(optarg);
+			break;
+		case 'v':
+			verbose = 1;
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [-t threads,...] [-r rate] [-d ms] [-j file] [-v]\n",
+				argv[0]);
+			return 1;
+		}
+	}
+
+	setenv("TZ", "UTC", 1);
+	tzset();
+
+	printf("amqp_cdr_log() contention, %s, %d ms per run\n",
+		rate > 0 ? "at a fixed combined rate" : "as fast as possible", duration_ms);
+	while ((count = strsep(&threads, ","))) {
+		double throughput = bench_threads(atoi(count), rate, duration_ms, base, verbose);
+
+		if (!base) {
+			base = throughput;
+		}
+	}
+	bench_json_close();
+
+	return harness_failures ? 1 : 0;
+}
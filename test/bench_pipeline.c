@@ -0,0 +1,388 @@
+/*
+ * Asterisk -- An open source telephony toolkit.
+ *
+ * See http://www.asterisk.org for more information about
+ * the Asterisk project.
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2. See the LICENSE file
+ * at the top of the source tree.
+ */
+
+/*! \file
+ *
+ * \brief Benchmark of each stage a CDR passes through, on a generated corpus.
+ *
+ * serialize  every serializer variant over the corpus, and for json,
+ *            cdr_serialize_common() taking its flags at run time next to
+ *            the CDR_SERIALIZER() variant specialized for them
+ * queue      message_queue() onto a stalled publisher, then draining it
+ * spool      appending to the dead-letter file, then re-driving it
+ * e2e        amqp_cdr_log() to the broker, for json and compact batches
+ *
+ * Usage: bench_pipeline [-n count] [-p params] [-j file] [-t corpus]
+ *
+ * -n  CDRs per benchmark (20000)
+ * -p  distributions of the corpus, see corpus_params_parse()
+ * -j  also write the results as JSON, see bench.h
+ * -t  only post the CDRs of a corpus file through the CDR handler, with
+ *     every configuration benchmarked; trains a profile guided build
+ */
+
+#include "../cdr_amqp.c"
+
+#include <getopt.h>
+
+#include "harness.h"
+#include "bench.h"
+#include "corpus.h"
+
+/*! \brief Serializer loops run for at least this long */
+#define BENCH_MIN_NS 200000000LL
+
+static const struct bench_variant {
+	const char *name;
+	const char *conf;
+} bench_variants[] = {
+	{ "json",
+		"[global]\n"
+		"connection = amqp1\n" },
+	{ "json-uniqueid-userfield",
+		"[global]\n"
+		"connection = amqp1\n"
+		"loguniqueid = yes\n"
+		"loguserfield = yes\n" },
+	{ "json-capped",
+		"[global]\n"
+		"connection = amqp1\n"
+		"loguniqueid = yes\n"
+		"loguserfield = yes\n"
+		"maxfieldlen = 32\n" },
+	{ "compact",
+		"[global]\n"
+		"connection = amqp1\n"
+		"format = compact\n" },
+};
+
+static const char json_conf[] =
+	"[global]\n"
+	"connection = amqp1\n";
+
+/*! \brief Keeps the serialized output live, so no loop is optimized away */
+static volatile size_t bench_sink;
+
+/*! \brief The destination the loaded configuration publishes to */
+static struct cdr_amqp_destination *bench_destination(void)
+{
+	RAII_VAR(struct cdr_amqp_conf *, conf, ao2_global_obj_ref(confs), ao2_cleanup);
+
+	/* The configuration holds the reference until the module is unloaded */
+	return conf->global;
+}
+
+static void bench_load(const char *conf)
+{
+	if (harness_load(conf) != AST_MODULE_LOAD_SUCCESS) {
+		fprintf(stderr, "Unable to load the module\n");
+		exit(1);
+	}
+	/* Only the counts matter; keeping every body would skew memory */
+	fake_broker_keep(0);
+}
+
+/*!
+ * \brief cdr_serialize_common() with the flags of \a dest read at run time.
+ *
+ * What every json destination would run without the CDR_SERIALIZER()
+ * variants; the same code, with the per-field configuration branches
+ * left in.
+ */
+static int __attribute__((noinline)) bench_serialize_runtime(struct cdr_amqp_buf *buf,
+	const struct cdr_amqp_destination *dest, const struct ast_cdr *cdr,
+	struct cdr_amqp_serialize_info *info)
+{
+	return cdr_serialize_common(buf, dest, cdr, info,
+		dest->loguniqueid, dest->loguserfield, destination_capped(dest));
+}
+
+/*! \brief Nanoseconds per CDR of \a serialize for \a dest over \a cdrs */
+static double bench_serializer(cdr_serializer_fn serialize,
+	const struct cdr_amqp_destination *dest, const struct ast_cdr *cdrs, size_t count)
+{
+	struct cdr_amqp_buf *buf = ast_threadstorage_get(&serialize_buf, sizeof(*buf));
+	struct cdr_amqp_serialize_info info;
+	size_t passes = 0;
+	int64_t start;
+	int64_t elapsed;
+	size_t i;
+
+	/* Untimed, so the first serializer timed does not pay for warming up */
+	for (i = 0; i < count; ++i) {
+		serialize(buf, dest, &cdrs[i], &info);
+	}
+
+	start = bench_now_ns();
+	do {
+		for (i = 0; i < count; ++i) {
+			serialize(buf, dest, &cdrs[i], &info);
+			bench_sink += buf->used;
+		}
+		++passes;
+		elapsed = bench_now_ns() - start;
+	} while (elapsed < BENCH_MIN_NS);
+
+	return (double) elapsed / (passes * count);
+}
+
+static void bench_serialize(const struct ast_cdr *cdrs, size_t count)
+{
+	size_t i;
+
+	for (i = 0; i < ARRAY_LEN(bench_variants); ++i) {
+		const struct bench_variant *variant = &bench_variants[i];
+		const struct cdr_amqp_destination *dest;
+		char name[64];
+		double ns;
+
+		bench_load(variant->conf);
+		dest = bench_destination();
+		ns = bench_serializer(dest->serialize, dest, cdrs, count);
+		snprintf(name, sizeof(name), "serialize/%s", variant->name);
+		bench_result(name, "time", ns, "ns/cdr", 0);
+		if (!dest->compact) {
+			double runtime = bench_serializer(bench_serialize_runtime, dest, cdrs, count);
+
+			snprintf(name, sizeof(name), "serialize/%s/runtime", variant->name);
+			bench_result(name, "time", runtime, "ns/cdr", 0);
+			snprintf(name, sizeof(name), "serialize/%s/specialized", variant->name);
+			bench_result(name, "speedup", runtime / ns, "x", 1);
+		}
+		harness_unload();
+	}
+}
+
+/*! \brief Serialize \a cdrs for the loaded configuration */
+static struct cdr_amqp_message **bench_messages(const struct ast_cdr *cdrs, size_t count)
+{
+	struct cdr_amqp_message **msgs = ast_calloc(count, sizeof(*msgs));
+	char id[CDR_MESSAGE_ID_LEN + 1];
+	size_t i;
+
+	for (i = 0; msgs && i < count; ++i) {
+		cdr_message_id(&cdrs[i], id);
+		msgs[i] = message_create(bench_destination(), &cdrs[i], id, cdr_amqp_now());
+		if (!msgs[i]) {
+			fprintf(stderr, "Unable to serialize CDR %zu\n", i);
+			exit(1);
+		}
+	}
+
+	return msgs;
+}
+
+static void bench_messages_free(struct cdr_amqp_message **msgs, size_t count)
+{
+	size_t i;
+
+	for (i = 0; i < count; ++i) {
+		ao2_cleanup(msgs[i]);
+	}
+	ast_free(msgs);
+}
+
+static void bench_queue(const struct ast_cdr *cdrs, size_t count)
+{
+	struct cdr_amqp_message **msgs;
+	struct cdr_amqp_destination *dest;
+	int64_t start;
+	int64_t elapsed;
+	size_t i;
+
+	bench_load(json_conf);
+	dest = bench_destination();
+	msgs = bench_messages(cdrs, count);
+
+	/* The publisher blocks on the first message, so the rest only queue */
+	fake_broker_stall(1);
+	start = bench_now_ns();
+	for (i = 0; i < count; ++i) {
+		message_queue(dest, msgs[i]);
+	}
+	elapsed = bench_now_ns() - start;
+	bench_result("queue/enqueue", "time", (double) elapsed / count, "ns/cdr", 0);
+
+	start = bench_now_ns();
+	fake_broker_stall(0);
+	CHECK(fake_broker_wait(count, 60000) == 0);
+	elapsed = bench_now_ns() - start;
+	bench_result("queue/drain", "throughput", count * 1e9 / elapsed, "cdr/s", 1);
+
+	bench_messages_free(msgs, count);
+	harness_unload();
+}
+
+static void bench_spool(const struct ast_cdr *cdrs, size_t count)
+{
+	struct cdr_amqp_message **msgs;
+	struct cdr_amqp_destination *dest;
+	int64_t start;
+	int64_t elapsed;
+	size_t i;
+
+	bench_load(json_conf);
+	dest = bench_destination();
+	msgs = bench_messages(cdrs, count);
+
+	start = bench_now_ns();
+	for (i = 0; i < count; ++i) {
+		deadletter_append(dest, msgs[i]);
+	}
+	elapsed = bench_now_ns() - start;
+	bench_result("spool/append", "time", (double) elapsed / count, "ns/cdr", 0);
+
+	start = bench_now_ns();
+	CHECK(destination_redrive(dest) == 0);
+	CHECK(fake_broker_wait(count, 60000) == 0);
+	elapsed = bench_now_ns() - start;
+	bench_result("spool/redrive", "throughput", count * 1e9 / elapsed, "cdr/s", 1);
+
+	bench_messages_free(msgs, count);
+	harness_unload();
+}
+
+/*!
+ * \brief Post \a cdrs and wait until the broker has them all.
+ *
+ * \param per_message CDRs per published message
+ */
+static void bench_e2e(const char *name, const char *conf, const struct ast_cdr *cdrs,
+	size_t count, size_t per_message)
+{
+	int64_t *latencies = ast_calloc(count, sizeof(*latencies));
+	int64_t start;
+	int64_t elapsed;
+	size_t i;
+
+	if (!latencies) {
+		exit(1);
+	}
+	bench_load(conf);
+
+	start = bench_now_ns();
+	for (i = 0; i < count; ++i) {
+		struct ast_cdr cdr = cdrs[i];
+		int64_t begin = bench_now_ns();
+
+		mock_cdr_post(&cdr);
+		latencies[i] = bench_now_ns() - begin;
+	}
+	CHECK(fake_broker_wait(count / per_message, 60000) == 0);
+	elapsed = bench_now_ns() - start;
+
+	bench_result(name, "throughput", count * 1e9 / elapsed, "cdr/s", 1);
+	bench_result(name, "p50", bench_quantile(latencies, count, 0.5) / 1e3, "us", 0);
+	bench_result(name, "p99", bench_quantile(latencies, count, 0.99) / 1e3, "us", 0);
+
+	ast_free(latencies);
+	harness_unload();
+}
+
+/*!
+ * \brief Post the CDRs of corpus file \a path as Asterisk would.
+ *
+ * Runs the module the way it runs in production, once per configuration
+ * benchmarked, and none of the benchmark loops, so a profile taken from
+ * it is of the module rather than of this program.
+ */
+static int bench_train(const char *path)
+{
+	RAII_VAR(struct ast_cdr *, cdrs, NULL, ast_free);
+	size_t count;
+	size_t i;
+	size_t j;
+
+	cdrs = corpus_load(path, &count);
+	if (!cdrs) {
+		fprintf(stderr, "Unable to read corpus %s\n", path);
+		return 1;
+	}
+
+	for (i = 0; i < ARRAY_LEN(bench_variants); ++i) {
+		bench_load(bench_variants[i].conf);
+		for (j = 0; j < count; ++j) {
+			struct ast_cdr cdr = cdrs[j];
+
+			mock_cdr_post(&cdr);
+		}
+		/* Unloading publishes whatever is still queued or batched */
+		harness_unload();
+	}
+
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	struct corpus_params params = CORPUS_PARAMS_DEFAULT;
+	struct corpus corpus;
+	struct ast_cdr *cdrs;
+	const char *train = NULL;
+	size_t count = 20000;
+	size_t i;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "n:p:j:t:")) != -1) {
+		switch (opt) {
+		case 'n':
+			count = strtoul(optarg, NULL, 10);
+			break;
+		case 'p':
+			if (corpus_params_parse(&params, optarg) != 0) {
+				fprintf(stderr, "Bad corpus parameters '%s'\n", optarg);
+				return 1;
+			}
+			break;
+		case 'j':
+			bench_json_open(optarg);
+			break;
+		case 't':
+			train = optarg;
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [-n count] [-p params] [-j file] [-t corpus]\n",
+				argv[0]);
+			return 1;
+		}
+	}
+	/* Whole compact batches, so the last is not left to batchlinger */
+	count = MAX(count / 100, (size_t) 1) * 100;
+
+	setenv("TZ", "UTC", 1);
+	tzset();
+
+	if (train) {
+		return bench_train(train) || harness_failures;
+	}
+
+	cdrs = ast_calloc(count, sizeof(*cdrs));
+	if (!cdrs) {
+		return 1;
+	}
+	corpus_init(&corpus, &params, 1);
+	for (i = 0; i < count; ++i) {
+		corpus_generate(&corpus, &cdrs[i]);
+	}
+
+	printf("cdr_amqp pipeline, %zu generated CDRs per benchmark\n", count);
+	bench_serialize(cdrs, count);
+	bench_queue(cdrs, count);
+	bench_spool(cdrs, count);
+	bench_e2e("e2e/json", json_conf, cdrs, count, 1);
+	bench_e2e("e2e/compact", "[global]\nconnection = amqp1\nformat = compact\n",
+		cdrs, count, 100);
+	bench_json_close();
+
+	ast_free(cdrs);
+
+	return harness_failures ? 1 : 0;
+}
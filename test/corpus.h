@@ -0,0 +1,664 @@
+/*
+ * Asterisk -- An open source telephony toolkit.
+ *
+ * See http://www.asterisk.org for more information about
+ * the Asterisk project.
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2. See the LICENSE file
+ * at the top of the source tree.
+ */
+
+/*! \file
+ *
+ * \brief CDR corpora: a generator of realistic CDR streams, and the file format they are kept in.
+ *
+ * The generator draws each CDR from configurable distributions, so
+ * benchmarks see the field lengths, repetition and awkward bytes of a
+ * real PBX rather than one CDR copied over and over. It is seeded and
+ * self-contained, so a seed names the same stream on every machine.
+ *
+ * A corpus file has one CDR per line, with the columns of corpus_columns
+ * separated by tabs. Backslash, tab and newline are written as \\, \t
+ * and \n, and any other control byte or byte that is not part of valid
+ * UTF-8 as \xHH, so the file itself is always valid UTF-8. Times are
+ * seconds.microseconds. Lines starting with # are comments.
+ */
+
+#ifndef CDR_AMQP_CORPUS_H
+#define CDR_AMQP_CORPUS_H
+
+#include <math.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "asterisk.h"
+#include "asterisk/cdr.h"
+
+/*! \brief Shape of a generated CDR stream */
+struct corpus_params {
+	/*! \brief mean and standard deviation of the clid length, in bytes */
+	double clid_mean;
+	double clid_sd;
+	/*! \brief mean and standard deviation of the lastdata length, in bytes */
+	double lastdata_mean;
+	double lastdata_sd;
+	/*! \brief relative weights of answered, no answer, busy, failed and congestion */
+	unsigned int dispositions[5];
+	/*! \brief mean number of CDRs sharing a linkedid */
+	double fanout;
+	/*! \brief fraction of caller names in a script other than Latin */
+	double nonascii;
+	/*! \brief fraction of strings carrying control characters or invalid UTF-8 */
+	double invalid;
+	/*! \brief mean number of name=value channel variables carried in userfield */
+	double vars;
+};
+
+/*! \brief Loosely, a busy office PBX with a trunk */
+#define CORPUS_PARAMS_DEFAULT { \
+	.clid_mean = 24, .clid_sd = 8, \
+	.lastdata_mean = 40, .lastdata_sd = 30, \
+	.dispositions = { 60, 25, 8, 5, 2 }, \
+	.fanout = 2, \
+	.nonascii = 0.1, \
+	.invalid = 0.01, \
+	.vars = 2, \
+}
+
+/*! \brief State of a generated stream */
+struct corpus {
+	struct corpus_params params;
+	uint64_t state;
+	/*! \brief CDRs generated so far */
+	int count;
+	/*! \brief start of the last CDR, in microseconds */
+	int64_t clock;
+	/*! \brief linkedid of the current call, and CDRs left in it */
+	char linkedid[AST_MAX_UNIQUEID];
+	int linked_left;
+};
+
+/*!
+ * \brief Parse \a spec into \a params, over whatever they already hold.
+ *
+ * \a spec is a comma separated list of name=value pairs: clid=mean:sd,
+ * lastdata=mean:sd, dispositions=answered:noanswer:busy:failed:congestion,
+ * fanout=mean, nonascii=fraction, invalid=fraction and vars=mean.
+ *
+ * \return 0 on success.
+ * \return -1 if \a spec is malformed.
+ */
+static int corpus_params_parse(struct corpus_params *params, const char *spec)
+{
+	char *copy = ast_strdupa(spec);
+	char *pair;
+
+	while ((pair = strsep(&copy, ","))) {
+		char *value = strchr(pair, '=');
+		int n;
+
+		if (ast_strlen_zero(pair)) {
+			continue;
+		}
+		if (!value) {
+			return -1;
+		}
+		*value++ = '\0';
+
+		if (!strcmp(pair, "clid")) {
+			n = sscanf(value, "%lf:%lf", &params->clid_mean, &params->clid_sd) == 2;
+		} else if (!strcmp(pair, "lastdata")) {
+			n = sscanf(value, "%lf:%lf", &params->lastdata_mean, &params->lastdata_sd) == 2;
+		} else if (!strcmp(pair, "dispositions")) {
+			n = sscanf(value, "%u:%u:%u:%u:%u", &params->dispositions[0],
+				&params->dispositions[1], &params->dispositions[2],
+				&params->dispositions[3], &params->dispositions[4]) == 5;
+		} else if (!strcmp(pair, "fanout")) {
+			n = sscanf(value, "%lf", &params->fanout) == 1 && params->fanout >= 1;
+		} else if (!strcmp(pair, "nonascii")) {
+			n = sscanf(value, "%lf", &params->nonascii) == 1;
+		} else if (!strcmp(pair, "invalid")) {
+			n = sscanf(value, "%lf", &params->invalid) == 1;
+		} else if (!strcmp(pair, "vars")) {
+			n = sscanf(value, "%lf", &params->vars) == 1;
+		} else {
+			n = 0;
+		}
+		if (!n) {
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/*! \brief Start the stream \a seed of \a params */
+static void corpus_init(struct corpus *corpus, const struct corpus_params *params,
+	uint64_t seed)
+{
+	memset(corpus, 0, sizeof(*corpus));
+	corpus->params = *params;
+	corpus->state = seed;
+	corpus->clock = 1700000000LL * 1000000;
+}
+
+/*! \brief Next 64 random bits; splitmix64, so streams do not depend on the libc */
+static uint64_t corpus_next(struct corpus *corpus)
+{
+	uint64_t z = (corpus->state += 0x9e3779b97f4a7c15ULL);
+
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+	return z ^ (z >> 31);
+}
+
+/*! \brief Uniform in [0, 1) */
+static double corpus_uniform(struct corpus *corpus)
+{
+	return (corpus_next(corpus) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/*! \brief Uniform in [0, \a n) */
+static unsigned int corpus_below(struct corpus *corpus, unsigned int n)
+{
+	return n ? corpus_next(corpus) % n : 0;
+}
+
+/*! \brief Exponential with mean \a mean */
+static double corpus_exponential(struct corpus *corpus, double mean)
+{
+	return -mean * log(1.0 - corpus_uniform(corpus));
+}
+
+/*! \brief A length from a normal distribution, clipped to [0, \a max] */
+static size_t corpus_length(struct corpus *corpus, double mean, double sd, size_t max)
+{
+	/* Box-Muller */
+	double u = 1.0 - corpus_uniform(corpus);
+	double len = mean + sd * sqrt(-2.0 * log(u)) * cos(2.0 * M_PI * corpus_uniform(corpus));
+
+	return len <= 0 ? 0 : len >= max ? max : (size_t) len;
+}
+
+/*! \brief Pick from a NULL terminated list */
+static const char *corpus_pick(struct corpus *corpus, const char * const *list)
+{
+	size_t count = 0;
+
+	while (list[count]) {
+		++count;
+	}
+	return list[corpus_below(corpus, count)];
+}
+
+/*! \brief Length of the valid UTF-8 sequence at \a s, or 0 if there is none */
+static size_t corpus_utf8_len(const unsigned char *s, size_t len)
+{
+	size_t need;
+	size_t i;
+
+	if (s[0] < 0x80) {
+		return 1;
+	} else if (s[0] >= 0xc2 && s[0] <= 0xdf) {
+		need = 2;
+	} else if (s[0] >= 0xe0 && s[0] <= 0xef) {
+		need = 3;
+	} else if (s[0] >= 0xf0 && s[0] <= 0xf4) {
+		need = 4;
+	} else {
+		return 0;
+	}
+	if (len < need
+		|| (s[0] == 0xe0 && s[1] < 0xa0) || (s[0] == 0xed && s[1] > 0x9f)
+		|| (s[0] == 0xf0 && s[1] < 0x90) || (s[0] == 0xf4 && s[1] > 0x8f)) {
+		return 0;
+	}
+	for (i = 1; i < need; ++i) {
+		if ((s[i] & 0xc0) != 0x80) {
+			return 0;
+		}
+	}
+
+	return need;
+}
+
+/*! \brief Whether \a str is valid UTF-8 */
+static int corpus_utf8_valid(const char *str)
+{
+	const unsigned char *s = (const unsigned char *) str;
+	size_t len = strlen(str);
+	size_t i = 0;
+
+	while (i < len) {
+		size_t seq = corpus_utf8_len(s + i, len - i);
+
+		if (!seq) {
+			return 0;
+		}
+		i += seq;
+	}
+
+	return 1;
+}
+
+/*!
+ * \brief Copy \a src into \a dst of \a size, cut to \a len bytes.
+ *
+ * The cut never splits a UTF-8 sequence; the generator adds broken
+ * sequences on purpose, in corpus_dirty(), not by accident.
+ */
+static void corpus_fill(char *dst, size_t size, const char *src, size_t len)
+{
+	len = MIN(len, MIN(strlen(src), size - 1));
+	while (len && ((unsigned char) src[len] & 0xc0) == 0x80) {
+		--len;
+	}
+	memcpy(dst, src, len);
+	dst[len] = '\0';
+}
+
+/*! \brief With probability invalid, overwrite a byte of \a str with one JSON has to escape or repair */
+static void corpus_dirty(struct corpus *corpus, char *str)
+{
+	static const char bad[] = { '\x01', '\x1b', '\x1f', '\x7f', '\x80', '\xc3', '\xfe', '\xff' };
+	size_t len = strlen(str);
+
+	if (!len || corpus_uniform(corpus) >= corpus->params.invalid) {
+		return;
+	}
+	str[corpus_below(corpus, len)] = bad[corpus_below(corpus, sizeof(bad))];
+}
+
+/*! \brief Fill in \a cdr as the next CDR of \a corpus */
+static void corpus_generate(struct corpus *corpus, struct ast_cdr *cdr)
+{
+	static const char * const latin[] = { "Alice Martin", "Bob O'Neill", "Carol \"CJ\" Jones",
+		"Dmitri Novak", "Eve Müller", "François Dubois", "Grace Hopper", "Håkon Ødegård",
+		"Reception", "Sales Queue", "UNKNOWN", "", NULL };
+	static const char * const other[] = { "Дмитрий Иванов", "Σοφία Παπαδοπούλου",
+		"山田 太郎", "张伟", "محمد علي", "דוד לוי", "Nguyễn Văn An", "김민준", NULL };
+	static const char * const contexts[] = { "from-internal", "from-internal",
+		"from-internal", "from-trunk", "from-trunk", "ext-queues", "default", NULL };
+	static const char * const apps[] = { "Dial", "Dial", "Dial", "Dial", "Queue",
+		"VoiceMail", "Playback", "Hangup", "AGI", NULL };
+	static const char * const accounts[] = { "", "", "", "sales", "support",
+		"billing", "acct-1042", NULL };
+	static const char * const names[] = { "campaign", "agent", "queue", "ivr_choice",
+		"customer_id", "transfer", NULL };
+	static const int dispositions[] = { AST_CDR_ANSWERED, AST_CDR_NOANSWER,
+		AST_CDR_BUSY, AST_CDR_FAILED, AST_CDR_CONGESTION };
+	const struct corpus_params *params = &corpus->params;
+	char tmp[512];
+	unsigned int total = 0;
+	unsigned int pick;
+	int64_t answer = 0;
+	int64_t end;
+	size_t len;
+	int vars;
+	int i;
+
+	memset(cdr, 0, sizeof(*cdr));
+
+	/* Calls arrive about one a second */
+	corpus->clock += corpus_exponential(corpus, 1000000);
+	cdr->start.tv_sec = corpus->clock / 1000000;
+	cdr->start.tv_usec = corpus->clock % 1000000;
+
+	for (i = 0; i < 5; ++i) {
+		total += params->dispositions[i];
+	}
+	pick = corpus_below(corpus, total);
+	for (i = 0; i < 4 && pick >= params->dispositions[i]; ++i) {
+		pick -= params->dispositions[i];
+	}
+	cdr->disposition = dispositions[i];
+
+	/* Rings for a while, and answered calls last a couple of minutes */
+	end = corpus->clock + 1000000 + corpus_exponential(corpus, 8000000);
+	if (cdr->disposition == AST_CDR_ANSWERED) {
+		answer = end;
+		end = answer + corpus_exponential(corpus, 120000000);
+		cdr->answer.tv_sec = answer / 1000000;
+		cdr->answer.tv_usec = answer % 1000000;
+		cdr->billsec = (end - answer) / 1000000;
+	}
+	cdr->end.tv_sec = end / 1000000;
+	cdr->end.tv_usec = end % 1000000;
+	cdr->duration = (end - corpus->clock) / 1000000;
+	cdr->amaflags = corpus_below(corpus, 10) ? AST_AMA_DOCUMENTATION : AST_AMA_BILLING;
+
+	snprintf(cdr->src, sizeof(cdr->src), "%u", 1000 + corpus_below(corpus, 9000));
+	if (corpus_below(corpus, 3)) {
+		snprintf(cdr->dst, sizeof(cdr->dst), "%u", 1000 + corpus_below(corpus, 9000));
+	} else {
+		snprintf(cdr->dst, sizeof(cdr->dst), "+1555%07u", corpus_below(corpus, 10000000));
+	}
+
+	/* "Name" <number>, with the name padded or cut to the drawn length */
+	len = corpus_length(corpus, params->clid_mean, params->clid_sd, sizeof(cdr->clid) - 1);
+	snprintf(tmp, sizeof(tmp), "\"%s\" <%s>", corpus_uniform(corpus) < params->nonascii
+		? corpus_pick(corpus, other) : corpus_pick(corpus, latin), cdr->src);
+	while (strlen(tmp) < len) {
+		strcat(tmp, " ");
+	}
+	corpus_fill(cdr->clid, sizeof(cdr->clid), tmp, len);
+	corpus_dirty(corpus, cdr->clid);
+
+	ast_copy_string(cdr->dcontext, corpus_pick(corpus, contexts), sizeof(cdr->dcontext));
+	snprintf(cdr->channel, sizeof(cdr->channel), "PJSIP/%.32s-%08x", cdr->src,
+		(unsigned int) corpus_next(corpus));
+	if (cdr->disposition != AST_CDR_FAILED && cdr->disposition != AST_CDR_CONGESTION) {
+		snprintf(cdr->dstchannel, sizeof(cdr->dstchannel), "PJSIP/%.32s-%08x",
+			*cdr->dst == '+' ? "trunk" : cdr->dst, (unsigned int) corpus_next(corpus));
+	}
+	ast_copy_string(cdr->lastapp, corpus_pick(corpus, apps), sizeof(cdr->lastapp));
+
+	/* Dial strings ringing several endpoints at once, with options */
+	len = corpus_length(corpus, params->lastdata_mean, params->lastdata_sd,
+		sizeof(cdr->lastdata) - 1);
+	snprintf(tmp, sizeof(tmp), "PJSIP/%s", cdr->dst);
+	while (strlen(tmp) < len) {
+		/* One draw per statement; argument order is unspecified */
+		unsigned int peer = 1000 + corpus_below(corpus, 9000);
+		unsigned int arg = corpus_below(corpus, 100);
+
+		snprintf(tmp + strlen(tmp), sizeof(tmp) - strlen(tmp), "&PJSIP/%u,30,tTr\\,U(sub^%u)",
+			peer, arg);
+	}
+	corpus_fill(cdr->lastdata, sizeof(cdr->lastdata), tmp, len);
+	corpus_dirty(corpus, cdr->lastdata);
+
+	ast_copy_string(cdr->accountcode, corpus_pick(corpus, accounts), sizeof(cdr->accountcode));
+	ast_copy_string(cdr->peeraccount, corpus_pick(corpus, accounts), sizeof(cdr->peeraccount));
+
+	snprintf(cdr->uniqueid, sizeof(cdr->uniqueid), "%ld.%d",
+		(long) cdr->start.tv_sec, corpus->count);
+	/* Calls have a geometric number of legs with the drawn mean */
+	if (corpus->linked_left <= 0) {
+		ast_copy_string(corpus->linkedid, cdr->uniqueid, sizeof(corpus->linkedid));
+		corpus->linked_left = 1;
+		while (corpus_uniform(corpus) < 1.0 - 1.0 / params->fanout) {
+			++corpus->linked_left;
+		}
+	}
+	--corpus->linked_left;
+	ast_copy_string(cdr->linkedid, corpus->linkedid, sizeof(cdr->linkedid));
+
+	/* Channel variables, as dialplans commonly fold them into userfield */
+	vars = floor(corpus_exponential(corpus, params->vars) + 0.5);
+	for (i = 0, *tmp = '\0'; i < vars; ++i) {
+		const char *name = corpus_pick(corpus, names);
+		unsigned int value = corpus_below(corpus, 100000);
+
+		snprintf(tmp + strlen(tmp), sizeof(tmp) - strlen(tmp), "%s%s=%u", i ? ";" : "",
+			name, value);
+	}
+	corpus_fill(cdr->userfield, sizeof(cdr->userfield), tmp, strlen(tmp));
+
+	cdr->sequence = corpus->count++;
+}
+
+enum corpus_column_type {
+	CORPUS_STRING,
+	CORPUS_TIME,
+	CORPUS_LONG,
+	CORPUS_INT,
+};
+
+/*! \brief Columns of a corpus file, in order */
+static const struct corpus_column {
+	const char *name;
+	enum corpus_column_type type;
+	size_t offset;
+	size_t size;
+} corpus_columns[] = {
+#define CORPUS_COLUMN(field, type) { #field, type, offsetof(struct ast_cdr, field), \
+	sizeof(((struct ast_cdr *) 0)->field) }
+	CORPUS_COLUMN(clid, CORPUS_STRING),
+	CORPUS_COLUMN(src, CORPUS_STRING),
+	CORPUS_COLUMN(dst, CORPUS_STRING),
+	CORPUS_COLUMN(dcontext, CORPUS_STRING),
+	CORPUS_COLUMN(channel, CORPUS_STRING),
+	CORPUS_COLUMN(dstchannel, CORPUS_STRING),
+	CORPUS_COLUMN(lastapp, CORPUS_STRING),
+	CORPUS_COLUMN(lastdata, CORPUS_STRING),
+	CORPUS_COLUMN(start, CORPUS_TIME),
+	CORPUS_COLUMN(answer, CORPUS_TIME),
+	CORPUS_COLUMN(end, CORPUS_TIME),
+	CORPUS_COLUMN(duration, CORPUS_LONG),
+	CORPUS_COLUMN(billsec, CORPUS_LONG),
+	CORPUS_COLUMN(disposition, CORPUS_LONG),
+	CORPUS_COLUMN(amaflags, CORPUS_LONG),
+	CORPUS_COLUMN(accountcode, CORPUS_STRING),
+	CORPUS_COLUMN(peeraccount, CORPUS_STRING),
+	CORPUS_COLUMN(uniqueid, CORPUS_STRING),
+	CORPUS_COLUMN(linkedid, CORPUS_STRING),
+	CORPUS_COLUMN(userfield, CORPUS_STRING),
+	CORPUS_COLUMN(sequence, CORPUS_INT),
+#undef CORPUS_COLUMN
+};
+
+/*! \brief Whether every string of \a cdr is valid UTF-8 */
+static int corpus_cdr_valid(const struct ast_cdr *cdr)
+{
+	size_t i;
+
+	for (i = 0; i < ARRAY_LEN(corpus_columns); ++i) {
+		if (corpus_columns[i].type == CORPUS_STRING
+			&& !corpus_utf8_valid((const char *) cdr + corpus_columns[i].offset)) {
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+/*! \brief Write the column names, as a comment */
+static void corpus_write_header(FILE *out)
+{
+	size_t i;
+
+	for (i = 0; i < ARRAY_LEN(corpus_columns); ++i) {
+		fprintf(out, "%s%s", i ? "\t" : "# ", corpus_columns[i].name);
+	}
+	fputc('\n', out);
+}
+
+/*! \brief Write \a cdr as a line of a corpus file */
+static void corpus_write(FILE *out, const struct ast_cdr *cdr)
+{
+	size_t i;
+
+	for (i = 0; i < ARRAY_LEN(corpus_columns); ++i) {
+		const struct corpus_column *column = &corpus_columns[i];
+		const void *field = (const char *) cdr + column->offset;
+		const unsigned char *s;
+		size_t len;
+		size_t j;
+
+		if (i) {
+			fputc('\t', out);
+		}
+		switch (column->type) {
+		case CORPUS_TIME:
+			fprintf(out, "%ld.%06ld", (long) ((const struct timeval *) field)->tv_sec,
+				(long) ((const struct timeval *) field)->tv_usec);
+			break;
+		case CORPUS_LONG:
+			fprintf(out, "%ld", *(const long *) field);
+			break;
+		case CORPUS_INT:
+			fprintf(out, "%d", *(const int *) field);
+			break;
+		case CORPUS_STRING:
+			s = field;
+			len = strlen(field);
+			for (j = 0; j < len; ++j) {
+				size_t seq = corpus_utf8_len(s + j, len - j);
+
+				if (s[j] == '\\') {
+					fputs("\\\\", out);
+				} else if (s[j] == '\t') {
+					fputs("\\t", out);
+				} else if (s[j] == '\n') {
+					fputs("\\n", out);
+				} else if (!seq || s[j] < 0x20 || s[j] == 0x7f) {
+					fprintf(out, "\\x%02x", s[j]);
+				} else {
+					fwrite(s + j, 1, seq, out);
+					j += seq - 1;
+				}
+			}
+			break;
+		}
+	}
+	fputc('\n', out);
+}
+
+/*! \brief Undo the escaping of corpus_write() in place */
+static int corpus_unescape(char *str)
+{
+	char *out = str;
+	unsigned int byte;
+
+	for (; *str; ++str) {
+		if (*str != '\\') {
+			*out++ = *str;
+			continue;
+		}
+		switch (*++str) {
+		case '\\':
+			*out++ = '\\';
+			break;
+		case 't':
+			*out++ = '\t';
+			break;
+		case 'n':
+			*out++ = '\n';
+			break;
+		case 'x':
+			if (sscanf(str + 1, "%2x", &byte) != 1 || !byte) {
+				return -1;
+			}
+			*out++ = byte;
+			str += 2;
+			break;
+		default:
+			return -1;
+		}
+	}
+	*out = '\0';
+
+	return 0;
+}
+
+/*!
+ * \brief Read the next CDR of a corpus file into \a cdr.
+ *
+ * \retval 1 if a CDR was read.
+ * \retval 0 at the end of the file.
+ * \retval -1 if the line is malformed.
+ */
+static int corpus_read(FILE *in, struct ast_cdr *cdr)
+{
+	char line[4096];
+
+	while (fgets(line, sizeof(line), in)) {
+		char *columns = line;
+		size_t i;
+
+		if (*line == '#' || *line == '\n') {
+			continue;
+		}
+		line[strcspn(line, "\n")] = '\0';
+
+		memset(cdr, 0, sizeof(*cdr));
+		for (i = 0; i < ARRAY_LEN(corpus_columns); ++i) {
+			const struct corpus_column *column = &corpus_columns[i];
+			void *field = (char *) cdr + column->offset;
+			char *value = strsep(&columns, "\t");
+			long sec;
+			long usec;
+
+			if (!value) {
+				return -1;
+			}
+			switch (column->type) {
+			case CORPUS_TIME:
+				if (sscanf(value, "%ld.%ld", &sec, &usec) != 2) {
+					return -1;
+				}
+				((struct timeval *) field)->tv_sec = sec;
+				((struct timeval *) field)->tv_usec = usec;
+				break;
+			case CORPUS_LONG:
+				*(long *) field = strtol(value, NULL, 10);
+				break;
+			case CORPUS_INT:
+				*(int *) field = strtol(value, NULL, 10);
+				break;
+			case CORPUS_STRING:
+				if (corpus_unescape(value) != 0 || strlen(value) >= column->size) {
+					return -1;
+				}
+				strcpy(field, value);
+				break;
+			}
+		}
+
+		return columns ? -1 : 1;
+	}
+
+	return 0;
+}
+
+/*!
+ * \brief Read the whole corpus file \a path.
+ *
+ * \return The CDRs, to be freed with ast_free(), with their number in \a count.
+ * \return NULL if the file cannot be read or is malformed.
+ */
+static struct ast_cdr *corpus_load(const char *path, size_t *count)
+{
+	FILE *in = fopen(path, "r");
+	struct ast_cdr *cdrs = NULL;
+	size_t size = 0;
+	int res = 0;
+
+	*count = 0;
+	if (!in) {
+		return NULL;
+	}
+	for (;;) {
+		if (*count == size) {
+			struct ast_cdr *grown = ast_realloc(cdrs, (size + 256) * sizeof(*cdrs));
+
+			if (!grown) {
+				res = -1;
+				break;
+			}
+			cdrs = grown;
+			size += 256;
+		}
+		res = corpus_read(in, &cdrs[*count]);
+		if (res <= 0) {
+			break;
+		}
+		++*count;
+	}
+	fclose(in);
+
+	if (res < 0) {
+		fprintf(stderr, "%s: malformed line after CDR %zu\n", path, *count);
+		ast_free(cdrs);
+		return NULL;
+	}
+
+	return cdrs;
+}
+
+#endif /* CDR_AMQP_CORPUS_H */
@@ -0,0 +1,70 @@
+/*
+ * Asterisk -- An open source telephony toolkit.
+ *
+ * See http://www.asterisk.org for more information about
+ * the Asterisk project.
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2. See the LICENSE file
+ * at the top of the source tree.
+ */
+
+/*! \file
+ *
+ * \brief Write a generated CDR corpus to stdout; see corpus.h.
+ *
+ * \verbatim
+ * corpus_gen [-n count] [-s seed] [-p params]
+ * \endverbatim
+ *
+ * \a params overrides the distributions of CORPUS_PARAMS_DEFAULT, as
+ * described at corpus_params_parse(); for example
+ * -p nonascii=0.5,invalid=0.05,fanout=4.
+ */
+
+#include <unistd.h>
+
+#include "corpus.h"
+
+int main(int argc, char *argv[])
+{
+	struct corpus_params params = CORPUS_PARAMS_DEFAULT;
+	struct corpus corpus;
+	struct ast_cdr cdr;
+	const char *spec = NULL;
+	unsigned long long seed = 1;
+	long count = 1000;
+	long i;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "n:s:p:")) != -1) {
+		switch (opt) {
+		case 'n':
+			count = strtol(optarg, NULL, 10);
+			break;
+		case 's':
+			seed = strtoull(optarg, NULL, 0);
+			break;
+		case 'p':
+			spec = optarg;
+			if (corpus_params_parse(&params, optarg) != 0) {
+				fprintf(stderr, "corpus_gen: bad parameters '%s'\n", optarg);
+				return 1;
+			}
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-n count] [-s seed] [-p params]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	corpus_init(&corpus, &params, seed);
+	printf("# corpus_gen -n %ld -s %llu%s%s\n", count, seed, spec ? " -p " : "", S_OR(spec, ""));
+	corpus_write_header(stdout);
+	for (i = 0; i < count; ++i) {
+		corpus_generate(&corpus, &cdr);
+		corpus_write(stdout, &cdr);
+	}
+
+	return 0;
+}
@@ -0,0 +1,435 @@
+/*
+ * Asterisk -- An open source telephony toolkit.
+ *
+ * See http://www.asterisk.org for more information about
+ * the Asterisk project.
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2. See the LICENSE file
+ * at the top of the source tree.
+ */
+
+/*! \file
+ *
+ * \brief res_amqp stand-in the tests publish to; see fake_broker.h.
+ *
+ * Built with FAKE_BROKER_WIRE, it leaves the res_amqp and librabbitmq
+ * functions to amqp_shim.c and the real librabbitmq, and only keeps
+ * what amqp_server publishes to.
+ */
+
+#include "asterisk.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <unistd.h>
+
+#include "asterisk/amqp.h"
+#include "asterisk/astobj2.h"
+
+#include "fake_broker.h"
+
+/*! \brief Connection names the broker knows, and their state */
+struct fake_connection {
+	char name[32];
+	int down;
+	/*! \brief publishes left to fail; -1 for all */
+	int fail;
+	size_t published;
+};
+
+#ifndef FAKE_BROKER_WIRE
+struct ast_amqp_connection {
+	struct fake_connection *cxn;
+};
+#endif
+
+static pthread_mutex_t broker_lock = PTHREAD_MUTEX_INITIALIZER;
+/*! \brief Signalled when a message is accepted or the broker stops stalling */
+static pthread_cond_t broker_cond = PTHREAD_COND_INITIALIZER;
+static struct fake_connection connections[8];
+static size_t connection_count;
+/*! \brief messages kept, \a stored of them in an array of \a message_max */
+static struct fake_message **messages;
+static size_t stored;
+static size_t message_max;
+/*! \brief messages accepted, whether kept or not */
+static size_t message_count;
+static size_t attempts;
+static int keep = 1;
+static int stalled;
+static unsigned int latency;
+static unsigned int latency_jitter;
+/*! \brief nack rate, scaled to RAND_MAX */
+static unsigned int nack_threshold;
+static unsigned int nack_seed;
+
+/*! \brief Find or add connection \a name; broker_lock must be held */
+static struct fake_connection *connection_find(const char *name)
+{
+	size_t i;
+
+	for (i = 0; i < connection_count; ++i) {
+		if (!strcmp(connections[i].name, name)) {
+			return &connections[i];
+		}
+	}
+	if (connection_count == ARRAY_LEN(connections)) {
+		abort();
+	}
+	ast_copy_string(connections[connection_count].name, name,
+		sizeof(connections[connection_count].name));
+	return &connections[connection_count++];
+}
+
+void fake_broker_reset(void)
+{
+	size_t i;
+
+	pthread_mutex_lock(&broker_lock);
+	for (i = 0; i < stored; ++i) {
+		free(messages[i]);
+	}
+	stored = 0;
+	message_count = 0;
+	attempts = 0;
+	keep = 1;
+	for (i = 0; i < connection_count; ++i) {
+		connections[i].down = 0;
+		connections[i].fail = 0;
+		connections[i].published = 0;
+	}
+	stalled = 0;
+	latency = latency_jitter = 0;
+	nack_threshold = 0;
+	nack_seed = 1;
+	pthread_cond_broadcast(&broker_cond);
+	pthread_mutex_unlock(&broker_lock);
+}
+
+void fake_broker_set_up(const char *name, int up)
+{
+	pthread_mutex_lock(&broker_lock);
+	connection_find(name)->down = !up;
+	pthread_mutex_unlock(&broker_lock);
+}
+
+void fake_broker_fail(const char *name, int count)
+{
+	pthread_mutex_lock(&broker_lock);
+	connection_find(name)->fail = count;
+	pthread_mutex_unlock(&broker_lock);
+}
+
+void fake_broker_keep(int on)
+{
+	pthread_mutex_lock(&broker_lock);
+	keep = on;
+	pthread_mutex_unlock(&broker_lock);
+}
+
+void fake_broker_stall(int stall)
+{
+	pthread_mutex_lock(&broker_lock);
+	stalled = stall;
+	pthread_cond_broadcast(&broker_cond);
+	pthread_mutex_unlock(&broker_lock);
+}
+
+void fake_broker_latency(unsigned int usec, unsigned int jitter)
+{
+	pthread_mutex_lock(&broker_lock);
+	latency = usec;
+	latency_jitter = MIN(jitter, usec);
+	pthread_mutex_unlock(&broker_lock);
+}
+
+void fake_broker_nack_rate(double rate)
+{
+	pthread_mutex_lock(&broker_lock);
+	nack_threshold = rate <= 0 ? 0 : rate >= 1 ? RAND_MAX : (unsigned int) (rate * RAND_MAX);
+	pthread_mutex_unlock(&broker_lock);
+}
+
+size_t fake_broker_count(void)
+{
+	size_t count;
+
+	pthread_mutex_lock(&broker_lock);
+	count = message_count;
+	pthread_mutex_unlock(&broker_lock);
+
+	return count;
+}
+
+size_t fake_broker_count_on(const char *name)
+{
+	size_t count;
+
+	pthread_mutex_lock(&broker_lock);
+	count = connection_find(name)->published;
+	pthread_mutex_unlock(&broker_lock);
+
+	return count;
+}
+
+size_t fake_broker_attempts(void)
+{
+	size_t count;
+
+	pthread_mutex_lock(&broker_lock);
+	count = attempts;
+	pthread_mutex_unlock(&broker_lock);
+
+	return count;
+}
+
+const struct fake_message *fake_broker_message(size_t index)
+{
+	const struct fake_message *msg = NULL;
+
+	pthread_mutex_lock(&broker_lock);
+	if (index < stored) {
+		msg = messages[index];
+	}
+	pthread_mutex_unlock(&broker_lock);
+
+	return msg;
+}
+
+int fake_broker_wait(size_t count, int timeout_ms)
+{
+	struct timespec deadline;
+	int res = 0;
+
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_sec += timeout_ms / 1000;
+	deadline.tv_nsec += (timeout_ms % 1000) * 1000000L;
+	if (deadline.tv_nsec >= 1000000000L) {
+		++deadline.tv_sec;
+		deadline.tv_nsec -= 1000000000L;
+	}
+
+	pthread_mutex_lock(&broker_lock);
+	while (message_count < count && res != ETIMEDOUT) {
+		res = pthread_cond_timedwait(&broker_cond, &broker_lock, &deadline);
+	}
+	res = message_count < count ? -1 : 0;
+	pthread_mutex_unlock(&broker_lock);
+
+	return res;
+}
+
+const char *fake_message_header(const struct fake_message *msg, const char *key)
+{
+	const char *text = msg->header_text;
+	int i;
+
+	for (i = 0; i < msg->headers; ++i) {
+		const char *value = text + strlen(text) + 1;
+
+		if (!strcmp(text, key)) {
+			return value;
+		}
+		text = value + strlen(value) + 1;
+	}
+	return NULL;
+}
+
+/*! \brief Copy at most \a size - 1 bytes of \a bytes to \a dst, NUL terminated */
+static void bytes_copy(char *dst, size_t size, amqp_bytes_t bytes)
+{
+	size_t len = MIN(bytes.len, size - 1);
+
+	memcpy(dst, bytes.bytes, len);
+	dst[len] = '\0';
+}
+
+/*! \brief Write \a value to \a out as text; see fake_message_header() */
+static void field_write(FILE *out, const amqp_field_value_t *value)
+{
+	int i;
+
+	switch (value->kind) {
+	case AMQP_FIELD_KIND_UTF8:
+	case AMQP_FIELD_KIND_BYTES:
+		fwrite(value->value.bytes.bytes, 1, value->value.bytes.len, out);
+		break;
+	case AMQP_FIELD_KIND_I32:
+		fprintf(out, "%d", value->value.i32);
+		break;
+	case AMQP_FIELD_KIND_I64:
+		fprintf(out, "%" PRId64, value->value.i64);
+		break;
+	case AMQP_FIELD_KIND_ARRAY:
+		for (i = 0; i < value->value.array.num_entries; ++i) {
+			if (i) {
+				fputc(',', out);
+			}
+			field_write(out, &value->value.array.entries[i]);
+		}
+		break;
+	default:
+		fputc('?', out);
+		break;
+	}
+}
+
+/*! \brief Keep a copy of a published message; broker_lock must be held */
+static int message_store(struct fake_connection *cxn, amqp_bytes_t routing_key,
+	const amqp_basic_properties_t *properties, amqp_bytes_t body)
+{
+	struct fake_message *msg;
+	char *headers = NULL;
+	size_t header_len = 0;
+	FILE *out;
+	int i;
+
+	if (stored == message_max) {
+		size_t max = message_max ? message_max * 2 : 1024;
+		struct fake_message **grown = realloc(messages, max * sizeof(*messages));
+
+		if (!grown) {
+			return -1;
+		}
+		messages = grown;
+		message_max = max;
+	}
+
+	/* Keys and values, each NUL terminated, go after the body */
+	out = open_memstream(&headers, &header_len);
+	if (!out) {
+		return -1;
+	}
+	for (i = 0; properties->_flags & AMQP_BASIC_HEADERS_FLAG
+		&& i < properties->headers.num_entries; ++i) {
+		const amqp_table_entry_t *entry = &properties->headers.entries[i];
+
+		fwrite(entry->key.bytes, 1, entry->key.len, out);
+		fputc('\0', out);
+		field_write(out, &entry->value);
+		fputc('\0', out);
+	}
+	fclose(out);
+
+	msg = calloc(1, sizeof(*msg) + body.len + 1 + header_len);
+	if (!msg) {
+		free(headers);
+		return -1;
+	}
+	msg->header_text = msg->body + body.len + 1;
+	memcpy(msg->body + body.len + 1, headers, header_len);
+	free(headers);
+
+	ast_copy_string(msg->connection, cxn->name, sizeof(msg->connection));
+	bytes_copy(msg->routing_key, sizeof(msg->routing_key), routing_key);
+	bytes_copy(msg->message_id, sizeof(msg->message_id), properties->message_id);
+	if (properties->_flags & AMQP_BASIC_CONTENT_ENCODING_FLAG) {
+		bytes_copy(msg->encoding, sizeof(msg->encoding), properties->content_encoding);
+	}
+	msg->timestamp = properties->timestamp;
+	msg->headers = i;
+	msg->len = body.len;
+	memcpy(msg->body, body.bytes, body.len);
+
+	messages[stored++] = msg;
+	return 0;
+}
+
+int fake_broker_is_up(const char *name)
+{
+	int up;
+
+	pthread_mutex_lock(&broker_lock);
+	up = !connection_find(name)->down;
+	pthread_mutex_unlock(&broker_lock);
+
+	return up;
+}
+
+int fake_broker_publish(const char *name, amqp_bytes_t routing_key,
+	const amqp_basic_properties_t *properties, amqp_bytes_t body)
+{
+	struct fake_connection *cxn;
+	unsigned int usec;
+	int nack;
+
+	pthread_mutex_lock(&broker_lock);
+	cxn = connection_find(name);
+	usec = latency;
+	if (latency_jitter) {
+		usec += rand_r(&nack_seed) % (2 * latency_jitter + 1) - latency_jitter;
+	}
+	pthread_mutex_unlock(&broker_lock);
+	if (usec) {
+		usleep(usec);
+	}
+
+	pthread_mutex_lock(&broker_lock);
+	++attempts;
+	while (stalled) {
+		pthread_cond_wait(&broker_cond, &broker_lock);
+	}
+	nack = nack_threshold && (unsigned int) rand_r(&nack_seed) < nack_threshold;
+	if (cxn->down || cxn->fail || nack) {
+		if (cxn->fail > 0) {
+			--cxn->fail;
+		}
+		pthread_mutex_unlock(&broker_lock);
+		return -1;
+	}
+
+	if (keep && message_store(cxn, routing_key, properties, body) != 0) {
+		pthread_mutex_unlock(&broker_lock);
+		return -1;
+	}
+	++message_count;
+	++cxn->published;
+	pthread_cond_broadcast(&broker_cond);
+	pthread_mutex_unlock(&broker_lock);
+
+	return 0;
+}
+
+#ifndef FAKE_BROKER_WIRE
+amqp_bytes_t amqp_cstring_bytes(char const *cstr)
+{
+	amqp_bytes_t bytes = { strlen(cstr), (void *) cstr };
+
+	return bytes;
+}
+
+struct ast_amqp_connection *ast_amqp_get_connection(const char *name)
+{
+	struct ast_amqp_connection *amqp;
+	struct fake_connection *cxn;
+
+	pthread_mutex_lock(&broker_lock);
+	cxn = connection_find(name);
+	if (cxn->down) {
+		cxn = NULL;
+	}
+	pthread_mutex_unlock(&broker_lock);
+
+	if (!cxn) {
+		return NULL;
+	}
+
+	amqp = ao2_alloc(sizeof(*amqp), NULL);
+	if (amqp) {
+		amqp->cxn = cxn;
+	}
+	return amqp;
+}
+
+int ast_amqp_basic_publish(struct ast_amqp_connection *amqp,
+	amqp_bytes_t exchange,
+	amqp_bytes_t routing_key,
+	amqp_boolean_t mandatory,
+	amqp_boolean_t immediate,
+	const amqp_basic_properties_t *properties,
+	amqp_bytes_t body)
+{
+	return fake_broker_publish(amqp->cxn->name, routing_key, properties, body);
+}
+#endif
@@ -0,0 +1,128 @@
+/*
+ * Asterisk -- An open source telephony toolkit.
+ *
+ * See http://www.asterisk.org for more information about
+ * the Asterisk project.
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2. See the LICENSE file
+ * at the top of the source tree.
+ */
+
+/*! \file
+ *
+ * \brief res_amqp stand-in the tests publish to.
+ *
+ * Connections are looked up by their amqp.conf name. Every name is up
+ * until it is taken down; a connection that is down cannot be obtained
+ * and fails every publish on handles obtained before.
+ */
+
+#ifndef CDR_AMQP_FAKE_BROKER_H
+#define CDR_AMQP_FAKE_BROKER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <amqp.h>
+
+/*! \brief A message the broker accepted */
+struct fake_message {
+	/*! \brief connection it was published on */
+	char connection[32];
+	char routing_key[64];
+	char message_id[33];
+	/*! \brief content_encoding; empty if none */
+	char encoding[16];
+	uint64_t timestamp;
+	/*! \brief number of headers */
+	int headers;
+	/*! \brief \a headers keys and values, each NUL terminated; see fake_message_header() */
+	const char *header_text;
+	size_t len;
+	/*! \brief the body, NUL terminated */
+	char body[];
+};
+
+/*! \brief Whether connection \a name is up, so it can be obtained */
+int fake_broker_is_up(const char *name);
+
+/*!
+ * \brief Publish a message on connection \a name.
+ *
+ * What every publish goes through, whether from the in-process
+ * ast_amqp_basic_publish() or from amqp_server, so the controls below
+ * apply to both.
+ *
+ * \return 0 if the broker accepted the message; -1 if it failed or nacked it.
+ */
+int fake_broker_publish(const char *name, amqp_bytes_t routing_key,
+	const amqp_basic_properties_t *properties, amqp_bytes_t body);
+
+/*! \brief Forget every message, and bring every connection back up */
+void fake_broker_reset(void);
+
+/*! \brief Take connection \a name down, or bring it back up */
+void fake_broker_set_up(const char *name, int up);
+
+/*! \brief Fail the next \a count publishes on \a name; -1 for all of them */
+void fake_broker_fail(const char *name, int count);
+
+/*!
+ * \brief Stall every publish until called again with \a stalled 0.
+ *
+ * A stalled broker blocks the publisher, as a TCP connection to a
+ * broker that stopped reading does.
+ */
+void fake_broker_stall(int stalled);
+
+/*!
+ * \brief Make each publish take \a usec microseconds, give or take up to \a jitter.
+ */
+void fake_broker_latency(unsigned int usec, unsigned int jitter);
+
+/*!
+ * \brief Fail a fraction \a rate of publishes, 0 to 1, on every connection.
+ *
+ * res_amqp reports a message the broker nacks as a failed publish; the
+ * failures follow a fixed pseudo-random sequence, so runs repeat.
+ */
+void fake_broker_nack_rate(double rate);
+
+/*!
+ * \brief Whether to keep what is published; on by default.
+ *
+ * Benchmarks turn it off, so only the counts grow.
+ */
+void fake_broker_keep(int keep);
+
+/*! \brief Messages accepted so far */
+size_t fake_broker_count(void);
+
+/*! \brief Messages accepted so far on connection \a name */
+size_t fake_broker_count_on(const char *name);
+
+/*! \brief Publishes attempted so far, including failed ones */
+size_t fake_broker_attempts(void);
+
+/*! \brief The \a index th message accepted; NULL past the end or if not kept */
+const struct fake_message *fake_broker_message(size_t index);
+
+/*!
+ * \brief Value of header \a key of \a msg, as text.
+ *
+ * Integers are in decimal and arrays have their elements separated by
+ * commas.
+ *
+ * \return The value; NULL if \a msg has no such header.
+ */
+const char *fake_message_header(const struct fake_message *msg, const char *key);
+
+/*!
+ * \brief Wait until \a count messages have been accepted.
+ *
+ * \return 0 once they have, -1 after \a timeout_ms milliseconds.
+ */
+int fake_broker_wait(size_t count, int timeout_ms);
+
+#endif /* CDR_AMQP_FAKE_BROKER_H */
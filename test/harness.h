@@ -0,0 +1,290 @@
+/*
+ * Asterisk -- An open source telephony toolkit.
+ *
+ * See http://www.asterisk.org for more information about
+ * the Asterisk project.
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2. See the LICENSE file
+ * at the top of the source tree.
+ */
+
+/*! \file
+ *
+ * \brief Helpers for tests that build cdr_amqp.c in.
+ *
+ * A test program includes cdr_amqp.c and then this file, so the tests
+ * can drive the module's static functions directly. Each test loads the
+ * module with its own cdr_amqp.conf and a fresh spool directory, and
+ * unloads it again, so tests do not see each other's state.
+ */
+
+#ifndef CDR_AMQP_HARNESS_H
+#define CDR_AMQP_HARNESS_H
+
+#include <dirent.h>
+#include <limits.h>
+#include <semaphore.h>
+#include <stdarg.h>
+
+#include "fake_broker.h"
+#include "mock_asterisk.h"
+
+/*! \brief Failed checks in the running test */
+static int harness_failures;
+
+/*! \brief Fail the running test unless \a cond holds */
+#define CHECK(cond) do { \
+	if (!(cond)) { \
+		fprintf(stderr, "  %s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+		++harness_failures; \
+	} \
+} while (0)
+
+/*! \brief Like CHECK(), with a message formatted from the remaining arguments */
+#define CHECK_MSG(cond, ...) do { \
+	if (!(cond)) { \
+		fprintf(stderr, "  %s:%d: check failed: %s: ", __FILE__, __LINE__, #cond); \
+		fprintf(stderr, __VA_ARGS__); \
+		fputc('\n', stderr); \
+		++harness_failures; \
+	} \
+} while (0)
+
+struct harness_test {
+	const char *name;
+	void (*fn)(void);
+};
+
+/*! \brief Spool directory of the loaded module */
+static char harness_spool[64];
+
+/*! \brief Remove directory \a path and what is in it; one level deep */
+static void harness_rmdir(const char *path)
+{
+	DIR *dir = opendir(path);
+	struct dirent *entry;
+
+	if (!dir) {
+		return;
+	}
+	while ((entry = readdir(dir))) {
+		char file[PATH_MAX];
+
+		if (!strcmp(entry->d_name, ".") || !strcmp(entry->d_name, "..")) {
+			continue;
+		}
+		snprintf(file, sizeof(file), "%s/%s", path, entry->d_name);
+		if (entry->d_type == DT_DIR) {
+			harness_rmdir(file);
+		} else {
+			unlink(file);
+		}
+	}
+	closedir(dir);
+	rmdir(path);
+}
+
+/*!
+ * \brief Load the module with \a conf as cdr_amqp.conf.
+ *
+ * \return The load_module() result.
+ */
+static int harness_load(const char *conf)
+{
+	strcpy(harness_spool, "/tmp/cdr_amqp_test.XXXXXX");
+	if (!mkdtemp(harness_spool)) {
+		perror("mkdtemp");
+		exit(1);
+	}
+	ast_config_AST_SPOOL_DIR = harness_spool;
+
+	memset(&stats, 0, sizeof(stats));
+	memset(latency, 0, sizeof(latency));
+	memset(latency_sum, 0, sizeof(latency_sum));
+	fake_broker_reset();
+
+	mock_config_set(CONF_FILENAME, conf);
+	return load_module();
+}
+
+/*! \brief Reload the module with \a conf as cdr_amqp.conf */
+static int harness_reload(const char *conf)
+{
+	mock_config_set(CONF_FILENAME, conf);
+	return reload_module();
+}
+
+/*! \brief Unload the module, publishing what is queued, and remove the spool */
+static void harness_unload(void)
+{
+	/* Nothing may be left stalled, or the publishers never drain */
+	fake_broker_stall(0);
+	CHECK(unload_module() == 0);
+	harness_rmdir(harness_spool);
+}
+
+/*! \brief Fill in \a cdr as call number \a n */
+static void harness_cdr(struct ast_cdr *cdr, int n)
+{
+	memset(cdr, 0, sizeof(*cdr));
+	snprintf(cdr->clid, sizeof(cdr->clid), "\"Caller %d\" <%d>", n, 1000 + n);
+	snprintf(cdr->src, sizeof(cdr->src), "%d", 1000 + n);
+	snprintf(cdr->dst, sizeof(cdr->dst), "%d", 2000 + n);
+	strcpy(cdr->dcontext, "from-internal");
+	snprintf(cdr->channel, sizeof(cdr->channel), "PJSIP/%d-%08x", 1000 + n, n);
+	snprintf(cdr->dstchannel, sizeof(cdr->dstchannel), "PJSIP/%d-%08x", 2000 + n, n);
+	strcpy(cdr->lastapp, "Dial");
+	snprintf(cdr->lastdata, sizeof(cdr->lastdata), "PJSIP/%d,30", 2000 + n);
+	cdr->start.tv_sec = 1700000000 + n;
+	cdr->answer.tv_sec = cdr->start.tv_sec + 2;
+	cdr->end.tv_sec = cdr->answer.tv_sec + 60;
+	cdr->start.tv_usec = cdr->answer.tv_usec = cdr->end.tv_usec = 250000;
+	cdr->duration = 62;
+	cdr->billsec = 60;
+	cdr->disposition = AST_CDR_ANSWERED;
+	cdr->amaflags = AST_AMA_DOCUMENTATION;
+	strcpy(cdr->accountcode, "acct");
+	snprintf(cdr->uniqueid, sizeof(cdr->uniqueid), "1700000000.%d", n);
+	snprintf(cdr->linkedid, sizeof(cdr->linkedid), "1700000000.%d", n);
+	cdr->sequence = n;
+}
+
+/*! \brief Post call number \a n to the module */
+static int harness_post(int n)
+{
+	struct ast_cdr cdr;
+
+	harness_cdr(&cdr, n);
+	return mock_cdr_post(&cdr);
+}
+
+struct harness_sync_data {
+	sem_t done;
+	struct cdr_amqp_pipeline *pipeline;
+	int redriving;
+};
+
+static int harness_sync_task(void *data)
+{
+	struct harness_sync_data *sync = data;
+
+	sync->redriving = sync->pipeline->redriving;
+	sem_post(&sync->done);
+	return 0;
+}
+
+/*!
+ * \brief Wait until the publisher of destination \a name has run what is queued.
+ *
+ * ast_taskprocessor_size() does not count the task running, so this
+ * queues one of its own and waits for it instead.
+ *
+ * \return Whether a re-drive was still under way; it yields to the tasks
+ * queued behind it, this one included.
+ */
+static int harness_sync(const char *name)
+{
+	RAII_VAR(struct cdr_amqp_pipeline *, pipeline, ao2_find(pipelines, name, OBJ_SEARCH_KEY),
+		ao2_cleanup);
+	struct harness_sync_data sync = { .pipeline = pipeline };
+
+	if (!pipeline) {
+		return 0;
+	}
+	sem_init(&sync.done, 0, 0);
+	if (ast_taskprocessor_push(pipeline->publisher, harness_sync_task, &sync) == 0) {
+		sem_wait(&sync.done);
+	}
+	sem_destroy(&sync.done);
+
+	return sync.redriving;
+}
+
+/*! \brief Wait until destination \a name has finished re-driving its dead-letter file */
+static void harness_redrive_wait(const char *name)
+{
+	while (harness_sync(name)) {
+	}
+}
+
+/*! \brief Lines in file \a path; 0 if there is none */
+static int harness_lines(const char *path)
+{
+	FILE *in = fopen(path, "r");
+	int lines = 0;
+	int c;
+
+	if (!in) {
+		return 0;
+	}
+	while ((c = fgetc(in)) != EOF) {
+		lines += c == '\n';
+	}
+	fclose(in);
+
+	return lines;
+}
+
+/*! \brief Path of the dead-letter file of destination \a name */
+static const char *harness_deadletter(const char *name)
+{
+	static char path[PATH_MAX];
+
+	if (!strcmp(name, GLOBAL_DESTINATION)) {
+		snprintf(path, sizeof(path), "%s/cdr_amqp/deadletter", harness_spool);
+	} else {
+		snprintf(path, sizeof(path), "%s/cdr_amqp/deadletter-%s", harness_spool, name);
+	}
+	return path;
+}
+
+/*! \brief Microseconds on the monotonic clock */
+static int64_t harness_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+/*!
+ * \brief Run the tests in \a tests, or only those named on the command line.
+ *
+ * \return The exit status: 0 if every test passed.
+ */
+static int harness_run(const struct harness_test *tests, size_t count, int argc, char *argv[])
+{
+	int failed = 0;
+	size_t i;
+
+	setenv("TZ", "UTC", 1);
+	tzset();
+
+	for (i = 0; i < count; ++i) {
+		int objects = mock_ao2_objects();
+		int j;
+
+		for (j = 1; j < argc; ++j) {
+			if (!strcmp(argv[j], tests[i].name)) {
+				break;
+			}
+		}
+		if (argc > 1 && j == argc) {
+			continue;
+		}
+
+		harness_failures = 0;
+		tests[i].fn();
+		/* Whatever a test allocated has to be gone once it unloaded */
+		CHECK_MSG(mock_ao2_objects() == objects, "%d ao2 objects leaked",
+			mock_ao2_objects() - objects);
+
+		printf("%s %s\n", harness_failures ? "FAIL" : "PASS", tests[i].name);
+		failed += !!harness_failures;
+	}
+
+	return failed ? 1 : 0;
+}
+
+#endif /* CDR_AMQP_HARNESS_H */
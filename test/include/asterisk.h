@@ -0,0 +1,39 @@
+/*
+ * Asterisk -- An open source telephony toolkit.
+ *
+ * See http://www.asterisk.org for more information about
+ * the Asterisk project.
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2. See the LICENSE file
+ * at the top of the source tree.
+ */
+
+/*! \file
+ *
+ * \brief Stand-in for asterisk.h, for building cdr_amqp.c into the tests.
+ *
+ * Only the parts of the Asterisk API the module uses are declared under
+ * test/include, with the same names and signatures as the real headers.
+ * They are implemented by test/mock_asterisk.c.
+ */
+
+#ifndef _ASTERISK_H
+#define _ASTERISK_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/time.h>
+#include <time.h>
+
+#define ASTERISK_GPL_KEY "This paragraph is copyright (c) 2006 by Digium, Inc."
+
+#include "asterisk/utils.h"
+#include "asterisk/logger.h"
+
+#endif /* _ASTERISK_H */
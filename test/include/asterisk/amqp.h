@@ -0,0 +1,27 @@
+/*! \file
+ *
+ * \brief Stand-in for res_amqp's asterisk/amqp.h; see test/include/asterisk.h.
+ *
+ * Implemented by test/fake_broker.c, which records what is published
+ * and can be told to fail, stall or slow down, or for test_publish_wire
+ * by test/amqp_shim.c, over the real librabbitmq.
+ */
+
+#ifndef _ASTERISK_AMQP_H
+#define _ASTERISK_AMQP_H
+
+#include <amqp.h>
+
+struct ast_amqp_connection;
+
+struct ast_amqp_connection *ast_amqp_get_connection(const char *name);
+
+int ast_amqp_basic_publish(struct ast_amqp_connection *cxn,
+	amqp_bytes_t exchange,
+	amqp_bytes_t routing_key,
+	amqp_boolean_t mandatory,
+	amqp_boolean_t immediate,
+	const amqp_basic_properties_t *properties,
+	amqp_bytes_t body);
+
+#endif /* _ASTERISK_AMQP_H */
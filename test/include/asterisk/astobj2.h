@@ -0,0 +1,109 @@
+/*! \file
+ *
+ * \brief Stand-in for asterisk/astobj2.h; see test/include/asterisk.h.
+ *
+ * Reference counting, list containers and global object holders with the
+ * semantics of the real thing. Hash and rbtree containers are not needed.
+ */
+
+#ifndef _ASTERISK_ASTOBJ2_H
+#define _ASTERISK_ASTOBJ2_H
+
+#include <pthread.h>
+#include <stddef.h>
+
+typedef void (*ao2_destructor_fn)(void *vdoomed);
+
+enum ao2_alloc_opts {
+	AO2_ALLOC_OPT_LOCK_MUTEX = (0 << 0),
+	AO2_ALLOC_OPT_LOCK_RWLOCK = (1 << 0),
+	AO2_ALLOC_OPT_LOCK_NOLOCK = (2 << 0),
+	AO2_ALLOC_OPT_LOCK_MASK = (3 << 0),
+};
+
+void *ao2_alloc_options(size_t data_size, ao2_destructor_fn destructor_fn, unsigned int options);
+#define ao2_alloc(data_size, destructor_fn) \
+	ao2_alloc_options(data_size, destructor_fn, AO2_ALLOC_OPT_LOCK_MUTEX)
+
+/*! \brief Change the reference count of \a o by \a delta; returns the count before */
+int ao2_ref(void *o, int delta);
+
+/*! \brief Drop a reference to \a obj, which may be NULL */
+void ao2_cleanup(void *obj);
+
+/*! \brief Reference count of \a obj; for tests only */
+int ao2_ref_count(void *obj);
+
+#define ao2_bump(obj) \
+	({ \
+		typeof(obj) __obj_ ## __LINE__ = (obj); \
+		if (__obj_ ## __LINE__) { \
+			ao2_ref(__obj_ ## __LINE__, +1); \
+		} \
+		__obj_ ## __LINE__; \
+	})
+
+int ao2_lock(void *a);
+int ao2_unlock(void *a);
+
+/*! \brief Holder of a global object */
+struct ao2_global_obj {
+	pthread_rwlock_t lock;
+	void *obj;
+};
+
+#define AO2_GLOBAL_OBJ_STATIC(name) \
+	struct ao2_global_obj name = { PTHREAD_RWLOCK_INITIALIZER, NULL }
+
+void *__ao2_global_obj_ref(struct ao2_global_obj *holder);
+void *__ao2_global_obj_replace(struct ao2_global_obj *holder, void *obj);
+int __ao2_global_obj_replace_unref(struct ao2_global_obj *holder, void *obj);
+
+#define ao2_global_obj_ref(holder) __ao2_global_obj_ref(&holder)
+#define ao2_global_obj_release(holder) __ao2_global_obj_replace_unref(&holder, NULL)
+#define ao2_global_obj_replace_unref(holder, obj) __ao2_global_obj_replace_unref(&holder, obj)
+
+enum search_flags {
+	OBJ_UNLINK = (1 << 0),
+	OBJ_NODATA = (1 << 1),
+	OBJ_MULTIPLE = (1 << 2),
+	OBJ_NOLOCK = (1 << 4),
+	OBJ_SEARCH_MASK = (0x07 << 5),
+	OBJ_SEARCH_NONE = (0 << 5),
+	OBJ_SEARCH_OBJECT = (1 << 5),
+	OBJ_SEARCH_KEY = (2 << 5),
+	OBJ_SEARCH_PARTIAL_KEY = (4 << 5),
+};
+
+enum _cb_results {
+	CMP_MATCH = 0x1,
+	CMP_STOP = 0x2,
+};
+
+typedef int (ao2_callback_fn)(void *obj, void *arg, int flags);
+typedef int (ao2_sort_fn)(const void *obj_left, const void *obj_right, int flags);
+
+struct ao2_container;
+
+struct ao2_container *ao2_container_alloc_list(unsigned int ao2_options,
+	unsigned int container_options, ao2_sort_fn *sort_fn, ao2_callback_fn *cmp_fn);
+
+int ao2_container_count(struct ao2_container *c);
+int ao2_link(struct ao2_container *c, void *obj);
+void *ao2_unlink(struct ao2_container *c, void *obj);
+void *ao2_callback(struct ao2_container *c, enum search_flags flags,
+	ao2_callback_fn *cb_fn, void *arg);
+void *ao2_find(struct ao2_container *c, const void *arg, enum search_flags flags);
+
+/*! \brief Iterator over a snapshot of a container */
+struct ao2_iterator {
+	void **objs;
+	size_t count;
+	size_t next;
+};
+
+struct ao2_iterator ao2_iterator_init(struct ao2_container *c, int flags);
+void *ao2_iterator_next(struct ao2_iterator *iter);
+void ao2_iterator_destroy(struct ao2_iterator *iter);
+
+#endif /* _ASTERISK_ASTOBJ2_H */
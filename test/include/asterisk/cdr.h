@@ -0,0 +1,67 @@
+/*! \file
+ *
+ * \brief Stand-in for asterisk/cdr.h; see test/include/asterisk.h.
+ */
+
+#ifndef _ASTERISK_CDR_H
+#define _ASTERISK_CDR_H
+
+#include <sys/time.h>
+
+#define AST_MAX_EXTENSION 80
+#define AST_MAX_ACCOUNT_CODE 80
+#define AST_MAX_UNIQUEID 150
+#define AST_MAX_USER_FIELD 256
+
+enum ast_cdr_disposition {
+	AST_CDR_NOANSWER = 0,
+	AST_CDR_NULL = (1 << 0),
+	AST_CDR_FAILED = (1 << 1),
+	AST_CDR_BUSY = (1 << 2),
+	AST_CDR_ANSWERED = (1 << 3),
+	AST_CDR_CONGESTION = (1 << 4),
+};
+
+enum ama_flags {
+	AST_AMA_NONE = 0,
+	AST_AMA_OMIT,
+	AST_AMA_BILLING,
+	AST_AMA_DOCUMENTATION,
+};
+
+struct ast_cdr {
+	char clid[AST_MAX_EXTENSION];
+	char src[AST_MAX_EXTENSION];
+	char dst[AST_MAX_EXTENSION];
+	char dcontext[AST_MAX_EXTENSION];
+	char channel[AST_MAX_EXTENSION];
+	char dstchannel[AST_MAX_EXTENSION];
+	char lastapp[AST_MAX_EXTENSION];
+	char lastdata[AST_MAX_EXTENSION];
+	struct timeval start;
+	struct timeval answer;
+	struct timeval end;
+	long int duration;
+	long int billsec;
+	long int disposition;
+	long int amaflags;
+	char accountcode[AST_MAX_ACCOUNT_CODE];
+	char peeraccount[AST_MAX_ACCOUNT_CODE];
+	unsigned int flags;
+	char uniqueid[AST_MAX_UNIQUEID];
+	char linkedid[AST_MAX_UNIQUEID];
+	char userfield[AST_MAX_USER_FIELD];
+	int sequence;
+	struct ast_cdr *next;
+};
+
+typedef int (*ast_cdrbe)(struct ast_cdr *cdr);
+
+int ast_cdr_register(const char *name, const char *desc, ast_cdrbe be);
+int ast_cdr_unregister(const char *name);
+const char *ast_cdr_disp2str(int disposition);
+
+/*! \brief From asterisk/channel.h */
+const char *ast_channel_amaflags2string(enum ama_flags flags);
+
+#endif /* _ASTERISK_CDR_H */
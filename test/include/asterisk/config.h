@@ -0,0 +1,35 @@
+/*! \file
+ *
+ * \brief Stand-in for asterisk/config.h; see test/include/asterisk.h.
+ */
+
+#ifndef _ASTERISK_CONFIG_H
+#define _ASTERISK_CONFIG_H
+
+#include <stdint.h>
+
+struct ast_variable {
+	const char *name;
+	const char *value;
+	struct ast_variable *next;
+	int lineno;
+};
+
+enum ast_parse_flags {
+	PARSE_TYPE = 0x000f,
+	PARSE_INT32 = 0x0001,
+	PARSE_UINT32 = 0x0002,
+	PARSE_DEFAULT = 0x0020,
+	PARSE_IN_RANGE = 0x0040,
+	PARSE_OUT_RANGE = 0x0080,
+};
+
+/*!
+ * \brief Parse \a arg as a PARSE_INT32 or PARSE_UINT32 into \a result.
+ *
+ * With PARSE_IN_RANGE the bounds follow \a result.
+ * \return 0 on success, non-zero on failure.
+ */
+int ast_parse_arg(const char *arg, enum ast_parse_flags flags, void *result, ...);
+
+#endif /* _ASTERISK_CONFIG_H */
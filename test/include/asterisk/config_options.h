@@ -0,0 +1,141 @@
+/*! \file
+ *
+ * \brief Stand-in for asterisk/config_options.h; see test/include/asterisk.h.
+ *
+ * Configuration is read from text handed to mock_config_set() rather
+ * than from a file, with the same category matching, option types and
+ * pre_apply_config handling as the real framework.
+ */
+
+#ifndef _ASTERISK_CONFIG_OPTIONS_H
+#define _ASTERISK_CONFIG_OPTIONS_H
+
+#include <regex.h>
+#include <stddef.h>
+
+#include "asterisk/astobj2.h"
+#include "asterisk/config.h"
+#include "asterisk/stringfields.h"
+
+struct aco_option;
+struct aco_info_internal;
+
+enum aco_type_t {
+	ACO_GLOBAL,
+	ACO_ITEM,
+	ACO_IGNORE,
+};
+
+enum aco_category_op {
+	ACO_BLACKLIST = 0,
+	ACO_WHITELIST,
+	ACO_BLACKLIST_EXACT,
+	ACO_WHITELIST_EXACT,
+};
+
+enum aco_matchtype {
+	ACO_EXACT = 1,
+	ACO_REGEX,
+	ACO_PREFIX,
+};
+
+typedef void *(*aco_type_item_alloc)(const char *category);
+typedef void *(*aco_type_item_find)(struct ao2_container *newcontainer, const char *category);
+
+struct aco_type {
+	enum aco_type_t type;
+	const char *name;
+	const char *category;
+	const char *matchfield;
+	const char *matchvalue;
+	enum aco_category_op category_match;
+	size_t item_offset;
+	aco_type_item_alloc item_alloc;
+	aco_type_item_find item_find;
+	/*! \brief compiled \a category */
+	regex_t *internal_category;
+};
+
+struct aco_file {
+	const char *filename;
+	const char *alias;
+	const char **skip_category;
+	struct aco_type *types[];
+};
+
+struct aco_info {
+	const char *module;
+	int (*pre_apply_config)(void);
+	void (*post_apply_config)(void);
+	void *(*snapshot_alloc)(void);
+	struct ao2_global_obj *global_obj;
+	struct aco_info_internal *internal;
+	struct aco_file *files[];
+};
+
+#define ACO_TYPES(...) { __VA_ARGS__, NULL, }
+#define ACO_FILES(...) { __VA_ARGS__, NULL, }
+
+#define CONFIG_INFO_STANDARD(name, arr, alloc, ...) \
+static struct aco_info name = { \
+	.module = AST_MODULE, \
+	.global_obj = &arr, \
+	.snapshot_alloc = alloc, \
+	__VA_ARGS__ \
+};
+
+enum aco_option_type {
+	OPT_ACL_T,
+	OPT_BOOL_T,
+	OPT_BOOLFLAG_T,
+	OPT_CHAR_ARRAY_T,
+	OPT_CODEC_T,
+	OPT_CUSTOM_T,
+	OPT_DOUBLE_T,
+	OPT_INT_T,
+	OPT_NOOP_T,
+	OPT_SOCKADDR_T,
+	OPT_STRINGFIELD_T,
+	OPT_UINT_T,
+	OPT_YESNO_T,
+	OPT_TIMELEN_T,
+};
+
+typedef int (*aco_option_handler)(const struct aco_option *opt, struct ast_variable *var, void *obj);
+
+enum aco_process_status {
+	ACO_PROCESS_OK,
+	ACO_PROCESS_UNCHANGED,
+	ACO_PROCESS_ERROR,
+};
+
+int aco_info_init(struct aco_info *info);
+void aco_info_destroy(struct aco_info *info);
+enum aco_process_status aco_process_config(struct aco_info *info, int reload);
+void *aco_pending_config(struct aco_info *info);
+int aco_set_defaults(struct aco_type *type, const char *category, void *obj);
+
+int __aco_option_register(struct aco_info *info, const char *name,
+	enum aco_matchtype match_type, struct aco_type **types, const char *default_val,
+	enum aco_option_type type, aco_option_handler handler, unsigned int flags,
+	unsigned int no_doc, size_t argc, ...);
+
+/*! \brief Count the arguments of a variadic macro, up to 8 */
+#define VA_NARGS(...) VA_NARGS1(__VA_ARGS__, 8, 7, 6, 5, 4, 3, 2, 1, 0)
+#define VA_NARGS1(_1, _2, _3, _4, _5, _6, _7, _8, N, ...) N
+
+#define aco_option_register(info, name, matchtype, types, default_val, opt_type, flags, ...) \
+	__aco_option_register(info, name, matchtype, types, default_val, opt_type, NULL, \
+		flags, 0, VA_NARGS(__VA_ARGS__), __VA_ARGS__)
+
+#define aco_option_register_custom(info, name, matchtype, types, default_val, handler, flags) \
+	__aco_option_register(info, name, matchtype, types, default_val, OPT_CUSTOM_T, \
+		handler, flags, 0, 0)
+
+/*! \brief Offset of \a field, as the option types read it */
+#define FLDSET(type, field) offsetof(type, field)
+/*! \brief Offsets of string field \a field and of the string field manager */
+#define STRFLDSET(type, field) \
+	offsetof(type, field), offsetof(type, __field_mgr_pool), offsetof(type, __field_mgr)
+
+#endif /* _ASTERISK_CONFIG_OPTIONS_H */
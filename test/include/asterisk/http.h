@@ -0,0 +1,48 @@
+/*! \file
+ *
+ * \brief Stand-in for asterisk/http.h; see test/include/asterisk.h.
+ */
+
+#ifndef _ASTERISK_HTTP_H
+#define _ASTERISK_HTTP_H
+
+struct ast_str;
+struct ast_tcptls_session_instance;
+struct ast_variable;
+
+enum ast_http_method {
+	AST_HTTP_UNKNOWN = -1,
+	AST_HTTP_GET = 0,
+	AST_HTTP_POST,
+	AST_HTTP_HEAD,
+	AST_HTTP_PUT,
+};
+
+struct ast_http_uri;
+
+typedef int (*ast_http_callback)(struct ast_tcptls_session_instance *ser,
+	const struct ast_http_uri *urih, const char *uri, enum ast_http_method method,
+	struct ast_variable *get_params, struct ast_variable *headers);
+
+struct ast_http_uri {
+	const char *description;
+	const char *uri;
+	const char *prefix;
+	ast_http_callback callback;
+	unsigned int has_subtree:1;
+	unsigned int dmallocd:1;
+	unsigned int mallocd:1;
+	unsigned int no_decode_uri:1;
+	void *data;
+	const char *key;
+};
+
+int ast_http_uri_link(struct ast_http_uri *urihandler);
+void ast_http_uri_unlink(struct ast_http_uri *urihandler);
+void ast_http_send(struct ast_tcptls_session_instance *ser, enum ast_http_method method,
+	int status_code, const char *status_title, struct ast_str *http_header,
+	struct ast_str *out, int fd, unsigned int static_content);
+void ast_http_error(struct ast_tcptls_session_instance *ser, int status,
+	const char *title, const char *text);
+
+#endif /* _ASTERISK_HTTP_H */
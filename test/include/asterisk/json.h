@@ -0,0 +1,50 @@
+/*! \file
+ *
+ * \brief Stand-in for asterisk/json.h; see test/include/asterisk.h.
+ *
+ * A small JSON tree, dumped the way jansson dumps it with JSON_COMPACT.
+ * ast_json_pack() understands the s, i, I, f and {} conversions.
+ */
+
+#ifndef _ASTERISK_JSON_H
+#define _ASTERISK_JSON_H
+
+#define AST_ISO8601_FORMAT "%FT%T.%q%z"
+#define AST_ISO8601_LEN 29
+
+struct ast_json;
+struct ast_json_error;
+
+enum ast_json_type {
+	AST_JSON_OBJECT,
+	AST_JSON_ARRAY,
+	AST_JSON_STRING,
+	AST_JSON_INTEGER,
+	AST_JSON_REAL,
+	AST_JSON_TRUE,
+	AST_JSON_FALSE,
+	AST_JSON_NULL,
+};
+
+typedef long long ast_json_int_t;
+
+struct ast_json *ast_json_ref(struct ast_json *value);
+void ast_json_unref(struct ast_json *value);
+struct ast_json *ast_json_pack(char const *format, ...);
+struct ast_json *ast_json_object_get(struct ast_json *object, const char *key);
+int ast_json_object_set(struct ast_json *object, const char *key, struct ast_json *value);
+size_t ast_json_object_size(struct ast_json *object);
+enum ast_json_type ast_json_typeof(const struct ast_json *value);
+struct ast_json *ast_json_integer_create(ast_json_int_t value);
+ast_json_int_t ast_json_integer_get(const struct ast_json *integer);
+double ast_json_real_get(const struct ast_json *real);
+const char *ast_json_string_get(const struct ast_json *string);
+struct ast_json *ast_json_array_create(void);
+int ast_json_array_append(struct ast_json *array, struct ast_json *value);
+size_t ast_json_array_size(const struct ast_json *array);
+struct ast_json *ast_json_array_get(const struct ast_json *array, size_t index);
+char *ast_json_dump_string(struct ast_json *root);
+void ast_json_free(void *p);
+struct ast_json *ast_json_load_buf(const char *buffer, size_t buflen, struct ast_json_error *error);
+
+#endif /* _ASTERISK_JSON_H */
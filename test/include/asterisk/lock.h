@@ -0,0 +1,28 @@
+/*! \file
+ *
+ * \brief Stand-in for asterisk/lock.h; see test/include/asterisk.h.
+ */
+
+#ifndef _ASTERISK_LOCK_H
+#define _ASTERISK_LOCK_H
+
+#include <pthread.h>
+
+typedef pthread_mutex_t ast_mutex_t;
+typedef pthread_cond_t ast_cond_t;
+
+#define AST_MUTEX_DEFINE_STATIC(mutex) static ast_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER
+
+#define ast_mutex_init(pmutex) pthread_mutex_init(pmutex, NULL)
+#define ast_mutex_destroy(a) pthread_mutex_destroy(a)
+#define ast_mutex_lock(a) pthread_mutex_lock(a)
+#define ast_mutex_unlock(a) pthread_mutex_unlock(a)
+
+#define ast_cond_init(cond, attr) pthread_cond_init(cond, attr)
+#define ast_cond_destroy(cond) pthread_cond_destroy(cond)
+#define ast_cond_signal(cond) pthread_cond_signal(cond)
+#define ast_cond_broadcast(cond) pthread_cond_broadcast(cond)
+#define ast_cond_wait(cond, mutex) pthread_cond_wait(cond, mutex)
+#define ast_cond_timedwait(cond, mutex, time) pthread_cond_timedwait(cond, mutex, time)
+
+#endif /* _ASTERISK_LOCK_H */
@@ -0,0 +1,29 @@
+/*! \file
+ *
+ * \brief Stand-in for asterisk/logger.h; see test/include/asterisk.h.
+ *
+ * Messages are printed to stderr when CDR_AMQP_TEST_VERBOSE is set in the
+ * environment, and counted by level either way, so tests can check that
+ * something was (or was not) logged.
+ */
+
+#ifndef _ASTERISK_LOGGER_H
+#define _ASTERISK_LOGGER_H
+
+#define _A_ __FILE__, __LINE__, __func__
+
+#define __LOG_DEBUG 0
+#define LOG_DEBUG __LOG_DEBUG, _A_
+#define __LOG_NOTICE 2
+#define LOG_NOTICE __LOG_NOTICE, _A_
+#define __LOG_WARNING 3
+#define LOG_WARNING __LOG_WARNING, _A_
+#define __LOG_ERROR 4
+#define LOG_ERROR __LOG_ERROR, _A_
+
+void ast_log(int level, const char *file, int line, const char *function,
+	const char *fmt, ...) __attribute__((format(printf, 5, 6)));
+
+#define ast_debug(level, ...) do { } while (0)
+
+#endif /* _ASTERISK_LOGGER_H */
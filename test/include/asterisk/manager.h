@@ -0,0 +1,40 @@
+/*! \file
+ *
+ * \brief Stand-in for asterisk/manager.h; see test/include/asterisk.h.
+ */
+
+#ifndef _ASTERISK_MANAGER_H
+#define _ASTERISK_MANAGER_H
+
+#define EVENT_FLAG_SYSTEM (1 << 0)
+#define EVENT_FLAG_CONFIG (1 << 7)
+#define EVENT_FLAG_REPORTING (1 << 9)
+
+struct mansession;
+struct message;
+
+#define manager_event(category, event, contents , ...) \
+	__manager_event(category, event, contents , ## __VA_ARGS__)
+
+void __manager_event(int category, const char *event, const char *contents, ...)
+	__attribute__((format(printf, 3, 4)));
+
+int ast_manager_register2(const char *action, int authority,
+	int (*func)(struct mansession *s, const struct message *m),
+	void *module, const char *synopsis, const char *description);
+
+#define ast_manager_register_xml(action, authority, func) \
+	ast_manager_register2(action, authority, func, NULL, NULL, NULL)
+
+int ast_manager_unregister(const char *action);
+
+const char *astman_get_header(const struct message *m, char *var);
+void astman_send_error(struct mansession *s, const struct message *m, char *error);
+void astman_send_ack(struct mansession *s, const struct message *m, char *msg);
+void astman_send_listack(struct mansession *s, const struct message *m, char *msg, char *listflag);
+void astman_send_list_complete_start(struct mansession *s, const struct message *m,
+	const char *event_name, int count);
+void astman_send_list_complete_end(struct mansession *s);
+void astman_append(struct mansession *s, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+#endif /* _ASTERISK_MANAGER_H */
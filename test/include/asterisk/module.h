@@ -0,0 +1,61 @@
+/*! \file
+ *
+ * \brief Stand-in for asterisk/module.h; see test/include/asterisk.h.
+ */
+
+#ifndef _ASTERISK_MODULE_H
+#define _ASTERISK_MODULE_H
+
+enum ast_module_load_result {
+	AST_MODULE_LOAD_SUCCESS = 0,
+	AST_MODULE_LOAD_DECLINE = 1,
+	AST_MODULE_LOAD_SKIP = 2,
+	AST_MODULE_LOAD_PRIORITY = 3,
+	AST_MODULE_LOAD_FAILURE = -1,
+};
+
+enum ast_module_flags {
+	AST_MODFLAG_DEFAULT = 0,
+	AST_MODFLAG_GLOBAL_SYMBOLS = (1 << 0),
+	AST_MODFLAG_LOAD_ORDER = (1 << 1),
+};
+
+enum ast_module_load_priority {
+	AST_MODPRI_CDR_DRIVER = 40,
+};
+
+enum ast_module_support_level {
+	AST_MODULE_SUPPORT_UNKNOWN,
+	AST_MODULE_SUPPORT_CORE,
+	AST_MODULE_SUPPORT_EXTENDED,
+	AST_MODULE_SUPPORT_DEPRECATED,
+};
+
+struct ast_module_info {
+	struct ast_module *self;
+	int (*load)(void);
+	int (*reload)(void);
+	int (*unload)(void);
+	const char *name;
+	const char *description;
+	const char *key;
+	unsigned int flags;
+	const char *buildopt_sum;
+	unsigned char load_pri;
+	const char *nonoptreq;
+	enum ast_module_support_level support_level;
+};
+
+static const __attribute__((unused)) struct ast_module_info *ast_module_info;
+
+#define AST_MODULE_INFO(keystr, flags_to_set, desc, fields...) \
+	static struct ast_module_info __mod_info = { \
+		.name = AST_MODULE, \
+		.flags = flags_to_set, \
+		.description = desc, \
+		.key = keystr, \
+		fields \
+	}; \
+	static const __attribute__((unused)) struct ast_module_info *ast_module_info = &__mod_info
+
+#endif /* _ASTERISK_MODULE_H */
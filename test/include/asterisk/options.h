@@ -0,0 +1,13 @@
+/*! \file
+ *
+ * \brief Stand-in for asterisk/options.h; see test/include/asterisk.h.
+ */
+
+#ifndef _ASTERISK_OPTIONS_H
+#define _ASTERISK_OPTIONS_H
+
+#define AST_MAX_SYSTEM_NAME 20
+
+extern char ast_config_AST_SYSTEM_NAME[AST_MAX_SYSTEM_NAME];
+
+#endif /* _ASTERISK_OPTIONS_H */
@@ -0,0 +1,13 @@
+/*! \file
+ *
+ * \brief Stand-in for asterisk/paths.h; see test/include/asterisk.h.
+ *
+ * The tests point ast_config_AST_SPOOL_DIR at a scratch directory.
+ */
+
+#ifndef _ASTERISK_PATHS_H
+#define _ASTERISK_PATHS_H
+
+extern const char *ast_config_AST_SPOOL_DIR;
+
+#endif /* _ASTERISK_PATHS_H */
@@ -0,0 +1,42 @@
+/*! \file
+ *
+ * \brief Stand-in for asterisk/sched.h; see test/include/asterisk.h.
+ */
+
+#ifndef _ASTERISK_SCHED_H
+#define _ASTERISK_SCHED_H
+
+#include <unistd.h>
+
+struct ast_sched_context;
+
+typedef int (*ast_sched_cb)(const void *data);
+
+struct ast_sched_context *ast_sched_context_create(void);
+void ast_sched_context_destroy(struct ast_sched_context *c);
+int ast_sched_start_thread(struct ast_sched_context *con);
+
+/*!
+ * \brief Run \a callback in \a when milliseconds.
+ *
+ * A callback returning non-zero runs again after the same interval.
+ * \return An id for ast_sched_del(), or -1 on failure.
+ */
+int ast_sched_add(struct ast_sched_context *con, int when, ast_sched_cb callback, const void *data);
+
+/*!
+ * \brief Cancel scheduled entry \a id, waiting for it if it is running.
+ * \return 0 if it was cancelled, -1 if there is no such entry.
+ */
+int ast_sched_del(struct ast_sched_context *con, int id);
+
+#define AST_SCHED_DEL(sched, id) \
+	({ \
+		int _count = 0, _sched_res = -1; \
+		while (id > -1 && (_sched_res = ast_sched_del(sched, id)) && ++_count < 10) \
+			usleep(1); \
+		id = -1; \
+		(_sched_res); \
+	})
+
+#endif /* _ASTERISK_SCHED_H */
@@ -0,0 +1,45 @@
+/*! \file
+ *
+ * \brief Stand-in for asterisk/stringfields.h; see test/include/asterisk.h.
+ *
+ * Keeps the real layout: a pool pointer, the fields, then the manager.
+ * Every value set is its own allocation in the pool, which is freed as a
+ * whole by ast_string_field_free_memory().
+ */
+
+#ifndef _ASTERISK_STRINGFIELDS_H
+#define _ASTERISK_STRINGFIELDS_H
+
+typedef const char * ast_string_field;
+
+struct ast_string_field_pool;
+
+struct ast_string_field_mgr {
+	/*! \brief number of values set; for tests */
+	size_t sets;
+};
+
+#define AST_STRING_FIELD(name) const ast_string_field name
+
+#define AST_DECLARE_STRING_FIELDS(field_list) \
+	struct ast_string_field_pool *__field_mgr_pool; \
+	field_list \
+	struct ast_string_field_mgr __field_mgr
+
+int __ast_string_field_init(struct ast_string_field_mgr *mgr,
+	struct ast_string_field_pool **pool_head, const char **first, const char **end);
+void __ast_string_field_free_memory(struct ast_string_field_pool **pool_head);
+int __ast_string_field_set(struct ast_string_field_mgr *mgr,
+	struct ast_string_field_pool **pool_head, const char **field, const char *value);
+
+#define ast_string_field_init(x, size) \
+	__ast_string_field_init(&(x)->__field_mgr, &(x)->__field_mgr_pool, \
+		(const char **) (&(x)->__field_mgr_pool + 1), (const char **) &(x)->__field_mgr)
+
+#define ast_string_field_free_memory(x) __ast_string_field_free_memory(&(x)->__field_mgr_pool)
+
+#define ast_string_field_set(x, field, data) \
+	__ast_string_field_set(&(x)->__field_mgr, &(x)->__field_mgr_pool, \
+		(const char **) &(x)->field, data)
+
+#endif /* _ASTERISK_STRINGFIELDS_H */
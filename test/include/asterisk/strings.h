@@ -0,0 +1,51 @@
+/*! \file
+ *
+ * \brief Stand-in for asterisk/strings.h; see test/include/asterisk.h.
+ */
+
+#ifndef _ASTERISK_STRINGS_H
+#define _ASTERISK_STRINGS_H
+
+#include <string.h>
+#include <sys/types.h>
+
+#define AST_YESNO(x) ((x) ? "Yes" : "No")
+
+#define S_OR(a, b) ({typeof(&((a)[0])) __x = (a); ast_strlen_zero(__x) ? (b) : __x;})
+
+static inline int ast_strlen_zero(const char *s)
+{
+	return (!s || (*s == '\0'));
+}
+
+/*! \brief Duplicate \a s on the stack */
+#define ast_strdupa(s) \
+	(__extension__ \
+	({ \
+		const char *__old = (s); \
+		size_t __len = strlen(__old) + 1; \
+		char *__new = __builtin_alloca(__len); \
+		memcpy(__new, __old, __len); \
+		__new; \
+	}))
+
+char *ast_skip_blanks(const char *str);
+char *ast_trim_blanks(char *str);
+char *ast_strip(char *s);
+void ast_copy_string(char *dst, const char *src, size_t size);
+int ast_true(const char *val);
+int ast_false(const char *val);
+
+/*! \brief A dynamically sized string */
+struct ast_str;
+
+struct ast_str *ast_str_create(size_t init_len);
+char *ast_str_buffer(const struct ast_str *buf);
+size_t ast_str_strlen(const struct ast_str *buf);
+void ast_str_reset(struct ast_str *buf);
+int ast_str_set(struct ast_str **buf, ssize_t max_len, const char *fmt, ...)
+	__attribute__((format(printf, 3, 4)));
+int ast_str_append(struct ast_str **buf, ssize_t max_len, const char *fmt, ...)
+	__attribute__((format(printf, 3, 4)));
+
+#endif /* _ASTERISK_STRINGS_H */
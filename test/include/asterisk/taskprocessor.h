@@ -0,0 +1,29 @@
+/*! \file
+ *
+ * \brief Stand-in for asterisk/taskprocessor.h; see test/include/asterisk.h.
+ *
+ * Each taskprocessor is a thread serving a FIFO, shared by name like the
+ * real ones. Dropping the last reference lets the thread run what is
+ * still queued, then joins it.
+ */
+
+#ifndef _ASTERISK_TASKPROCESSOR_H
+#define _ASTERISK_TASKPROCESSOR_H
+
+#define AST_TASKPROCESSOR_MAX_NAME 70
+
+struct ast_taskprocessor;
+
+enum ast_tps_options {
+	TPS_REF_DEFAULT = 0,
+	TPS_REF_IF_EXISTS = (1 << 0),
+};
+
+struct ast_taskprocessor *ast_taskprocessor_get(const char *name, enum ast_tps_options create);
+void *ast_taskprocessor_unreference(struct ast_taskprocessor *tps);
+int ast_taskprocessor_push(struct ast_taskprocessor *tps, int (*task_exe)(void *datap), void *datap);
+long ast_taskprocessor_size(struct ast_taskprocessor *tps);
+int ast_taskprocessor_is_task(struct ast_taskprocessor *tps);
+const char *ast_taskprocessor_name(struct ast_taskprocessor *tps);
+
+#endif /* _ASTERISK_TASKPROCESSOR_H */
@@ -0,0 +1,31 @@
+/*! \file
+ *
+ * \brief Stand-in for asterisk/threadpool.h; see test/include/asterisk.h.
+ */
+
+#ifndef _ASTERISK_THREADPOOL_H
+#define _ASTERISK_THREADPOOL_H
+
+#define AST_THREADPOOL_OPTIONS_VERSION 1
+
+struct ast_threadpool;
+struct ast_threadpool_listener;
+
+struct ast_threadpool_options {
+	int version;
+	int idle_timeout;
+	int auto_increment;
+	int initial_size;
+	int max_size;
+	void (*thread_start)(void);
+	void (*thread_end)(void);
+};
+
+struct ast_threadpool *ast_threadpool_create(const char *name,
+	struct ast_threadpool_listener *listener,
+	const struct ast_threadpool_options *options);
+void ast_threadpool_set_size(struct ast_threadpool *threadpool, unsigned int size);
+int ast_threadpool_push(struct ast_threadpool *pool, int (*task)(void *data), void *data);
+void ast_threadpool_shutdown(struct ast_threadpool *pool);
+
+#endif /* _ASTERISK_THREADPOOL_H */
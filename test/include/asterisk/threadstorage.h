@@ -0,0 +1,52 @@
+/*! \file
+ *
+ * \brief Stand-in for asterisk/threadstorage.h; see test/include/asterisk.h.
+ */
+
+#ifndef _ASTERISK_THREADSTORAGE_H
+#define _ASTERISK_THREADSTORAGE_H
+
+#include <pthread.h>
+#include <stdlib.h>
+
+struct ast_threadstorage {
+	pthread_once_t once;
+	pthread_key_t key;
+	void (*key_init)(void);
+	int (*custom_init)(void *);
+};
+
+#define AST_THREADSTORAGE_CUSTOM(name, c_init, c_cleanup) \
+	static void __init_ ## name(void); \
+	static struct ast_threadstorage name = { \
+		.once = PTHREAD_ONCE_INIT, \
+		.key_init = __init_ ## name, \
+		.custom_init = c_init, \
+	}; \
+	static void __init_ ## name(void) \
+	{ \
+		pthread_key_create(&(name).key, c_cleanup); \
+	}
+
+#define AST_THREADSTORAGE(name) AST_THREADSTORAGE_CUSTOM(name, NULL, free)
+
+static inline void *ast_threadstorage_get(struct ast_threadstorage *ts, size_t init_size)
+{
+	void *buf;
+
+	pthread_once(&ts->once, ts->key_init);
+	if (!(buf = pthread_getspecific(ts->key))) {
+		if (!(buf = calloc(1, init_size))) {
+			return NULL;
+		}
+		if (ts->custom_init && ts->custom_init(buf)) {
+			free(buf);
+			return NULL;
+		}
+		pthread_setspecific(ts->key, buf);
+	}
+
+	return buf;
+}
+
+#endif /* _ASTERISK_THREADSTORAGE_H */
@@ -0,0 +1,55 @@
+/*! \file
+ *
+ * \brief Stand-in for asterisk/time.h and asterisk/localtime.h; see test/include/asterisk.h.
+ */
+
+#ifndef _ASTERISK_TIME_H
+#define _ASTERISK_TIME_H
+
+#include <sys/time.h>
+#include <time.h>
+
+static inline int ast_tvzero(const struct timeval t)
+{
+	return (t.tv_sec == 0 && t.tv_usec == 0);
+}
+
+static inline struct timeval ast_tvnow(void)
+{
+	struct timeval t;
+
+	gettimeofday(&t, NULL);
+	return t;
+}
+
+static inline struct timeval ast_tv(time_t sec, suseconds_t usec)
+{
+	struct timeval t;
+
+	t.tv_sec = sec;
+	t.tv_usec = usec;
+	return t;
+}
+
+/*! \brief struct tm with microseconds, as ast_localtime() fills it in */
+struct ast_tm {
+	int tm_sec;
+	int tm_min;
+	int tm_hour;
+	int tm_mday;
+	int tm_mon;
+	int tm_year;
+	int tm_wday;
+	int tm_yday;
+	int tm_isdst;
+	long tm_gmtoff;
+	char *tm_zone;
+	int tm_usec;
+};
+
+struct ast_tm *ast_localtime(const struct timeval *timep, struct ast_tm *p_tm, const char *zone);
+
+/*! \brief strftime(), plus %q for fractions of a second (%1q to %6q digits, 3 by default) */
+int ast_strftime(char *buf, size_t len, const char *format, const struct ast_tm *tm);
+
+#endif /* _ASTERISK_TIME_H */
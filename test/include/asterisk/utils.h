@@ -0,0 +1,67 @@
+/*! \file
+ *
+ * \brief Stand-in for asterisk/utils.h and friends; see test/include/asterisk.h.
+ */
+
+#ifndef _ASTERISK_UTILS_H
+#define _ASTERISK_UTILS_H
+
+#include <alloca.h>
+#include <ctype.h>
+#include <stdarg.h>
+
+#include "asterisk/strings.h"
+#include "asterisk/time.h"
+
+#ifndef MIN
+#define MIN(a, b) ({ typeof(a) __a = (a); typeof(b) __b = (b); ((__a > __b) ? __b : __a);})
+#endif
+#ifndef MAX
+#define MAX(a, b) ({ typeof(a) __a = (a); typeof(b) __b = (b); ((__a < __b) ? __b : __a);})
+#endif
+
+#define ARRAY_LEN(a) (size_t) (sizeof(a) / sizeof(0[a]))
+
+#define __stringify_1(x) #x
+#define __stringify(x) __stringify_1(x)
+
+#define ast_assert(a) do { if (!(a)) { ast_assert_failed(#a, __FILE__, __LINE__, __func__); } } while (0)
+void ast_assert_failed(const char *condition, const char *file, int line,
+	const char *function) __attribute__((noreturn));
+
+#define ast_malloc(len) malloc(len)
+#define ast_calloc(num, len) calloc(num, len)
+#define ast_realloc(p, len) realloc(p, len)
+#define ast_strdup(str) ((str) ? strdup(str) : NULL)
+#define ast_std_free free
+#define ast_alloca(size) __builtin_alloca(size)
+
+/* A function rather than a macro, so it can be passed as a destructor */
+void ast_free(void *ptr);
+
+int ast_asprintf(char **ret, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+/*! \brief Declare a variable that is cleaned up by \a dtor when it leaves scope */
+#define RAII_VAR(vartype, varname, initval, dtor) \
+	auto void _dtor_ ## varname (vartype * v); \
+	void _dtor_ ## varname (vartype * v) { dtor(*v); } \
+	vartype varname __attribute__((cleanup(_dtor_ ## varname))) = (initval)
+
+static inline int ast_atomic_fetchadd_int(volatile int *p, int v)
+{
+	return __atomic_fetch_add(p, v, __ATOMIC_RELAXED);
+}
+
+#define ast_atomic_fetch_add(ptr, val, memorder) __atomic_fetch_add((ptr), (val), (memorder))
+
+int ast_mkdir(const char *path, int mode);
+
+struct ast_eid {
+	unsigned char eid[6];
+} __attribute__((__packed__));
+
+extern struct ast_eid ast_eid_default;
+
+char *ast_eid_to_str(char *s, int maxlen, struct ast_eid *eid);
+
+#endif /* _ASTERISK_UTILS_H */
@@ -0,0 +1,78 @@
+/*! \file
+ *
+ * \brief Stand-in for asterisk/vector.h; see test/include/asterisk.h.
+ */
+
+#ifndef _ASTERISK_VECTOR_H
+#define _ASTERISK_VECTOR_H
+
+#include <stdlib.h>
+
+#define AST_VECTOR(name, type) \
+	struct name { \
+		type *elems; \
+		size_t max; \
+		size_t current; \
+	}
+
+#define AST_VECTOR_INIT(vec, size) \
+	({ \
+		size_t __size = (size); \
+		size_t alloc_size = __size * sizeof(*((vec)->elems)); \
+		(vec)->elems = alloc_size ? calloc(1, alloc_size) : NULL; \
+		(vec)->current = 0; \
+		if ((vec)->elems) { \
+			(vec)->max = __size; \
+		} else { \
+			(vec)->max = 0; \
+		} \
+		(alloc_size == 0 || (vec)->elems != NULL) ? 0 : -1; \
+	})
+
+#define AST_VECTOR_FREE(vec) \
+	do { \
+		free((vec)->elems); \
+		(vec)->elems = NULL; \
+		(vec)->max = 0; \
+		(vec)->current = 0; \
+	} while (0)
+
+#define AST_VECTOR_APPEND(vec, elem) \
+	({ \
+		int res = 0; \
+		if ((vec)->current + 1 > (vec)->max) { \
+			size_t new_max = (vec)->max ? 2 * (vec)->max : 1; \
+			typeof((vec)->elems) new_elems = realloc((vec)->elems, \
+				new_max * sizeof(*new_elems)); \
+			if (new_elems) { \
+				(vec)->elems = new_elems; \
+				(vec)->max = new_max; \
+			} else { \
+				res = -1; \
+			} \
+		} \
+		if (res == 0) { \
+			(vec)->elems[(vec)->current++] = (elem); \
+		} \
+		res; \
+	})
+
+#define AST_VECTOR_SIZE(vec) (vec)->current
+#define AST_VECTOR_GET(vec, idx) ((vec)->elems[(idx)])
+#define AST_VECTOR_GET_ADDR(vec, idx) (&(vec)->elems[(idx)])
+
+#define AST_VECTOR_CALLBACK_VOID(vec, callback, ...) \
+	do { \
+		size_t idx; \
+		for (idx = 0; idx < (vec)->current; idx++) { \
+			callback((vec)->elems[idx], ##__VA_ARGS__); \
+		} \
+	} while (0)
+
+#define AST_VECTOR_RESET(vec, cleanup) \
+	do { \
+		AST_VECTOR_CALLBACK_VOID(vec, cleanup); \
+		(vec)->current = 0; \
+	} while (0)
+
+#endif /* _ASTERISK_VECTOR_H */
@@ -0,0 +1,123 @@
+/*! \file
+ *
+ * \brief Stand-in for the parts of librabbitmq's amqp.h that res_amqp exposes.
+ *
+ * In a directory of its own, so test_publish_wire can build against the
+ * real one instead.
+ */
+
+#ifndef AMQP_H
+#define AMQP_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef int amqp_boolean_t;
+
+typedef struct amqp_bytes_t_ {
+	size_t len;
+	void *bytes;
+} amqp_bytes_t;
+
+typedef struct amqp_decimal_t_ {
+	uint8_t decimals;
+	uint32_t value;
+} amqp_decimal_t;
+
+struct amqp_field_value_t_;
+
+typedef struct amqp_array_t_ {
+	int num_entries;
+	struct amqp_field_value_t_ *entries;
+} amqp_array_t;
+
+struct amqp_table_entry_t_;
+
+typedef struct amqp_table_t_ {
+	int num_entries;
+	struct amqp_table_entry_t_ *entries;
+} amqp_table_t;
+
+typedef struct amqp_field_value_t_ {
+	uint8_t kind;
+	union {
+		amqp_boolean_t boolean;
+		int8_t i8;
+		uint8_t u8;
+		int16_t i16;
+		uint16_t u16;
+		int32_t i32;
+		uint32_t u32;
+		int64_t i64;
+		uint64_t u64;
+		float f32;
+		double f64;
+		amqp_decimal_t decimal;
+		amqp_bytes_t bytes;
+		amqp_table_t table;
+		amqp_array_t array;
+	} value;
+} amqp_field_value_t;
+
+typedef struct amqp_table_entry_t_ {
+	amqp_bytes_t key;
+	amqp_field_value_t value;
+} amqp_table_entry_t;
+
+typedef enum {
+	AMQP_FIELD_KIND_BOOLEAN = 't',
+	AMQP_FIELD_KIND_I8 = 'b',
+	AMQP_FIELD_KIND_U8 = 'B',
+	AMQP_FIELD_KIND_I16 = 's',
+	AMQP_FIELD_KIND_U16 = 'u',
+	AMQP_FIELD_KIND_I32 = 'I',
+	AMQP_FIELD_KIND_U32 = 'i',
+	AMQP_FIELD_KIND_I64 = 'l',
+	AMQP_FIELD_KIND_U64 = 'L',
+	AMQP_FIELD_KIND_F32 = 'f',
+	AMQP_FIELD_KIND_F64 = 'd',
+	AMQP_FIELD_KIND_DECIMAL = 'D',
+	AMQP_FIELD_KIND_UTF8 = 'S',
+	AMQP_FIELD_KIND_ARRAY = 'A',
+	AMQP_FIELD_KIND_TIMESTAMP = 'T',
+	AMQP_FIELD_KIND_TABLE = 'F',
+	AMQP_FIELD_KIND_VOID = 'V',
+	AMQP_FIELD_KIND_BYTES = 'x',
+} amqp_field_value_kind_t;
+
+#define AMQP_BASIC_CONTENT_TYPE_FLAG (1 << 15)
+#define AMQP_BASIC_CONTENT_ENCODING_FLAG (1 << 14)
+#define AMQP_BASIC_HEADERS_FLAG (1 << 13)
+#define AMQP_BASIC_DELIVERY_MODE_FLAG (1 << 12)
+#define AMQP_BASIC_PRIORITY_FLAG (1 << 11)
+#define AMQP_BASIC_CORRELATION_ID_FLAG (1 << 10)
+#define AMQP_BASIC_REPLY_TO_FLAG (1 << 9)
+#define AMQP_BASIC_EXPIRATION_FLAG (1 << 8)
+#define AMQP_BASIC_MESSAGE_ID_FLAG (1 << 7)
+#define AMQP_BASIC_TIMESTAMP_FLAG (1 << 6)
+#define AMQP_BASIC_TYPE_FLAG (1 << 5)
+#define AMQP_BASIC_USER_ID_FLAG (1 << 4)
+#define AMQP_BASIC_APP_ID_FLAG (1 << 3)
+#define AMQP_BASIC_CLUSTER_ID_FLAG (1 << 2)
+
+typedef struct amqp_basic_properties_t_ {
+	uint32_t _flags;
+	amqp_bytes_t content_type;
+	amqp_bytes_t content_encoding;
+	amqp_table_t headers;
+	uint8_t delivery_mode;
+	uint8_t priority;
+	amqp_bytes_t correlation_id;
+	amqp_bytes_t reply_to;
+	amqp_bytes_t expiration;
+	amqp_bytes_t message_id;
+	uint64_t timestamp;
+	amqp_bytes_t type;
+	amqp_bytes_t user_id;
+	amqp_bytes_t app_id;
+	amqp_bytes_t cluster_id;
+} amqp_basic_properties_t;
+
+amqp_bytes_t amqp_cstring_bytes(char const *cstr);
+
+#endif /* AMQP_H */
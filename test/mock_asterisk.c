@@ -0,0 +1,2853 @@
+/*
+ * Asterisk -- An open source telephony toolkit.
+ *
+ * See http://www.asterisk.org for more information about
+ * the Asterisk project.
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2. See the LICENSE file
+ * at the top of the source tree.
+ */
+
+/*! \file
+ *
+ * \brief The parts of the Asterisk core cdr_amqp.c uses, for the tests.
+ *
+ * These behave like the real thing wherever the module depends on it:
+ * reference counts, taskprocessors that drain their queue when released,
+ * scheduler entries that are waited for when deleted, and configuration
+ * that only replaces the running one once pre_apply_config accepts it.
+ */
+
+#include "asterisk.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <math.h>
+#include <stdarg.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "asterisk/astobj2.h"
+#include "asterisk/cdr.h"
+#include "asterisk/cli.h"
+#include "asterisk/config_options.h"
+#include "asterisk/http.h"
+#include "asterisk/json.h"
+#include "asterisk/lock.h"
+#include "asterisk/manager.h"
+#include "asterisk/options.h"
+#include "asterisk/paths.h"
+#include "asterisk/sched.h"
+#include "asterisk/stringfields.h"
+#include "asterisk/taskprocessor.h"
+#include "asterisk/threadpool.h"
+
+#include "mock_asterisk.h"
+
+char ast_config_AST_SYSTEM_NAME[AST_MAX_SYSTEM_NAME] = "";
+const char *ast_config_AST_SPOOL_DIR = "/tmp";
+struct ast_eid ast_eid_default = { { 0x02, 0x42, 0xac, 0x11, 0x00, 0x02 } };
+
+/* Logging */
+
+static int log_counts[5];
+
+void ast_log(int level, const char *file, int line, const char *function,
+	const char *fmt, ...)
+{
+	static const char * const names[] = { "DEBUG", "", "NOTICE", "WARNING", "ERROR" };
+	va_list ap;
+
+	if (level >= 0 && level < (int) ARRAY_LEN(log_counts)) {
+		__atomic_fetch_add(&log_counts[level], 1, __ATOMIC_RELAXED);
+	}
+
+	if (!getenv("CDR_AMQP_TEST_VERBOSE")) {
+		return;
+	}
+
+	fprintf(stderr, "[%s] %s:%d %s: ", names[level], file, line, function);
+	va_start(ap, fmt);
+	vfprintf(stderr, fmt, ap);
+	va_end(ap);
+}
+
+int mock_log_count(int level)
+{
+	return __atomic_load_n(&log_counts[level], __ATOMIC_RELAXED);
+}
+
+void ast_assert_failed(const char *condition, const char *file, int line,
+	const char *function)
+{
+	fprintf(stderr, "%s:%d %s: assertion '%s' failed\n", file, line, function, condition);
+	abort();
+}
+
+/* Utilities */
+
+void ast_free(void *ptr)
+{
+	free(ptr);
+}
+
+int ast_asprintf(char **ret, const char *fmt, ...)
+{
+	va_list ap;
+	int res;
+
+	va_start(ap, fmt);
+	res = vasprintf(ret, fmt, ap);
+	va_end(ap);
+
+	return res;
+}
+
+int ast_mkdir(const char *path, int mode)
+{
+	char *copy = ast_strdupa(path);
+	char *slash = copy;
+
+	while ((slash = strchr(slash + 1, '/'))) {
+		*slash = '\0';
+		if (mkdir(copy, mode) != 0 && errno != EEXIST) {
+			return errno;
+		}
+		*slash = '/';
+	}
+	if (mkdir(copy, mode) != 0 && errno != EEXIST) {
+		return errno;
+	}
+
+	return 0;
+}
+
+char *ast_eid_to_str(char *s, int maxlen, struct ast_eid *eid)
+{
+	snprintf(s, maxlen, "%02x:%02x:%02x:%02x:%02x:%02x",
+		eid->eid[0], eid->eid[1], eid->eid[2], eid->eid[3], eid->eid[4], eid->eid[5]);
+	return s;
+}
+
+char *ast_skip_blanks(const char *str)
+{
+	while (*str && ((unsigned char) *str) < 33) {
+		str++;
+	}
+	return (char *) str;
+}
+
+char *ast_trim_blanks(char *str)
+{
+	char *work = str;
+
+	if (work) {
+		work += strlen(work) - 1;
+		while ((work >= str) && ((unsigned char) *work) < 33) {
+			*(work--) = '\0';
+		}
+	}
+	return str;
+}
+
+char *ast_strip(char *s)
+{
+	if ((s = ast_skip_blanks(s))) {
+		ast_trim_blanks(s);
+	}
+	return s;
+}
+
+void ast_copy_string(char *dst, const char *src, size_t size)
+{
+	snprintf(dst, size, "%s", src);
+}
+
+int ast_true(const char *s)
+{
+	if (ast_strlen_zero(s)) {
+		return 0;
+	}
+
+	return !strcasecmp(s, "yes") || !strcasecmp(s, "true") || !strcasecmp(s, "y")
+		|| !strcasecmp(s, "t") || !strcasecmp(s, "1") || !strcasecmp(s, "on");
+}
+
+int ast_false(const char *s)
+{
+	if (ast_strlen_zero(s)) {
+		return 0;
+	}
+
+	return !strcasecmp(s, "no") || !strcasecmp(s, "false") || !strcasecmp(s, "n")
+		|| !strcasecmp(s, "f") || !strcasecmp(s, "0") || !strcasecmp(s, "off");
+}
+
+struct ast_str {
+	size_t len;
+	size_t used;
+	char str[0];
+};
+
+struct ast_str *ast_str_create(size_t init_len)
+{
+	struct ast_str *buf = calloc(1, sizeof(*buf) + init_len);
+
+	if (buf) {
+		buf->len = init_len;
+	}
+	return buf;
+}
+
+char *ast_str_buffer(const struct ast_str *buf)
+{
+	return (char *) buf->str;
+}
+
+size_t ast_str_strlen(const struct ast_str *buf)
+{
+	return buf->used;
+}
+
+void ast_str_reset(struct ast_str *buf)
+{
+	buf->used = 0;
+	if (buf->len) {
+		buf->str[0] = '\0';
+	}
+}
+
+static int str_vappend(struct ast_str **buf, const char *fmt, va_list ap)
+{
+	for (;;) {
+		va_list aq;
+		int res;
+
+		va_copy(aq, ap);
+		res = vsnprintf((*buf)->str + (*buf)->used, (*buf)->len - (*buf)->used, fmt, aq);
+		va_end(aq);
+		if (res < 0) {
+			return -1;
+		}
+		if ((size_t) res < (*buf)->len - (*buf)->used) {
+			(*buf)->used += res;
+			return res;
+		} else {
+			size_t len = (*buf)->used + res + 1;
+			struct ast_str *grown = realloc(*buf, sizeof(**buf) + len);
+
+			if (!grown) {
+				return -1;
+			}
+			grown->len = len;
+			*buf = grown;
+		}
+	}
+}
+
+int ast_str_set(struct ast_str **buf, ssize_t max_len, const char *fmt, ...)
+{
+	va_list ap;
+	int res;
+
+	ast_str_reset(*buf);
+	va_start(ap, fmt);
+	res = str_vappend(buf, fmt, ap);
+	va_end(ap);
+
+	return res;
+}
+
+int ast_str_append(struct ast_str **buf, ssize_t max_len, const char *fmt, ...)
+{
+	va_list ap;
+	int res;
+
+	va_start(ap, fmt);
+	res = str_vappend(buf, fmt, ap);
+	va_end(ap);
+
+	return res;
+}
+
+/* Time */
+
+struct ast_tm *ast_localtime(const struct timeval *timep, struct ast_tm *p_tm, const char *zone)
+{
+	struct tm tm;
+	time_t t = timep->tv_sec;
+
+	if (!localtime_r(&t, &tm)) {
+		return NULL;
+	}
+
+	p_tm->tm_sec = tm.tm_sec;
+	p_tm->tm_min = tm.tm_min;
+	p_tm->tm_hour = tm.tm_hour;
+	p_tm->tm_mday = tm.tm_mday;
+	p_tm->tm_mon = tm.tm_mon;
+	p_tm->tm_year = tm.tm_year;
+	p_tm->tm_wday = tm.tm_wday;
+	p_tm->tm_yday = tm.tm_yday;
+	p_tm->tm_isdst = tm.tm_isdst;
+	p_tm->tm_gmtoff = tm.tm_gmtoff;
+	p_tm->tm_zone = (char *) tm.tm_zone;
+	p_tm->tm_usec = timep->tv_usec;
+
+	return p_tm;
+}
+
+int ast_strftime(char *buf, size_t len, const char *format, const struct ast_tm *tm)
+{
+	char fmt[256];
+	size_t used = 0;
+	struct tm t = {
+		.tm_sec = tm->tm_sec,
+		.tm_min = tm->tm_min,
+		.tm_hour = tm->tm_hour,
+		.tm_mday = tm->tm_mday,
+		.tm_mon = tm->tm_mon,
+		.tm_year = tm->tm_year,
+		.tm_wday = tm->tm_wday,
+		.tm_yday = tm->tm_yday,
+		.tm_isdst = tm->tm_isdst,
+		.tm_gmtoff = tm->tm_gmtoff,
+		.tm_zone = tm->tm_zone,
+	};
+	const char *p;
+
+	/* Replace %q, which strftime() does not know, before handing over */
+	for (p = format; *p && used < sizeof(fmt) - 8; ++p) {
+		int decimals = -1;
+		long fraction;
+		int i;
+
+		if (p[0] != '%') {
+			fmt[used++] = *p;
+			continue;
+		}
+		if (p[1] >= '1' && p[1] <= '6' && p[2] == 'q') {
+			decimals = p[1] - '0';
+			++p;
+		}
+		if (p[1] != 'q') {
+			fmt[used++] = *p++;
+			fmt[used++] = *p;
+			continue;
+		}
+		if (decimals == -1) {
+			decimals = 3;
+		}
+		for (i = 6, fraction = tm->tm_usec; i > decimals; i--) {
+			fraction /= 10;
+		}
+		used += snprintf(fmt + used, sizeof(fmt) - used, "%0*ld", decimals, fraction);
+		++p;
+	}
+	fmt[used] = '\0';
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wformat-nonliteral"
+	return strftime(buf, len, fmt, &t);
+#pragma GCC diagnostic pop
+}
+
+/* Configuration parsing */
+
+int ast_parse_arg(const char *arg, enum ast_parse_flags flags, void *result, ...)
+{
+	va_list ap;
+	long long value;
+	long long low;
+	long long high;
+	char *end;
+	int error = 0;
+
+	if (ast_strlen_zero(arg)) {
+		return -1;
+	}
+
+	errno = 0;
+	value = strtoll(arg, &end, 0);
+	if (errno || *ast_skip_blanks(end) || end == arg) {
+		error = 1;
+	}
+
+	va_start(ap, result);
+	switch (flags & PARSE_TYPE) {
+	case PARSE_INT32:
+		low = INT_MIN;
+		high = INT_MAX;
+		if (flags & (PARSE_IN_RANGE | PARSE_OUT_RANGE)) {
+			low = va_arg(ap, int32_t);
+			high = va_arg(ap, int32_t);
+		}
+		break;
+	case PARSE_UINT32:
+		low = 0;
+		high = UINT_MAX;
+		if (flags & (PARSE_IN_RANGE | PARSE_OUT_RANGE)) {
+			low = va_arg(ap, uint32_t);
+			high = va_arg(ap, uint32_t);
+		}
+		/* strtoll() would take a sign */
+		if (*ast_skip_blanks(arg) == '-') {
+			error = 1;
+		}
+		break;
+	default:
+		va_end(ap);
+		return -1;
+	}
+	va_end(ap);
+
+	if ((flags & PARSE_OUT_RANGE) ? (value >= low && value <= high)
+		: (value < low || value > high)) {
+		error = 1;
+	}
+	if (error) {
+		return -1;
+	}
+
+	if ((flags & PARSE_TYPE) == PARSE_INT32) {
+		*(int32_t *) result = value;
+	} else {
+		*(uint32_t *) result = value;
+	}
+	return 0;
+}
+
+/* String fields */
+
+struct ast_string_field_pool {
+	struct ast_string_field_pool *prev;
+	char base[0];
+};
+
+int __ast_string_field_init(struct ast_string_field_mgr *mgr,
+	struct ast_string_field_pool **pool_head, const char **first, const char **end)
+{
+	const char **field;
+
+	mgr->sets = 0;
+	*pool_head = NULL;
+	for (field = first; field < end; ++field) {
+		*field = "";
+	}
+
+	return 0;
+}
+
+void __ast_string_field_free_memory(struct ast_string_field_pool **pool_head)
+{
+	while (*pool_head) {
+		struct ast_string_field_pool *prev = (*pool_head)->prev;
+
+		free(*pool_head);
+		*pool_head = prev;
+	}
+}
+
+int __ast_string_field_set(struct ast_string_field_mgr *mgr,
+	struct ast_string_field_pool **pool_head, const char **field, const char *value)
+{
+	struct ast_string_field_pool *pool;
+	size_t len = strlen(value ? value : "") + 1;
+
+	pool = malloc(sizeof(*pool) + len);
+	if (!pool) {
+		return -1;
+	}
+	memcpy(pool->base, value ? value : "", len);
+	pool->prev = *pool_head;
+	*pool_head = pool;
+	*field = pool->base;
+	++mgr->sets;
+
+	return 0;
+}
+
+/* astobj2 */
+
+#define AO2_MAGIC 0xa570b123
+
+struct astobj2 {
+	uint32_t magic;
+	int ref_counter;
+	ao2_destructor_fn destructor_fn;
+	unsigned int options;
+	pthread_mutex_t lock;
+	void *user_data[0];
+};
+
+static int ao2_objects;
+
+int mock_ao2_objects(void)
+{
+	return __atomic_load_n(&ao2_objects, __ATOMIC_ACQUIRE);
+}
+
+static struct astobj2 *INTERNAL_OBJ(void *user_data)
+{
+	struct astobj2 *p;
+
+	if (!user_data) {
+		fprintf(stderr, "ao2: NULL object\n");
+		abort();
+	}
+	p = (struct astobj2 *) ((char *) user_data - sizeof(*p));
+	if (p->magic != AO2_MAGIC) {
+		fprintf(stderr, "ao2: bad magic number 0x%x for object %p\n", p->magic, user_data);
+		abort();
+	}
+	return p;
+}
+
+void *ao2_alloc_options(size_t data_size, ao2_destructor_fn destructor_fn, unsigned int options)
+{
+	struct astobj2 *obj = calloc(1, sizeof(*obj) + data_size);
+
+	if (!obj) {
+		return NULL;
+	}
+	obj->magic = AO2_MAGIC;
+	obj->ref_counter = 1;
+	obj->destructor_fn = destructor_fn;
+	obj->options = options;
+	pthread_mutex_init(&obj->lock, NULL);
+	__atomic_fetch_add(&ao2_objects, 1, __ATOMIC_RELAXED);
+
+	return obj->user_data;
+}
+
+int ao2_ref(void *user_data, int delta)
+{
+	struct astobj2 *obj = INTERNAL_OBJ(user_data);
+	int current;
+
+	current = __atomic_fetch_add(&obj->ref_counter, delta, __ATOMIC_ACQ_REL);
+	if (current + delta < 0) {
+		fprintf(stderr, "ao2: invalid refcount %d on object %p\n", current + delta, user_data);
+		abort();
+	}
+	if (current + delta == 0) {
+		if (obj->destructor_fn) {
+			obj->destructor_fn(user_data);
+		}
+		pthread_mutex_destroy(&obj->lock);
+		obj->magic = 0;
+		free(obj);
+		__atomic_fetch_sub(&ao2_objects, 1, __ATOMIC_RELEASE);
+	}
+
+	return current;
+}
+
+void ao2_cleanup(void *obj)
+{
+	if (obj) {
+		ao2_ref(obj, -1);
+	}
+}
+
+int ao2_ref_count(void *obj)
+{
+	return __atomic_load_n(&INTERNAL_OBJ(obj)->ref_counter, __ATOMIC_ACQUIRE);
+}
+
+int ao2_lock(void *a)
+{
+	return pthread_mutex_lock(&INTERNAL_OBJ(a)->lock);
+}
+
+int ao2_unlock(void *a)
+{
+	return pthread_mutex_unlock(&INTERNAL_OBJ(a)->lock);
+}
+
+void *__ao2_global_obj_ref(struct ao2_global_obj *holder)
+{
+	void *obj;
+
+	pthread_rwlock_rdlock(&holder->lock);
+	obj = holder->obj;
+	if (obj) {
+		ao2_ref(obj, +1);
+	}
+	pthread_rwlock_unlock(&holder->lock);
+
+	return obj;
+}
+
+void *__ao2_global_obj_replace(struct ao2_global_obj *holder, void *obj)
+{
+	void *old;
+
+	if (obj) {
+		ao2_ref(obj, +1);
+	}
+	pthread_rwlock_wrlock(&holder->lock);
+	old = holder->obj;
+	holder->obj = obj;
+	pthread_rwlock_unlock(&holder->lock);
+
+	return old;
+}
+
+int __ao2_global_obj_replace_unref(struct ao2_global_obj *holder, void *obj)
+{
+	void *old = __ao2_global_obj_replace(holder, obj);
+
+	if (old) {
+		ao2_ref(old, -1);
+		return 1;
+	}
+	return 0;
+}
+
+struct ao2_container {
+	pthread_mutex_t lock;
+	ao2_callback_fn *cmp_fn;
+	void **objs;
+	size_t count;
+	size_t size;
+};
+
+static void container_dtor(void *obj)
+{
+	struct ao2_container *c = obj;
+	size_t i;
+
+	for (i = 0; i < c->count; ++i) {
+		ao2_ref(c->objs[i], -1);
+	}
+	free(c->objs);
+	pthread_mutex_destroy(&c->lock);
+}
+
+struct ao2_container *ao2_container_alloc_list(unsigned int ao2_options,
+	unsigned int container_options, ao2_sort_fn *sort_fn, ao2_callback_fn *cmp_fn)
+{
+	struct ao2_container *c = ao2_alloc_options(sizeof(*c), container_dtor, ao2_options);
+
+	if (!c) {
+		return NULL;
+	}
+	pthread_mutex_init(&c->lock, NULL);
+	c->cmp_fn = cmp_fn;
+
+	return c;
+}
+
+int ao2_container_count(struct ao2_container *c)
+{
+	int count;
+
+	pthread_mutex_lock(&c->lock);
+	count = c->count;
+	pthread_mutex_unlock(&c->lock);
+
+	return count;
+}
+
+int ao2_link(struct ao2_container *c, void *obj)
+{
+	pthread_mutex_lock(&c->lock);
+	if (c->count == c->size) {
+		size_t size = c->size ? c->size * 2 : 8;
+		void **objs = realloc(c->objs, size * sizeof(*objs));
+
+		if (!objs) {
+			pthread_mutex_unlock(&c->lock);
+			return 0;
+		}
+		c->objs = objs;
+		c->size = size;
+	}
+	c->objs[c->count++] = obj;
+	ao2_ref(obj, +1);
+	pthread_mutex_unlock(&c->lock);
+
+	return 1;
+}
+
+static int cb_true(void *obj, void *arg, int flags)
+{
+	return CMP_MATCH;
+}
+
+static int cb_identity(void *obj, void *arg, int flags)
+{
+	return obj == arg ? CMP_MATCH | CMP_STOP : 0;
+}
+
+void *ao2_callback(struct ao2_container *c, enum search_flags flags,
+	ao2_callback_fn *cb_fn, void *arg)
+{
+	void **unlinked = NULL;
+	size_t unlinked_count = 0;
+	void *found = NULL;
+	size_t i;
+
+	if (!cb_fn) {
+		cb_fn = cb_true;
+	}
+
+	pthread_mutex_lock(&c->lock);
+	for (i = 0; i < c->count;) {
+		void *obj = c->objs[i];
+		int res = cb_fn(obj, arg, flags);
+
+		if (!(res & CMP_MATCH)) {
+			if (res & CMP_STOP) {
+				break;
+			}
+			++i;
+			continue;
+		}
+
+		if (!(flags & OBJ_NODATA) && !found) {
+			found = obj;
+			ao2_ref(obj, +1);
+		}
+		if (flags & OBJ_UNLINK) {
+			void **grown = realloc(unlinked, (unlinked_count + 1) * sizeof(*grown));
+
+			if (!grown) {
+				break;
+			}
+			unlinked = grown;
+			unlinked[unlinked_count++] = obj;
+			memmove(&c->objs[i], &c->objs[i + 1], (c->count - i - 1) * sizeof(*c->objs));
+			--c->count;
+		} else {
+			++i;
+		}
+		if ((res & CMP_STOP) || !(flags & OBJ_MULTIPLE)) {
+			break;
+		}
+	}
+	pthread_mutex_unlock(&c->lock);
+
+	/* Outside the lock, since these can run destructors */
+	for (i = 0; i < unlinked_count; ++i) {
+		ao2_ref(unlinked[i], -1);
+	}
+	free(unlinked);
+
+	return found;
+}
+
+void *ao2_find(struct ao2_container *c, const void *arg, enum search_flags flags)
+{
+	return ao2_callback(c, flags, c->cmp_fn, (void *) arg);
+}
+
+void *ao2_unlink(struct ao2_container *c, void *obj)
+{
+	ao2_callback(c, OBJ_UNLINK | OBJ_NODATA, cb_identity, obj);
+	return NULL;
+}
+
+struct ao2_iterator ao2_iterator_init(struct ao2_container *c, int flags)
+{
+	struct ao2_iterator iter = { NULL, 0, 0 };
+	size_t i;
+
+	pthread_mutex_lock(&c->lock);
+	iter.objs = calloc(c->count ? c->count : 1, sizeof(*iter.objs));
+	if (iter.objs) {
+		for (i = 0; i < c->count; ++i) {
+			iter.objs[i] = c->objs[i];
+			ao2_ref(iter.objs[i], +1);
+		}
+		iter.count = c->count;
+	}
+	pthread_mutex_unlock(&c->lock);
+
+	return iter;
+}
+
+void *ao2_iterator_next(struct ao2_iterator *iter)
+{
+	if (iter->next == iter->count) {
+		return NULL;
+	}
+	return ao2_bump(iter->objs[iter->next++]);
+}
+
+void ao2_iterator_destroy(struct ao2_iterator *iter)
+{
+	size_t i;
+
+	for (i = 0; i < iter->count; ++i) {
+		ao2_ref(iter->objs[i], -1);
+	}
+	free(iter->objs);
+	iter->objs = NULL;
+	iter->count = iter->next = 0;
+}
+
+/* Taskprocessors */
+
+struct tps_task {
+	int (*fn)(void *data);
+	void *data;
+	struct tps_task *next;
+};
+
+struct ast_taskprocessor {
+	char name[AST_TASKPROCESSOR_MAX_NAME + 1];
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	pthread_t thread;
+	struct tps_task *head;
+	struct tps_task *tail;
+	long size;
+	int refs;
+	int dead;
+	struct ast_taskprocessor *next;
+};
+
+/*! \brief Live taskprocessors, shared by name like the real registry */
+static struct ast_taskprocessor *tps_list;
+static pthread_mutex_t tps_list_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct tps_task *tps_pop(struct ast_taskprocessor *tps)
+{
+	struct tps_task *task = tps->head;
+
+	if (task) {
+		tps->head = task->next;
+		if (!tps->head) {
+			tps->tail = NULL;
+		}
+		--tps->size;
+	}
+	return task;
+}
+
+static void *tps_thread(void *data)
+{
+	struct ast_taskprocessor *tps = data;
+
+	pthread_mutex_lock(&tps->lock);
+	for (;;) {
+		struct tps_task *task = tps_pop(tps);
+
+		if (!task) {
+			if (tps->dead) {
+				break;
+			}
+			pthread_cond_wait(&tps->cond, &tps->lock);
+			continue;
+		}
+		pthread_mutex_unlock(&tps->lock);
+		task->fn(task->data);
+		free(task);
+		pthread_mutex_lock(&tps->lock);
+	}
+	pthread_mutex_unlock(&tps->lock);
+
+	return NULL;
+}
+
+struct ast_taskprocessor *ast_taskprocessor_get(const char *name, enum ast_tps_options create)
+{
+	struct ast_taskprocessor *tps;
+
+	pthread_mutex_lock(&tps_list_lock);
+	for (tps = tps_list; tps; tps = tps->next) {
+		if (!strcmp(tps->name, name)) {
+			++tps->refs;
+			pthread_mutex_unlock(&tps_list_lock);
+			return tps;
+		}
+	}
+	if (create & TPS_REF_IF_EXISTS) {
+		pthread_mutex_unlock(&tps_list_lock);
+		return NULL;
+	}
+
+	tps = calloc(1, sizeof(*tps));
+	if (!tps) {
+		pthread_mutex_unlock(&tps_list_lock);
+		return NULL;
+	}
+	ast_copy_string(tps->name, name, sizeof(tps->name));
+	pthread_mutex_init(&tps->lock, NULL);
+	pthread_cond_init(&tps->cond, NULL);
+	tps->refs = 1;
+	if (pthread_create(&tps->thread, NULL, tps_thread, tps) != 0) {
+		free(tps);
+		pthread_mutex_unlock(&tps_list_lock);
+		return NULL;
+	}
+	tps->next = tps_list;
+	tps_list = tps;
+	pthread_mutex_unlock(&tps_list_lock);
+
+	return tps;
+}
+
+void *ast_taskprocessor_unreference(struct ast_taskprocessor *tps)
+{
+	struct ast_taskprocessor **prev;
+
+	pthread_mutex_lock(&tps_list_lock);
+	if (--tps->refs) {
+		pthread_mutex_unlock(&tps_list_lock);
+		return NULL;
+	}
+	for (prev = &tps_list; *prev != tps; prev = &(*prev)->next) {
+	}
+	*prev = tps->next;
+	pthread_mutex_unlock(&tps_list_lock);
+
+	if (pthread_equal(tps->thread, pthread_self())) {
+		fprintf(stderr, "taskprocessor %s released by its own thread\n", tps->name);
+		abort();
+	}
+
+	/* Like the default listener: run what is queued, then exit */
+	pthread_mutex_lock(&tps->lock);
+	tps->dead = 1;
+	pthread_cond_signal(&tps->cond);
+	pthread_mutex_unlock(&tps->lock);
+	pthread_join(tps->thread, NULL);
+
+	pthread_cond_destroy(&tps->cond);
+	pthread_mutex_destroy(&tps->lock);
+	free(tps);
+
+	return NULL;
+}
+
+int ast_taskprocessor_push(struct ast_taskprocessor *tps, int (*task_exe)(void *datap), void *datap)
+{
+	struct tps_task *task;
+
+	if (!tps || !task_exe) {
+		return -1;
+	}
+	if (mock_tps_push_fail) {
+		return -1;
+	}
+
+	task = malloc(sizeof(*task));
+	if (!task) {
+		return -1;
+	}
+	task->fn = task_exe;
+	task->data = datap;
+	task->next = NULL;
+
+	pthread_mutex_lock(&tps->lock);
+	if (tps->dead) {
+		pthread_mutex_unlock(&tps->lock);
+		free(task);
+		return -1;
+	}
+	if (tps->tail) {
+		tps->tail->next = task;
+	} else {
+		tps->head = task;
+	}
+	tps->tail = task;
+	++tps->size;
+	pthread_cond_signal(&tps->cond);
+	pthread_mutex_unlock(&tps->lock);
+
+	return 0;
+}
+
+long ast_taskprocessor_size(struct ast_taskprocessor *tps)
+{
+	long size;
+
+	pthread_mutex_lock(&tps->lock);
+	size = tps->size;
+	pthread_mutex_unlock(&tps->lock);
+
+	return size;
+}
+
+int ast_taskprocessor_is_task(struct ast_taskprocessor *tps)
+{
+	return pthread_equal(tps->thread, pthread_self());
+}
+
+const char *ast_taskprocessor_name(struct ast_taskprocessor *tps)
+{
+	return tps->name;
+}
+
+int mock_tps_push_fail;
+
+/* Threadpools */
+
+struct ast_threadpool {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct tps_task *head;
+	struct tps_task *tail;
+	/*! \brief threads wanted */
+	unsigned int size;
+	/*! \brief threads running */
+	unsigned int running;
+	int shutdown;
+	pthread_t *threads;
+	size_t thread_count;
+};
+
+static void *threadpool_thread(void *data)
+{
+	struct ast_threadpool *pool = data;
+
+	pthread_mutex_lock(&pool->lock);
+	for (;;) {
+		struct tps_task *task;
+
+		if (pool->running > pool->size) {
+			break;
+		}
+		task = pool->head;
+		if (!task) {
+			if (pool->shutdown) {
+				break;
+			}
+			pthread_cond_wait(&pool->cond, &pool->lock);
+			continue;
+		}
+		pool->head = task->next;
+		if (!pool->head) {
+			pool->tail = NULL;
+		}
+		pthread_mutex_unlock(&pool->lock);
+		task->fn(task->data);
+		free(task);
+		pthread_mutex_lock(&pool->lock);
+	}
+	--pool->running;
+	pthread_mutex_unlock(&pool->lock);
+
+	return NULL;
+}
+
+/*! \brief Start threads until \a pool has its size; called with the lock held */
+static void threadpool_grow(struct ast_threadpool *pool)
+{
+	while (pool->running < pool->size) {
+		pthread_t *threads = realloc(pool->threads,
+			(pool->thread_count + 1) * sizeof(*threads));
+
+		if (!threads) {
+			return;
+		}
+		pool->threads = threads;
+		if (pthread_create(&pool->threads[pool->thread_count], NULL,
+				threadpool_thread, pool) != 0) {
+			return;
+		}
+		++pool->thread_count;
+		++pool->running;
+	}
+}
+
+struct ast_threadpool *ast_threadpool_create(const char *name,
+	struct ast_threadpool_listener *listener,
+	const struct ast_threadpool_options *options)
+{
+	struct ast_threadpool *pool = calloc(1, sizeof(*pool));
+
+	if (!pool) {
+		return NULL;
+	}
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->cond, NULL);
+
+	pthread_mutex_lock(&pool->lock);
+	pool->size = options->initial_size;
+	threadpool_grow(pool);
+	pthread_mutex_unlock(&pool->lock);
+
+	return pool;
+}
+
+void ast_threadpool_set_size(struct ast_threadpool *pool, unsigned int size)
+{
+	pthread_mutex_lock(&pool->lock);
+	pool->size = size;
+	threadpool_grow(pool);
+	/* Surplus threads notice and exit */
+	pthread_cond_broadcast(&pool->cond);
+	pthread_mutex_unlock(&pool->lock);
+}
+
+int ast_threadpool_push(struct ast_threadpool *pool, int (*task_fn)(void *data), void *data)
+{
+	struct tps_task *task = malloc(sizeof(*task));
+
+	if (!task) {
+		return -1;
+	}
+	task->fn = task_fn;
+	task->data = data;
+	task->next = NULL;
+
+	pthread_mutex_lock(&pool->lock);
+	if (pool->shutdown || !pool->running) {
+		pthread_mutex_unlock(&pool->lock);
+		free(task);
+		return -1;
+	}
+	if (pool->tail) {
+		pool->tail->next = task;
+	} else {
+		pool->head = task;
+	}
+	pool->tail = task;
+	pthread_cond_signal(&pool->cond);
+	pthread_mutex_unlock(&pool->lock);
+
+	return 0;
+}
+
+void ast_threadpool_shutdown(struct ast_threadpool *pool)
+{
+	size_t i;
+
+	if (!pool) {
+		return;
+	}
+
+	pthread_mutex_lock(&pool->lock);
+	pool->shutdown = 1;
+	pthread_cond_broadcast(&pool->cond);
+	pthread_mutex_unlock(&pool->lock);
+
+	for (i = 0; i < pool->thread_count; ++i) {
+		pthread_join(pool->threads[i], NULL);
+	}
+	free(pool->threads);
+	pthread_cond_destroy(&pool->cond);
+	pthread_mutex_destroy(&pool->lock);
+	free(pool);
+}
+
+unsigned int mock_threadpool_running(struct ast_threadpool *pool)
+{
+	unsigned int running;
+
+	pthread_mutex_lock(&pool->lock);
+	running = pool->running;
+	pthread_mutex_unlock(&pool->lock);
+
+	return running;
+}
+
+/* Scheduler */
+
+struct sched_entry {
+	int id;
+	struct timeval when;
+	int interval;
+	ast_sched_cb callback;
+	const void *data;
+	struct sched_entry *next;
+};
+
+struct ast_sched_context {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	pthread_t thread;
+	int running;
+	int stop;
+	int next_id;
+	struct sched_entry *entries;
+	/*! \brief id of the entry being run; -1 if none */
+	int executing;
+	pthread_cond_t executed;
+};
+
+struct ast_sched_context *ast_sched_context_create(void)
+{
+	struct ast_sched_context *con = calloc(1, sizeof(*con));
+
+	if (!con) {
+		return NULL;
+	}
+	pthread_mutex_init(&con->lock, NULL);
+	pthread_cond_init(&con->cond, NULL);
+	pthread_cond_init(&con->executed, NULL);
+	con->executing = -1;
+
+	return con;
+}
+
+static struct timeval tv_add_ms(struct timeval tv, int ms)
+{
+	tv.tv_sec += ms / 1000;
+	tv.tv_usec += (ms % 1000) * 1000;
+	if (tv.tv_usec >= 1000000) {
+		++tv.tv_sec;
+		tv.tv_usec -= 1000000;
+	}
+	return tv;
+}
+
+static int tv_cmp(struct timeval a, struct timeval b)
+{
+	if (a.tv_sec != b.tv_sec) {
+		return a.tv_sec < b.tv_sec ? -1 : 1;
+	}
+	return a.tv_usec < b.tv_usec ? -1 : a.tv_usec > b.tv_usec;
+}
+
+/*! \brief Insert \a entry in time order; called with the lock held */
+static void sched_insert(struct ast_sched_context *con, struct sched_entry *entry)
+{
+	struct sched_entry **pos;
+
+	for (pos = &con->entries; *pos && tv_cmp((*pos)->when, entry->when) <= 0;
+		pos = &(*pos)->next) {
+	}
+	entry->next = *pos;
+	*pos = entry;
+	pthread_cond_signal(&con->cond);
+}
+
+static void *sched_thread(void *data)
+{
+	struct ast_sched_context *con = data;
+
+	pthread_mutex_lock(&con->lock);
+	while (!con->stop) {
+		struct sched_entry *entry = con->entries;
+		struct timeval now = ast_tvnow();
+		int res;
+
+		if (!entry) {
+			pthread_cond_wait(&con->cond, &con->lock);
+			continue;
+		}
+		if (tv_cmp(entry->when, now) > 0) {
+			struct timespec ts = {
+				.tv_sec = entry->when.tv_sec,
+				.tv_nsec = entry->when.tv_usec * 1000,
+			};
+
+			pthread_cond_timedwait(&con->cond, &con->lock, &ts);
+			continue;
+		}
+
+		con->entries = entry->next;
+		con->executing = entry->id;
+		pthread_mutex_unlock(&con->lock);
+		res = entry->callback(entry->data);
+		pthread_mutex_lock(&con->lock);
+
+		/* Deleted while it ran, if it is no longer the one executing */
+		if (res && con->executing == entry->id) {
+			entry->when = tv_add_ms(ast_tvnow(), entry->interval);
+			sched_insert(con, entry);
+		} else {
+			free(entry);
+		}
+		con->executing = -1;
+		pthread_cond_broadcast(&con->executed);
+	}
+	pthread_mutex_unlock(&con->lock);
+
+	return NULL;
+}
+
+int ast_sched_start_thread(struct ast_sched_context *con)
+{
+	if (pthread_create(&con->thread, NULL, sched_thread, con) != 0) {
+		return -1;
+	}
+	con->running = 1;
+	return 0;
+}
+
+int ast_sched_add(struct ast_sched_context *con, int when, ast_sched_cb callback, const void *data)
+{
+	struct sched_entry *entry;
+	int id;
+
+	if (!con) {
+		return -1;
+	}
+	entry = calloc(1, sizeof(*entry));
+	if (!entry) {
+		return -1;
+	}
+	entry->when = tv_add_ms(ast_tvnow(), when);
+	entry->interval = when;
+	entry->callback = callback;
+	entry->data = data;
+
+	pthread_mutex_lock(&con->lock);
+	id = entry->id = con->next_id++;
+	sched_insert(con, entry);
+	pthread_mutex_unlock(&con->lock);
+
+	return id;
+}
+
+int ast_sched_del(struct ast_sched_context *con, int id)
+{
+	struct sched_entry **pos;
+
+	if (!con) {
+		return -1;
+	}
+
+	pthread_mutex_lock(&con->lock);
+	for (pos = &con->entries; *pos; pos = &(*pos)->next) {
+		if ((*pos)->id == id) {
+			struct sched_entry *entry = *pos;
+
+			*pos = entry->next;
+			free(entry);
+			pthread_mutex_unlock(&con->lock);
+			return 0;
+		}
+	}
+
+	if (con->executing == id) {
+		/* Like the real scheduler, wait for it unless it is deleting itself */
+		if (!pthread_equal(con->thread, pthread_self())) {
+			con->executing = -2;
+			while (con->executing == -2) {
+				pthread_cond_wait(&con->executed, &con->lock);
+			}
+		} else {
+			con->executing = -2;
+		}
+		pthread_mutex_unlock(&con->lock);
+		return 0;
+	}
+	pthread_mutex_unlock(&con->lock);
+
+	return -1;
+}
+
+void ast_sched_context_destroy(struct ast_sched_context *con)
+{
+	if (!con) {
+		return;
+	}
+
+	if (con->running) {
+		pthread_mutex_lock(&con->lock);
+		con->stop = 1;
+		pthread_cond_signal(&con->cond);
+		pthread_mutex_unlock(&con->lock);
+		pthread_join(con->thread, NULL);
+	}
+
+	while (con->entries) {
+		struct sched_entry *entry = con->entries;
+
+		con->entries = entry->next;
+		free(entry);
+	}
+	pthread_cond_destroy(&con->executed);
+	pthread_cond_destroy(&con->cond);
+	pthread_mutex_destroy(&con->lock);
+	free(con);
+}
+
+/* Configuration framework */
+
+struct aco_option {
+	const char *name;
+	const char *default_val;
+	enum aco_option_type type;
+	aco_option_handler handler;
+	unsigned int flags;
+	struct aco_type **types;
+	size_t argc;
+	size_t args[4];
+	struct aco_option *next;
+};
+
+struct aco_info_internal {
+	void *pending;
+	struct aco_option *options;
+};
+
+/*! \brief A config file set by the test */
+struct mock_file {
+	char *filename;
+	char *text;
+	/*! \brief whether it changed since it was last processed */
+	int changed;
+	struct mock_file *next;
+};
+
+static struct mock_file *mock_files;
+
+void mock_config_set(const char *filename, const char *text)
+{
+	struct mock_file *file;
+
+	for (file = mock_files; file; file = file->next) {
+		if (!strcmp(file->filename, filename)) {
+			break;
+		}
+	}
+	if (!file) {
+		file = calloc(1, sizeof(*file));
+		file->filename = strdup(filename);
+		file->next = mock_files;
+		mock_files = file;
+	}
+	free(file->text);
+	file->text = text ? strdup(text) : NULL;
+	file->changed = 1;
+}
+
+int aco_info_init(struct aco_info *info)
+{
+	size_t i;
+	size_t j;
+
+	info->internal = calloc(1, sizeof(*info->internal));
+	if (!info->internal) {
+		return -1;
+	}
+
+	for (i = 0; info->files[i]; ++i) {
+		for (j = 0; info->files[i]->types[j]; ++j) {
+			struct aco_type *type = info->files[i]->types[j];
+
+			if (type->internal_category) {
+				continue;
+			}
+			type->internal_category = calloc(1, sizeof(*type->internal_category));
+			if (!type->internal_category
+				|| regcomp(type->internal_category, type->category,
+					REG_EXTENDED | REG_NOSUB) != 0) {
+				return -1;
+			}
+		}
+	}
+
+	return 0;
+}
+
+void aco_info_destroy(struct aco_info *info)
+{
+	size_t i;
+	size_t j;
+
+	if (!info->internal) {
+		return;
+	}
+
+	while (info->internal->options) {
+		struct aco_option *opt = info->internal->options;
+
+		info->internal->options = opt->next;
+		free(opt);
+	}
+	for (i = 0; info->files[i]; ++i) {
+		for (j = 0; info->files[i]->types[j]; ++j) {
+			struct aco_type *type = info->files[i]->types[j];
+
+			if (type->internal_category) {
+				regfree(type->internal_category);
+				free(type->internal_category);
+				type->internal_category = NULL;
+			}
+		}
+	}
+	free(info->internal);
+	info->internal = NULL;
+}
+
+int __aco_option_register(struct aco_info *info, const char *name,
+	enum aco_matchtype match_type, struct aco_type **types, const char *default_val,
+	enum aco_option_type type, aco_option_handler handler, unsigned int flags,
+	unsigned int no_doc, size_t argc, ...)
+{
+	struct aco_option *opt;
+	va_list ap;
+	size_t i;
+
+	if (!info->internal || argc > ARRAY_LEN(opt->args)) {
+		return -1;
+	}
+
+	opt = calloc(1, sizeof(*opt));
+	if (!opt) {
+		return -1;
+	}
+	opt->name = name;
+	opt->default_val = default_val;
+	opt->type = type;
+	opt->handler = handler;
+	opt->flags = flags;
+	opt->types = types;
+	opt->argc = argc;
+
+	/* Offsets are size_t, range bounds are int */
+	va_start(ap, argc);
+	for (i = 0; i < argc; ++i) {
+		if (i > 0 && (type == OPT_UINT_T || type == OPT_INT_T)) {
+			opt->args[i] = va_arg(ap, int);
+		} else {
+			opt->args[i] = va_arg(ap, size_t);
+		}
+	}
+	va_end(ap);
+
+	opt->next = info->internal->options;
+	info->internal->options = opt;
+
+	return 0;
+}
+
+/*! \brief The aco_info whose options aco_set_defaults() looks up */
+static struct aco_info *aco_current;
+
+static int option_applies(const struct aco_option *opt, const struct aco_type *type)
+{
+	size_t i;
+
+	for (i = 0; opt->types[i]; ++i) {
+		if (opt->types[i] == type) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static int option_apply(const struct aco_option *opt, struct ast_variable *var, void *obj)
+{
+	char *base = obj;
+
+	switch (opt->type) {
+	case OPT_CUSTOM_T:
+		return opt->handler(opt, var, obj);
+	case OPT_BOOL_T:
+		*(int *) (base + opt->args[0]) = opt->flags ? ast_true(var->value) : !ast_false(var->value);
+		return 0;
+	case OPT_UINT_T:
+		if (opt->flags & PARSE_IN_RANGE) {
+			return ast_parse_arg(var->value, PARSE_UINT32 | PARSE_IN_RANGE,
+				base + opt->args[0], (uint32_t) opt->args[1], (uint32_t) opt->args[2]);
+		}
+		return ast_parse_arg(var->value, PARSE_UINT32, base + opt->args[0]);
+	case OPT_INT_T:
+		if (opt->flags & PARSE_IN_RANGE) {
+			return ast_parse_arg(var->value, PARSE_INT32 | PARSE_IN_RANGE,
+				base + opt->args[0], (int32_t) opt->args[1], (int32_t) opt->args[2]);
+		}
+		return ast_parse_arg(var->value, PARSE_INT32, base + opt->args[0]);
+	case OPT_STRINGFIELD_T:
+		return __ast_string_field_set((struct ast_string_field_mgr *) (base + opt->args[2]),
+			(struct ast_string_field_pool **) (base + opt->args[1]),
+			(const char **) (base + opt->args[0]), var->value);
+	default:
+		return -1;
+	}
+}
+
+int aco_set_defaults(struct aco_type *type, const char *category, void *obj)
+{
+	struct aco_option *opt;
+
+	if (!aco_current || !aco_current->internal) {
+		return -1;
+	}
+
+	for (opt = aco_current->internal->options; opt; opt = opt->next) {
+		struct ast_variable var = { opt->name, opt->default_val, NULL, 0 };
+
+		if (!opt->default_val || !option_applies(opt, type)) {
+			continue;
+		}
+		if (option_apply(opt, &var, obj) != 0) {
+			ast_log(LOG_ERROR, "Unable to set default for %s, %s=%s\n",
+				category, opt->name, opt->default_val);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+void *aco_pending_config(struct aco_info *info)
+{
+	return info->internal ? info->internal->pending : NULL;
+}
+
+static struct aco_type *category_type(struct aco_file *file, const char *category)
+{
+	size_t i;
+
+	for (i = 0; file->types[i]; ++i) {
+		struct aco_type *type = file->types[i];
+		int match = !regexec(type->internal_category, category, 0, NULL, 0);
+
+		if (type->category_match == ACO_WHITELIST ? match : !match) {
+			return type;
+		}
+	}
+	return NULL;
+}
+
+/*! \brief Apply \a name = \a value to \a obj, a \a type */
+static int category_option(struct aco_info *info, struct aco_type *type,
+	const char *category, void *obj, const char *name, const char *value, int lineno)
+{
+	struct ast_variable var = { name, value, NULL, lineno };
+	struct aco_option *opt;
+
+	for (opt = info->internal->options; opt; opt = opt->next) {
+		if (!strcasecmp(opt->name, name) && option_applies(opt, type)) {
+			break;
+		}
+	}
+	if (!opt) {
+		ast_log(LOG_ERROR, "Could not find option suitable for category '%s' named '%s' at line %d\n",
+			category, name, lineno);
+		return -1;
+	}
+	if (option_apply(opt, &var, obj) != 0) {
+		ast_log(LOG_ERROR, "Error parsing %s=%s at line %d\n", name, value, lineno);
+		return -1;
+	}
+
+	return 0;
+}
+
+/*! \brief Parse \a text, an ini file, into the pending configuration */
+static int config_parse(struct aco_info *info, struct aco_file *file, char *text)
+{
+	struct aco_type *type = NULL;
+	char category[80] = "";
+	void *obj = NULL;
+	int is_new = 0;
+	struct ao2_container *container = NULL;
+	int lineno = 0;
+	int res = 0;
+	char *line;
+
+	while (!res && (line = strsep(&text, "\n"))) {
+		char *sep;
+
+		++lineno;
+		if ((sep = strchr(line, ';'))) {
+			*sep = '\0';
+		}
+		line = ast_strip(line);
+		if (ast_strlen_zero(line)) {
+			continue;
+		}
+
+		if (*line == '[') {
+			if (obj && is_new && !ao2_link(container, obj)) {
+				res = -1;
+			}
+			if (obj && type->type == ACO_ITEM) {
+				ao2_ref(obj, -1);
+			}
+			obj = NULL;
+			if (res) {
+				break;
+			}
+
+			sep = strchr(line, ']');
+			if (!sep) {
+				ast_log(LOG_ERROR, "Missing ']' at line %d\n", lineno);
+				return -1;
+			}
+			*sep = '\0';
+			ast_copy_string(category, line + 1, sizeof(category));
+
+			type = category_type(file, category);
+			if (!type) {
+				ast_log(LOG_ERROR, "Could not find config type for category '%s' in '%s'\n",
+					category, file->filename);
+				return -1;
+			}
+
+			is_new = 0;
+			if (type->type == ACO_GLOBAL) {
+				obj = *(void **) ((char *) info->internal->pending + type->item_offset);
+			} else {
+				container = *(struct ao2_container **) ((char *) info->internal->pending
+					+ type->item_offset);
+				obj = type->item_find(container, category);
+				if (!obj) {
+					obj = type->item_alloc(category);
+					if (!obj || aco_set_defaults(type, category, obj) != 0) {
+						ao2_cleanup(obj);
+						return -1;
+					}
+					is_new = 1;
+				}
+			}
+			continue;
+		}
+
+		if (!obj) {
+			ast_log(LOG_ERROR, "Option outside of a category at line %d\n", lineno);
+			return -1;
+		}
+
+		sep = strchr(line, '=');
+		if (!sep) {
+			ast_log(LOG_ERROR, "No '=' at line %d\n", lineno);
+			res = -1;
+			continue;
+		}
+		*sep++ = '\0';
+		if (*sep == '>') {
+			++sep;
+		}
+		res = category_option(info, type, category, obj,
+			ast_strip(line), ast_strip(sep), lineno);
+	}
+
+	if (obj && !res && is_new && !ao2_link(container, obj)) {
+		res = -1;
+	}
+	if (obj && type->type == ACO_ITEM) {
+		ao2_ref(obj, -1);
+	}
+
+	return res;
+}
+
+enum aco_process_status aco_process_config(struct aco_info *info, int reload)
+{
+	enum aco_process_status res = ACO_PROCESS_OK;
+	size_t i;
+
+	if (!info->internal) {
+		return ACO_PROCESS_ERROR;
+	}
+
+	aco_current = info;
+	info->internal->pending = info->snapshot_alloc();
+	if (!info->internal->pending) {
+		return ACO_PROCESS_ERROR;
+	}
+
+	for (i = 0; res == ACO_PROCESS_OK && info->files[i]; ++i) {
+		struct mock_file *file;
+		char *text;
+
+		for (file = mock_files; file; file = file->next) {
+			if (!strcmp(file->filename, info->files[i]->filename)) {
+				break;
+			}
+		}
+		if (!file || !file->text) {
+			ast_log(LOG_ERROR, "Unable to load config file '%s'\n", info->files[i]->filename);
+			res = ACO_PROCESS_ERROR;
+			break;
+		}
+		if (reload && !file->changed) {
+			res = ACO_PROCESS_UNCHANGED;
+			break;
+		}
+		file->changed = 0;
+
+		text = strdup(file->text);
+		if (!text || config_parse(info, info->files[i], text) != 0) {
+			res = ACO_PROCESS_ERROR;
+		}
+		free(text);
+	}
+
+	if (res == ACO_PROCESS_OK && info->pre_apply_config && info->pre_apply_config()) {
+		res = ACO_PROCESS_ERROR;
+	}
+	if (res == ACO_PROCESS_OK) {
+		__ao2_global_obj_replace_unref(info->global_obj, info->internal->pending);
+		if (info->post_apply_config) {
+			info->post_apply_config();
+		}
+	}
+
+	ao2_ref(info->internal->pending, -1);
+	info->internal->pending = NULL;
+
+	return res;
+}
+
+/* JSON */
+
+struct json_member {
+	char *key;
+	struct ast_json *value;
+};
+
+struct ast_json {
+	int refcount;
+	enum ast_json_type type;
+	union {
+		ast_json_int_t integer;
+		double real;
+		char *string;
+		struct {
+			struct json_member *members;
+			size_t count;
+		} object;
+		struct {
+			struct ast_json **values;
+			size_t count;
+		} array;
+	} u;
+};
+
+static struct ast_json *json_alloc(enum ast_json_type type)
+{
+	struct ast_json *json = calloc(1, sizeof(*json));
+
+	if (json) {
+		json->refcount = 1;
+		json->type = type;
+	}
+	return json;
+}
+
+struct ast_json *ast_json_ref(struct ast_json *value)
+{
+	if (value) {
+		__atomic_fetch_add(&value->refcount, 1, __ATOMIC_RELAXED);
+	}
+	return value;
+}
+
+void ast_json_unref(struct ast_json *value)
+{
+	size_t i;
+
+	if (!value || __atomic_sub_fetch(&value->refcount, 1, __ATOMIC_ACQ_REL)) {
+		return;
+	}
+
+	switch (value->type) {
+	case AST_JSON_STRING:
+		free(value->u.string);
+		break;
+	case AST_JSON_OBJECT:
+		for (i = 0; i < value->u.object.count; ++i) {
+			free(value->u.object.members[i].key);
+			ast_json_unref(value->u.object.members[i].value);
+		}
+		free(value->u.object.members);
+		break;
+	case AST_JSON_ARRAY:
+		for (i = 0; i < value->u.array.count; ++i) {
+			ast_json_unref(value->u.array.values[i]);
+		}
+		free(value->u.array.values);
+		break;
+	default:
+		break;
+	}
+	free(value);
+}
+
+enum ast_json_type ast_json_typeof(const struct ast_json *value)
+{
+	return value->type;
+}
+
+struct ast_json *ast_json_integer_create(ast_json_int_t value)
+{
+	struct ast_json *json = json_alloc(AST_JSON_INTEGER);
+
+	if (json) {
+		json->u.integer = value;
+	}
+	return json;
+}
+
+ast_json_int_t ast_json_integer_get(const struct ast_json *integer)
+{
+	return integer && integer->type == AST_JSON_INTEGER ? integer->u.integer : 0;
+}
+
+static struct ast_json *json_real_create(double value)
+{
+	struct ast_json *json = json_alloc(AST_JSON_REAL);
+
+	if (json) {
+		json->u.real = value;
+	}
+	return json;
+}
+
+double ast_json_real_get(const struct ast_json *real)
+{
+	return real && real->type == AST_JSON_REAL ? real->u.real : 0;
+}
+
+static struct ast_json *json_string_create(const char *value, size_t len)
+{
+	struct ast_json *json = json_alloc(AST_JSON_STRING);
+
+	if (json) {
+		json->u.string = strndup(value, len);
+		if (!json->u.string) {
+			free(json);
+			return NULL;
+		}
+	}
+	return json;
+}
+
+const char *ast_json_string_get(const struct ast_json *string)
+{
+	return string && string->type == AST_JSON_STRING ? string->u.string : NULL;
+}
+
+struct ast_json *ast_json_array_create(void)
+{
+	return json_alloc(AST_JSON_ARRAY);
+}
+
+int ast_json_array_append(struct ast_json *array, struct ast_json *value)
+{
+	struct ast_json **values;
+
+	if (!array || !value || array->type != AST_JSON_ARRAY) {
+		ast_json_unref(value);
+		return -1;
+	}
+	values = realloc(array->u.array.values, (array->u.array.count + 1) * sizeof(*values));
+	if (!values) {
+		ast_json_unref(value);
+		return -1;
+	}
+	values[array->u.array.count++] = value;
+	array->u.array.values = values;
+
+	return 0;
+}
+
+size_t ast_json_array_size(const struct ast_json *array)
+{
+	return array && array->type == AST_JSON_ARRAY ? array->u.array.count : 0;
+}
+
+struct ast_json *ast_json_array_get(const struct ast_json *array, size_t index)
+{
+	return index < ast_json_array_size(array) ? array->u.array.values[index] : NULL;
+}
+
+struct ast_json *ast_json_object_get(struct ast_json *object, const char *key)
+{
+	size_t i;
+
+	if (!object || object->type != AST_JSON_OBJECT) {
+		return NULL;
+	}
+	for (i = 0; i < object->u.object.count; ++i) {
+		if (!strcmp(object->u.object.members[i].key, key)) {
+			return object->u.object.members[i].value;
+		}
+	}
+	return NULL;
+}
+
+int ast_json_object_set(struct ast_json *object, const char *key, struct ast_json *value)
+{
+	struct json_member *members;
+	size_t i;
+
+	if (!object || !value || object->type != AST_JSON_OBJECT) {
+		ast_json_unref(value);
+		return -1;
+	}
+	for (i = 0; i < object->u.object.count; ++i) {
+		if (!strcmp(object->u.object.members[i].key, key)) {
+			ast_json_unref(object->u.object.members[i].value);
+			object->u.object.members[i].value = value;
+			return 0;
+		}
+	}
+
+	/* Members keep their insertion order, as in jansson 2.8 and later */
+	members = realloc(object->u.object.members,
+		(object->u.object.count + 1) * sizeof(*members));
+	if (!members) {
+		ast_json_unref(value);
+		return -1;
+	}
+	object->u.object.members = members;
+	members[object->u.object.count].key = strdup(key);
+	members[object->u.object.count].value = value;
+	++object->u.object.count;
+
+	return 0;
+}
+
+size_t ast_json_object_size(struct ast_json *object)
+{
+	return object && object->type == AST_JSON_OBJECT ? object->u.object.count : 0;
+}
+
+struct ast_json *ast_json_pack(char const *format, ...)
+{
+	struct ast_json *stack[8];
+	struct ast_json *root = NULL;
+	const char *key = NULL;
+	int depth = 0;
+	int error = 0;
+	va_list ap;
+
+	va_start(ap, format);
+	for (; *format && !error; ++format) {
+		struct ast_json *value = NULL;
+
+		switch (*format) {
+		case ' ':
+		case ',':
+		case ':':
+			continue;
+		case '{':
+			value = json_alloc(AST_JSON_OBJECT);
+			break;
+		case '}':
+			if (!depth) {
+				error = 1;
+			} else {
+				--depth;
+			}
+			continue;
+		case 's':
+			if (depth && !key) {
+				key = va_arg(ap, const char *);
+				continue;
+			} else {
+				const char *str = va_arg(ap, const char *);
+
+				value = str ? json_string_create(str, strlen(str)) : NULL;
+			}
+			break;
+		case 'i':
+			value = ast_json_integer_create(va_arg(ap, int));
+			break;
+		case 'I':
+			value = ast_json_integer_create(va_arg(ap, ast_json_int_t));
+			break;
+		case 'f':
+			value = json_real_create(va_arg(ap, double));
+			break;
+		default:
+			error = 1;
+			continue;
+		}
+
+		if (!value) {
+			error = 1;
+			break;
+		}
+		if (!depth) {
+			root = value;
+		} else if (ast_json_object_set(stack[depth - 1], key, value) != 0) {
+			error = 1;
+		}
+		key = NULL;
+		if (value->type == AST_JSON_OBJECT) {
+			if (depth == ARRAY_LEN(stack)) {
+				error = 1;
+			} else {
+				stack[depth++] = value;
+			}
+		}
+	}
+	va_end(ap);
+
+	if (error || depth) {
+		ast_json_unref(root);
+		return NULL;
+	}
+	return root;
+}
+
+static int json_dump_string(struct ast_str **out, const char *str)
+{
+	const unsigned char *s = (const unsigned char *) str;
+
+	ast_str_append(out, 0, "\"");
+	for (; *s; ++s) {
+		switch (*s) {
+		case '"':
+			ast_str_append(out, 0, "\\\"");
+			break;
+		case '\\':
+			ast_str_append(out, 0, "\\\\");
+			break;
+		case '\b':
+			ast_str_append(out, 0, "\\b");
+			break;
+		case '\f':
+			ast_str_append(out, 0, "\\f");
+			break;
+		case '\n':
+			ast_str_append(out, 0, "\\n");
+			break;
+		case '\r':
+			ast_str_append(out, 0, "\\r");
+			break;
+		case '\t':
+			ast_str_append(out, 0, "\\t");
+			break;
+		default:
+			if (*s < 0x20) {
+				/* jansson's format, upper case hex included */
+				ast_str_append(out, 0, "\\u%04X", *s);
+			} else {
+				ast_str_append(out, 0, "%c", *s);
+			}
+			break;
+		}
+	}
+	return ast_str_append(out, 0, "\"");
+}
+
+static void json_dump(struct ast_str **out, const struct ast_json *json)
+{
+	char real[32];
+	size_t i;
+
+	switch (json->type) {
+	case AST_JSON_OBJECT:
+		ast_str_append(out, 0, "{");
+		for (i = 0; i < json->u.object.count; ++i) {
+			if (i) {
+				ast_str_append(out, 0, ",");
+			}
+			json_dump_string(out, json->u.object.members[i].key);
+			ast_str_append(out, 0, ":");
+			json_dump(out, json->u.object.members[i].value);
+		}
+		ast_str_append(out, 0, "}");
+		break;
+	case AST_JSON_ARRAY:
+		ast_str_append(out, 0, "[");
+		for (i = 0; i < json->u.array.count; ++i) {
+			if (i) {
+				ast_str_append(out, 0, ",");
+			}
+			json_dump(out, json->u.array.values[i]);
+		}
+		ast_str_append(out, 0, "]");
+		break;
+	case AST_JSON_STRING:
+		json_dump_string(out, json->u.string);
+		break;
+	case AST_JSON_INTEGER:
+		ast_str_append(out, 0, "%lld", json->u.integer);
+		break;
+	case AST_JSON_REAL:
+		/* Like jansson: 17 digits, and always recognizably a real */
+		snprintf(real, sizeof(real), "%.17g", json->u.real);
+		if (!strpbrk(real, ".eE")) {
+			strcat(real, ".0");
+		}
+		ast_str_append(out, 0, "%s", real);
+		break;
+	case AST_JSON_TRUE:
+		ast_str_append(out, 0, "true");
+		break;
+	case AST_JSON_FALSE:
+		ast_str_append(out, 0, "false");
+		break;
+	case AST_JSON_NULL:
+		ast_str_append(out, 0, "null");
+		break;
+	}
+}
+
+char *ast_json_dump_string(struct ast_json *root)
+{
+	struct ast_str *out;
+	char *str;
+
+	if (!root || (out = ast_str_create(256)) == NULL) {
+		return NULL;
+	}
+	json_dump(&out, root);
+	str = strdup(ast_str_buffer(out));
+	ast_free(out);
+
+	return str;
+}
+
+void ast_json_free(void *p)
+{
+	free(p);
+}
+
+/*! \brief State of ast_json_load_buf() */
+struct json_parser {
+	const char *s;
+	const char *end;
+	int depth;
+};
+
+static void json_skip_ws(struct json_parser *p)
+{
+	while (p->s < p->end && (*p->s == ' ' || *p->s == '\t' || *p->s == '\n' || *p->s == '\r')) {
+		++p->s;
+	}
+}
+
+static int json_hex4(struct json_parser *p, unsigned int *out)
+{
+	int i;
+
+	*out = 0;
+	for (i = 0; i < 4; ++i) {
+		char c;
+
+		if (p->s >= p->end) {
+			return -1;
+		}
+		c = *p->s++;
+		*out <<= 4;
+		if (c >= '0' && c <= '9') {
+			*out |= c - '0';
+		} else if (c >= 'a' && c <= 'f') {
+			*out |= c - 'a' + 10;
+		} else if (c >= 'A' && c <= 'F') {
+			*out |= c - 'A' + 10;
+		} else {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static struct ast_json *json_parse_string(struct json_parser *p)
+{
+	struct ast_json *json;
+	char *out;
+	size_t len = 0;
+
+	/* The unescaped string is never longer than the escaped one */
+	out = malloc(p->end - p->s + 1);
+	if (!out) {
+		return NULL;
+	}
+
+	for (++p->s; p->s < p->end && *p->s != '"'; ) {
+		unsigned char c = *p->s++;
+		unsigned int cp;
+
+		if (c < 0x20) {
+			goto error;
+		}
+		if (c != '\\') {
+			out[len++] = c;
+			continue;
+		}
+		if (p->s == p->end) {
+			goto error;
+		}
+		switch ((c = *p->s++)) {
+		case '"': case '\\': case '/':
+			out[len++] = c;
+			break;
+		case 'b': out[len++] = '\b'; break;
+		case 'f': out[len++] = '\f'; break;
+		case 'n': out[len++] = '\n'; break;
+		case 'r': out[len++] = '\r'; break;
+		case 't': out[len++] = '\t'; break;
+		case 'u':
+			if (json_hex4(p, &cp) != 0) {
+				goto error;
+			}
+			if (cp >= 0xd800 && cp < 0xdc00) {
+				unsigned int low;
+
+				if (p->end - p->s < 6 || p->s[0] != '\\' || p->s[1] != 'u') {
+					goto error;
+				}
+				p->s += 2;
+				if (json_hex4(p, &low) != 0 || low < 0xdc00 || low > 0xdfff) {
+					goto error;
+				}
+				cp = 0x10000 + ((cp - 0xd800) << 10) + (low - 0xdc00);
+			} else if (cp >= 0xdc00 && cp <= 0xdfff) {
+				goto error;
+			}
+			if (!cp) {
+				/* Strings are NUL terminated here, as in jansson's API */
+				goto error;
+			}
+			if (cp < 0x80) {
+				out[len++] = cp;
+			} else if (cp < 0x800) {
+				out[len++] = 0xc0 | (cp >> 6);
+				out[len++] = 0x80 | (cp & 0x3f);
+			} else if (cp < 0x10000) {
+				out[len++] = 0xe0 | (cp >> 12);
+				out[len++] = 0x80 | ((cp >> 6) & 0x3f);
+				out[len++] = 0x80 | (cp & 0x3f);
+			} else {
+				out[len++] = 0xf0 | (cp >> 18);
+				out[len++] = 0x80 | ((cp >> 12) & 0x3f);
+				out[len++] = 0x80 | ((cp >> 6) & 0x3f);
+				out[len++] = 0x80 | (cp & 0x3f);
+			}
+			break;
+		default:
+			goto error;
+		}
+	}
+	if (p->s == p->end) {
+		goto error;
+	}
+	++p->s;
+
+	json = json_string_create(out, len);
+	free(out);
+	return json;
+
+error:
+	free(out);
+	return NULL;
+}
+
+static struct ast_json *json_parse_value(struct json_parser *p);
+
+static struct ast_json *json_parse_container(struct json_parser *p, int object)
+{
+	struct ast_json *json = json_alloc(object ? AST_JSON_OBJECT : AST_JSON_ARRAY);
+	const char close = object ? '}' : ']';
+
+	if (!json || ++p->depth > 64) {
+		goto error;
+	}
+
+	++p->s;
+	json_skip_ws(p);
+	if (p->s < p->end && *p->s == close) {
+		++p->s;
+		--p->depth;
+		return json;
+	}
+
+	for (;;) {
+		struct ast_json *key = NULL;
+		struct ast_json *value;
+		int res;
+
+		json_skip_ws(p);
+		if (object) {
+			if (p->s == p->end || *p->s != '"' || !(key = json_parse_string(p))) {
+				goto error;
+			}
+			json_skip_ws(p);
+			if (p->s == p->end || *p->s++ != ':') {
+				ast_json_unref(key);
+				goto error;
+			}
+		}
+		value = json_parse_value(p);
+		if (!value) {
+			ast_json_unref(key);
+			goto error;
+		}
+		res = object ? ast_json_object_set(json, key->u.string, value)
+			: ast_json_array_append(json, value);
+		ast_json_unref(key);
+		if (res) {
+			goto error;
+		}
+
+		json_skip_ws(p);
+		if (p->s == p->end) {
+			goto error;
+		}
+		if (*p->s == ',') {
+			++p->s;
+			continue;
+		}
+		if (*p->s++ != close) {
+			goto error;
+		}
+		--p->depth;
+		return json;
+	}
+
+error:
+	ast_json_unref(json);
+	return NULL;
+}
+
+static struct ast_json *json_parse_value(struct json_parser *p)
+{
+	json_skip_ws(p);
+	if (p->s == p->end) {
+		return NULL;
+	}
+
+	switch (*p->s) {
+	case '{':
+		return json_parse_container(p, 1);
+	case '[':
+		return json_parse_container(p, 0);
+	case '"':
+		return json_parse_string(p);
+	case 't':
+		if (p->end - p->s >= 4 && !strncmp(p->s, "true", 4)) {
+			p->s += 4;
+			return json_alloc(AST_JSON_TRUE);
+		}
+		return NULL;
+	case 'f':
+		if (p->end - p->s >= 5 && !strncmp(p->s, "false", 5)) {
+			p->s += 5;
+			return json_alloc(AST_JSON_FALSE);
+		}
+		return NULL;
+	case 'n':
+		if (p->end - p->s >= 4 && !strncmp(p->s, "null", 4)) {
+			p->s += 4;
+			return json_alloc(AST_JSON_NULL);
+		}
+		return NULL;
+	default: {
+		char num[64];
+		size_t len = 0;
+		int real = 0;
+		char *end;
+
+		while (p->s + len < p->end && len < sizeof(num) - 1
+			&& strchr("+-0123456789.eE", p->s[len])) {
+			if (strchr(".eE", p->s[len])) {
+				real = 1;
+			}
+			num[len] = p->s[len];
+			++len;
+		}
+		num[len] = '\0';
+		if (!len) {
+			return NULL;
+		}
+		p->s += len;
+		if (real) {
+			double value = strtod(num, &end);
+
+			return *end ? NULL : json_real_create(value);
+		} else {
+			long long value = strtoll(num, &end, 10);
+
+			return *end ? NULL : ast_json_integer_create(value);
+		}
+	}
+	}
+}
+
+struct ast_json *ast_json_load_buf(const char *buffer, size_t buflen, struct ast_json_error *error)
+{
+	struct json_parser p = { buffer, buffer + buflen, 0 };
+	struct ast_json *json = json_parse_value(&p);
+
+	json_skip_ws(&p);
+	if (json && p.s != p.end) {
+		ast_json_unref(json);
+		return NULL;
+	}
+	return json;
+}
+
+/* CDR engine */
+
+static ast_cdrbe cdr_backend;
+
+int ast_cdr_register(const char *name, const char *desc, ast_cdrbe be)
+{
+	if (cdr_backend) {
+		return -1;
+	}
+	cdr_backend = be;
+	return 0;
+}
+
+int ast_cdr_unregister(const char *name)
+{
+	cdr_backend = NULL;
+	return 0;
+}
+
+int mock_cdr_post(struct ast_cdr *cdr)
+{
+	return cdr_backend ? cdr_backend(cdr) : -1;
+}
+
+const char *ast_cdr_disp2str(int disposition)
+{
+	switch (disposition) {
+	case AST_CDR_NULL:
+		return "NO ANSWER"; /* by default, for backward compatibility */
+	case AST_CDR_NOANSWER:
+		return "NO ANSWER";
+	case AST_CDR_FAILED:
+		return "FAILED";
+	case AST_CDR_BUSY:
+		return "BUSY";
+	case AST_CDR_ANSWERED:
+		return "ANSWERED";
+	case AST_CDR_CONGESTION:
+		return "CONGESTION";
+	}
+	return "UNKNOWN";
+}
+
+const char *ast_channel_amaflags2string(enum ama_flags flag)
+{
+	switch (flag) {
+	case AST_AMA_OMIT:
+		return "OMIT";
+	case AST_AMA_BILLING:
+		return "BILLING";
+	case AST_AMA_DOCUMENTATION:
+		return "DOCUMENTATION";
+	default:
+		return "Unknown";
+	}
+}
+
+/* CLI */
+
+static struct ast_cli_entry *cli_entries[16];
+static size_t cli_count;
+static struct ast_str *cli_out;
+
+void ast_cli(int fd, const char *fmt, ...)
+{
+	va_list ap;
+
+	if (!cli_out && !(cli_out = ast_str_create(256))) {
+		return;
+	}
+	va_start(ap, fmt);
+	str_vappend(&cli_out, fmt, ap);
+	va_end(ap);
+}
+
+int ast_cli_register_multiple(struct ast_cli_entry *e, int len)
+{
+	int i;
+
+	for (i = 0; i < len && cli_count < ARRAY_LEN(cli_entries); ++i) {
+		/* As the real CLI does, let the handler fill in its command */
+		e[i].handler(&e[i], CLI_INIT, NULL);
+		cli_entries[cli_count++] = &e[i];
+	}
+	return 0;
+}
+
+int ast_cli_unregister_multiple(struct ast_cli_entry *e, int len)
+{
+	size_t i;
+	size_t j = 0;
+
+	for (i = 0; i < cli_count; ++i) {
+		if (cli_entries[i] < e || cli_entries[i] >= e + len) {
+			cli_entries[j++] = cli_entries[i];
+		}
+	}
+	cli_count = j;
+	return 0;
+}
+
+char *mock_cli_exec(const char *line)
+{
+	char *copy = ast_strdupa(line);
+	const char *argv[16];
+	int argc = 0;
+	char *word;
+	size_t i;
+
+	while ((word = strsep(&copy, " ")) && argc < (int) ARRAY_LEN(argv)) {
+		if (*word) {
+			argv[argc++] = word;
+		}
+	}
+
+	if (!cli_out) {
+		cli_out = ast_str_create(256);
+	}
+	ast_str_reset(cli_out);
+
+	for (i = 0; i < cli_count; ++i) {
+		char *command = ast_strdupa(cli_entries[i]->command);
+		int words = 0;
+
+		while ((word = strsep(&command, " "))) {
+			if (words >= argc || strcasecmp(word, argv[words])) {
+				break;
+			}
+			++words;
+		}
+		if (!word) {
+			struct ast_cli_args args = {
+				.fd = -1,
+				.argc = argc,
+				.argv = argv,
+				.line = line,
+			};
+
+			return cli_entries[i]->handler(cli_entries[i], -4, &args);
+		}
+	}
+
+	return CLI_SHOWUSAGE;
+}
+
+const char *mock_cli_output(void)
+{
+	return cli_out ? ast_str_buffer(cli_out) : "";
+}
+
+/* Manager */
+
+struct message {
+	const char *headers;
+};
+
+struct mansession {
+	struct ast_str *out;
+};
+
+struct manager_action {
+	const char *action;
+	int (*func)(struct mansession *s, const struct message *m);
+};
+
+static struct manager_action manager_actions[16];
+static size_t manager_count;
+
+struct manager_event_count {
+	char name[64];
+	int count;
+};
+
+static struct manager_event_count manager_event_counts[16];
+static pthread_mutex_t manager_lock = PTHREAD_MUTEX_INITIALIZER;
+
+int ast_manager_register2(const char *action, int authority,
+	int (*func)(struct mansession *s, const struct message *m),
+	void *module, const char *synopsis, const char *description)
+{
+	if (manager_count == ARRAY_LEN(manager_actions)) {
+		return -1;
+	}
+	manager_actions[manager_count].action = action;
+	manager_actions[manager_count].func = func;
+	++manager_count;
+	return 0;
+}
+
+int ast_manager_unregister(const char *action)
+{
+	size_t i;
+
+	for (i = 0; i < manager_count; ++i) {
+		if (!strcasecmp(manager_actions[i].action, action)) {
+			manager_actions[i] = manager_actions[--manager_count];
+			return 0;
+		}
+	}
+	return -1;
+}
+
+void __manager_event(int category, const char *event, const char *contents, ...)
+{
+	size_t i;
+
+	pthread_mutex_lock(&manager_lock);
+	for (i = 0; i < ARRAY_LEN(manager_event_counts); ++i) {
+		if (!manager_event_counts[i].name[0]) {
+			ast_copy_string(manager_event_counts[i].name, event,
+				sizeof(manager_event_counts[i].name));
+		}
+		if (!strcmp(manager_event_counts[i].name, event)) {
+			++manager_event_counts[i].count;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&manager_lock);
+}
+
+int mock_manager_events(const char *event)
+{
+	int count = 0;
+	size_t i;
+
+	pthread_mutex_lock(&manager_lock);
+	for (i = 0; i < ARRAY_LEN(manager_event_counts); ++i) {
+		if (!strcmp(manager_event_counts[i].name, event)) {
+			count = manager_event_counts[i].count;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&manager_lock);
+
+	return count;
+}
+
+const char *astman_get_header(const struct message *m, char *var)
+{
+	/* Asterisk returns a pointer into the message, so several can be held at once */
+	static __thread char values[8][256];
+	static __thread unsigned int next;
+	char *value = values[next++ % ARRAY_LEN(values)];
+	size_t len = strlen(var);
+	const char *line;
+
+	for (line = m->headers; line && *line; ) {
+		const char *eol = strstr(line, "\r\n");
+
+		if (!strncasecmp(line, var, len) && line[len] == ':') {
+			const char *start = ast_skip_blanks(line + len + 1);
+			size_t n = eol ? (size_t) (eol - start) : strlen(start);
+
+			snprintf(value, sizeof(values[0]), "%.*s", (int) n, start);
+			return value;
+		}
+		line = eol ? eol + 2 : NULL;
+	}
+	return "";
+}
+
+void astman_send_error(struct mansession *s, const struct message *m, char *error)
+{
+	ast_str_append(&s->out, 0, "Response: Error\r\nMessage: %s\r\n\r\n", error);
+}
+
+void astman_send_ack(struct mansession *s, const struct message *m, char *msg)
+{
+	ast_str_append(&s->out, 0, "Response: Success\r\nMessage: %s\r\n\r\n", msg);
+}
+
+void astman_send_listack(struct mansession *s, const struct message *m, char *msg, char *listflag)
+{
+	ast_str_append(&s->out, 0, "Response: Success\r\nEventList: %s\r\nMessage: %s\r\n\r\n",
+		listflag, msg);
+}
+
+void astman_send_list_complete_start(struct mansession *s, const struct message *m,
+	const char *event_name, int count)
+{
+	ast_str_append(&s->out, 0, "Event: %s\r\nEventList: Complete\r\nListItems: %d\r\n",
+		event_name, count);
+}
+
+void astman_send_list_complete_end(struct mansession *s)
+{
+	ast_str_append(&s->out, 0, "\r\n");
+}
+
+void astman_append(struct mansession *s, const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	str_vappend(&s->out, fmt, ap);
+	va_end(ap);
+}
+
+const char *mock_manager_action(const char *action, const char *headers)
+{
+	static struct mansession session;
+	struct message m = { headers };
+	size_t i;
+
+	if (!session.out && !(session.out = ast_str_create(256))) {
+		return NULL;
+	}
+	ast_str_reset(session.out);
+
+	for (i = 0; i < manager_count; ++i) {
+		if (!strcasecmp(manager_actions[i].action, action)) {
+			manager_actions[i].func(&session, &m);
+			return ast_str_buffer(session.out);
+		}
+	}
+	return NULL;
+}
+
+/* HTTP server */
+
+static struct ast_http_uri *http_uris[4];
+static struct ast_str *http_body;
+
+int ast_http_uri_link(struct ast_http_uri *urih)
+{
+	size_t i;
+
+	for (i = 0; i < ARRAY_LEN(http_uris); ++i) {
+		if (!http_uris[i]) {
+			http_uris[i] = urih;
+			return 0;
+		}
+	}
+	return -1;
+}
+
+void ast_http_uri_unlink(struct ast_http_uri *urih)
+{
+	size_t i;
+
+	for (i = 0; i < ARRAY_LEN(http_uris); ++i) {
+		if (http_uris[i] == urih) {
+			http_uris[i] = NULL;
+		}
+	}
+}
+
+void ast_http_send(struct ast_tcptls_session_instance *ser, enum ast_http_method method,
+	int status_code, const char *status_title, struct ast_str *http_header,
+	struct ast_str *out, int fd, unsigned int static_content)
+{
+	if (http_body) {
+		ast_str_set(&http_body, 0, "%s", out ? ast_str_buffer(out) : "");
+	}
+	ast_free(http_header);
+	ast_free(out);
+}
+
+void ast_http_error(struct ast_tcptls_session_instance *ser, int status,
+	const char *title, const char *text)
+{
+	if (http_body) {
+		ast_str_set(&http_body, 0, "%d %s", status, title);
+	}
+}
+
+const char *mock_http_get(const char *uri)
+{
+	size_t i;
+
+	if (!http_body && !(http_body = ast_str_create(1024))) {
+		return NULL;
+	}
+
+	for (i = 0; i < ARRAY_LEN(http_uris); ++i) {
+		if (http_uris[i] && !strcmp(http_uris[i]->uri, uri)) {
+			ast_str_reset(http_body);
+			http_uris[i]->callback(NULL, http_uris[i], uri, AST_HTTP_GET, NULL, NULL);
+			return ast_str_buffer(http_body);
+		}
+	}
+	return NULL;
+}
@@ -0,0 +1,66 @@
+/*! \file
+ *
+ * \brief Test controls of the mock Asterisk core in mock_asterisk.c.
+ */
+
+#ifndef CDR_AMQP_MOCK_ASTERISK_H
+#define CDR_AMQP_MOCK_ASTERISK_H
+
+#include "asterisk/cdr.h"
+#include "asterisk/threadpool.h"
+
+/*! \brief Messages logged so far at \a level, e.g. __LOG_WARNING */
+int mock_log_count(int level);
+
+/*! \brief ao2 objects currently allocated, to spot leaks */
+int mock_ao2_objects(void);
+
+/*! \brief While set, ast_taskprocessor_push() fails */
+extern int mock_tps_push_fail;
+
+/*! \brief Threads \a pool is running */
+unsigned int mock_threadpool_running(struct ast_threadpool *pool);
+
+/*!
+ * \brief Use \a text as the contents of config file \a filename.
+ *
+ * aco_process_config() fails for a file that has no text, and a reload
+ * reports ACO_PROCESS_UNCHANGED until the text is set again.
+ */
+void mock_config_set(const char *filename, const char *text);
+
+/*!
+ * \brief Post \a cdr to the registered backend, as the CDR engine would.
+ *
+ * \return What the backend returned, or -1 if none is registered.
+ */
+int mock_cdr_post(struct ast_cdr *cdr);
+
+/*!
+ * \brief Run CLI command \a line against the registered commands.
+ *
+ * \return The handler's CLI_* result, or CLI_SHOWUSAGE if nothing matched.
+ */
+char *mock_cli_exec(const char *line);
+
+/*! \brief Output of the last mock_cli_exec() */
+const char *mock_cli_output(void);
+
+/*!
+ * \brief Run AMI \a action with \a headers, "Key: Value" lines separated by CRLF.
+ *
+ * \return The response, valid until the next call; NULL if \a action is unknown.
+ */
+const char *mock_manager_action(const char *action, const char *headers);
+
+/*! \brief Number of \a event manager events sent so far */
+int mock_manager_events(const char *event);
+
+/*!
+ * \brief GET \a uri from the linked HTTP handlers.
+ *
+ * \return The body, valid until the next call; NULL if no handler matched.
+ */
+const char *mock_http_get(const char *uri);
+
+#endif /* CDR_AMQP_MOCK_ASTERISK_H */
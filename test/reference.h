@@ -0,0 +1,100 @@
+/*
+ * Asterisk -- An open source telephony toolkit.
+ *
+ * See http://www.asterisk.org for more information about
+ * the Asterisk project.
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2. See the LICENSE file
+ * at the top of the source tree.
+ */
+
+/*! \file
+ *
+ * \brief The generic serializer: a CDR built with ast_json_pack() and dumped.
+ *
+ * This is how the module serialized CDRs before its serializer was
+ * specialized, so the specialized serializers are checked against it
+ * for byte-exactness and benchmarked against it. Included after
+ * cdr_amqp.c.
+ */
+
+#ifndef CDR_AMQP_REFERENCE_H
+#define CDR_AMQP_REFERENCE_H
+
+/*! \brief What ast_json_timeval() makes of \a tv, as a string */
+static const char *reference_timeval(struct timeval tv, char *out, size_t size)
+{
+	struct ast_tm tm = {};
+
+	ast_localtime(&tv, &tm, NULL);
+	ast_strftime(out, size, AST_ISO8601_FORMAT, &tm);
+	return out;
+}
+
+/*!
+ * \brief Serialize \a cdr for the uncapped json destination \a dest.
+ *
+ * \return The message body, to be freed with ast_json_free().
+ * \return NULL on error.
+ */
+static char *reference_serialize(const struct cdr_amqp_destination *dest,
+	const struct ast_cdr *cdr)
+{
+	RAII_VAR(struct ast_json *, json, NULL, ast_json_unref);
+	char start[AST_ISO8601_LEN];
+	char answer[AST_ISO8601_LEN];
+	char end[AST_ISO8601_LEN];
+
+	json = ast_json_pack("{"
+		/* clid, src, dst, dcontext */
+		"s: s, s: s, s: s, s: s,"
+		/* channel, dstchannel, lastapp, lastdata */
+		"s: s, s: s, s: s, s: s,"
+		/* start, answer, end, duration */
+		"s: s, s: s, s: s, s: I"
+		/* billsec, disposition, accountcode, amaflags */
+		"s: I, s: s, s: s, s: s"
+		/* peeraccount, linkedid */
+		"s: s, s: s }",
+
+		"clid", cdr->clid,
+		"src", cdr->src,
+		"dst", cdr->dst,
+		"dcontext", cdr->dcontext,
+
+		"channel", cdr->channel,
+		"dstchannel", cdr->dstchannel,
+		"lastapp", cdr->lastapp,
+		"lastdata", cdr->lastdata,
+
+		"start", reference_timeval(cdr->start, start, sizeof(start)),
+		"answer", reference_timeval(cdr->answer, answer, sizeof(answer)),
+		"end", reference_timeval(cdr->end, end, sizeof(end)),
+		"durationsec", (ast_json_int_t) cdr->duration,
+
+		"billsec", (ast_json_int_t) cdr->billsec,
+		"disposition", ast_cdr_disp2str(cdr->disposition),
+		"accountcode", cdr->accountcode,
+		"amaflags", ast_channel_amaflags2string(cdr->amaflags),
+
+		"peeraccount", cdr->peeraccount,
+		"linkedid", cdr->linkedid);
+	if (!json) {
+		return NULL;
+	}
+
+	/* Set optional fields */
+	if (dest->loguniqueid
+		&& ast_json_object_set(json, "uniqueid", ast_json_pack("s", cdr->uniqueid)) != 0) {
+		return NULL;
+	}
+	if (dest->loguserfield
+		&& ast_json_object_set(json, "userfield", ast_json_pack("s", cdr->userfield)) != 0) {
+		return NULL;
+	}
+
+	return ast_json_dump_string(json);
+}
+
+#endif /* CDR_AMQP_REFERENCE_H */
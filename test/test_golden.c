@@ -0,0 +1,297 @@
+/*
+ * Asterisk -- An open source telephony toolkit.
+ *
+ * See http://www.asterisk.org for more information about
+ * the Asterisk project.
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2. See the LICENSE file
+ * at the top of the source tree.
+ */
+
+/*! \file
+ *
+ * \brief Byte-exact output of every serializer variant on the golden corpus.
+ *
+ * golden/corpus.tsv is a generated corpus (see corpus.h), and
+ * golden/<variant>.out holds what the broker has to receive for it, one
+ * message body per line. A change to the output of any variant fails
+ * here; when the change is intended, run with CDR_AMQP_GOLDEN_UPDATE=1
+ * to rewrite the expected files, and review their diff.
+ */
+
+#include "../cdr_amqp.c"
+
+#include "harness.h"
+#include "corpus.h"
+#include "reference.h"
+
+#define GOLDEN_DIR "golden"
+
+static const struct golden_variant {
+	const char *name;
+	const char *conf;
+	/*! \brief rows per compact batch; 0 for a message per CDR */
+	unsigned int batchsize;
+	/*! \brief whether to check against the generic serializer too */
+	int reference;
+} golden_variants[] = {
+	{ "json",
+		"[global]\n"
+		"connection = amqp1\n",
+		0, 1 },
+	{ "json-uniqueid-userfield",
+		"[global]\n"
+		"connection = amqp1\n"
+		"loguniqueid = yes\n"
+		"loguserfield = yes\n",
+		0, 1 },
+	{ "json-capped",
+		"[global]\n"
+		"connection = amqp1\n"
+		"loguniqueid = yes\n"
+		"loguserfield = yes\n"
+		"maxfieldlen = 24\n"
+		"fieldlimits = lastdata:16,clid:0\n",
+		0, 0 },
+	{ "compact",
+		"[global]\n"
+		"connection = amqp1\n"
+		"format = compact\n"
+		"batchsize = 50\n"
+		"batchlinger = 60000\n"
+		"loguniqueid = yes\n"
+		"loguserfield = yes\n",
+		50, 0 },
+	{ "compact-capped",
+		"[global]\n"
+		"connection = amqp1\n"
+		"format = compact\n"
+		"batchsize = 40\n"
+		"batchlinger = 60000\n"
+		"batchdictionary = no\n"
+		"maxfieldlen = 24\n",
+		40, 0 },
+};
+
+/*! \brief Write what the broker received to the expected file of \a variant */
+static void golden_update(const char *path, size_t messages)
+{
+	FILE *out = fopen(path, "w");
+	size_t i;
+
+	CHECK_MSG(out != NULL, "cannot write %s", path);
+	if (!out) {
+		return;
+	}
+	for (i = 0; i < messages; ++i) {
+		const struct fake_message *msg = fake_broker_message(i);
+
+		fwrite(msg->body, 1, msg->len, out);
+		fputc('\n', out);
+	}
+	fclose(out);
+	printf("  wrote %s\n", path);
+}
+
+/*! \brief Compare what the broker received with the expected file of \a variant */
+static void golden_compare(const char *path, size_t messages)
+{
+	FILE *in = fopen(path, "r");
+	char *line = NULL;
+	size_t size = 0;
+	ssize_t len;
+	size_t i;
+
+	CHECK_MSG(in != NULL, "cannot read %s", path);
+	if (!in) {
+		return;
+	}
+	for (i = 0; (len = getline(&line, &size, in)) > 0; ++i) {
+		const struct fake_message *msg = i < messages ? fake_broker_message(i) : NULL;
+		size_t at;
+
+		line[--len] = '\0';
+		if (!msg) {
+			CHECK_MSG(msg != NULL, "%s: expected more than %zu messages", path, messages);
+			break;
+		}
+		for (at = 0; at < msg->len && at < (size_t) len && msg->body[at] == line[at]; ++at) {
+		}
+		CHECK_MSG(at == msg->len && at == (size_t) len,
+			"%s: message %zu differs from byte %zu:\n    got      %.60s\n    expected %.60s",
+			path, i, at, msg->body + at, line + at);
+	}
+	CHECK_MSG(i == messages, "%s: %zu messages expected, %zu published", path, i, messages);
+	free(line);
+	fclose(in);
+}
+
+/*! \brief Check the specialized serializer of \a dest against the generic one */
+static void golden_reference(const struct cdr_amqp_destination *dest,
+	const struct ast_cdr *cdrs, size_t count)
+{
+	size_t checked = 0;
+	size_t i;
+
+	for (i = 0; i < count; ++i) {
+		const struct fake_message *msg = fake_broker_message(i);
+		char *expected;
+
+		/* jansson refuses invalid UTF-8 rather than repairing it */
+		if (!corpus_cdr_valid(&cdrs[i])) {
+			continue;
+		}
+		expected = reference_serialize(dest, &cdrs[i]);
+		CHECK_MSG(expected && msg && msg->len == strlen(expected)
+			&& !memcmp(msg->body, expected, msg->len),
+			"CDR %zu differs from the generic serializer:\n    got      %.*s\n    expected %s",
+			i, msg ? (int) msg->len : 0, msg ? msg->body : "", S_OR(expected, "(null)"));
+		ast_json_free(expected);
+		++checked;
+	}
+	/* Most of the corpus has to be comparable, or this checks little */
+	CHECK(checked > count / 2);
+}
+
+/*!
+ * \brief Check the message_id column of every compact row.
+ *
+ * Row \a i ends with the message_id CDR \a i would have had on its own,
+ * and the batch's message_id is the hash of its rows' ids.
+ */
+static void golden_row_ids(const struct ast_cdr *cdrs, size_t count, unsigned int batchsize)
+{
+	struct cdr_amqp_buf ids = { 0, };
+	char id[CDR_MESSAGE_ID_LEN + 1];
+	char row[CDR_MESSAGE_ID_LEN + 4];
+	uint64_t hash[2];
+	size_t i;
+
+	CHECK(buf_reserve(&ids, batchsize * CDR_MESSAGE_ID_LEN) == 0);
+	for (i = 0; ids.data && i < count; ++i) {
+		const struct fake_message *msg = fake_broker_message(i / batchsize);
+
+		cdr_message_id(&cdrs[i], id);
+		snprintf(row, sizeof(row), "\"%s\"]", id);
+		CHECK_MSG(msg && memmem(msg->body, msg->len, row, strlen(row)),
+			"CDR %zu: row with message_id %s not in batch", i, id);
+		buf_append(&ids, id, CDR_MESSAGE_ID_LEN);
+
+		if ((i + 1) % batchsize == 0) {
+			murmur3_128(ids.data, ids.used, hash);
+			message_id_format(hash, id);
+			CHECK_MSG(msg && !strcmp(msg->message_id, id),
+				"batch %zu: message_id %s is not the hash of its rows' ids", i / batchsize,
+				msg ? msg->message_id : "");
+			ids.used = 0;
+		}
+	}
+	ast_free(ids.data);
+}
+
+static void golden_check(const struct golden_variant *variant)
+{
+	RAII_VAR(struct ast_cdr *, cdrs, NULL, ast_free);
+	char path[PATH_MAX];
+	size_t messages;
+	size_t count;
+	size_t i;
+
+	cdrs = corpus_load(GOLDEN_DIR "/corpus.tsv", &count);
+	CHECK(cdrs != NULL && count > 0);
+	if (!cdrs || !count) {
+		return;
+	}
+	/* Only full batches, so none is cut short by batchlinger */
+	CHECK(!variant->batchsize || count % variant->batchsize == 0);
+	messages = variant->batchsize ? count / variant->batchsize : count;
+
+	CHECK(harness_load(variant->conf) == AST_MODULE_LOAD_SUCCESS);
+	for (i = 0; i < count; ++i) {
+		CHECK(mock_cdr_post(&cdrs[i]) == 0);
+	}
+	CHECK(fake_broker_wait(messages, 10000) == 0);
+	CHECK(fake_broker_count() == messages);
+
+	snprintf(path, sizeof(path), "%s/%s.out", GOLDEN_DIR, variant->name);
+	if (!ast_strlen_zero(getenv("CDR_AMQP_GOLDEN_UPDATE"))) {
+		golden_update(path, messages);
+	} else {
+		golden_compare(path, messages);
+	}
+
+	if (variant->batchsize) {
+		golden_row_ids(cdrs, count, variant->batchsize);
+	}
+
+	if (variant->reference) {
+		RAII_VAR(struct cdr_amqp_conf *, conf, ao2_global_obj_ref(confs), ao2_cleanup);
+
+		golden_reference(conf->global, cdrs, count);
+	}
+
+	harness_unload();
+}
+
+#define GOLDEN_TEST(fn, index) \
+	static void fn(void) \
+	{ \
+		golden_check(&golden_variants[index]); \
+	}
+
+GOLDEN_TEST(test_golden_json, 0)
+GOLDEN_TEST(test_golden_json_uf, 1)
+GOLDEN_TEST(test_golden_json_capped, 2)
+GOLDEN_TEST(test_golden_compact, 3)
+GOLDEN_TEST(test_golden_compact_capped, 4)
+
+/*! \brief A generated corpus reads back exactly as it was written */
+static void test_corpus_roundtrip(void)
+{
+	struct corpus_params params = CORPUS_PARAMS_DEFAULT;
+	struct corpus corpus;
+	struct ast_cdr written;
+	struct ast_cdr read;
+	FILE *file = tmpfile();
+	int i;
+
+	CHECK(file != NULL);
+	if (!file) {
+		return;
+	}
+	/* Mostly awkward bytes */
+	CHECK(corpus_params_parse(&params, "nonascii=0.5,invalid=0.5,vars=4") == 0);
+	CHECK(corpus_params_parse(&params, "fanout=0.5") != 0);
+
+	corpus_init(&corpus, &params, 42);
+	corpus_write_header(file);
+	for (i = 0; i < 500; ++i) {
+		corpus_generate(&corpus, &written);
+		corpus_write(file, &written);
+	}
+
+	rewind(file);
+	corpus_init(&corpus, &params, 42);
+	for (i = 0; i < 500; ++i) {
+		corpus_generate(&corpus, &written);
+		CHECK_MSG(corpus_read(file, &read) == 1 && !memcmp(&read, &written, sizeof(read)),
+			"CDR %d did not read back", i);
+	}
+	CHECK(corpus_read(file, &read) == 0);
+	fclose(file);
+}
+
+int main(int argc, char *argv[])
+{
+	static const struct harness_test tests[] = {
+		{ "corpus_roundtrip", test_corpus_roundtrip },
+		{ "golden_json", test_golden_json },
+		{ "golden_json_uniqueid_userfield", test_golden_json_uf },
+		{ "golden_json_capped", test_golden_json_capped },
+		{ "golden_compact", test_golden_compact },
+		{ "golden_compact_capped", test_golden_compact_capped },
+	};
+
+	return harness_run(tests, ARRAY_LEN(tests), argc, argv);
+}
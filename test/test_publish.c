@@ -0,0 +1,977 @@
+/*
+ * Asterisk -- An open source telephony toolkit.
+ *
+ * See http://www.asterisk.org for more information about
+ * the Asterisk project.
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2. See the LICENSE file
+ * at the top of the source tree.
+ */
+
+/*! \file
+ *
+ * \brief Publishing, dead-lettering, re-drive and failover against the fake broker.
+ */
+
+#include "../cdr_amqp.c"
+
+#include "harness.h"
+
+static const char single_conf[] =
+	"[global]\n"
+	"connection = amqp1\n";
+
+/*! \brief The \a n th message published to \a routing_key; NULL if there is none */
+static const struct fake_message *message_routed(const char *routing_key, int n)
+{
+	const struct fake_message *msg;
+	size_t i;
+
+	for (i = 0; (msg = fake_broker_message(i)); ++i) {
+		if (!strcmp(msg->routing_key, routing_key) && !n--) {
+			return msg;
+		}
+	}
+	return NULL;
+}
+
+/*! \brief Integer header \a key of \a msg; -1 if it has none */
+static int64_t message_header_int(const struct fake_message *msg, const char *key)
+{
+	const char *value = msg ? fake_message_header(msg, key) : NULL;
+
+	return value ? strtoll(value, NULL, 10) : -1;
+}
+
+static void test_publish(void)
+{
+	const struct fake_message *msg;
+	struct ast_json *json;
+	int i;
+
+	CHECK(harness_load(single_conf) == AST_MODULE_LOAD_SUCCESS);
+
+	for (i = 0; i < 3; ++i) {
+		CHECK(harness_post(i) == 0);
+	}
+	CHECK(fake_broker_wait(3, 5000) == 0);
+
+	msg = fake_broker_message(0);
+	CHECK(msg != NULL);
+	if (msg) {
+		CHECK(!strcmp(msg->connection, "amqp1"));
+		CHECK(!strcmp(msg->routing_key, "asterisk_cdr"));
+		CHECK(strlen(msg->message_id) == CDR_MESSAGE_ID_LEN);
+
+		json = ast_json_load_buf(msg->body, msg->len, NULL);
+		CHECK(json != NULL);
+		CHECK(!strcmp(S_OR(ast_json_string_get(ast_json_object_get(json, "src")), ""), "1000"));
+		CHECK(!strcmp(S_OR(ast_json_string_get(ast_json_object_get(json, "disposition")), ""),
+			"ANSWERED"));
+		ast_json_unref(json);
+	}
+
+	harness_unload();
+	CHECK(stats.published == 3);
+	CHECK(stats.failed == 0);
+}
+
+static void test_publish_order(void)
+{
+	size_t i;
+
+	CHECK(harness_load(single_conf) == AST_MODULE_LOAD_SUCCESS);
+
+	/* Queued while the broker is stalled, published in order afterwards */
+	fake_broker_stall(1);
+	for (i = 0; i < 50; ++i) {
+		CHECK(harness_post(i) == 0);
+	}
+	fake_broker_stall(0);
+	CHECK(fake_broker_wait(50, 5000) == 0);
+
+	for (i = 0; i < 50; ++i) {
+		const struct fake_message *msg = fake_broker_message(i);
+		char src[16];
+
+		snprintf(src, sizeof(src), "\"src\":\"%zu\"", 1000 + i);
+		CHECK_MSG(msg && strstr(msg->body, src), "message %zu out of order", i);
+	}
+
+	harness_unload();
+}
+
+static void test_deadletter(void)
+{
+	CHECK(harness_load(single_conf) == AST_MODULE_LOAD_SUCCESS);
+
+	fake_broker_fail("amqp1", -1);
+	CHECK(harness_post(1) == 0);
+	CHECK(harness_post(2) == 0);
+	harness_sync(GLOBAL_DESTINATION);
+
+	CHECK(fake_broker_count() == 0);
+	CHECK(stats.failed == 2);
+	CHECK(stats.deadlettered == 2);
+	CHECK(harness_lines(harness_deadletter(GLOBAL_DESTINATION)) == 2);
+
+	/* A failure only costs that message; the next one is published */
+	fake_broker_fail("amqp1", 1);
+	CHECK(harness_post(3) == 0);
+	CHECK(harness_post(4) == 0);
+	CHECK(fake_broker_wait(1, 5000) == 0);
+	harness_sync(GLOBAL_DESTINATION);
+	CHECK(stats.deadlettered == 3);
+	CHECK(strstr(fake_broker_message(0)->body, "\"src\":\"1004\"") != NULL);
+
+	harness_unload();
+}
+
+static void test_fieldlimits(void)
+{
+	static const char * const invalid[] = {
+		"lastdata:-1",
+		"lastdata:3000000000",
+		"lastdata",
+		"lastdata:ten",
+		"nosuchfield:10",
+	};
+	struct ast_json *json;
+	char conf[128];
+	size_t i;
+
+	CHECK(harness_load(
+		"[global]\n"
+		"connection = amqp1\n"
+		"maxfieldlen = 4\n"
+		"fieldlimits = lastdata:6, clid:0\n") == AST_MODULE_LOAD_SUCCESS);
+
+	/* A reload with a bad limit is refused, and the running limits stay */
+	for (i = 0; i < ARRAY_LEN(invalid); ++i) {
+		snprintf(conf, sizeof(conf), "[global]\nconnection = amqp1\nfieldlimits = %s\n",
+			invalid[i]);
+		CHECK_MSG(harness_reload(conf) != 0, "fieldlimits = %s accepted", invalid[i]);
+	}
+
+	CHECK(harness_post(1) == 0);
+	CHECK(fake_broker_wait(1, 5000) == 0);
+	json = ast_json_load_buf(fake_broker_message(0)->body, fake_broker_message(0)->len, NULL);
+	CHECK(json != NULL);
+	CHECK(!strcmp(S_OR(ast_json_string_get(ast_json_object_get(json, "lastdata")), ""),
+		"PJSIP/"));
+	CHECK(!strcmp(S_OR(ast_json_string_get(ast_json_object_get(json, "clid")), ""),
+		"\"Caller 1\" <1001>"));
+	CHECK(!strcmp(S_OR(ast_json_string_get(ast_json_object_get(json, "channel")), ""),
+		"PJSI"));
+	ast_json_unref(json);
+
+	harness_unload();
+}
+
+static void test_oversize(void)
+{
+	struct ast_cdr cdr;
+
+	CHECK(harness_load(
+		"[global]\n"
+		"connection = amqp1\n"
+		"maxmessagesize = 600\n") == AST_MODULE_LOAD_SUCCESS);
+
+	/* Some 200 bytes over a typical CDR */
+	harness_cdr(&cdr, 1);
+	memset(cdr.lastdata, 'x', sizeof(cdr.lastdata) - 1);
+	memset(cdr.dcontext, 'x', sizeof(cdr.dcontext) - 1);
+	memset(cdr.lastapp, 'x', sizeof(cdr.lastapp) - 1);
+	CHECK(mock_cdr_post(&cdr) != 0);
+	CHECK(harness_post(2) == 0);
+	CHECK(fake_broker_wait(1, 5000) == 0);
+	harness_sync(GLOBAL_DESTINATION);
+
+	/* Dropped and counted, but neither published nor dead-lettered */
+	CHECK(stats.oversize == 1);
+	CHECK(fake_broker_count() == 1);
+	CHECK(strstr(fake_broker_message(0)->body, "\"src\":\"1002\"") != NULL);
+	CHECK(stats.deadlettered == 0);
+	CHECK(harness_lines(harness_deadletter(GLOBAL_DESTINATION)) == 0);
+
+	harness_unload();
+}
+
+static void test_nack(void)
+{
+	int i;
+
+	CHECK(harness_load(single_conf) == AST_MODULE_LOAD_SUCCESS);
+
+	/* Every CDR ends up either at the broker or in the dead-letter file */
+	fake_broker_nack_rate(0.3);
+	fake_broker_latency(200, 100);
+	for (i = 0; i < 200; ++i) {
+		CHECK(harness_post(i) == 0);
+	}
+	harness_sync(GLOBAL_DESTINATION);
+
+	CHECK(stats.published > 0);
+	CHECK(stats.deadlettered > 0);
+	CHECK(stats.published + stats.deadlettered == 200);
+	CHECK(fake_broker_count() == stats.published);
+	CHECK((uint64_t) harness_lines(harness_deadletter(GLOBAL_DESTINATION)) == stats.deadlettered);
+
+	harness_unload();
+}
+
+static void test_redrive(void)
+{
+	char path[PATH_MAX + sizeof(REDRIVE_SUFFIX)];
+
+	CHECK(harness_load(single_conf) == AST_MODULE_LOAD_SUCCESS);
+
+	fake_broker_fail("amqp1", -1);
+	CHECK(harness_post(1) == 0);
+	CHECK(harness_post(2) == 0);
+	harness_sync(GLOBAL_DESTINATION);
+	CHECK(stats.deadlettered == 2);
+
+	fake_broker_fail("amqp1", 0);
+	CHECK(mock_cli_exec("cdr amqp redrive global") == CLI_SUCCESS);
+	CHECK(fake_broker_wait(2, 5000) == 0);
+	harness_redrive_wait(GLOBAL_DESTINATION);
+
+	CHECK(stats.redriven == 2);
+	CHECK(strstr(fake_broker_message(0)->body, "\"src\":\"1001\"") != NULL);
+	CHECK(strstr(fake_broker_message(1)->body, "\"src\":\"1002\"") != NULL);
+	/* The original message ids are kept, so consumers can deduplicate */
+	CHECK(strlen(fake_broker_message(0)->message_id) == CDR_MESSAGE_ID_LEN);
+
+	snprintf(path, sizeof(path), "%s" REDRIVE_SUFFIX, harness_deadletter(GLOBAL_DESTINATION));
+	CHECK(access(path, F_OK) != 0);
+	CHECK(harness_lines(harness_deadletter(GLOBAL_DESTINATION)) == 0);
+
+	harness_unload();
+}
+
+static void test_failover(void)
+{
+	CHECK(harness_load(
+		"[global]\n"
+		"connection = amqp1, amqp2\n"
+		"failback = 1\n") == AST_MODULE_LOAD_SUCCESS);
+
+	CHECK(harness_post(1) == 0);
+	CHECK(fake_broker_wait(1, 5000) == 0);
+	CHECK(fake_broker_count_on("amqp1") == 1);
+
+	fake_broker_set_up("amqp1", 0);
+	CHECK(harness_post(2) == 0);
+	CHECK(harness_post(3) == 0);
+	CHECK(fake_broker_wait(3, 5000) == 0);
+	harness_sync(GLOBAL_DESTINATION);
+	CHECK(fake_broker_count_on("amqp2") == 2);
+	CHECK(stats.failovers == 1);
+	CHECK(stats.deadlettered == 0);
+
+	/* Back on the primary once it has been up for failback seconds */
+	fake_broker_set_up("amqp1", 1);
+	usleep((FAILBACK_PROBE_INTERVAL * 3 + 500) * 1000);
+	CHECK(harness_post(4) == 0);
+	CHECK(fake_broker_wait(4, 5000) == 0);
+	harness_sync(GLOBAL_DESTINATION);
+	CHECK(fake_broker_count_on("amqp1") == 2);
+	CHECK(stats.failovers == 2);
+
+	harness_unload();
+}
+
+static void test_all_down(void)
+{
+	CHECK(harness_load(
+		"[global]\n"
+		"connection = amqp1, amqp2\n") == AST_MODULE_LOAD_SUCCESS);
+
+	fake_broker_set_up("amqp1", 0);
+	fake_broker_set_up("amqp2", 0);
+	CHECK(harness_post(1) == 0);
+	harness_sync(GLOBAL_DESTINATION);
+	CHECK(stats.deadlettered == 1);
+	CHECK(harness_lines(harness_deadletter(GLOBAL_DESTINATION)) == 1);
+
+	harness_unload();
+}
+
+static void test_queue_failure(void)
+{
+	CHECK(harness_load(single_conf) == AST_MODULE_LOAD_SUCCESS);
+
+	mock_tps_push_fail = 1;
+	CHECK(harness_post(1) == -1);
+	mock_tps_push_fail = 0;
+	CHECK(stats.failed == 1);
+
+	harness_unload();
+}
+
+static void test_destinations(void)
+{
+	struct cdr_amqp_conf *conf;
+	struct ast_json *summary;
+
+	CHECK(harness_load(
+		"[global]\n"
+		"[a]\n"
+		"connection = amqp1\n"
+		"queue = cdr_a\n"
+		"[b]\n"
+		"connection = amqp2\n"
+		"queue = cdr_b\n"
+		"dispositions = answered\n") == AST_MODULE_LOAD_SUCCESS);
+
+	CHECK(harness_post(1) == 0);
+	CHECK(fake_broker_wait(2, 5000) == 0);
+	CHECK(fake_broker_count_on("amqp1") == 1);
+	CHECK(fake_broker_count_on("amqp2") == 1);
+
+	/* [global] is not a destination here, but still names the node */
+	conf = ao2_global_obj_ref(confs);
+	summary = metrics_summary(conf);
+	CHECK(summary != NULL);
+	CHECK(!ast_strlen_zero(ast_json_string_get(ast_json_object_get(summary, "node_id"))));
+	ast_json_unref(summary);
+	/* The configuration has to go before unloading waits for the publishers */
+	ao2_cleanup(conf);
+
+	harness_unload();
+}
+
+static void test_reload_prune(void)
+{
+	RAII_VAR(struct cdr_amqp_pipeline *, pipeline, NULL, ao2_cleanup);
+
+	CHECK(harness_load(
+		"[global]\n"
+		"[a]\n"
+		"connection = amqp1\n"
+		"[b]\n"
+		"connection = amqp2\n") == AST_MODULE_LOAD_SUCCESS);
+
+	/* CDRs queued for a destination a reload removes are still published */
+	fake_broker_stall(1);
+	CHECK(harness_post(1) == 0);
+	CHECK(harness_reload(
+		"[global]\n"
+		"[a]\n"
+		"connection = amqp1\n") == 0);
+
+	pipeline = ao2_find(pipelines, "b", OBJ_SEARCH_KEY);
+	CHECK(pipeline == NULL);
+
+	fake_broker_stall(0);
+	CHECK(fake_broker_wait(2, 5000) == 0);
+	CHECK(fake_broker_count_on("amqp2") == 1);
+
+	/* A reload that fails to apply keeps the running configuration */
+	CHECK(harness_reload(
+		"[global]\n"
+		"[a]\n"
+		"connection = amqp1\n"
+		"bogus = yes\n") != 0);
+	CHECK(harness_post(2) == 0);
+	CHECK(fake_broker_wait(3, 5000) == 0);
+
+	harness_unload();
+}
+
+static void test_intern_full(void)
+{
+	int warnings;
+	int i;
+
+	CHECK(harness_load(single_conf) == AST_MODULE_LOAD_SUCCESS);
+	warnings = mock_log_count(__LOG_WARNING);
+
+	/* More distinct contexts than the table holds; the rest go out in full */
+	for (i = 0; i < INTERN_MAX + 10; ++i) {
+		struct ast_cdr cdr;
+
+		harness_cdr(&cdr, i);
+		snprintf(cdr.dcontext, sizeof(cdr.dcontext), "context-%d", i);
+		CHECK(mock_cdr_post(&cdr) == 0);
+	}
+	CHECK(fake_broker_wait(INTERN_MAX + 10, 5000) == 0);
+
+	CHECK(intern_count == INTERN_MAX);
+	CHECK(stats.intern_misses >= 10);
+	CHECK(mock_log_count(__LOG_WARNING) == warnings + 1);
+	CHECK(strstr(fake_broker_message(INTERN_MAX + 9)->body, "\"context-1033\"") != NULL);
+
+	harness_unload();
+	CHECK(intern_count == 0);
+}
+
+static void test_rate_change(void)
+{
+	int64_t start;
+	int64_t elapsed;
+	int i;
+
+	CHECK(harness_load(
+		"[global]\n"
+		"connection = amqp1\n"
+		"maxpublishrate = 100000\n") == AST_MODULE_LOAD_SUCCESS);
+
+	/* Well over a second's worth of the byte limit set below */
+	for (i = 0; i < 200; ++i) {
+		CHECK(harness_post(i) == 0);
+	}
+	CHECK(fake_broker_wait(200, 5000) == 0);
+	CHECK(fake_broker_message(0)->len > 250);
+
+	/* None of that is charged to a byte limit turned on afterwards */
+	CHECK(mock_cli_exec("cdr amqp set maxpublishbytes 1000") == CLI_SUCCESS);
+	start = harness_now();
+	for (i = 0; i < 4; ++i) {
+		CHECK(harness_post(200 + i) == 0);
+	}
+	CHECK(fake_broker_wait(204, 5000) == 0);
+	elapsed = harness_now() - start;
+
+	/* A full burst of 1000 bytes goes at once, and the rest at the limit */
+	CHECK_MSG(elapsed > 250000 && elapsed < 3000000, "took %" PRId64 " us", elapsed);
+
+	harness_unload();
+}
+
+static void test_metrics_http(void)
+{
+	const char *body;
+
+	CHECK(harness_load(single_conf) == AST_MODULE_LOAD_SUCCESS);
+	CHECK(harness_post(1) == 0);
+	CHECK(fake_broker_wait(1, 5000) == 0);
+	harness_sync(GLOBAL_DESTINATION);
+
+	/* Past what an int holds, as a busy system gets to */
+	stats.published += 3000000000ULL;
+
+	body = mock_http_get("cdr_amqp/metrics");
+	CHECK(body != NULL);
+	if (body) {
+		CHECK(strstr(body, "# TYPE cdr_amqp_published_total counter\n") != NULL);
+		CHECK(strstr(body, "\ncdr_amqp_published_total 3000000001\n") != NULL);
+		CHECK(strstr(body, "cdr_amqp_queue_depth{destination=\"global\"} ") != NULL);
+		CHECK(strstr(body, "cdr_amqp_connection{destination=\"global\",connection=\"amqp1\"} 0\n")
+			!= NULL);
+		CHECK(strstr(body, "cdr_amqp_latency_seconds_count{hop=\"publisher\"} 1\n") != NULL);
+	}
+
+	harness_unload();
+}
+
+static void test_latency_headers(void)
+{
+	const struct fake_message *msg;
+	struct ast_cdr cdr;
+	int64_t before;
+	int64_t end;
+
+	CHECK(harness_load(single_conf) == AST_MODULE_LOAD_SUCCESS);
+	CHECK(harness_post(1) == 0);
+	CHECK(fake_broker_wait(1, 5000) == 0);
+	msg = fake_broker_message(0);
+	CHECK(msg && fake_message_header(msg, "x-node-id") != NULL);
+	CHECK(msg && fake_message_header(msg, "x-received") == NULL);
+	harness_unload();
+
+	CHECK(harness_load(
+		"[global]\n"
+		"connection = amqp1\n"
+		"latencyheaders = yes\n") == AST_MODULE_LOAD_SUCCESS);
+
+	/* Ended a second ago, by the wall clock the stamps are taken from */
+	before = cdr_amqp_now();
+	harness_cdr(&cdr, 1);
+	end = before - 1000000;
+	cdr.end.tv_sec = end / 1000000;
+	cdr.end.tv_usec = end % 1000000;
+	CHECK(mock_cdr_post(&cdr) == 0);
+	CHECK(fake_broker_wait(1, 5000) == 0);
+
+	msg = fake_broker_message(0);
+	CHECK(message_header_int(msg, "x-cdr-end") == end);
+	CHECK(message_header_int(msg, "x-received") >= before);
+	CHECK(message_header_int(msg, "x-enqueued") >= message_header_int(msg, "x-received"));
+	CHECK(message_header_int(msg, "x-published") >= message_header_int(msg, "x-enqueued"));
+	CHECK(message_header_int(msg, "x-published") <= cdr_amqp_now());
+
+	/* Asterisk's hop, from the end of the call to the module, took the second */
+	CHECK(latency_quantile(CDR_HOP_ASTERISK, 1) >= 1000000);
+
+	harness_unload();
+}
+
+static void test_metrics_summary(void)
+{
+	const struct fake_message *msg;
+	struct ast_json *json = NULL;
+	struct ast_json *buckets;
+	int64_t count = 0;
+	size_t i;
+
+	CHECK(harness_load(
+		"[global]\n"
+		"connection = amqp1\n"
+		"nodeid = node-a\n"
+		"metricsinterval = 1\n") == AST_MODULE_LOAD_SUCCESS);
+
+	CHECK(harness_post(1) == 0);
+	CHECK(harness_post(2) == 0);
+	/* Both CDRs, then the first summary after a second */
+	CHECK(fake_broker_wait(3, 5000) == 0);
+
+	msg = message_routed("asterisk_cdr_metrics", 0);
+	CHECK(msg != NULL);
+	if (msg) {
+		json = ast_json_load_buf(msg->body, msg->len, NULL);
+	}
+	CHECK(json != NULL);
+	if (json) {
+		CHECK(!strcmp(S_OR(ast_json_string_get(ast_json_object_get(json, "node_id")), ""),
+			"node-a"));
+		CHECK(ast_json_integer_get(ast_json_object_get(
+			ast_json_object_get(json, "counters"), "published")) == 2);
+		CHECK(ast_json_integer_get(ast_json_object_get(
+			ast_json_object_get(json, "counters"), "deadlettered")) == 0);
+
+		buckets = ast_json_object_get(ast_json_object_get(json, "latency"), "publisher");
+		CHECK(ast_json_array_size(buckets) == LATENCY_BUCKETS);
+		for (i = 0; i < ast_json_array_size(buckets); ++i) {
+			count += ast_json_integer_get(ast_json_array_get(buckets, i));
+		}
+		CHECK(count == 2);
+	}
+	ast_json_unref(json);
+
+	harness_unload();
+}
+
+/*! \brief Whether AMI \a action with \a headers succeeded */
+static int manager_ok(const char *action, const char *headers)
+{
+	const char *response = mock_manager_action(action, headers);
+
+	return response && !strncmp(response, "Response: Success\r\n", 19);
+}
+
+static void test_manager(void)
+{
+	struct cdr_amqp_conf *conf;
+	const char *status;
+	const char *b;
+
+	CHECK(harness_load(
+		"[global]\n"
+		"[a]\n"
+		"connection = amqp1\n"
+		"[b]\n"
+		"connection = amqp2\n") == AST_MODULE_LOAD_SUCCESS);
+
+	CHECK(!manager_ok("CdrAmqpPause", "Destination: nosuch\r\n"));
+	CHECK(manager_ok("CdrAmqpPause", "Destination: a\r\n"));
+
+	/* A paused destination dead-letters what it gets; the others go on */
+	CHECK(harness_post(1) == 0);
+	CHECK(fake_broker_wait(1, 5000) == 0);
+	harness_sync("a");
+	CHECK(fake_broker_count_on("amqp1") == 0);
+	CHECK(fake_broker_count_on("amqp2") == 1);
+	CHECK(harness_lines(harness_deadletter("a")) == 1);
+	CHECK(!manager_ok("CdrAmqpFlush", "Destination: a\r\n"));
+
+	status = mock_manager_action("CdrAmqpStatus", "ActionID: 42\r\n");
+	CHECK(status != NULL);
+	if (status) {
+		b = strstr(status, "Destination: b\r\n");
+		CHECK(strstr(status, "Event: CdrAmqpStatus\r\nActionID: 42\r\nDestination: a\r\n"
+			"Connection: amqp1\r\nPaused: Yes\r\nQueueDepth: 0\r\n") != NULL);
+		CHECK(strstr(status, "DeadletterBytes: 0\r\n") == b + strlen("Destination: b\r\n"
+			"Connection: amqp2\r\nPaused: No\r\nQueueDepth: 0\r\n"));
+		CHECK(strstr(status, "EventList: Complete\r\nListItems: 2\r\n") != NULL);
+	}
+
+	/* Resuming publishes the dead-letter file too */
+	CHECK(manager_ok("CdrAmqpResume", "Destination: a\r\n"));
+	harness_redrive_wait("a");
+	CHECK(fake_broker_count_on("amqp1") == 1);
+	CHECK(harness_lines(harness_deadletter("a")) == 0);
+
+	/* Flushing re-drives without a pause */
+	fake_broker_fail("amqp2", -1);
+	CHECK(harness_post(2) == 0);
+	harness_sync("b");
+	CHECK(harness_lines(harness_deadletter("b")) == 1);
+	fake_broker_fail("amqp2", 0);
+	CHECK(manager_ok("CdrAmqpFlush", ""));
+	harness_redrive_wait("a");
+	harness_redrive_wait("b");
+	CHECK(fake_broker_count_on("amqp1") == 2);
+	CHECK(fake_broker_count_on("amqp2") == 2);
+	CHECK(harness_lines(harness_deadletter("b")) == 0);
+
+	/* Settings, on one destination or on all of them */
+	CHECK(!manager_ok("CdrAmqpSet", "Parameter: bogus\r\nValue: 1\r\n"));
+	CHECK(!manager_ok("CdrAmqpSet", "Parameter: batchsize\r\nValue: 0\r\n"));
+	CHECK(!manager_ok("CdrAmqpSet", "Parameter: failback\r\nValue: 5\r\nDestination: nosuch\r\n"));
+	CHECK(manager_ok("CdrAmqpSet", "Parameter: failback\r\nValue: 5\r\nDestination: b\r\n"));
+	CHECK(manager_ok("CdrAmqpSet", "Parameter: queuewatermark\r\nValue: 7\r\n"));
+	conf = ao2_global_obj_ref(confs);
+	CHECK(AST_VECTOR_GET(&conf->active, 0)->failback != 5);
+	CHECK(AST_VECTOR_GET(&conf->active, 1)->failback == 5);
+	CHECK(AST_VECTOR_GET(&conf->active, 0)->queuewatermark == 7);
+	CHECK(AST_VECTOR_GET(&conf->active, 1)->queuewatermark == 7);
+	/* The configuration has to go before unloading waits for the publishers */
+	ao2_cleanup(conf);
+
+	harness_unload();
+}
+
+static void test_heartbeat(void)
+{
+	const struct fake_message *msg;
+	struct ast_json *json;
+	size_t published;
+	int i;
+
+	CHECK(harness_load(
+		"[global]\n"
+		"heartbeatinterval = 1\n"
+		"[a]\n"
+		"connection = amqp1\n"
+		"[b]\n"
+		"connection = amqp2\n") == AST_MODULE_LOAD_SUCCESS);
+
+	CHECK(harness_post(7) == 0);
+	/* The CDR to each destination, then a heartbeat through each */
+	CHECK(fake_broker_wait(4, 5000) == 0);
+
+	for (i = 0; i < 2; ++i) {
+		msg = message_routed("asterisk_cdr_heartbeat", i);
+		CHECK(msg != NULL);
+		if (!msg) {
+			continue;
+		}
+		json = ast_json_load_buf(msg->body, msg->len, NULL);
+		CHECK(json != NULL);
+		CHECK(!strcmp(S_OR(ast_json_string_get(ast_json_object_get(json, "node_id")), "-"),
+			S_OR(fake_message_header(msg, "x-node-id"), "")));
+		/* Each through its own destination's connection */
+		CHECK(!strcmp(S_OR(ast_json_string_get(ast_json_object_get(json, "destination")), ""),
+			!strcmp(msg->connection, "amqp1") ? "a" : "b"));
+		CHECK(ast_json_integer_get(ast_json_object_get(json, "sequence")) == 7);
+		CHECK(ast_json_integer_get(ast_json_object_get(json, "queue_depth")) == 0);
+		CHECK(ast_json_integer_get(ast_json_object_get(json, "deadletter_bytes")) == 0);
+		CHECK(ast_json_object_get(json, "latency_p99_us") != NULL);
+		ast_json_unref(json);
+	}
+
+	/* A paused destination sends none; two more go through a meanwhile */
+	CHECK(manager_ok("CdrAmqpPause", "Destination: b\r\n"));
+	harness_sync("b");
+	published = fake_broker_count_on("amqp2");
+	CHECK(fake_broker_wait(fake_broker_count() + 2, 5000) == 0);
+	CHECK(fake_broker_count_on("amqp2") == published);
+
+	harness_unload();
+}
+
+/*!
+ * \brief Decompress the body of \a msg, by zlib window bits \a wbits.
+ *
+ * \return The body, NUL terminated, to be freed; NULL if it does not inflate.
+ */
+static char *message_inflate(const struct fake_message *msg, int wbits)
+{
+	z_stream strm = {};
+	size_t size = msg->len * 8 + 64;
+	char *out = ast_malloc(size);
+
+	if (!out || inflateInit2(&strm, wbits) != Z_OK) {
+		ast_free(out);
+		return NULL;
+	}
+	strm.next_in = (Bytef *) msg->body;
+	strm.avail_in = msg->len;
+	strm.next_out = (Bytef *) out;
+	strm.avail_out = size - 1;
+	if (inflate(&strm, Z_FINISH) != Z_STREAM_END) {
+		inflateEnd(&strm);
+		ast_free(out);
+		return NULL;
+	}
+	out[strm.total_out] = '\0';
+	inflateEnd(&strm);
+
+	return out;
+}
+
+/*! \brief Sequence number of the CDR in the plain json body \a body; -1 if none */
+static int body_sequence(const char *body)
+{
+	const char *src = body ? strstr(body, "\"src\":\"") : NULL;
+
+	return src ? atoi(src + 7) - 1000 : -1;
+}
+
+/*! \brief The \a n th message published on connection \a name; NULL if there is none */
+static const struct fake_message *message_on(const char *name, int n)
+{
+	const struct fake_message *msg;
+	size_t i;
+
+	for (i = 0; (msg = fake_broker_message(i)); ++i) {
+		if (!strcmp(msg->connection, name) && !n--) {
+			return msg;
+		}
+	}
+	return NULL;
+}
+
+static void test_compression(void)
+{
+	static const struct {
+		const char *connection;
+		const char *encoding;
+		int wbits;
+	} codecs[] = {
+		/* gzip's wrapper, and zlib's for deflate, as HTTP has them */
+		{ "amqp1", "gzip", MAX_WBITS + 16 },
+		{ "amqp2", "deflate", MAX_WBITS },
+	};
+	const struct fake_message *plain;
+	const struct fake_message *msg;
+	char *body;
+	size_t i;
+
+	CHECK(harness_load(
+		"[global]\n"
+		"[gzip]\n"
+		"connection = amqp1\n"
+		"compression = gzip\n"
+		"[deflate]\n"
+		"connection = amqp2\n"
+		"compression = deflate\n"
+		"compressionlevel = 9\n"
+		"[plain]\n"
+		"connection = amqp3\n") == AST_MODULE_LOAD_SUCCESS);
+
+	CHECK(harness_post(1) == 0);
+	CHECK(fake_broker_wait(3, 5000) == 0);
+	CHECK(stats.compressed == 2);
+
+	plain = message_on("amqp3", 0);
+	CHECK(plain && !*plain->encoding);
+	for (i = 0; plain && i < ARRAY_LEN(codecs); ++i) {
+		msg = message_on(codecs[i].connection, 0);
+		CHECK(msg != NULL);
+		if (!msg) {
+			continue;
+		}
+		CHECK(!strcmp(msg->encoding, codecs[i].encoding));
+		CHECK(msg->len < plain->len);
+		CHECK(!strcmp(msg->message_id, plain->message_id));
+		body = message_inflate(msg, codecs[i].wbits);
+		CHECK_MSG(body && !strcmp(body, plain->body), "%s did not round trip",
+			codecs[i].encoding);
+		ast_free(body);
+	}
+
+	harness_unload();
+}
+
+static void test_compression_order(void)
+{
+	const struct fake_message *msg;
+	char *body;
+	int i;
+
+	CHECK(harness_load(
+		"[global]\n"
+		"connection = amqp1\n"
+		"compression = gzip\n"
+		"compressionthreads = 4\n") == AST_MODULE_LOAD_SUCCESS);
+
+	/* Uneven publish times, so compressing and publishing overlap unevenly */
+	fake_broker_latency(200, 200);
+	for (i = 0; i < 300; ++i) {
+		CHECK(harness_post(i) == 0);
+	}
+	CHECK(fake_broker_wait(300, 10000) == 0);
+
+	for (i = 0; (msg = fake_broker_message(i)); ++i) {
+		body = message_inflate(msg, MAX_WBITS + 16);
+		CHECK_MSG(body_sequence(body) == i, "message %d holds CDR %d", i, body_sequence(body));
+		ast_free(body);
+	}
+	CHECK(i == 300);
+
+	harness_unload();
+}
+
+static void test_compression_deadletter(void)
+{
+	FILE *in;
+	char line[2048];
+	int lines = 0;
+
+	CHECK(harness_load(
+		"[global]\n"
+		"connection = amqp1\n"
+		"compression = gzip\n") == AST_MODULE_LOAD_SUCCESS);
+
+	/* Failed, then paused: both go to the file as the plain message */
+	fake_broker_fail("amqp1", -1);
+	CHECK(harness_post(1) == 0);
+	harness_sync(GLOBAL_DESTINATION);
+	fake_broker_fail("amqp1", 0);
+	CHECK(mock_cli_exec("cdr amqp set compressionlevel 9") == CLI_SUCCESS);
+	CHECK(manager_ok("CdrAmqpPause", ""));
+	CHECK(harness_post(2) == 0);
+	harness_sync(GLOBAL_DESTINATION);
+
+	in = fopen(harness_deadletter(GLOBAL_DESTINATION), "r");
+	CHECK(in != NULL);
+	while (in && fgets(line, sizeof(line), in)) {
+		CHECK_MSG(body_sequence(line) == ++lines, "line %d: %s", lines, line);
+		CHECK(strstr(line, "\"disposition\":\"ANSWERED\"") != NULL);
+	}
+	if (in) {
+		fclose(in);
+	}
+	CHECK(lines == 2);
+
+	/* A re-drive compresses them again */
+	CHECK(manager_ok("CdrAmqpResume", ""));
+	harness_redrive_wait(GLOBAL_DESTINATION);
+	CHECK(fake_broker_count() == 2);
+	for (lines = 0; (size_t) lines < fake_broker_count(); ++lines) {
+		char *body = message_inflate(fake_broker_message(lines), MAX_WBITS + 16);
+
+		CHECK(!strcmp(fake_broker_message(lines)->encoding, "gzip"));
+		CHECK(body_sequence(body) == lines + 1);
+		ast_free(body);
+	}
+
+	harness_unload();
+}
+
+/*! \brief The compression level \a dest will use next */
+static int compression_level(void)
+{
+	RAII_VAR(struct cdr_amqp_pipeline *, pipeline,
+		ao2_find(pipelines, GLOBAL_DESTINATION, OBJ_SEARCH_KEY), ao2_cleanup);
+
+	return pipeline ? pipeline->level : -1;
+}
+
+static void test_compression_adaptive(void)
+{
+	int i;
+
+	CHECK(harness_load(
+		"[global]\n"
+		"connection = amqp1\n"
+		"compression = gzip\n"
+		"compressionlevel = 9\n") == AST_MODULE_LOAD_SUCCESS);
+
+	CHECK(harness_post(0) == 0);
+	harness_sync(GLOBAL_DESTINATION);
+	CHECK(compression_level() == 9);
+
+	/* CDRs arrive faster than they are published, so the queue keeps growing */
+	fake_broker_latency(2000, 0);
+	for (i = 1; i < 300; ++i) {
+		CHECK(harness_post(i) == 0);
+		usleep(1000);
+	}
+	harness_sync(GLOBAL_DESTINATION);
+	CHECK_MSG(compression_level() < 5, "level %d", compression_level());
+
+	/*
+	 * Each CDR that finds the queue empty brings the level back up by one;
+	 * waiting for it to be published, not syncing, keeps the queue empty.
+	 */
+	fake_broker_latency(0, 0);
+	for (i = 300; i < 310; ++i) {
+		CHECK(harness_post(i) == 0);
+		CHECK(fake_broker_wait(i + 1, 5000) == 0);
+	}
+	CHECK_MSG(compression_level() == 9, "level %d", compression_level());
+
+	harness_unload();
+}
+
+static void test_set_compressionthreads(void)
+{
+	int64_t deadline;
+
+	CHECK(harness_load(single_conf) == AST_MODULE_LOAD_SUCCESS);
+	CHECK(mock_threadpool_running(compressors) == 2);
+
+	CHECK(mock_cli_exec("cdr amqp set compressionthreads 4") == CLI_SUCCESS);
+	CHECK(mock_threadpool_running(compressors) == 4);
+
+	/* The compressors are shared, so no destination can be named */
+	CHECK(mock_cli_exec("cdr amqp set compressionthreads 3 global") == CLI_FAILURE);
+	CHECK(mock_cli_exec("cdr amqp set compressionthreads 0") == CLI_FAILURE);
+	CHECK(mock_cli_exec("cdr amqp set compressionthreads 65") == CLI_FAILURE);
+	CHECK(mock_threadpool_running(compressors) == 4);
+
+	CHECK(strstr(mock_manager_action("CdrAmqpSet",
+		"Parameter: compressionthreads\r\nValue: 3\r\nDestination: global\r\n"),
+		"Response: Error") != NULL);
+	CHECK(strstr(mock_manager_action("CdrAmqpSet",
+		"Parameter: compressionthreads\r\nValue: 1\r\n"), "Response: Success") != NULL);
+	/* Surplus threads exit in their own time */
+	deadline = harness_now() + 5000000;
+	while (mock_threadpool_running(compressors) > 1 && harness_now() < deadline) {
+		usleep(1000);
+	}
+	CHECK(mock_threadpool_running(compressors) == 1);
+
+	/* A reload sizes the pool from the configuration again */
+	CHECK(harness_reload(single_conf) == 0);
+	CHECK(mock_threadpool_running(compressors) == 2);
+
+	harness_unload();
+}
+
+static const struct harness_test tests[] = {
+	{ "publish", test_publish },
+	{ "publish_order", test_publish_order },
+	{ "deadletter", test_deadletter },
+	{ "fieldlimits", test_fieldlimits },
+	{ "oversize", test_oversize },
+	{ "nack", test_nack },
+	{ "redrive", test_redrive },
+	{ "failover", test_failover },
+	{ "all_down", test_all_down },
+	{ "queue_failure", test_queue_failure },
+	{ "destinations", test_destinations },
+	{ "reload_prune", test_reload_prune },
+	{ "intern_full", test_intern_full },
+	{ "rate_change", test_rate_change },
+	{ "metrics_http", test_metrics_http },
+	{ "latency_headers", test_latency_headers },
+	{ "metrics_summary", test_metrics_summary },
+	{ "manager", test_manager },
+	{ "heartbeat", test_heartbeat },
+	{ "compression", test_compression },
+	{ "compression_order", test_compression_order },
+	{ "compression_deadletter", test_compression_deadletter },
+	{ "compression_adaptive", test_compression_adaptive },
+	{ "set_compressionthreads", test_set_compressionthreads },
+};
+
+int main(int argc, char *argv[])
+{
+	return harness_run(tests, ARRAY_LEN(tests), argc, argv);
+}
@@ -0,0 +1,279 @@
+/*
+ * Asterisk -- An open source telephony toolkit.
+ *
+ * See http://www.asterisk.org for more information about
+ * the Asterisk project.
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2. See the LICENSE file
+ * at the top of the source tree.
+ */
+
+/*! \file
+ *
+ * \brief Soak test: CDRs at a steady rate while the broker degrades.
+ *
+ * CDRs are posted at a fixed rate through a sequence of broker
+ * conditions: RTT spikes, a stall (as when the broker blocks the
+ * connection), a disconnect of the primary and nacks. Afterwards the dead-letter file is re-driven, and the test
+ * checks that
+ *
+ * - every CDR reached the broker, by sequence number;
+ * - amqp_cdr_log() stayed fast, by its p99 latency;
+ * - the publisher queue only grew while the broker was stalled, and
+ *   drained again after;
+ * - the spool drained.
+ *
+ * Tune with these environment variables:
+ * CDR_AMQP_SOAK_RATE, CDRs per second (1000);
+ * CDR_AMQP_SOAK_PHASE_MS, length of each phase (1000);
+ * CDR_AMQP_SOAK_P99_USEC, bound on the amqp_cdr_log() p99 (5000).
+ */
+
+#include "../cdr_amqp.c"
+
+#include "harness.h"
+
+/*! \brief cdr_amqp.conf; the watermark is filled in so the stall crosses it */
+static const char soak_conf[] =
+	"[global]\n"
+	"connection = amqp1, amqp2\n"
+	"loguniqueid = yes\n"
+	"failback = 1\n"
+	"queuewatermark = %ld\n";
+
+/*! \brief A broker condition CDRs are posted through */
+struct soak_phase {
+	const char *name;
+	void (*enter)(void);
+	void (*leave)(void);
+	/*! \brief whether the publisher is expected to fall behind */
+	int backlog;
+};
+
+static void rtt_enter(void)
+{
+	fake_broker_latency(400, 300);
+}
+
+static void rtt_leave(void)
+{
+	fake_broker_latency(0, 0);
+}
+
+static void stall_enter(void)
+{
+	fake_broker_stall(1);
+}
+
+static void stall_leave(void)
+{
+	fake_broker_stall(0);
+}
+
+static void disconnect_enter(void)
+{
+	fake_broker_set_up("amqp1", 0);
+}
+
+static void disconnect_leave(void)
+{
+	fake_broker_set_up("amqp1", 1);
+}
+
+static void nack_enter(void)
+{
+	fake_broker_nack_rate(0.2);
+}
+
+static void nack_leave(void)
+{
+	fake_broker_nack_rate(0);
+}
+
+static const struct soak_phase phases[] = {
+	{ "steady", NULL, NULL, 0 },
+	{ "rtt spikes", rtt_enter, rtt_leave, 0 },
+	{ "stall", stall_enter, stall_leave, 1 },
+	{ "disconnect", disconnect_enter, disconnect_leave, 0 },
+	{ "nacks", nack_enter, nack_leave, 0 },
+	{ "recovery", NULL, NULL, 0 },
+};
+
+/*! \brief Publisher queue depth, sampled by depth_monitor() */
+static struct {
+	struct ast_taskprocessor *publisher;
+	int stop;
+	long max;
+} depth;
+
+static void *depth_monitor(void *data)
+{
+	while (!__atomic_load_n(&depth.stop, __ATOMIC_ACQUIRE)) {
+		long size = ast_taskprocessor_size(depth.publisher);
+
+		if (size > __atomic_load_n(&depth.max, __ATOMIC_RELAXED)) {
+			__atomic_store_n(&depth.max, size, __ATOMIC_RELAXED);
+		}
+		usleep(500);
+	}
+	return NULL;
+}
+
+static long env_long(const char *name, long def)
+{
+	const char *value = getenv(name);
+
+	return value && atol(value) > 0 ? atol(value) : def;
+}
+
+static int cmp_int64(const void *a, const void *b)
+{
+	int64_t x = *(const int64_t *) a;
+	int64_t y = *(const int64_t *) b;
+
+	return x < y ? -1 : x > y;
+}
+
+/*! \brief Sequence number of a CDR from harness_cdr(), from its uniqueid */
+static int message_sequence(const struct fake_message *msg)
+{
+	const char *id = strstr(msg->body, "\"uniqueid\":\"1700000000.");
+
+	return id ? atoi(id + strlen("\"uniqueid\":\"1700000000.")) : -1;
+}
+
+static void test_soak(void)
+{
+	long rate = env_long("CDR_AMQP_SOAK_RATE", 1000);
+	long phase_ms = env_long("CDR_AMQP_SOAK_PHASE_MS", 1000);
+	long p99_bound = env_long("CDR_AMQP_SOAK_P99_USEC", 5000);
+	long per_phase = rate * phase_ms / 1000;
+	int total = per_phase * ARRAY_LEN(phases);
+	int64_t *latencies = calloc(total, sizeof(*latencies));
+	char *seen = calloc(total, 1);
+	struct cdr_amqp_pipeline *pipeline;
+	char conf[256];
+	pthread_t monitor;
+	int64_t start;
+	long peak = 0;
+	int missing = 0;
+	int posted = 0;
+	size_t count;
+	size_t i;
+	int n;
+
+	snprintf(conf, sizeof(conf), soak_conf, MAX(per_phase / 4, 1));
+	CHECK(harness_load(conf) == AST_MODULE_LOAD_SUCCESS);
+	if (!latencies || !seen) {
+		CHECK(!"setup");
+		goto cleanup;
+	}
+
+	/* Unload waits for the pipeline to go, so hold no reference past here */
+	pipeline = ao2_find(pipelines, GLOBAL_DESTINATION, OBJ_SEARCH_KEY);
+	if (!pipeline) {
+		CHECK(!"setup");
+		goto cleanup;
+	}
+	depth.publisher = pipeline->publisher;
+	ao2_ref(pipeline, -1);
+	depth.stop = 0;
+	depth.max = 0;
+	pthread_create(&monitor, NULL, depth_monitor, NULL);
+
+	start = harness_now();
+	for (i = 0; i < ARRAY_LEN(phases); ++i) {
+		const struct soak_phase *phase = &phases[i];
+		long phase_max;
+		long end_depth;
+
+		if (phase->enter) {
+			phase->enter();
+		}
+		for (n = 0; n < per_phase; ++n, ++posted) {
+			int64_t due = start + posted * 1000000LL / rate;
+			int64_t now = harness_now();
+			int64_t begin;
+
+			if (due > now) {
+				usleep(due - now);
+			}
+			begin = harness_now();
+			CHECK(harness_post(posted) == 0);
+			latencies[posted] = harness_now() - begin;
+		}
+		end_depth = ast_taskprocessor_size(depth.publisher);
+		if (phase->leave) {
+			phase->leave();
+		}
+		phase_max = __atomic_exchange_n(&depth.max, 0, __ATOMIC_RELAXED);
+		peak = MAX(peak, phase_max);
+
+		printf("  %-12s max queue %5ld, at end %5ld\n", phase->name, phase_max, end_depth);
+		if (phase->backlog) {
+			/* Nothing is published, so everything posted waits, and no more */
+			CHECK_MSG(end_depth <= per_phase, "%ld queued", end_depth);
+		} else {
+			/* The publisher keeps up; a tenth of a phase leaves room for noise */
+			CHECK_MSG(end_depth <= per_phase / 10, "%ld queued in phase %s",
+				end_depth, phase->name);
+		}
+	}
+
+	__atomic_store_n(&depth.stop, 1, __ATOMIC_RELEASE);
+	pthread_join(monitor, NULL);
+	/* Every CDR queued behind the stall counts once, and nothing else piles up */
+	CHECK_MSG(peak <= per_phase + per_phase / 10, "max queue %ld", peak);
+
+	harness_sync(GLOBAL_DESTINATION);
+	CHECK(ast_taskprocessor_size(depth.publisher) == 0);
+	CHECK(mock_manager_events("CdrAmqpQueueHigh") >= 1);
+	CHECK(mock_manager_events("CdrAmqpQueueNormal") == mock_manager_events("CdrAmqpQueueHigh"));
+
+	/* CDRs nacked during the run are in the spool; publish them again */
+	CHECK(stats.deadlettered > 0);
+	CHECK(mock_cli_exec("cdr amqp redrive") == CLI_SUCCESS);
+	harness_redrive_wait(GLOBAL_DESTINATION);
+	CHECK(harness_lines(harness_deadletter(GLOBAL_DESTINATION)) == 0);
+	CHECK(stats.redriven == stats.deadlettered);
+
+	count = fake_broker_count();
+	for (i = 0; i < count; ++i) {
+		int seq = message_sequence(fake_broker_message(i));
+
+		if (seq >= 0 && seq < total) {
+			seen[seq] = 1;
+		}
+	}
+	for (n = 0; n < total; ++n) {
+		if (!seen[n]) {
+			if (++missing <= 5) {
+				fprintf(stderr, "  CDR %d never reached the broker\n", n);
+			}
+		}
+	}
+	CHECK_MSG(!missing, "%d of %d CDRs lost", missing, total);
+	CHECK(stats.lost == 0);
+
+	qsort(latencies, total, sizeof(*latencies), cmp_int64);
+	printf("  amqp_cdr_log p50 %" PRId64 " us, p99 %" PRId64 " us, max %" PRId64 " us"
+		" over %d CDRs\n", latencies[total / 2], latencies[total * 99 / 100],
+		latencies[total - 1], total);
+	CHECK_MSG(latencies[total * 99 / 100] <= p99_bound, "p99 %" PRId64 " us over %ld us",
+		latencies[total * 99 / 100], p99_bound);
+
+cleanup:
+	harness_unload();
+	free(latencies);
+	free(seen);
+}
+
+static const struct harness_test tests[] = {
+	{ "soak", test_soak },
+};
+
+int main(int argc, char *argv[])
+{
+	return harness_run(tests, ARRAY_LEN(tests), argc, argv);
+}